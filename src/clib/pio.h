@@ -147,6 +147,9 @@ typedef struct var_desc_t
      * missing sections of data when using the subset rearranger. */
     void *fillbuf;
 
+    /** Size in bytes of fillbuf. */
+    PIO_Offset fillbuf_bytes;
+
     /** The PIO data type. */
     int pio_type;
 
@@ -174,7 +177,9 @@ typedef struct var_desc_t
  *
  * The write from a particular IO task is divided into 1 or more
  * regions each of which can be described using start and count. The
- * io_region typedef is a linked list of those regions.
+ * io_region typedef is a linked list of those regions. The regions
+ * made by get_regions() are stored in one contiguous array, with
+ * each region linked to the one after it.
  */
 typedef struct io_region
 {
@@ -190,6 +195,10 @@ typedef struct io_region
 
     /** Pointer to the next io_region in the list. */
     struct io_region *next;
+
+    /** Number of regions in the array that starts with this region,
+     * or 0 if this region was allocated on its own. */
+    int nregions;
 } io_region;
 
 /**
@@ -202,7 +211,30 @@ enum PIO_REARR_COMM_TYPE
     PIO_REARR_COMM_P2P = (0),
 
     /** Collective */
-    PIO_REARR_COMM_COLL
+    PIO_REARR_COMM_COLL,
+
+    /** Point to point, only with the tasks that exchange data */
+    PIO_REARR_COMM_SPARSE,
+
+    /** MPI neighborhood collective over a graph of the tasks that
+     * exchange data (needs MPI-3, otherwise same as sparse) */
+    PIO_REARR_COMM_NEIGHBOR,
+
+    /** Same as sparse, but IO tasks copy the data of compute tasks on
+     * the same node from an MPI-3 shared memory window */
+    PIO_REARR_COMM_SHM,
+
+    /** One-sided MPI_Put() and MPI_Get() into windows on the IO
+     * tasks, synchronized with MPI_Win_fence() */
+    PIO_REARR_COMM_RMA,
+
+    /** Collective MPI_Alltoallv() on buffers packed with the index
+     * lists of the decomposition */
+    PIO_REARR_COMM_ALLTOALLV,
+
+    /** Point to point with persistent requests, made once for each
+     * number of variables and pair of buffers */
+    PIO_REARR_COMM_PERSIST
 };
 
 /**
@@ -227,6 +259,49 @@ enum PIO_REARR_COMM_FC_DIR
 /** Constant to indicate unlimited requests for the rearranger. */
 #define PIO_REARR_COMM_UNLIMITED_PEND_REQ -1
 
+/**
+ * How PIOc_write_darray() decides to flush the data it has cached
+ * to the IO tasks. See PIOc_set_buffer_policy().
+ */
+enum PIO_BUFFER_POLICY
+{
+    /** Flush when the cache of a decomposition reaches the size limit
+     * of the decomposition, which all computation tasks know. No
+     * communication is needed to decide. */
+    PIO_BUFFER_POLICY_BUDGET = (0),
+
+    /** Also flush when memory for the cache can't be allocated on
+     * any computation task. This needs an MPI_Allreduce in every
+     * call to PIOc_write_darray(). */
+    PIO_BUFFER_POLICY_COLLECTIVE
+};
+
+/**
+ * Which write multi-buffer is flushed first when the memory budget
+ * of an IO system is reached. See PIOc_set_mem_budget().
+ */
+enum PIO_MEM_FLUSH_ORDER
+{
+    /** Flush the multi-buffer that needs the largest IO buffer. */
+    PIO_MEM_FLUSH_LARGEST = (0),
+
+    /** Flush the multi-buffer that has held data the longest. */
+    PIO_MEM_FLUSH_OLDEST
+};
+
+/**
+ * Flags of the IO buffer pool of an IO system. See
+ * PIOc_set_iobuf_pool().
+ */
+enum PIO_IOBUF_POOL_FLAGS
+{
+    /** Keep freed IO buffers for reuse. */
+    PIO_IOBUF_POOL_ENABLE = (1),
+
+    /** Ask for huge pages for large pool buffers. */
+    PIO_IOBUF_POOL_HUGEPAGE = (2)
+};
+
 /**
  * Rearranger comm flow control options.
  */
@@ -265,6 +340,66 @@ typedef struct rearr_opt
     rearr_comm_fc_opt_t io2comp;
 } rearr_opt_t;
 
+/** Maximum number of entries in the datatype cache of an
+ * io_desc_t. When full, the least recently used entry is freed. */
+#define PIO_TYPE_CACHE_SIZE 8
+
+/**
+ * Persistent MPI requests of PIO_REARR_COMM_PERSIST for one direction
+ * of the exchange. The requests are bound to the buffers they were
+ * made with, and are made again when either buffer changes.
+ */
+typedef struct rearr_persist_req
+{
+    /** Number of requests. */
+    int nreqs;
+
+    /** Array of requests, NULL if they have not been made. */
+    MPI_Request *reqs;
+
+    /** The buffer on the compute task the requests were made with. */
+    void *cbuf;
+
+    /** The IO buffer the requests were made with. */
+    void *iobuf;
+} rearr_persist_req_t;
+
+/**
+ * Datatype cache entry. Holds the committed MPI vector datatypes used
+ * by rearrange_comp2io() to move nvars variables at once, so they can
+ * be reused by later calls with the same number of variables.
+ */
+typedef struct rearr_type_cache
+{
+    /** Number of variables the types were built for, 0 if this entry
+     * is not in use. */
+    int nvars;
+
+    /** Length of the sendtypes and recvtypes arrays. This is the
+     * number of tasks in the rearranger communicator, or the number
+     * of peers with the sparse exchange. */
+    int ntasks;
+
+    /** The comm_type of the rearranger options the types were built
+     * for, which decides how the type arrays are indexed. */
+    int comm_type;
+
+    /** Array of send types, indexed like the pio_swapm() arrays. */
+    MPI_Datatype *sendtypes;
+
+    /** Array of receive types, indexed like the pio_swapm() arrays. */
+    MPI_Datatype *recvtypes;
+
+    /** When this entry was last used, for LRU eviction. */
+    PIO_Offset last_use;
+
+    /** Persistent requests of rearrange_comp2io() with these types. */
+    rearr_persist_req_t comp2io;
+
+    /** Persistent requests of rearrange_io2comp() with these types. */
+    rearr_persist_req_t io2comp;
+} rearr_type_cache_t;
+
 /**
  * IO descriptor structure.
  *
@@ -290,6 +425,13 @@ typedef struct io_desc_t
     /** Remap. */
     int *remap;
 
+    /** Buffer for the data in the order of the sorted map, kept
+     * between calls when needssort is set. See pio_get_sortbuf(). */
+    void *sortbuf;
+
+    /** Size in bytes of sortbuf. */
+    size_t sortbuf_bytes;
+
     /** Number of tasks involved in the communication between comp and
      * io tasks. */
     int nrecvs;
@@ -321,11 +463,18 @@ typedef struct io_desc_t
      * sort it. */
     bool needssort;
 
+    /** True if the send types (stype) of this computation task take
+     * the data in the order of the original map, so it does not have
+     * to be sorted first, even if needssort is set. */
+    bool stype_unsorted;
+
     /** If the decomp has repeated values it can only be used for reading
 	since it doesn't make sense to write a single value from more than one location. */
     bool readonly;
 
-    /** The maximum number of bytes of this iodesc before flushing. */
+    /** The maximum number of bytes of this iodesc before flushing,
+     * per element of the local array. This is the same on all
+     * tasks. */
     int maxbytes;
 
     /** The PIO type of the data. */
@@ -351,7 +500,7 @@ typedef struct io_desc_t
 	are repeated in the compmap - used for darray read only. */
     PIO_Offset rllen;
 
-    /** Maximum llen participating. */
+    /** Maximum llen participating. This is known on all tasks. */
     int maxiobuflen;
 
     /** Array (length nrecvs) of computation tasks received from. */
@@ -406,6 +555,62 @@ typedef struct io_desc_t
      * group. */
     MPI_Comm subset_comm;
 
+    /** Number of tasks in the rearranger communicator that this task
+     * exchanges data with. Used by the sparse and neighbor comm
+     * types. */
+    int npeers;
+
+    /** Sorted array (length npeers) of the ranks of the tasks this
+     * task exchanges data with. */
+    int *peers;
+
+    /** Distributed graph communicator over the peers, used with
+     * PIO_REARR_COMM_NEIGHBOR. Created on first use. */
+    MPI_Comm neighbor_comm;
+
+    /** The node level of the decomposition with PIO_REARR_HIER,
+     * NULL otherwise. */
+    struct pio_hier_desc *hier;
+
+    /** The node level of the decomposition with PIO_REARR_COMM_SHM.
+     * Created on first use. */
+    struct pio_shm_desc *shm;
+
+    /** The windows of the decomposition with PIO_REARR_COMM_RMA.
+     * Created on first use. */
+    struct pio_rma_desc *rma;
+
+    /** With PIO_REARR_COMM_ALLTOALLV, the index in the data of this
+     * task of each element sent to the IO tasks, in the order of
+     * sindex. Created on first use. */
+    int *pack_sidx;
+
+    /** With PIO_REARR_COMM_ALLTOALLV, the index in the IO buffer of
+     * each element received from the compute tasks, in the order the
+     * elements arrive. Created on first use. */
+    int *pack_ridx;
+
+    /** Cache of MPI vector datatypes used in rearrange_comp2io(),
+     * keyed by number of variables. */
+    rearr_type_cache_t type_cache[PIO_TYPE_CACHE_SIZE];
+
+    /** Incremented on each use of the type cache. */
+    PIO_Offset type_cache_clock;
+
+    /** Number of times the datatypes were found in the cache. */
+    PIO_Offset type_cache_hits;
+
+    /** Number of times the datatypes had to be created. */
+    PIO_Offset type_cache_misses;
+
+    /** With PIO_REARR_COMM_SHM, bytes this task moved to IO tasks on
+     * its own node through the shared window. */
+    PIO_Offset onnode_bytes;
+
+    /** With PIO_REARR_COMM_SHM, bytes this task sent to IO tasks on
+     * other nodes with messages. */
+    PIO_Offset offnode_bytes;
+
     /** Hash table entry. */
     UT_hash_handle hh;
 
@@ -515,6 +720,44 @@ typedef struct iosystem_desc_t
     /** Rearranger options. */
     rearr_opt_t rearr_opts;
 
+    /** Non-zero if IO tasks write PIO_IOTYPE_NETCDF files directly
+     * with MPI-IO instead of sending their data to IO task 0. See
+     * PIOc_set_multiwriter(). */
+    int multiwriter;
+
+    /** How PIOc_write_darray() decides to flush its cache, one of
+     * the PIO_BUFFER_POLICY values. See PIOc_set_buffer_policy(). */
+    int buffer_policy;
+
+    /** Bytes of buffer memory PIO may use on this task before
+     * PIOc_write_darray() flushes cached data, 0 for no
+     * limit. See PIOc_set_mem_budget(). */
+    PIO_Offset mem_budget;
+
+    /** Which cached data is flushed first when mem_budget is
+     * reached, one of the PIO_MEM_FLUSH_ORDER values. */
+    int mem_flush_order;
+
+    /** Bytes of buffer memory in use by the files of this IO system
+     * on this task: write multi-buffers, IO buffers, holegrid fill
+     * buffers and pnetcdf attached buffers. */
+    PIO_Offset mem_usage;
+
+    /** Largest value of mem_usage. */
+    PIO_Offset mem_highwater;
+
+    /** Counter used to order the write multi-buffers by age. */
+    PIO_Offset mem_seq;
+
+    /** IO buffers kept for reuse, or NULL if the pool is not
+     * enabled. See PIOc_set_iobuf_pool(). */
+    struct pio_iobuf_pool *iobuf_pool;
+
+    /** Non-zero if define-mode calls made by computation tasks are
+     * deferred and sent to the IO tasks in one batch (async
+     * only). See PIOc_set_batch_define(). */
+    int batch_define;
+
     /** Pointer to the next iosystem_desc_t in the list. */
     struct iosystem_desc_t *next;
 } iosystem_desc_t;
@@ -554,6 +797,30 @@ typedef struct wmulti_buffer
     /** Pointer to the data. */
     void *data;
 
+    /** Number of arrays that vid and frame have room for. The
+     * buffers of a multi-buffer grow geometrically, and are kept when
+     * it is flushed, so that writing the same variables again does
+     * not allocate memory. They are freed when the file is closed. */
+    int capacity;
+
+    /** Size in bytes of the memory allocated for data. */
+    size_t data_capacity;
+
+    /** Size in bytes of the memory allocated for fillvalue. */
+    size_t fill_capacity;
+
+    /** Non-zero if frame holds the record numbers of the arrays in
+     * the multi-buffer. */
+    int use_frame;
+
+    /** Non-zero if fillvalue holds the fill values of the arrays in
+     * the multi-buffer. */
+    int use_fill;
+
+    /** Value of mem_seq of the IO system when the first array was
+     * added since the last flush. */
+    PIO_Offset seq;
+
     /** uthash handle for hash of buffers */
     int htid;
 
@@ -597,6 +864,13 @@ typedef struct file_desc_t
     /** Data buffer for this file. */
     void *iobuf;
 
+    /** Size in bytes of iobuf. */
+    PIO_Offset iobuf_bytes;
+
+    /** Size in bytes of the buffer attached to the file with
+     * ncmpi_buffer_attach(). */
+    PIO_Offset attached_bytes;
+
     /** PIO data type. */
     int pio_type;
 
@@ -611,6 +885,37 @@ typedef struct file_desc_t
      * feature. One consequence is that PIO_IOTYPE_NETCDF4C files will
      * not have deflate automatically turned on for each var. */
     int ncint_file;
+
+    /** Non-zero if distributed arrays are written to this classic
+     * netCDF file by all IO tasks (see PIOc_set_multiwriter()). */
+    int multiwriter;
+
+    /** MPI-IO handle for the multi-writer mode, opened on io_comm. */
+    MPI_File mw_fh;
+
+    /** Byte layout of the variables, read from the file header by IO
+     * task 0. For each varid, mw_layout[mw_varpos[varid]] holds the
+     * begin offset, the external element size, the number of
+     * dimensions and then the length of each dimension. NULL until
+     * the first multi-writer write after enddef. */
+    PIO_Offset *mw_layout;
+
+    /** Start of each variable in mw_layout. */
+    int *mw_varpos;
+
+    /** Number of variables in mw_varpos. */
+    int mw_nvars;
+
+    /** Size in bytes of one record in the file. */
+    PIO_Offset mw_recsize;
+
+    /** Number of collective data writes made to this file by this
+     * task (PIO_IOTYPE_NETCDF4P only). */
+    PIO_Offset num_collective_writes;
+
+    /** Define-mode calls deferred on the computation tasks, and the
+     * metadata they define. NULL if there are none. */
+    struct pio_def_batch *def_batch;
 #ifdef PIO_ENABLE_GDAL
     /** GDAL specific vars - M.Long */
     GDALDatasetH *hDS;
@@ -653,7 +958,12 @@ enum PIO_REARRANGERS
     PIO_REARR_BOX = 1,
 
     /** Subset rearranger. */
-    PIO_REARR_SUBSET = 2
+    PIO_REARR_SUBSET = 2,
+
+    /** Hierarchical rearranger. The data of the tasks on a node is
+     * combined in node shared memory, then moved to the IO tasks
+     * like the box rearranger. */
+    PIO_REARR_HIER = 3
 };
 
 /**
@@ -808,6 +1118,10 @@ enum PIO_ERROR_HANDLERS
 #define PIO_EBADREARR (-502)        /**< Rearranger error in async mode.  */
 #define PIO_REQ_NULL (NC_REQ_NULL-1) /**< Request null. */
 
+/** Handle of a write started with PIOc_iwrite_darray(). PIO_REQ_NULL
+ * once the write is complete. */
+typedef int PIO_Request;
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -872,6 +1186,10 @@ extern "C" {
     int PIOc_Init_Intracomm(MPI_Comm comp_comm, int num_iotasks, int stride, int base, int rearr,
 			    int *iosysidp);
 
+    /* Initialize PIO for intracomm mode, spreading IO tasks across nodes. */
+    int PIOc_Init_Intracomm_pernode(MPI_Comm comp_comm, int num_iotasks, int iotasks_per_node,
+                                    int rearr, int *iosysidp);
+
     /** Shut down an iosystem and free all associated resources. Use
      * PIOc_free_iosystem() instead. */
     int PIOc_finalize(int iosysid);
@@ -918,12 +1236,34 @@ extern "C" {
     int PIOc_write_darray_multi(int ncid, const int *varids, int ioid, int nvars, PIO_Offset arraylen,
 				void *array, const int *frame, void **fillvalue, bool flushtodisk);
 
+    /* Start writing a distributed array, without buffering. */
+    int PIOc_iwrite_darray(int ncid, int varid, int ioid, PIO_Offset arraylen, void *array,
+                           void *fillvalue, PIO_Request *reqp);
+
+    /* Complete writes started with PIOc_iwrite_darray(). */
+    int PIOc_wait(PIO_Request *reqp);
+    int PIOc_waitall(int nreqs, PIO_Request *reqs);
+
+    /* Check if the data of a write has reached the IO tasks. */
+    int PIOc_test(PIO_Request req, int *flagp);
+
+    /* Start or stop the progress thread for nonblocking writes. */
+    int PIOc_set_progress_thread(int enable);
+
     /* Read distributed array. */
     int PIOc_read_darray(int ncid, int varid, int ioid, PIO_Offset arraylen, void *array);
+    int PIOc_read_darray_multi(int ncid, int nvars, const int *varids, int ioid,
+                               const int *frames, void *arrays);
 
     /* Get size of local distributed array. */
     int PIOc_get_local_array_size(int ioid);
 
+    /* Get the hit and miss counts of the rearranger datatype cache. */
+    int PIOc_get_type_cache_stats(int ioid, PIO_Offset *hits, PIO_Offset *misses);
+
+    /* Get the bytes moved on and off the node by the rearranger. */
+    int PIOc_get_rearr_node_stats(int ioid, PIO_Offset *onnode, PIO_Offset *offnode);
+
     /* Handling files. */
     int PIOc_redef(int ncid);
     int PIOc_enddef(int ncid);
@@ -949,10 +1289,28 @@ extern "C" {
     /* Set the IO node data buffer size limit. */
     PIO_Offset PIOc_set_buffer_size_limit(PIO_Offset limit);
 
+    /* Choose how PIOc_write_darray() decides to flush its cache. */
+    int PIOc_set_buffer_policy(int iosysid, int policy);
+
+    /* Limit the buffer memory of an IO system, and learn its usage. */
+    int PIOc_set_mem_budget(int iosysid, PIO_Offset budget, int flush_order);
+    int PIOc_get_mem_usage(int iosysid, PIO_Offset *usagep, PIO_Offset *highwaterp);
+
+    /* Reuse the IO buffers of an IO system, and learn how well it works. */
+    int PIOc_set_iobuf_pool(int iosysid, int flags, PIO_Offset max_cached);
+    int PIOc_get_iobuf_pool_stats(int iosysid, PIO_Offset *hitsp, PIO_Offset *missesp,
+                                  PIO_Offset *bytes_savedp, PIO_Offset *cached_bytesp);
+
     /* Set the error hanlding for a file. */
     int PIOc_Set_File_Error_Handling(int ncid, int method);
 
     int PIOc_set_hint(int iosysid, const char *hint, const char *hintval);
+
+    /* Turn on or off parallel writes of classic netCDF files. */
+    int PIOc_set_multiwriter(int iosysid, int enable);
+
+    /* Defer define-mode calls in async mode, and send them in one batch. */
+    int PIOc_set_batch_define(int iosysid, int enable);
     int PIOc_set_chunk_cache(int iosysid, int iotype, PIO_Offset size, PIO_Offset nelems,
 			     float preemption);
     int PIOc_get_chunk_cache(int iosysid, int iotype, PIO_Offset *sizep, PIO_Offset *nelemsp,
@@ -0,0 +1,379 @@
+/**
+ * @file
+ * A pool of IO buffers for each IO system.
+ *
+ * The IO buffers of PIOc_write_darray_multi() and PIOc_read_darray()
+ * are as large as the data of all the variables on an IO task, and
+ * are allocated and freed for every write and read. Large buffers
+ * come straight from the operating system, so each one page faults,
+ * and is zeroed by the kernel, again. When the pool is enabled, freed
+ * buffers are kept, and given out again for the next buffer of the
+ * same size class.
+ *
+ * Buffer sizes are rounded up to size classes, four for each power
+ * of two, so a buffer wastes at most a quarter of its size. Buffers
+ * smaller than PIO_IOBUF_POOL_MIN_BYTES are not pooled.
+ *
+ * @author Jim Edwards
+ */
+#include <config.h>
+#include <pio.h>
+#include <pio_internal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/** Buffers of this many bytes or fewer are not pooled. */
+#define PIO_IOBUF_POOL_MIN_BYTES 65536
+
+/** Log2 of PIO_IOBUF_POOL_MIN_BYTES. */
+#define PIO_IOBUF_POOL_MIN_SHIFT 16
+
+/** Size of a huge page on the systems which have them. */
+#define PIO_HUGEPAGE_BYTES (2 * 1024 * 1024)
+
+/**
+ * Find the size class of a buffer.
+ *
+ * @param bytes the size of the buffer in bytes.
+ * @param round_up if true, the class of the smallest class size
+ * which holds bytes, otherwise the class of the largest class size
+ * which fits in bytes.
+ * @param class_bytesp pointer that gets the size of the class in
+ * bytes.
+ * @returns the class, or -1 if the buffer is not pooled.
+ * @author Jim Edwards
+ */
+static int
+iobuf_class(PIO_Offset bytes, bool round_up, PIO_Offset *class_bytesp)
+{
+    int shift;
+    PIO_Offset base, step, q;
+
+    if (bytes <= PIO_IOBUF_POOL_MIN_BYTES)
+        return -1;
+
+    /* 2^shift < bytes <= 2^(shift+1) */
+    for (shift = PIO_IOBUF_POOL_MIN_SHIFT; ((PIO_Offset)2 << shift) < bytes; shift++)
+        ;
+    if (shift >= PIO_IOBUF_POOL_MIN_SHIFT + PIO_IOBUF_POOL_SHIFTS)
+        return -1;
+
+    base = (PIO_Offset)1 << shift;
+    step = base / PIO_IOBUF_POOL_STEPS;
+    if (round_up)
+        q = (bytes - base + step - 1) / step;
+    else
+    {
+        /* Round down, staying in the class range above base. */
+        q = (bytes - base) / step;
+        if (!q)
+        {
+            if (shift == PIO_IOBUF_POOL_MIN_SHIFT)
+                return -1;
+            shift--;
+            base /= 2;
+            step /= 2;
+            q = PIO_IOBUF_POOL_STEPS;
+        }
+    }
+
+    *class_bytesp = base + q * step;
+    return (shift - PIO_IOBUF_POOL_MIN_SHIFT) * PIO_IOBUF_POOL_STEPS + (int)q - 1;
+}
+
+/**
+ * Free the buffers held by the pool of an IO system, and take them
+ * off its memory usage. This is not collective.
+ *
+ * @param ios pointer to the IO system info.
+ * @author Jim Edwards
+ */
+void
+pio_iobuf_pool_drain(iosystem_desc_t *ios)
+{
+    pio_iobuf_pool *pool = ios->iobuf_pool;
+
+    if (!pool)
+        return;
+
+    for (int c = 0; c < PIO_IOBUF_POOL_NCLASS; c++)
+    {
+        while (pool->ncached[c])
+            free(pool->cached[c][--pool->ncached[c]]);
+    }
+    pio_mem_add(ios, -pool->cached_bytes);
+    pool->cached_bytes = 0;
+}
+
+/**
+ * Get an IO buffer. If the pool of the IO system is enabled, the
+ * buffer is taken from the pool if it holds one of the right size
+ * class, otherwise a new one is allocated, with the size rounded up
+ * to the size class. New pool buffers are aligned to pages, or to
+ * huge pages with PIO_IOBUF_POOL_HUGEPAGE, and their pages are
+ * touched by this task, so that they are placed in the memory of the
+ * NUMA node of this task. The contents of the buffer are undefined.
+ *
+ * @param ios pointer to the IO system info.
+ * @param bytes the number of bytes needed.
+ * @param alloc_bytesp pointer that gets the size of the buffer,
+ * which must be given to pio_iobuf_free().
+ * @returns pointer to the buffer, or NULL if out of memory.
+ * @author Jim Edwards
+ */
+void *
+pio_iobuf_alloc(iosystem_desc_t *ios, PIO_Offset bytes, PIO_Offset *alloc_bytesp)
+{
+    pio_iobuf_pool *pool;
+    PIO_Offset class_bytes;
+    size_t align;
+    size_t page;
+    void *buf;
+    int c;
+
+    pioassert(ios && bytes > 0 && alloc_bytesp, "invalid input", __FILE__, __LINE__);
+
+    pool = ios->iobuf_pool;
+    if (!pool || (c = iobuf_class(bytes, true, &class_bytes)) < 0)
+    {
+        *alloc_bytesp = bytes;
+        return malloc(bytes);
+    }
+
+    /* Reuse a buffer of this class. The caller counts it in the
+     * memory usage again. */
+    if (pool->ncached[c])
+    {
+        pool->hits++;
+        pool->bytes_saved += class_bytes;
+        pool->cached_bytes -= class_bytes;
+        pio_mem_add(ios, -class_bytes);
+        *alloc_bytesp = class_bytes;
+        return pool->cached[c][--pool->ncached[c]];
+    }
+
+    /* Give back the buffers of the other classes if the new one
+     * would not fit in the memory budget. */
+    if (ios->mem_budget && ios->mem_usage + class_bytes > ios->mem_budget)
+        pio_iobuf_pool_drain(ios);
+
+    pool->misses++;
+    page = sysconf(_SC_PAGESIZE);
+    align = page;
+    if ((pool->flags & PIO_IOBUF_POOL_HUGEPAGE) && class_bytes >= PIO_HUGEPAGE_BYTES)
+        align = PIO_HUGEPAGE_BYTES;
+    if (posix_memalign(&buf, align, class_bytes))
+        return NULL;
+
+#ifdef MADV_HUGEPAGE
+    if (align == PIO_HUGEPAGE_BYTES)
+        madvise(buf, class_bytes, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+
+    /* Fault the pages in now, on this task, so they come from the
+     * NUMA node this task runs on. */
+    for (PIO_Offset b = 0; b < class_bytes; b += page)
+        ((char *)buf)[b] = 0;
+
+    PLOG((3, "pio_iobuf_alloc new buffer of class %d, %lld bytes", c, class_bytes));
+    *alloc_bytesp = class_bytes;
+    return buf;
+}
+
+/**
+ * Give back an IO buffer from pio_iobuf_alloc(). If the pool of the
+ * IO system is enabled, and has room, the buffer is kept for
+ * reuse. Buffers are not kept if that would exceed the limit of the
+ * pool, or the memory budget of the IO system (see
+ * PIOc_set_mem_budget()). The caller must already have taken the
+ * buffer off the memory usage of the IO system. A kept buffer is
+ * counted in the memory usage again, until it is reused or the pool
+ * is drained.
+ *
+ * @param ios pointer to the IO system info.
+ * @param buf pointer to the buffer. May be NULL.
+ * @param alloc_bytes the size of the buffer from pio_iobuf_alloc().
+ * @author Jim Edwards
+ */
+void
+pio_iobuf_free(iosystem_desc_t *ios, void *buf, PIO_Offset alloc_bytes)
+{
+    pio_iobuf_pool *pool;
+    PIO_Offset class_bytes;
+    int c;
+
+    pioassert(ios, "invalid input", __FILE__, __LINE__);
+
+    if (!buf)
+        return;
+
+    /* The buffer is at least as large as the class it is kept in,
+     * even if it was allocated before the pool was enabled. */
+    pool = ios->iobuf_pool;
+    if (!pool || (c = iobuf_class(alloc_bytes, false, &class_bytes)) < 0 ||
+        pool->ncached[c] == PIO_IOBUF_POOL_DEPTH ||
+        (pool->max_cached && pool->cached_bytes + class_bytes > pool->max_cached) ||
+        (ios->mem_budget && ios->mem_usage + class_bytes > ios->mem_budget))
+    {
+        free(buf);
+        return;
+    }
+
+    pool->cached[c][pool->ncached[c]++] = buf;
+    pool->cached_bytes += class_bytes;
+    pio_mem_add(ios, class_bytes);
+}
+
+/**
+ * Free the pool of an IO system, and the buffers it holds. This is
+ * called when the IO system is freed.
+ *
+ * @param ios pointer to the IO system info.
+ * @author Jim Edwards
+ */
+void
+pio_iobuf_pool_free(iosystem_desc_t *ios)
+{
+    pio_iobuf_pool *pool = ios->iobuf_pool;
+
+    if (!pool)
+        return;
+
+    PLOG((2, "iobuf pool of iosysid %d: %lld hits %lld misses %lld bytes saved",
+          ios->iosysid, pool->hits, pool->misses, pool->bytes_saved));
+    pio_iobuf_pool_drain(ios);
+    free(pool);
+    ios->iobuf_pool = NULL;
+}
+
+/**
+ * Enable or disable the IO buffer pool of an IO system.
+ *
+ * With the pool, the IO buffers used by the IO tasks to write and
+ * read distributed arrays are kept when they are freed, and reused
+ * for later buffers of the same size class, instead of being
+ * allocated again from the operating system for each write or
+ * read. This saves the page faults and zeroing of large buffers, at
+ * the cost of holding the memory between calls.
+ *
+ * With PIO_IOBUF_POOL_HUGEPAGE, large pool buffers are aligned to
+ * huge pages and the system is asked to back them with huge pages,
+ * where this is supported.
+ *
+ * The setting applies to the tasks of the IO system, and is not
+ * collective, except in async mode, where the computation tasks
+ * pass it to the IO tasks.
+ *
+ * @param iosysid the IO system ID.
+ * @param flags 0 to disable the pool and free the buffers it holds,
+ * otherwise PIO_IOBUF_POOL_ENABLE, optionally or-ed with
+ * PIO_IOBUF_POOL_HUGEPAGE.
+ * @param max_cached the largest number of bytes the pool may hold
+ * when they are not in use, 0 for no limit.
+ * @returns 0 for success, error code otherwise.
+ * @ingroup PIO_write_darray_c
+ * @author Jim Edwards
+ */
+int
+PIOc_set_iobuf_pool(int iosysid, int flags, PIO_Offset max_cached)
+{
+    iosystem_desc_t *ios;
+    pio_iobuf_pool *pool;
+    int mpierr = MPI_SUCCESS, mpierr2;  /* Return code from MPI function codes. */
+
+    PLOG((1, "PIOc_set_iobuf_pool iosysid = %d flags = %d max_cached = %lld", iosysid,
+          flags, max_cached));
+
+    if (!(ios = pio_get_iosystem_from_id(iosysid)))
+        return pio_err(NULL, NULL, PIO_EBADID, __FILE__, __LINE__);
+
+    if (max_cached < 0 || (flags & ~(PIO_IOBUF_POOL_ENABLE | PIO_IOBUF_POOL_HUGEPAGE)) ||
+        (flags && !(flags & PIO_IOBUF_POOL_ENABLE)))
+        return pio_err(ios, NULL, PIO_EINVAL, __FILE__, __LINE__);
+
+    /* If using async, and not an IO task, then send parameters. */
+    if (ios->async)
+    {
+        if (!ios->ioproc)
+        {
+            int msg = PIO_MSG_SET_IOBUF_POOL;
+
+            if (ios->compmain == MPI_ROOT)
+                mpierr = MPI_Send(&msg, 1, MPI_INT, ios->ioroot, 1, ios->union_comm);
+
+            if (!mpierr)
+                mpierr = MPI_Bcast(&flags, 1, MPI_INT, ios->compmain, ios->intercomm);
+            if (!mpierr)
+                mpierr = MPI_Bcast(&max_cached, 1, MPI_OFFSET, ios->compmain, ios->intercomm);
+        }
+
+        /* Handle MPI errors. */
+        if ((mpierr2 = MPI_Bcast(&mpierr, 1, MPI_INT, ios->comproot, ios->my_comm)))
+            check_mpi(ios, NULL, mpierr2, __FILE__, __LINE__);
+        if (mpierr)
+            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    }
+
+    if (!flags)
+    {
+        pio_iobuf_pool_free(ios);
+        return PIO_NOERR;
+    }
+
+    if (!(pool = ios->iobuf_pool))
+    {
+        if (!(pool = calloc(1, sizeof(pio_iobuf_pool))))
+            return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+        ios->iobuf_pool = pool;
+    }
+    pool->flags = flags;
+    pool->max_cached = max_cached;
+
+    /* Give back what no longer fits in the limit. */
+    if (max_cached && pool->cached_bytes > max_cached)
+        pio_iobuf_pool_drain(ios);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Get the counters of the IO buffer pool of an IO system on this
+ * task. All counters are 0 if the pool is not enabled. This is not
+ * collective.
+ *
+ * @param iosysid the IO system ID.
+ * @param hitsp pointer that gets the number of buffers reused from
+ * the pool. Ignored if NULL.
+ * @param missesp pointer that gets the number of buffers the pool
+ * had to allocate. Ignored if NULL.
+ * @param bytes_savedp pointer that gets the total bytes of the
+ * reused buffers, which did not have to be allocated. Ignored if
+ * NULL.
+ * @param cached_bytesp pointer that gets the bytes the pool holds
+ * now. Ignored if NULL.
+ * @returns 0 for success, error code otherwise.
+ * @ingroup PIO_write_darray_c
+ * @author Jim Edwards
+ */
+int
+PIOc_get_iobuf_pool_stats(int iosysid, PIO_Offset *hitsp, PIO_Offset *missesp,
+                          PIO_Offset *bytes_savedp, PIO_Offset *cached_bytesp)
+{
+    iosystem_desc_t *ios;
+    pio_iobuf_pool *pool;
+
+    if (!(ios = pio_get_iosystem_from_id(iosysid)))
+        return pio_err(NULL, NULL, PIO_EBADID, __FILE__, __LINE__);
+    pool = ios->iobuf_pool;
+
+    if (hitsp)
+        *hitsp = pool ? pool->hits : 0;
+    if (missesp)
+        *missesp = pool ? pool->misses : 0;
+    if (bytes_savedp)
+        *bytes_savedp = pool ? pool->bytes_saved : 0;
+    if (cached_bytesp)
+        *cached_bytesp = pool ? pool->cached_bytes : 0;
+
+    return PIO_NOERR;
+}
@@ -66,206 +66,268 @@ PIOc_set_buffer_size_limit(PIO_Offset limit)
 }
 
 /**
- * Write one or more arrays with the same IO decomposition to the
- * file.
+ * Choose how PIOc_write_darray() decides to flush the data it has
+ * cached to the IO tasks.
  *
- * This funciton is similar to PIOc_write_darray(), but allows the
- * caller to use their own data buffering (instead of using the
- * buffering implemented in PIOc_write_darray()).
+ * With PIO_BUFFER_POLICY_BUDGET (the default), the cache of a
+ * decomposition is flushed when it reaches a size limit, which is
+ * computed when the decomposition is created from the buffer size
+ * limits and is the same on all tasks. No communication is needed in
+ * PIOc_write_darray(), but it returns PIO_ENOMEM if the memory for the
+ * cache can't be allocated.
  *
- * When the user calls PIOc_write_darray() one or more times, then
- * PIO_write_darray_multi() will be called when the buffer is flushed.
+ * With PIO_BUFFER_POLICY_COLLECTIVE, the computation tasks also
+ * agree, with an MPI_Allreduce in every call to PIOc_write_darray(),
+ * to flush the cache when memory for it can't be allocated on any of
+ * them.
  *
- * Internally, this function will:
- * <ul>
- * <li>Find info about file, decomposition, and variable.
- * <li>Do a special flush for pnetcdf if needed.
- * <li>Allocates a buffer big enough to hold all the data in the
- * multi-buffer, for all tasks.
- * <li>Calls rearrange_comp2io() to move data from compute to IO
- * tasks.
- * <li>For parallel iotypes (pnetcdf and netCDF-4 parallel) call
- * pio_write_darray_multi_nc().
- * <li>For serial iotypes (netcdf classic and netCDF-4 serial) call
- * write_darray_multi_serial().
- * <li>For subset rearranger, create holegrid to write missing
- * data. Then call pio_write_darray_multi_nc() or
- * write_darray_multi_serial() to write the holegrid.
- * <li>Special buffer flush for pnetcdf.
- * </ul>
+ * This function must be called on all computation tasks of the IO
+ * system.
  *
- * @param ncid identifies the netCDF file.
- * @param varids an array of length nvars containing the variable ids to
- * be written.
- * @param ioid the I/O description ID as passed back by
- * PIOc_InitDecomp().
- * @param nvars the number of variables to be written with this
- * call.
- * @param arraylen the length of the array to be written. This is the
- * length of the distrubited array. That is, the length of the portion
- * of the data that is on the processor. The same arraylen is used for
- * all variables in the call.
- * @param array pointer to the data to be written. This is a pointer
- * to an array of arrays with the distributed portion of the array
- * that is on this processor. There are nvars arrays of data, and each
- * array of data contains one record worth of data for that variable.
- * @param frame an array of length nvars with the frame or record
- * dimension for each of the nvars variables in IOBUF. NULL if this
- * iodesc contains non-record vars.
- * @param fillvalue pointer an array (of length nvars) of pointers to
- * the fill value to be used for missing data.
- * @param flushtodisk non-zero to cause buffers to be flushed to disk.
- * @return 0 for success, error code otherwise.
+ * @param iosysid the IO system ID.
+ * @param policy PIO_BUFFER_POLICY_BUDGET or
+ * PIO_BUFFER_POLICY_COLLECTIVE.
+ * @returns 0 for success, PIO_EBADID if iosysid can't be found,
+ * PIO_EINVAL if policy is invalid.
  * @ingroup PIO_write_darray_c
- * @author Jim Edwards, Ed Hartnett
+ * @author Jim Edwards
  */
 int
-PIOc_write_darray_multi(int ncid, const int *varids, int ioid, int nvars,
-                        PIO_Offset arraylen, void *array, const int *frame,
-                        void **fillvalue, bool flushtodisk)
+PIOc_set_buffer_policy(int iosysid, int policy)
 {
-    iosystem_desc_t *ios;  /* Pointer to io system information. */
-    file_desc_t *file;     /* Pointer to file information. */
-    io_desc_t *iodesc;     /* Pointer to IO description information. */
-    int rlen;              /* Total data buffer size. */
-    var_desc_t *vdesc0;    /* First entry in array of var_desc structure for each var. */
-    int fndims, fndims2;            /* Number of dims in the var in the file. */
-    int mpierr = MPI_SUCCESS, mpierr2;  /* Return code from MPI function calls. */
-    int ierr;              /* Return code. */
-    void *tmparray;
+    iosystem_desc_t *ios;
 
-/* #ifdef USE_MPE */
-/*     pio_start_mpe_log(DARRAY_WRITE); */
-/* #endif /\* USE_MPE *\/ */
-
-    /* Get the file info. */
-    if ((ierr = pio_get_file(ncid, &file)))
+    /* Get the iosysid. */
+    if (!(ios = pio_get_iosystem_from_id(iosysid)))
         return pio_err(NULL, NULL, PIO_EBADID, __FILE__, __LINE__);
-    ios = file->iosystem;
 
-    /* Check inputs. */
-    if (nvars <= 0 || !varids)
-        return pio_err(ios, file, PIO_EINVAL, __FILE__, __LINE__);
+    if (policy != PIO_BUFFER_POLICY_BUDGET && policy != PIO_BUFFER_POLICY_COLLECTIVE)
+        return pio_err(ios, NULL, PIO_EINVAL, __FILE__, __LINE__);
 
-    PLOG((1, "PIOc_write_darray_multi ncid = %d ioid = %d nvars = %d arraylen = %ld "
-          "flushtodisk = %d",
-          ncid, ioid, nvars, arraylen, flushtodisk));
+    PLOG((1, "PIOc_set_buffer_policy policy = %d", policy));
+    ios->buffer_policy = policy;
 
-    /* Check that we can write to this file. */
-    if (!file->writable)
-        return pio_err(ios, file, PIO_EPERM, __FILE__, __LINE__);
-
-    /* Get iodesc. */
-    if (!(iodesc = pio_get_iodesc_from_id(ioid)))
-        return pio_err(ios, file, PIO_EBADID, __FILE__, __LINE__);
-    pioassert(iodesc->rearranger == PIO_REARR_BOX || iodesc->rearranger == PIO_REARR_SUBSET,
-              "unknown rearranger", __FILE__, __LINE__);
-
-    pioassert(iodesc->readonly == 0,"Multiple sources in map for a single destination",__FILE__,__LINE__);
-
-
-    /* Check the types of all the vars. They must match the type of
-     * the decomposition. */
-    for (int v = 0; v < nvars; v++)
-    {
-        var_desc_t *vdesc;
-        if ((ierr = get_var_desc(varids[v], &file->varlist, &vdesc)))
-            return pio_err(ios, file, ierr, __FILE__, __LINE__);
-        /* if (vdesc->pio_type != iodesc->piotype)
-           return pio_err(ios, file, PIO_EINVAL, __FILE__, __LINE__);*/
-    }
-
-    /* Get a pointer to the variable info for the first variable. */
-    if ((ierr = get_var_desc(varids[0], &file->varlist, &vdesc0)))
-        return pio_err(ios, file, ierr, __FILE__, __LINE__);
+    return PIO_NOERR;
+}
 
-    /* Run these on all tasks if async is not in use, but only on
-     * non-IO tasks if async is in use. */
-    if ((!ios->async || !ios->ioproc) && (file->iotype != PIO_IOTYPE_GDAL))
-    {
-        /* Get the number of dims for this var. */
-        PLOG((3, "about to call PIOc_inq_varndims varids[0] = %d", varids[0]));
-        if ((ierr = PIOc_inq_varndims(file->pio_ncid, varids[0], &fndims)))
-            return check_netcdf(file, ierr, __FILE__, __LINE__);
-        PLOG((3, "called PIOc_inq_varndims varids[0] = %d fndims = %d", varids[0], fndims));
-        for (int v=1; v < nvars; v++){
-            if ((ierr = PIOc_inq_varndims(file->pio_ncid, varids[v], &fndims2)))
-                return check_netcdf(file, ierr, __FILE__, __LINE__);
-            if(fndims != fndims2)
-                return pio_err(ios, file, PIO_EVARDIMMISMATCH, __FILE__, __LINE__);
-        }
+/**
+ * Set a budget for the buffer memory used on this task by the files
+ * of an IO system.
+ *
+ * The memory counted is that of the write multi-buffers of
+ * PIOc_write_darray(), the IO buffers the data is moved into before
+ * it is written, the buffers held by the IO buffer pool (see
+ * PIOc_set_iobuf_pool()), the holegrid fill buffers of the subset
+ * rearranger and the buffers attached to pnetcdf files. When adding
+ * an array to the multi-buffer would take this over the budget on
+ * any computation task, PIOc_write_darray() gives back the buffers
+ * of the pool of that task, then flushes multi-buffers of any file
+ * of the IO system to disk, and frees their memory, until it
+ * fits. Multi-buffers with no data are freed first, then the others
+ * in the order given by flush_order. This needs an MPI_Allreduce on
+ * the computation tasks in each call to PIOc_write_darray().
+ *
+ * On the IO tasks, which hold no multi-buffers in async mode, the
+ * pool gives back its buffers when a new IO buffer would not fit in
+ * the budget. The IO buffers and pnetcdf buffers that are in use are
+ * not limited by the budget.
+ *
+ * The budget does not stop a single write from going over it, and
+ * the other size limits (see PIOc_set_buffer_size_limit()) still
+ * apply. This function must be called on all computation tasks,
+ * with the same arguments. In async mode, the computation tasks
+ * pass the budget to the IO tasks.
+ *
+ * @param iosysid the IO system ID.
+ * @param budget the budget in bytes, 0 for no budget.
+ * @param flush_order one of the PIO_MEM_FLUSH_ORDER values.
+ * @returns 0 for success, error code otherwise.
+ * @ingroup PIO_write_darray_c
+ * @author Jim Edwards
+ */
+int
+PIOc_set_mem_budget(int iosysid, PIO_Offset budget, int flush_order)
+{
+    iosystem_desc_t *ios;
+    int mpierr = MPI_SUCCESS, mpierr2;  /* Return code from MPI function codes. */
 
-    }
+    if (!(ios = pio_get_iosystem_from_id(iosysid)))
+        return pio_err(NULL, NULL, PIO_EBADID, __FILE__, __LINE__);
 
-    if ((!ios->async || !ios->ioproc) && (file->iotype == PIO_IOTYPE_GDAL))
-    {
-      // Do we even need to sort out fndims here? (MSL<<>>)
-      fndims = 1;
-    }
+    if (budget < 0 || (flush_order != PIO_MEM_FLUSH_LARGEST &&
+                       flush_order != PIO_MEM_FLUSH_OLDEST))
+        return pio_err(ios, NULL, PIO_EINVAL, __FILE__, __LINE__);
 
-    /* If async is in use, and this is not an IO task, bcast the
-     * parameters. */
+    /* If using async, and not an IO task, then send parameters. */
     if (ios->async)
     {
         if (!ios->ioproc)
         {
-            int msg = PIO_MSG_WRITEDARRAYMULTI;
-            char frame_present = frame ? true : false;         /* Is frame non-NULL? */
-            char fillvalue_present = fillvalue ? true : false; /* Is fillvalue non-NULL? */
-            int flushtodisk_int = flushtodisk; /* Need this to be int not boolean. */
+            int msg = PIO_MSG_SET_MEM_BUDGET;
 
             if (ios->compmain == MPI_ROOT)
                 mpierr = MPI_Send(&msg, 1, MPI_INT, ios->ioroot, 1, ios->union_comm);
 
-            /* Send the function parameters and associated informaiton
-             * to the msg handler. */
-            if (!mpierr)
-                mpierr = MPI_Bcast(&ncid, 1, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&nvars, 1, MPI_INT, ios->compmain, ios->intercomm);
             if (!mpierr)
-                mpierr = MPI_Bcast((void *)varids, nvars, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&ioid, 1, MPI_INT, ios->compmain, ios->intercomm);
+                mpierr = MPI_Bcast(&budget, 1, MPI_OFFSET, ios->compmain, ios->intercomm);
             if (!mpierr)
-                mpierr = MPI_Bcast(&arraylen, 1, MPI_OFFSET, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(array, arraylen * iodesc->piotype_size, MPI_CHAR, ios->compmain,
-                                   ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&frame_present, 1, MPI_CHAR, ios->compmain, ios->intercomm);
-            if (!mpierr && frame_present)
-                mpierr = MPI_Bcast((void *)frame, nvars, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&fillvalue_present, 1, MPI_CHAR, ios->compmain, ios->intercomm);
-            if (!mpierr && fillvalue_present)
-                mpierr = MPI_Bcast((void *)fillvalue, nvars * iodesc->piotype_size, MPI_CHAR,
-                                   ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&flushtodisk_int, 1, MPI_INT, ios->compmain, ios->intercomm);
-            PLOG((2, "PIOc_write_darray_multi file->pio_ncid = %d nvars = %d ioid = %d arraylen = %d "
-                  "frame_present = %d fillvalue_present = %d flushtodisk = %d", file->pio_ncid, nvars,
-                  ioid, arraylen, frame_present, fillvalue_present, flushtodisk));
+                mpierr = MPI_Bcast(&flush_order, 1, MPI_INT, ios->compmain, ios->intercomm);
         }
 
         /* Handle MPI errors. */
         if ((mpierr2 = MPI_Bcast(&mpierr, 1, MPI_INT, ios->comproot, ios->my_comm)))
-            return check_mpi(NULL, file, mpierr2, __FILE__, __LINE__);
+            check_mpi(ios, NULL, mpierr2, __FILE__, __LINE__);
         if (mpierr)
-            return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    }
 
-        /* Share results known only on computation tasks with IO tasks. */
-        if ((mpierr = MPI_Bcast(&fndims, 1, MPI_INT, ios->comproot, ios->my_comm)))
-            check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
-        PLOG((3, "shared fndims = %d", fndims));
+    PLOG((1, "PIOc_set_mem_budget iosysid = %d budget = %lld flush_order = %d", iosysid,
+          budget, flush_order));
+    ios->mem_budget = budget;
+    ios->mem_flush_order = flush_order;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Get the buffer memory used on this task by the files of an IO
+ * system, now and at most. See PIOc_set_mem_budget(). This is not
+ * collective.
+ *
+ * @param iosysid the IO system ID.
+ * @param usagep pointer that gets the bytes in use. Ignored if NULL.
+ * @param highwaterp pointer that gets the largest number of bytes
+ * that have been in use. Ignored if NULL.
+ * @returns 0 for success, error code otherwise.
+ * @ingroup PIO_write_darray_c
+ * @author Jim Edwards
+ */
+int
+PIOc_get_mem_usage(int iosysid, PIO_Offset *usagep, PIO_Offset *highwaterp)
+{
+    iosystem_desc_t *ios;
+
+    if (!(ios = pio_get_iosystem_from_id(iosysid)))
+        return pio_err(NULL, NULL, PIO_EBADID, __FILE__, __LINE__);
+
+    if (usagep)
+        *usagep = ios->mem_usage;
+    if (highwaterp)
+        *highwaterp = ios->mem_highwater;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Flush and free write multi-buffers of the IO system until the
+ * buffer memory, plus the bytes about to be allocated, fits in the
+ * budget on all computation tasks. A task which is over the budget
+ * first gives back the buffers held by its IO buffer pool, which
+ * needs no communication.
+ *
+ * All tasks choose the same multi-buffers, because the choice only
+ * depends on values which are the same on all tasks.
+ *
+ * @param ios pointer to the IO system info.
+ * @param need bytes about to be allocated on this task.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+mem_govern(iosystem_desc_t *ios, PIO_Offset need)
+{
+    int mpierr;
+    int ierr;
+
+    pioassert(ios && ios->mem_budget > 0, "invalid input", __FILE__, __LINE__);
+
+    for (;;)
+    {
+        wmulti_buffer *victim;
+        file_desc_t *vfile;
+        int over;
+
+        if (ios->mem_usage + need > ios->mem_budget)
+            pio_iobuf_pool_drain(ios);
+        over = ios->mem_usage + need > ios->mem_budget;
+
+        if ((mpierr = MPI_Allreduce(MPI_IN_PLACE, &over, 1, MPI_INT, MPI_MAX, ios->comp_comm)))
+            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+        if (!over)
+            break;
+
+        /* Stop if there is nothing left to free. */
+        if (!(victim = pio_find_flush_victim(ios, &vfile)))
+            break;
+        PLOG((2, "mem_govern usage = %lld need = %lld flushing ncid = %d ioid = %d", ios->mem_usage,
+              need, vfile->pio_ncid, victim->ioid));
+
+        if (victim->num_arrays > 0)
+            if ((ierr = flush_buffer(vfile->pio_ncid, victim, true)))
+                return pio_err(ios, vfile, ierr, __FILE__, __LINE__);
+        pio_mem_add(ios, -pio_wmb_bytes(victim));
+        pio_wmb_release(victim);
     }
 
-    /* if the buffer is already in use in pnetcdf we need to flush first */
-    if (file->iotype == PIO_IOTYPE_PNETCDF && file->iobuf)
-        if ((ierr = flush_output_buffer(file, 1, 0)))
-            return pio_err(ios, file, ierr, __FILE__, __LINE__);
+    return PIO_NOERR;
+}
 
-    pioassert(!file->iobuf, "buffer overwrite",__FILE__, __LINE__);
+/**
+ * Find out whether the data of a decomposition has to be copied to
+ * the order of the sorted map before it is sent, or from it after it
+ * is received. This is not needed if the map is sorted, or if the
+ * send types of this task take the data in the order of the original
+ * map (see define_iodesc_datatypes()). The types are created here if
+ * they don't exist yet.
+ *
+ * @param ios pointer to the IO system info.
+ * @param iodesc pointer to the decomposition info.
+ * @param copyp pointer that gets true if the data must be copied.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+needs_sorted_copy(iosystem_desc_t *ios, io_desc_t *iodesc, bool *copyp)
+{
+    int ierr;
+
+    *copyp = false;
+    if (!iodesc->needssort)
+        return PIO_NOERR;
+
+    if ((ierr = define_iodesc_datatypes(ios, iodesc)))
+        return pio_err(ios, NULL, ierr, __FILE__, __LINE__);
+    *copyp = !iodesc->stype_unsorted;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Allocate the buffer that the data of a write is moved into on the
+ * IO tasks. The buffer is big enough for nvars arrays with the
+ * decomposition. If fill values are needed with the box rearranger,
+ * they are put in the buffer, to be overwritten where there is data.
+ *
+ * @param file pointer to the file_desc_t info.
+ * @param iodesc pointer to the decomposition info.
+ * @param nvars number of variables.
+ * @param fillvalue an array of nvars fill values, or NULL.
+ * @param bufp pointer that gets the buffer. NULL on tasks that
+ * don't need one.
+ * @param bytesp pointer that gets the size of the buffer in bytes,
+ * which is added to the memory usage of the IO system.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards, Ed Hartnett
+ */
+static int
+alloc_darray_iobuf(file_desc_t *file, io_desc_t *iodesc, int nvars, void *fillvalue,
+                   void **bufp, PIO_Offset *bytesp)
+{
+    iosystem_desc_t *ios = file->iosystem;
+    int rlen;              /* Total data buffer size. */
+
+    *bufp = NULL;
+    *bytesp = 0;
 
     /* Determine total size of aggregated data (all vars/records).
      * For netcdf serial writes we collect the data on io nodes and
@@ -284,44 +346,62 @@ PIOc_write_darray_multi(int ncid, const int *varids, int ioid, int nvars,
     if (rlen > 0)
     {
         /* Allocate memory for the buffer for all vars/records. */
-        if (!(file->iobuf = malloc(iodesc->mpitype_size * (size_t)rlen)))
+        if (!(*bufp = pio_iobuf_alloc(ios, (PIO_Offset)rlen * iodesc->mpitype_size, bytesp)))
             return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
-        PLOG((3, "allocated %lld bytes for variable buffer", (size_t)rlen * iodesc->mpitype_size));
+        PLOG((3, "allocated %lld bytes for variable buffer", *bytesp));
 
         /* If fill values are desired, and we're using the BOX
          * rearranger, insert fill values. */
-        if (iodesc->needsfill && iodesc->rearranger == PIO_REARR_BOX && fillvalue)
+        if (iodesc->needsfill && iodesc->rearranger != PIO_REARR_SUBSET && fillvalue)
         {
             PLOG((3, "inerting fill values iodesc->maxiobuflen = %d", iodesc->maxiobuflen));
             for (int nv = 0; nv < nvars; nv++)
-                for (int i = 0; i < iodesc->maxiobuflen; i++)
-                    memcpy(&((char *)file->iobuf)[iodesc->mpitype_size * (i + nv * iodesc->maxiobuflen)],
-                           &((char *)fillvalue)[nv * iodesc->mpitype_size], iodesc->mpitype_size);
+                pio_fill_buffer((char *)(*bufp) + (size_t)iodesc->mpitype_size * nv * iodesc->maxiobuflen,
+                                (char *)fillvalue + nv * iodesc->mpitype_size,
+                                iodesc->maxiobuflen, iodesc->mpitype_size);
         }
     }
     else if (file->iotype == PIO_IOTYPE_PNETCDF && ios->ioproc)
     {
         /* this assures that iobuf is allocated on all iotasks thus
-           assuring that the flush_output_buffer call above is called
-           collectively (from all iotasks) */
-        if (!(file->iobuf = malloc(1)))
+           assuring that the flush_output_buffer call before the
+           write is called collectively (from all iotasks) */
+        if (!(*bufp = malloc(1)))
             return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
+        *bytesp = 1;
         PLOG((3, "allocated token for variable buffer"));
     }
-    if (iodesc->needssort)
-    {
-        if (!(tmparray = calloc(arraylen*nvars, iodesc->piotype_size)))
-            return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
-        pio_sorted_copy(array, tmparray, iodesc, nvars, 0);
-    }
-    else
-    {
-        tmparray = array;
-    }
+    pio_mem_add(ios, *bytesp);
 
-    /* Move data from compute to IO tasks. */
-    if ((ierr = rearrange_comp2io(ios, iodesc, tmparray, file->iobuf, nvars)))
-        return pio_err(ios, file, ierr, __FILE__, __LINE__);
+    return PIO_NOERR;
+}
+
+/**
+ * Write data that has been moved to file->iobuf on the IO tasks to
+ * the file. For the subset rearranger, the holegrid is written with
+ * fill values too.
+ *
+ * The iobuf is freed, except for pnetcdf, which frees it in
+ * flush_output_buffer().
+ *
+ * @param file pointer to the file_desc_t info.
+ * @param iodesc pointer to the decomposition info.
+ * @param vdesc0 pointer to the var_desc_t of the first variable.
+ * @param nvars number of variables.
+ * @param fndims number of dims of the variables in the file.
+ * @param varids an array of length nvars containing the variable ids.
+ * @param frame an array of length nvars with the record of each
+ * variable, or NULL for non-record vars.
+ * @param fillvalue an array of nvars fill values, or NULL.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards, Ed Hartnett
+ */
+static int
+write_darray_multi_io(file_desc_t *file, io_desc_t *iodesc, var_desc_t *vdesc0, int nvars,
+                      int fndims, const int *varids, const int *frame, void *fillvalue)
+{
+    iosystem_desc_t *ios = file->iosystem;
+    int ierr;
 
     /* Write the darray based on the iotype. */
     PLOG((2, "about to write darray for iotype = %d", file->iotype));
@@ -354,12 +434,8 @@ PIOc_write_darray_multi(int ncid, const int *varids, int ioid, int nvars,
     if (file->iotype != PIO_IOTYPE_PNETCDF)
     {
         /* Release resources. */
-        if (file->iobuf)
-        {
-            PLOG((3,"freeing variable buffer in pio_darray"));
-            free(file->iobuf);
-            file->iobuf = NULL;
-        }
+        PLOG((3,"freeing variable buffer in pio_darray"));
+        pio_free_iobuf(file);
     }
 
     /* The box rearranger will always have data (it could be fill
@@ -374,6 +450,8 @@ PIOc_write_darray_multi(int ncid, const int *varids, int ioid, int nvars,
      * those values later. */
     if (iodesc->rearranger == PIO_REARR_SUBSET && iodesc->needsfill)
     {
+        PIO_Offset fillbytes = 0;
+
         PLOG((2, "nvars = %d holegridsize = %ld iodesc->needsfill = %d\n", nvars,
               iodesc->holegridsize, iodesc->needsfill));
 
@@ -381,18 +459,24 @@ PIOc_write_darray_multi(int ncid, const int *varids, int ioid, int nvars,
 
         /* Get a buffer. */
         if (ios->io_rank == 0)
-            vdesc0->fillbuf = malloc(iodesc->maxholegridsize * iodesc->mpitype_size * nvars);
+            fillbytes = iodesc->maxholegridsize * iodesc->mpitype_size * nvars;
         else if (iodesc->holegridsize > 0)
-            vdesc0->fillbuf = malloc(iodesc->holegridsize * iodesc->mpitype_size * nvars);
+            fillbytes = iodesc->holegridsize * iodesc->mpitype_size * nvars;
+        if (fillbytes)
+        {
+            if (!(vdesc0->fillbuf = pio_iobuf_alloc(ios, fillbytes, &vdesc0->fillbuf_bytes)))
+                return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
+            pio_mem_add(ios, vdesc0->fillbuf_bytes);
+        }
 
         /* copying the fill value into the data buffer for the box
          * rearranger. This will be overwritten with data where
          * provided. */
         if(fillvalue)
             for (int nv = 0; nv < nvars; nv++)
-                for (int i = 0; i < iodesc->holegridsize; i++)
-                    memcpy(&((char *)vdesc0->fillbuf)[iodesc->mpitype_size * (i + nv * iodesc->holegridsize)],
-                           &((char *)fillvalue)[iodesc->mpitype_size * nv], iodesc->mpitype_size);
+                pio_fill_buffer((char *)vdesc0->fillbuf + (size_t)iodesc->mpitype_size * nv * iodesc->holegridsize,
+                                (char *)fillvalue + iodesc->mpitype_size * nv,
+                                iodesc->holegridsize, iodesc->mpitype_size);
 
         /* Write the darray based on the iotype. */
         switch (file->iotype)
@@ -413,20 +497,241 @@ PIOc_write_darray_multi(int ncid, const int *varids, int ioid, int nvars,
             return pio_err(ios, file, PIO_EBADIOTYPE, __FILE__, __LINE__);
         }
 
-        /* For PNETCDF fillbuf is freed in flush_output_buffer() */
-        if (file->iotype != PIO_IOTYPE_PNETCDF)
+        /* For PNETCDF fillbuf is freed in flush_output_buffer() */
+        if (file->iotype != PIO_IOTYPE_PNETCDF)
+        {
+            /* Free resources. */
+            pio_free_fillbuf(file, vdesc0);
+        }
+    }
+
+    return PIO_NOERR;
+}
+
+/**
+ * Write one or more arrays with the same IO decomposition to the
+ * file.
+ *
+ * This funciton is similar to PIOc_write_darray(), but allows the
+ * caller to use their own data buffering (instead of using the
+ * buffering implemented in PIOc_write_darray()).
+ *
+ * When the user calls PIOc_write_darray() one or more times, then
+ * PIO_write_darray_multi() will be called when the buffer is flushed.
+ *
+ * Internally, this function will:
+ * <ul>
+ * <li>Find info about file, decomposition, and variable.
+ * <li>Do a special flush for pnetcdf if needed.
+ * <li>Allocates a buffer big enough to hold all the data in the
+ * multi-buffer, for all tasks.
+ * <li>Calls rearrange_comp2io() to move data from compute to IO
+ * tasks.
+ * <li>For parallel iotypes (pnetcdf and netCDF-4 parallel) call
+ * pio_write_darray_multi_nc().
+ * <li>For serial iotypes (netcdf classic and netCDF-4 serial) call
+ * write_darray_multi_serial().
+ * <li>For subset rearranger, create holegrid to write missing
+ * data. Then call pio_write_darray_multi_nc() or
+ * write_darray_multi_serial() to write the holegrid.
+ * <li>Special buffer flush for pnetcdf.
+ * </ul>
+ *
+ * @param ncid identifies the netCDF file.
+ * @param varids an array of length nvars containing the variable ids to
+ * be written.
+ * @param ioid the I/O description ID as passed back by
+ * PIOc_InitDecomp().
+ * @param nvars the number of variables to be written with this
+ * call.
+ * @param arraylen the length of the array to be written. This is the
+ * length of the distrubited array. That is, the length of the portion
+ * of the data that is on the processor. The same arraylen is used for
+ * all variables in the call.
+ * @param array pointer to the data to be written. This is a pointer
+ * to an array of arrays with the distributed portion of the array
+ * that is on this processor. There are nvars arrays of data, and each
+ * array of data contains one record worth of data for that variable.
+ * @param frame an array of length nvars with the frame or record
+ * dimension for each of the nvars variables in IOBUF. NULL if this
+ * iodesc contains non-record vars.
+ * @param fillvalue pointer an array (of length nvars) of pointers to
+ * the fill value to be used for missing data.
+ * @param flushtodisk non-zero to cause buffers to be flushed to disk.
+ * @return 0 for success, error code otherwise.
+ * @ingroup PIO_write_darray_c
+ * @author Jim Edwards, Ed Hartnett
+ */
+int
+PIOc_write_darray_multi(int ncid, const int *varids, int ioid, int nvars,
+                        PIO_Offset arraylen, void *array, const int *frame,
+                        void **fillvalue, bool flushtodisk)
+{
+    iosystem_desc_t *ios;  /* Pointer to io system information. */
+    file_desc_t *file;     /* Pointer to file information. */
+    io_desc_t *iodesc;     /* Pointer to IO description information. */
+    var_desc_t *vdesc0;    /* First entry in array of var_desc structure for each var. */
+    int fndims, fndims2;            /* Number of dims in the var in the file. */
+    int mpierr = MPI_SUCCESS, mpierr2;  /* Return code from MPI function calls. */
+    int ierr;              /* Return code. */
+    void *tmparray;
+    bool sortcopy;         /* True if the data is sent from a sorted copy. */
+
+/* #ifdef USE_MPE */
+/*     pio_start_mpe_log(DARRAY_WRITE); */
+/* #endif /\* USE_MPE *\/ */
+
+    /* Get the file info. */
+    if ((ierr = pio_get_file(ncid, &file)))
+        return pio_err(NULL, NULL, PIO_EBADID, __FILE__, __LINE__);
+    ios = file->iosystem;
+
+    /* Check inputs. */
+    if (nvars <= 0 || !varids)
+        return pio_err(ios, file, PIO_EINVAL, __FILE__, __LINE__);
+
+    PLOG((1, "PIOc_write_darray_multi ncid = %d ioid = %d nvars = %d arraylen = %ld "
+          "flushtodisk = %d",
+          ncid, ioid, nvars, arraylen, flushtodisk));
+
+    /* Check that we can write to this file. */
+    if (!file->writable)
+        return pio_err(ios, file, PIO_EPERM, __FILE__, __LINE__);
+
+    /* Get iodesc. */
+    if (!(iodesc = pio_get_iodesc_from_id(ioid)))
+        return pio_err(ios, file, PIO_EBADID, __FILE__, __LINE__);
+    pioassert(iodesc->rearranger == PIO_REARR_BOX || iodesc->rearranger == PIO_REARR_SUBSET ||
+              iodesc->rearranger == PIO_REARR_HIER, "unknown rearranger", __FILE__, __LINE__);
+
+    pioassert(iodesc->readonly == 0,"Multiple sources in map for a single destination",__FILE__,__LINE__);
+
+
+    /* Check the types of all the vars. They must match the type of
+     * the decomposition. */
+    for (int v = 0; v < nvars; v++)
+    {
+        var_desc_t *vdesc;
+        if ((ierr = get_var_desc(varids[v], &file->varlist, &vdesc)))
+            return pio_err(ios, file, ierr, __FILE__, __LINE__);
+        /* if (vdesc->pio_type != iodesc->piotype)
+           return pio_err(ios, file, PIO_EINVAL, __FILE__, __LINE__);*/
+    }
+
+    /* Get a pointer to the variable info for the first variable. */
+    if ((ierr = get_var_desc(varids[0], &file->varlist, &vdesc0)))
+        return pio_err(ios, file, ierr, __FILE__, __LINE__);
+
+    /* Run these on all tasks if async is not in use, but only on
+     * non-IO tasks if async is in use. */
+    if ((!ios->async || !ios->ioproc) && (file->iotype != PIO_IOTYPE_GDAL))
+    {
+        /* Get the number of dims for this var. */
+        PLOG((3, "about to call PIOc_inq_varndims varids[0] = %d", varids[0]));
+        if ((ierr = PIOc_inq_varndims(file->pio_ncid, varids[0], &fndims)))
+            return check_netcdf(file, ierr, __FILE__, __LINE__);
+        PLOG((3, "called PIOc_inq_varndims varids[0] = %d fndims = %d", varids[0], fndims));
+        for (int v=1; v < nvars; v++){
+            if ((ierr = PIOc_inq_varndims(file->pio_ncid, varids[v], &fndims2)))
+                return check_netcdf(file, ierr, __FILE__, __LINE__);
+            if(fndims != fndims2)
+                return pio_err(ios, file, PIO_EVARDIMMISMATCH, __FILE__, __LINE__);
+        }
+
+    }
+
+    if ((!ios->async || !ios->ioproc) && (file->iotype == PIO_IOTYPE_GDAL))
+    {
+      // Do we even need to sort out fndims here? (MSL<<>>)
+      fndims = 1;
+    }
+
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
+    /* If async is in use, and this is not an IO task, bcast the
+     * parameters. */
+    if (ios->async)
+    {
+        if (!ios->ioproc)
         {
-            /* Free resources. */
-            if (vdesc0->fillbuf)
+            int msg = PIO_MSG_WRITEDARRAYMULTI;
+            char frame_present = frame ? true : false;         /* Is frame non-NULL? */
+            char fillvalue_present = fillvalue ? true : false; /* Is fillvalue non-NULL? */
+            int flushtodisk_int = flushtodisk; /* Need this to be int not boolean. */
+
+            pio_msgbuf mb; /* The packed parameters. */
+
+            /* Send the function parameters and associated informaiton
+             * to the msg handler, packed into one message. */
+            if (!(mpierr = pio_msgbuf_start(ios, &mb, msg)))
             {
-                free(vdesc0->fillbuf);
-                vdesc0->fillbuf = NULL;
+                pio_msgbuf_put(&mb, &ncid, sizeof(int));
+                pio_msgbuf_put(&mb, &nvars, sizeof(int));
+                pio_msgbuf_put(&mb, varids, nvars * sizeof(int));
+                pio_msgbuf_put(&mb, &ioid, sizeof(int));
+                pio_msgbuf_put(&mb, &arraylen, sizeof(PIO_Offset));
+                pio_msgbuf_put_bulk(&mb, array, arraylen * iodesc->piotype_size);
+                pio_msgbuf_put(&mb, &frame_present, 1);
+                if (frame_present)
+                    pio_msgbuf_put(&mb, frame, nvars * sizeof(int));
+                pio_msgbuf_put(&mb, &fillvalue_present, 1);
+                if (fillvalue_present)
+                    pio_msgbuf_put(&mb, fillvalue, nvars * iodesc->piotype_size);
+                pio_msgbuf_put(&mb, &flushtodisk_int, sizeof(int));
+                mpierr = pio_msgbuf_send(ios, &mb);
             }
+            PLOG((2, "PIOc_write_darray_multi file->pio_ncid = %d nvars = %d ioid = %d arraylen = %d "
+                  "frame_present = %d fillvalue_present = %d flushtodisk = %d", file->pio_ncid, nvars,
+                  ioid, arraylen, frame_present, fillvalue_present, flushtodisk));
         }
+
+        /* Handle MPI errors. */
+        if ((mpierr2 = MPI_Bcast(&mpierr, 1, MPI_INT, ios->comproot, ios->my_comm)))
+            return check_mpi(NULL, file, mpierr2, __FILE__, __LINE__);
+        if (mpierr)
+            return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+
+        /* Share results known only on computation tasks with IO tasks. */
+        if ((mpierr = MPI_Bcast(&fndims, 1, MPI_INT, ios->comproot, ios->my_comm)))
+            check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+        PLOG((3, "shared fndims = %d", fndims));
+    }
+
+    /* if the buffer is already in use in pnetcdf we need to flush first */
+    if (file->iotype == PIO_IOTYPE_PNETCDF && file->iobuf)
+        if ((ierr = flush_output_buffer(file, 1, 0)))
+            return pio_err(ios, file, ierr, __FILE__, __LINE__);
+
+    pioassert(!file->iobuf, "buffer overwrite",__FILE__, __LINE__);
+
+    /* Allocate the buffer for the data on the IO tasks. */
+    if ((ierr = alloc_darray_iobuf(file, iodesc, nvars, fillvalue, &file->iobuf,
+                                   &file->iobuf_bytes)))
+        return pio_err(ios, file, ierr, __FILE__, __LINE__);
+
+    if ((ierr = needs_sorted_copy(ios, iodesc, &sortcopy)))
+        return pio_err(ios, file, ierr, __FILE__, __LINE__);
+    if (sortcopy)
+    {
+        if (!(tmparray = pio_get_sortbuf(iodesc, (size_t)arraylen * nvars * iodesc->piotype_size)))
+            return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+        pio_sorted_copy(array, tmparray, iodesc, nvars, 0);
+    }
+    else
+    {
+        tmparray = array;
     }
 
-    if(iodesc->needssort && tmparray != NULL)
-        free(tmparray);
+    /* Move data from compute to IO tasks. */
+    if ((ierr = rearrange_comp2io(ios, iodesc, tmparray, file->iobuf, nvars)))
+        return pio_err(ios, file, ierr, __FILE__, __LINE__);
+
+    /* Write the data, and fill the holes of the subset rearranger. */
+    if ((ierr = write_darray_multi_io(file, iodesc, vdesc0, nvars, fndims, varids, frame,
+                                      fillvalue)))
+        return pio_err(ios, file, ierr, __FILE__, __LINE__);
 
     /* Flush data to disk for pnetcdf. */
     if (ios->ioproc && file->iotype == PIO_IOTYPE_PNETCDF)
@@ -661,11 +966,13 @@ PIOc_write_darray(int ncid, int varid, int ioid, PIO_Offset arraylen, void *arra
     void *bufptr;          /* A data buffer. */
     wmulti_buffer *wmb;    /* The write multi buffer for one or more vars. */
     int needsflush = 0;    /* True if we need to flush buffer. */
-    void *realloc_data = NULL;
+    size_t array_size;     /* Size in bytes of the data. */
+    size_t fill_size;      /* Size in bytes of the fill value, if needed. */
     int hashid;
     int mpierr = MPI_SUCCESS;  /* Return code from MPI functions. */
     int ierr = PIO_NOERR;      /* Return code. */
     size_t io_data_size;          /* potential size of data on io task */
+    PIO_Offset wmb_bytes;  /* Memory of the multi-buffer before it grows. */
 
     PLOG((1, "PIOc_write_darray ncid = %d varid = %d ioid = %d arraylen = %d",
           ncid, varid, ioid, arraylen));
@@ -727,130 +1034,552 @@ PIOc_write_darray(int ncid, int varid, int ioid, PIO_Offset arraylen, void *arra
     if (wmb)
         PLOG((3, "wmb->ioid = %d wmb->recordvar = %d", wmb->ioid, wmb->recordvar));
 
-    /* If we did not find an existing wmb entry, create a new wmb. */
-    if (!wmb)
+    /* If we did not find an existing wmb entry, create a new wmb. */
+    if (!wmb)
+    {
+        /* Allocate a buffer. Its data buffers are allocated as
+         * needed, below. */
+        if (!(wmb = calloc(1, sizeof(wmulti_buffer))))
+            return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
+
+        /* Set pointer to newly allocated buffer and initialize.*/
+        wmb->recordvar = vdesc->rec_var;
+        wmb->ioid = ioid;
+        wmb->arraylen = arraylen;
+        wmb->htid = hashid;
+        HASH_ADD_INT( file->buffer, htid, wmb );
+    }
+    PLOG((2, "wmb->num_arrays = %d arraylen = %d iodesc->mpitype_size = %d\n",
+          wmb->num_arrays, arraylen, iodesc->mpitype_size));
+
+    /* If a fill value is needed (we are using the subset rearranger
+     * and not using the netcdf fill mode), there must be room for it
+     * too. */
+    array_size = arraylen * iodesc->mpitype_size;
+    fill_size = iodesc->needsfill ? iodesc->mpitype_size : 0;
+
+    /* the limit of data_size < INT_MAX is due to a bug in ROMIO which limits
+       the size of contiguous data to INT_MAX, a fix has been proposed in
+       https://github.com/pmodels/mpich/pull/2888 */
+    io_data_size = (1 + wmb->num_arrays) * (size_t)iodesc->maxiobuflen * iodesc->mpitype_size;
+    if(io_data_size > INT_MAX)
+        needsflush = 2;
+
+    /* Flush when the buffer would go over the limit of this
+     * decomposition. compute_maxaggregate_bytes() gives maxbytes and
+     * maxiobuflen to all tasks of every rearranger, and all tasks have
+     * the same number of arrays in the buffer, so they all decide the
+     * same way without communicating. */
+    if (!needsflush && wmb->num_arrays > 0 &&
+        (PIO_Offset)(1 + wmb->num_arrays) * iodesc->mpitype_size > iodesc->maxbytes)
+        needsflush = 1;
+
+    if (ios->buffer_policy == PIO_BUFFER_POLICY_COLLECTIVE)
+    {
+        /* Make room for this array, and call flush if that fails on
+         * any task. The buffer is still valid for a flush. */
+        if (!needsflush)
+        {
+            wmb_bytes = pio_wmb_bytes(wmb);
+            if (pio_wmb_reserve(wmb, array_size, fill_size))
+                needsflush = 1;
+            pio_mem_add(ios, pio_wmb_bytes(wmb) - wmb_bytes);
+        }
+
+        /* Tell all tasks on the computation communicator whether we
+         * need to flush data. */
+        if ((mpierr = MPI_Allreduce(MPI_IN_PLACE, &needsflush, 1,  MPI_INT,  MPI_MAX,
+                                    ios->comp_comm)))
+            return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+    }
+    PLOG((2, "needsflush = %d", needsflush));
+
+    /* Flush data if needed. */
+    if (needsflush > 0)
+    {
+        /* If needsflush == 2 flush to disk otherwise just flush to io
+         * node. This will cause PIOc_write_darray_multi() to be
+         * called. */
+        if ((ierr = flush_buffer(ncid, wmb, needsflush == 2)))
+            return pio_err(ios, file, ierr, __FILE__, __LINE__);
+    }
+
+    /* Keep the buffer memory of the IO system in its budget. */
+    if (ios->mem_budget > 0)
+    {
+        PIO_Offset need = 0;
+
+        if ((1 + wmb->num_arrays) * array_size > wmb->data_capacity)
+            need += (1 + wmb->num_arrays) * array_size - wmb->data_capacity;
+        if ((1 + wmb->num_arrays) * fill_size > wmb->fill_capacity)
+            need += (1 + wmb->num_arrays) * fill_size - wmb->fill_capacity;
+        if ((ierr = mem_govern(ios, need)))
+            return pio_err(ios, file, ierr, __FILE__, __LINE__);
+    }
+
+    /* Make room for this array. */
+    wmb_bytes = pio_wmb_bytes(wmb);
+    ierr = pio_wmb_reserve(wmb, array_size, fill_size);
+    pio_mem_add(ios, pio_wmb_bytes(wmb) - wmb_bytes);
+    if (ierr)
+        return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
+    PLOG((2, "wmb->data_capacity = %ld bytes", wmb->data_capacity));
+
+    /* Remember when the multi-buffer got its first array. */
+    if (!wmb->num_arrays)
+        wmb->seq = ios->mem_seq++;
+
+    /* wmb->frame is the record number, we assume that the variables
+     * in the wmb list may not all have the same unlimited dimension
+     * value although they usually do. */
+    wmb->frame[wmb->num_arrays] = vdesc->record;
+    if (vdesc->record >= 0)
+        wmb->use_frame = 1;
+
+    /* If we need a fill value, remember it. If we are using the
+     * subset rearranger and not using the netcdf fill mode then we
+     * need to do an extra write to fill in the holes with the fill
+     * value. */
+    if (iodesc->needsfill)
+    {
+        memcpy((char *)wmb->fillvalue + fill_size * wmb->num_arrays, vdesc->fillvalue,
+               fill_size);
+        wmb->use_fill = 1;
+    }
+
+    /* Tell the buffer about the data it is getting. */
+    wmb->arraylen = arraylen;
+    wmb->vid[wmb->num_arrays] = varid;
+    PLOG((3, "wmb->num_arrays = %d wmb->vid[wmb->num_arrays] = %d", wmb->num_arrays,
+          wmb->vid[wmb->num_arrays]));
+
+    /* Copy the user-provided data to the buffer. */
+    bufptr = (void *)((char *)wmb->data + arraylen * iodesc->mpitype_size * wmb->num_arrays);
+    if (arraylen > 0)
+    {
+        PLOG((3, "copying %ld bytes of user data %d", arraylen * iodesc->mpitype_size, iodesc->mpitype_size));
+        memcpy(bufptr, array, arraylen * iodesc->mpitype_size);
+    }
+
+    wmb->num_arrays++;
+
+#ifdef USE_MPE
+    pio_stop_mpe_log(DARRAY_WRITE, __func__);
+#endif /* USE_MPE */
+
+    PLOG((2, "wmb->num_arrays = %d iodesc->maxbytes / iodesc->mpitype_size = %d "
+          "iodesc->ndof = %d iodesc->llen = %d", wmb->num_arrays,
+          iodesc->maxbytes / iodesc->mpitype_size, iodesc->ndof, iodesc->llen));
+
+    return PIO_NOERR;
+}
+
+/**
+ * Free a pending write and the buffers it holds. Outstanding MPI
+ * requests are waited for first, since they use the buffers.
+ *
+ * @param req pointer to the pio_write_req.
+ * @author Jim Edwards
+ */
+static void
+free_write_req(pio_write_req *req)
+{
+    pio_progress_release(req);
+    if (req->nreqs > 0)
+        MPI_Waitall(req->nreqs, req->reqs, MPI_STATUSES_IGNORE);
+    free(req->reqs);
+    free(req->sortbuf);
+    if (req->iobuf)
+    {
+        pio_mem_add(req->ios, -req->iobuf_bytes);
+        pio_iobuf_free(req->ios, req->iobuf, req->iobuf_bytes);
+    }
+    free(req);
+}
+
+/**
+ * Start writing a distributed array to a file, and return without
+ * waiting for the data to reach the IO tasks.
+ *
+ * Unlike PIOc_write_darray(), the data is not copied into the write
+ * cache. The exchange of the data between the computation and IO
+ * tasks is started with nonblocking MPI calls, and the data is sent
+ * from the array given by the caller. The array must not be changed
+ * or freed until PIOc_wait() or PIOc_waitall() has been called for
+ * the write. PIOc_wait() completes the exchange and writes the data
+ * to the file. The data moves while the caller computes if the
+ * progress thread is running (see PIOc_set_progress_thread()).
+ *
+ * This function and PIOc_wait() must be called by all computation
+ * tasks, and writes must be started and waited for in the same order
+ * on all tasks. The record written is the one set for the variable
+ * with PIOc_setframe() when the write is started. Writes which have
+ * not been waited for are completed by PIOc_sync() and
+ * PIOc_closefile(). The order in which data of PIOc_write_darray()
+ * and PIOc_iwrite_darray() for the same variable and record reaches
+ * the file is not defined.
+ *
+ * If the decomposition needs its data sorted, and the data can't be
+ * sent in the order of the original map, the data is copied once.
+ * When async is in use, the data must be sent to the IO tasks before
+ * this function returns, so the data is written at once, and the
+ * request returned is already complete.
+ *
+ * @param ncid identifies the netCDF file.
+ * @param varid the variable ID to be written.
+ * @param ioid the I/O description ID as passed back by
+ * PIOc_InitDecomp().
+ * @param arraylen the length of the array to be written. This is the
+ * length of the distrubited array. That is, the length of the portion
+ * of the data that is on the processor.
+ * @param array pointer to the data to be written.
+ * @param fillvalue pointer to the fill value to be used for missing
+ * data. Ignored if NULL. If provided, must be the correct fill value
+ * for the variable.
+ * @param reqp pointer that gets the PIO_Request of the write, to be
+ * passed to PIOc_wait().
+ * @returns 0 for success, error code otherwise.
+ * @ingroup PIO_write_darray_c
+ * @author Jim Edwards
+ */
+int
+PIOc_iwrite_darray(int ncid, int varid, int ioid, PIO_Offset arraylen, void *array,
+                   void *fillvalue, PIO_Request *reqp)
+{
+    iosystem_desc_t *ios;  /* Pointer to io system information. */
+    file_desc_t *file;     /* Info about file we are writing to. */
+    io_desc_t *iodesc;     /* The IO description. */
+    var_desc_t *vdesc;     /* Info about the var being written. */
+    pio_write_req *req;    /* The pending write. */
+    void *sbuf;            /* The data sent to the IO tasks. */
+    bool sortcopy;         /* True if the data is sent from a sorted copy. */
+    int ierr;              /* Return code. */
+
+    PLOG((1, "PIOc_iwrite_darray ncid = %d varid = %d ioid = %d arraylen = %d",
+          ncid, varid, ioid, arraylen));
+
+    /* Get the file info. */
+    if ((ierr = pio_get_file(ncid, &file)))
+        return pio_err(NULL, NULL, PIO_EBADID, __FILE__, __LINE__);
+    ios = file->iosystem;
+
+    if (!reqp)
+        return pio_err(ios, file, PIO_EINVAL, __FILE__, __LINE__);
+    *reqp = PIO_REQ_NULL;
+
+    /* Can we write to this file? */
+    if (!file->writable)
+        return pio_err(ios, file, PIO_EPERM, __FILE__, __LINE__);
+
+    /* Get decomposition information. */
+    if (!(iodesc = pio_get_iodesc_from_id(ioid)))
+        return pio_err(ios, file, PIO_EBADID, __FILE__, __LINE__);
+
+    pioassert(iodesc->readonly == 0,"Multiple sources in map for a single destination",__FILE__,__LINE__);
+
+    /* The array must hold the local part of the decomposition. */
+    if (arraylen < iodesc->ndof)
+        return pio_err(ios, file, PIO_EINVAL, __FILE__, __LINE__);
+
+    /* Get var description. */
+    if ((ierr = get_var_desc(varid, &file->varlist, &vdesc)))
+        return pio_err(ios, file, ierr, __FILE__, __LINE__);
+
+    /* If we don't know the fill value for this var, get it. */
+    if (!vdesc->fillvalue && file->iotype != PIO_IOTYPE_GDAL)
+        if ((ierr = find_var_fillvalue(file, varid, vdesc)))
+            return pio_err(ios, file, PIO_EBADID, __FILE__, __LINE__);
+
+    /* Check that if the user passed a fill value, it is correct. */
+    if (fillvalue && vdesc->use_fill)
+        if (memcmp(fillvalue, vdesc->fillvalue, vdesc->pio_type_size))
+            return pio_err(ios, file, PIO_EINVAL, __FILE__, __LINE__);
+
+    /* With async, write the data now. */
+    if (ios->async)
+    {
+        int frame = vdesc->record;
+
+        return PIOc_write_darray_multi(ncid, &varid, ioid, 1, arraylen, array,
+                                       frame >= 0 ? &frame : NULL,
+                                       iodesc->needsfill ? vdesc->fillvalue : NULL, false);
+    }
+
+    if (!(req = calloc(1, sizeof(pio_write_req))))
+        return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
+    req->ios = ios;
+    req->ncid = ncid;
+    req->varid = varid;
+    req->ioid = ioid;
+    req->frame = vdesc->record;
+    req->fillvalue = iodesc->needsfill ? vdesc->fillvalue : NULL;
+
+    /* Get the number of dims for this var. */
+    if ((ierr = PIOc_inq_varndims(ncid, varid, &req->fndims)))
+    {
+        free_write_req(req);
+        return check_netcdf(file, ierr, __FILE__, __LINE__);
+    }
+
+    /* Allocate the buffer for the data on the IO tasks. */
+    if ((ierr = alloc_darray_iobuf(file, iodesc, 1, req->fillvalue, &req->iobuf,
+                                   &req->iobuf_bytes)))
+    {
+        free_write_req(req);
+        return pio_err(ios, file, ierr, __FILE__, __LINE__);
+    }
+
+    /* Send the user's data, or a sorted copy of it. */
+    sbuf = array;
+    if ((ierr = needs_sorted_copy(ios, iodesc, &sortcopy)))
+    {
+        free_write_req(req);
+        return pio_err(ios, file, ierr, __FILE__, __LINE__);
+    }
+    if (sortcopy)
+    {
+        if (!(req->sortbuf = calloc(arraylen, iodesc->piotype_size)))
+        {
+            free_write_req(req);
+            return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
+        }
+        pio_sorted_copy(array, req->sortbuf, iodesc, 1, 0);
+        sbuf = req->sortbuf;
+    }
+
+    /* Start moving the data from compute to IO tasks. */
+    if ((ierr = rearrange_comp2io_start(ios, iodesc, sbuf, req->iobuf, 1, &req->nreqs,
+                                        &req->reqs)))
+    {
+        free_write_req(req);
+        return pio_err(ios, file, ierr, __FILE__, __LINE__);
+    }
+
+    pio_add_to_request_list(req);
+    *reqp = req->id;
+
+    /* Let the progress thread, if running, move the data. */
+    pio_progress_submit(req);
+    PLOG((2, "PIOc_iwrite_darray started request %d nreqs = %d", req->id, req->nreqs));
+
+    return PIO_NOERR;
+}
+
+/**
+ * Complete a pending write, and free it. The write must already be
+ * removed from the list of pending writes.
+ *
+ * @param req pointer to the pio_write_req.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+complete_write_req(pio_write_req *req)
+{
+    iosystem_desc_t *ios;  /* Pointer to io system information. */
+    file_desc_t *file;     /* Info about file we are writing to. */
+    io_desc_t *iodesc;     /* The IO description. */
+    var_desc_t *vdesc;     /* Info about the var being written. */
+    int varid = req->varid;
+    int frame = req->frame;
+    int fndims = req->fndims;
+    void *fillvalue = req->fillvalue;
+    int mpierr;
+    int ierr;
+
+    PLOG((2, "complete_write_req id = %d ncid = %d varid = %d", req->id, req->ncid,
+          req->varid));
+
+    /* The file, decomposition and var must still exist. */
+    if ((ierr = pio_get_file(req->ncid, &file)))
     {
-        /* Allocate a buffer. */
-        if (!(wmb = malloc(sizeof(wmulti_buffer))))
-            return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
+        free_write_req(req);
+        return pio_err(NULL, NULL, PIO_EBADID, __FILE__, __LINE__);
+    }
+    ios = file->iosystem;
+    if (!(iodesc = pio_get_iodesc_from_id(req->ioid)))
+    {
+        free_write_req(req);
+        return pio_err(ios, file, PIO_EBADID, __FILE__, __LINE__);
+    }
+    if ((ierr = get_var_desc(req->varid, &file->varlist, &vdesc)))
+    {
+        free_write_req(req);
+        return pio_err(ios, file, ierr, __FILE__, __LINE__);
+    }
 
-        /* Set pointer to newly allocated buffer and initialize.*/
-        wmb->recordvar = vdesc->rec_var;
-        wmb->ioid = ioid;
-        wmb->num_arrays = 0;
-        wmb->arraylen = arraylen;
-        wmb->vid = NULL;
-        wmb->data = NULL;
-        wmb->frame = NULL;
-        wmb->fillvalue = NULL;
-        wmb->htid = hashid;
-        HASH_ADD_INT( file->buffer, htid, wmb );
+    /* Take the requests back from the progress thread. */
+    if ((mpierr = pio_progress_release(req)))
+    {
+        free_write_req(req);
+        return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
     }
-    PLOG((2, "wmb->num_arrays = %d arraylen = %d iodesc->mpitype_size = %d\n",
-          wmb->num_arrays, arraylen, iodesc->mpitype_size));
 
-    /* Try realloc first and call flush if realloc fails. */
-    if (arraylen > 0)
+    /* Wait for the data to reach the IO tasks. */
+    ierr = rearrange_comp2io_finish(ios, req->nreqs, req->reqs);
+    req->nreqs = 0;
+    req->reqs = NULL;
+    if (ierr)
     {
-        size_t data_size = (1 + wmb->num_arrays) * arraylen * iodesc->mpitype_size;
+        free_write_req(req);
+        return pio_err(ios, file, ierr, __FILE__, __LINE__);
+    }
 
-        if ((realloc_data = realloc(wmb->data, data_size)))
-        {
-            needsflush = 0;
-            wmb->data = realloc_data;
-        }
-        else /* Failed to realloc, but wmb->data is still valid for a flush. */
+    /* if the buffer is already in use in pnetcdf we need to flush first */
+    if (file->iotype == PIO_IOTYPE_PNETCDF && file->iobuf)
+        if ((ierr = flush_output_buffer(file, 1, 0)))
         {
-            needsflush = 1;
+            free_write_req(req);
+            return pio_err(ios, file, ierr, __FILE__, __LINE__);
         }
-        PLOG((2, "realloc attempted to get %ld bytes for data, needsflush %d", data_size,
-              needsflush));
-    }
 
-    /* the limit of data_size < INT_MAX is due to a bug in ROMIO which limits
-       the size of contiguous data to INT_MAX, a fix has been proposed in
-       https://github.com/pmodels/mpich/pull/2888 */
-    io_data_size = (1 + wmb->num_arrays) * iodesc->maxiobuflen * iodesc->mpitype_size;
-    if(io_data_size > INT_MAX)
-        needsflush = 2;
+    pioassert(!file->iobuf, "buffer overwrite",__FILE__, __LINE__);
 
-    /* Tell all tasks on the computation communicator whether we need
-     * to flush data. */
-    if ((mpierr = MPI_Allreduce(MPI_IN_PLACE, &needsflush, 1,  MPI_INT,  MPI_MAX,
-                                ios->comp_comm)))
-        return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
-    PLOG((2, "needsflush = %d", needsflush));
+    /* The file now owns the data buffer. */
+    file->iobuf = req->iobuf;
+    file->iobuf_bytes = req->iobuf_bytes;
+    req->iobuf = NULL;
+    free_write_req(req);
 
-    /* Flush data if needed. */
-    if (needsflush > 0)
-    {
-        /* If needsflush == 2 flush to disk otherwise just flush to io
-         * node. This will cause PIOc_write_darray_multi() to be
-         * called. */
-        if ((ierr = flush_buffer(ncid, wmb, needsflush == 2)))
+    /* Write the data, and fill the holes of the subset rearranger. */
+    if ((ierr = write_darray_multi_io(file, iodesc, vdesc, 1, fndims, &varid,
+                                      frame >= 0 ? &frame : NULL, fillvalue)))
+        return pio_err(ios, file, ierr, __FILE__, __LINE__);
+
+    /* Start the pnetcdf write. */
+    if (ios->ioproc && file->iotype == PIO_IOTYPE_PNETCDF)
+        if ((ierr = flush_output_buffer(file, false, 0)))
             return pio_err(ios, file, ierr, __FILE__, __LINE__);
-    }
 
-    /* Try realloc again if there is a flush. */
-    if (arraylen > 0 && needsflush > 0)
-    {
-        if (!(wmb->data = realloc(wmb->data, (1 + wmb->num_arrays) * arraylen * iodesc->mpitype_size)))
-            return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
-        PLOG((2, "after a flush, realloc got %ld bytes for data", (1 + wmb->num_arrays) * arraylen * iodesc->mpitype_size));
-    }
+    return PIO_NOERR;
+}
 
-    /* vid is an array of variable ids in the wmb list, grow the list
-     * and add the new entry. */
-    if (!(wmb->vid = realloc(wmb->vid, sizeof(int) * (1 + wmb->num_arrays))))
-        return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
+/**
+ * Complete a write started with PIOc_iwrite_darray(). The exchange of
+ * the data with the IO tasks is completed, and the data is written
+ * to the file. After this the array passed to PIOc_iwrite_darray()
+ * may be reused.
+ *
+ * This must be called by all computation tasks, for the writes in
+ * the order in which they were started.
+ *
+ * @param reqp pointer to the PIO_Request returned by
+ * PIOc_iwrite_darray(). It is set to PIO_REQ_NULL. If it is
+ * PIO_REQ_NULL already, this function does nothing.
+ * @returns 0 for success, error code otherwise.
+ * @ingroup PIO_write_darray_c
+ * @author Jim Edwards
+ */
+int
+PIOc_wait(PIO_Request *reqp)
+{
+    pio_write_req *req;
 
-    /* wmb->frame is the record number, we assume that the variables
-     * in the wmb list may not all have the same unlimited dimension
-     * value although they usually do. */
-    if (vdesc->record >= 0)
-        if (!(wmb->frame = realloc(wmb->frame, sizeof(int) * (1 + wmb->num_arrays))))
-            return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
+    if (!reqp)
+        return pio_err(NULL, NULL, PIO_EINVAL, __FILE__, __LINE__);
 
-    /* If we need a fill value, get it. If we are using the subset
-     * rearranger and not using the netcdf fill mode then we need to
-     * do an extra write to fill in the holes with the fill value. */
-    if (iodesc->needsfill)
-    {
-        /* Get memory to hold fill value. */
-        if (!(wmb->fillvalue = realloc(wmb->fillvalue, iodesc->mpitype_size * (1 + wmb->num_arrays))))
-            return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
+    PLOG((1, "PIOc_wait req = %d", *reqp));
 
-        memcpy((char *)wmb->fillvalue + iodesc->mpitype_size * wmb->num_arrays,
-               vdesc->fillvalue, iodesc->mpitype_size);
-    }
+    if (*reqp == PIO_REQ_NULL)
+        return PIO_NOERR;
 
-    /* Tell the buffer about the data it is getting. */
-    wmb->arraylen = arraylen;
-    wmb->vid[wmb->num_arrays] = varid;
-    PLOG((3, "wmb->num_arrays = %d wmb->vid[wmb->num_arrays] = %d", wmb->num_arrays,
-          wmb->vid[wmb->num_arrays]));
+    if (!(req = pio_get_request_from_id(*reqp)))
+        return pio_err(NULL, NULL, PIO_EBADID, __FILE__, __LINE__);
 
-    /* Copy the user-provided data to the buffer. */
-    bufptr = (void *)((char *)wmb->data + arraylen * iodesc->mpitype_size * wmb->num_arrays);
-    if (arraylen > 0)
-    {
-        PLOG((3, "copying %ld bytes of user data %d", arraylen * iodesc->mpitype_size, iodesc->mpitype_size));
-        memcpy(bufptr, array, arraylen * iodesc->mpitype_size);
-    }
+    pio_delete_request_from_list(req);
+    *reqp = PIO_REQ_NULL;
 
-    /* Add the unlimited dimension value of this variable to the frame
-     * array in wmb. */
-    if (wmb->frame)
-        wmb->frame[wmb->num_arrays] = vdesc->record;
-    wmb->num_arrays++;
+    return complete_write_req(req);
+}
 
-#ifdef USE_MPE
-    pio_stop_mpe_log(DARRAY_WRITE, __func__);
-#endif /* USE_MPE */
+/**
+ * Complete several writes started with PIOc_iwrite_darray(), in the
+ * order in which they appear in the array. See PIOc_wait().
+ *
+ * @param nreqs the number of requests.
+ * @param reqs array of nreqs PIO_Request, which are all set to
+ * PIO_REQ_NULL.
+ * @returns 0 for success, error code otherwise.
+ * @ingroup PIO_write_darray_c
+ * @author Jim Edwards
+ */
+int
+PIOc_waitall(int nreqs, PIO_Request *reqs)
+{
+    int ierr;
 
-    PLOG((2, "wmb->num_arrays = %d iodesc->maxbytes / iodesc->mpitype_size = %d "
-          "iodesc->ndof = %d iodesc->llen = %d", wmb->num_arrays,
-          iodesc->maxbytes / iodesc->mpitype_size, iodesc->ndof, iodesc->llen));
+    if (nreqs < 0 || (nreqs && !reqs))
+        return pio_err(NULL, NULL, PIO_EINVAL, __FILE__, __LINE__);
+
+    for (int r = 0; r < nreqs; r++)
+        if ((ierr = PIOc_wait(&reqs[r])))
+            return ierr;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Check, without waiting, whether the data of a write started with
+ * PIOc_iwrite_darray() has been exchanged with the IO tasks. This
+ * only checks the tasks that call it, and is not collective. The
+ * write is not complete, and the data is not in the file, until
+ * PIOc_wait() has been called.
+ *
+ * @param req the PIO_Request returned by PIOc_iwrite_darray().
+ * @param flagp pointer that gets 1 if the exchange is complete on
+ * this task, 0 otherwise. Always 1 for PIO_REQ_NULL.
+ * @returns 0 for success, error code otherwise.
+ * @ingroup PIO_write_darray_c
+ * @author Jim Edwards
+ */
+int
+PIOc_test(PIO_Request req, int *flagp)
+{
+    pio_write_req *wreq;
+    int mpierr;
+
+    if (!flagp)
+        return pio_err(NULL, NULL, PIO_EINVAL, __FILE__, __LINE__);
+
+    *flagp = 1;
+    if (req == PIO_REQ_NULL)
+        return PIO_NOERR;
+
+    if (!(wreq = pio_get_request_from_id(req)))
+        return pio_err(NULL, NULL, PIO_EBADID, __FILE__, __LINE__);
+
+    /* The progress thread tests the requests it owns. */
+    if (pio_progress_test(wreq, flagp))
+        return PIO_NOERR;
+
+    if (wreq->nreqs > 0)
+        if ((mpierr = MPI_Testall(wreq->nreqs, wreq->reqs, flagp, MPI_STATUSES_IGNORE)))
+            return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Complete all the writes to a file started with PIOc_iwrite_darray()
+ * which have not been waited for, oldest first. This is called by
+ * PIOc_sync().
+ *
+ * @param ncid the ncid of the file.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+pio_wait_file_requests(int ncid)
+{
+    pio_write_req *req;
+    int ierr;
+
+    while ((req = pio_get_file_request(ncid)))
+    {
+        pio_delete_request_from_list(req);
+        if ((ierr = complete_write_req(req)))
+            return ierr;
+    }
 
     return PIO_NOERR;
 }
@@ -884,7 +1613,9 @@ PIOc_read_darray(int ncid, int varid, int ioid, PIO_Offset arraylen,
     io_desc_t *iodesc;     /* Pointer to IO description information. */
     void *iobuf = NULL;    /* holds the data as read on the io node. */
     size_t rlen = 0;       /* the length of data in iobuf. */
+    PIO_Offset iobuf_bytes = 0; /* the size of iobuf in bytes. */
     void *tmparray;        /* unsorted copy of array buf if required */
+    bool sortcopy;         /* True if the data is received into a sorted copy. */
     int mpierr = MPI_SUCCESS, mpierr2;  /* Return code from MPI function calls. */
     int ierr;              /* Return code. */
 
@@ -900,6 +1631,10 @@ PIOc_read_darray(int ncid, int varid, int ioid, PIO_Offset arraylen,
         return pio_err(NULL, NULL, PIO_EBADID, __FILE__, __LINE__);
     ios = file->iosystem;
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the
      * parameters. */
     if (ios->async)
@@ -935,8 +1670,8 @@ PIOc_read_darray(int ncid, int varid, int ioid, PIO_Offset arraylen,
     /* Get the iodesc. */
     if (!(iodesc = pio_get_iodesc_from_id(ioid)))
         return pio_err(ios, file, PIO_EBADID, __FILE__, __LINE__);
-    pioassert(iodesc->rearranger == PIO_REARR_BOX || iodesc->rearranger == PIO_REARR_SUBSET,
-              "unknown rearranger", __FILE__, __LINE__);
+    pioassert(iodesc->rearranger == PIO_REARR_BOX || iodesc->rearranger == PIO_REARR_SUBSET ||
+              iodesc->rearranger == PIO_REARR_HIER, "unknown rearranger", __FILE__, __LINE__);
 
     /* iomain needs max of buflen, others need local len */
     if (ios->iomain == MPI_ROOT)
@@ -946,7 +1681,7 @@ PIOc_read_darray(int ncid, int varid, int ioid, PIO_Offset arraylen,
 
     /* Allocate a buffer for one record. */
     if (ios->ioproc && rlen > 0)
-        if (!(iobuf = malloc(iodesc->mpitype_size * rlen)))
+        if (!(iobuf = pio_iobuf_alloc(ios, (PIO_Offset)iodesc->mpitype_size * rlen, &iobuf_bytes)))
             return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
 
     /* Call the correct darray read function based on iotype. */
@@ -978,13 +1713,21 @@ PIOc_read_darray(int ncid, int varid, int ioid, PIO_Offset arraylen,
      * it. */
     PLOG((2, "iodesc->needssort %d", iodesc->needssort));
 
-    if (iodesc->needssort)
+    /* Elements of the map which get no data are read as 0. */
+    if ((ierr = needs_sorted_copy(ios, iodesc, &sortcopy)))
+        return pio_err(ios, file, ierr, __FILE__, __LINE__);
+    if (sortcopy)
     {
-        if (!(tmparray = calloc(iodesc->maplen, iodesc->piotype_size)))
+        if (!(tmparray = pio_get_sortbuf(iodesc, (size_t)iodesc->maplen * iodesc->piotype_size)))
             return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+        memset(tmparray, 0, (size_t)iodesc->maplen * iodesc->piotype_size);
     }
     else
+    {
         tmparray = array;
+        if (iodesc->needssort)
+            memset(array, 0, (size_t)iodesc->maplen * iodesc->piotype_size);
+    }
 
     /* prefill the output array with 0 then overwrite from iobuf */
     /*    switch(iodesc->piotype)
@@ -1011,19 +1754,16 @@ PIOc_read_darray(int ncid, int varid, int ioid, PIO_Offset arraylen,
     */
 
     /* Rearrange the data. */
-    if ((ierr = rearrange_io2comp(ios, iodesc, iobuf, tmparray)))
+    if ((ierr = rearrange_io2comp(ios, iodesc, iobuf, tmparray, 1)))
         return pio_err(ios, file, ierr, __FILE__, __LINE__);
 
     /* Free the buffer. */
     if (ios->ioproc && rlen > 0)
-        free(iobuf);
+        pio_iobuf_free(ios, iobuf, iobuf_bytes);
 
     /* If we need to sort the map, do it. */
-    if (iodesc->needssort && ios->compproc)
-    {
+    if (sortcopy && ios->compproc)
         pio_sorted_copy(tmparray, array, iodesc, 1, 1);
-        free(tmparray);
-    }
 
 #ifdef USE_MPE
     pio_stop_mpe_log(DARRAY_READ, __func__);
@@ -1033,3 +1773,203 @@ PIOc_read_darray(int ncid, int varid, int ioid, PIO_Offset arraylen,
 
     return PIO_NOERR;
 }
+
+/**
+ * Read several variables with the same decomposition from a file
+ * using distributed arrays.
+ *
+ * This does the work of calling PIOc_read_darray() for each
+ * variable, but all variables are read from the file in one pass
+ * (with pnetcdf, one collective completion for all of them), and
+ * moved from the IO tasks to the compute tasks in a single
+ * rearrangement. This is much faster for reading many variables,
+ * as is done for a restart.
+ *
+ * @param ncid identifies the netCDF file.
+ * @param nvars the number of variables to be read.
+ * @param varids an array of length nvars containing the variable
+ * ids to be read.
+ * @param ioid the I/O description ID as passed back by
+ * PIOc_InitDecomp().
+ * @param frames an array of length nvars with the frame (record
+ * number) to read for each variable, or NULL to use the frames set
+ * with PIOc_setframe(). Ignored for variables without a record
+ * dimension.
+ * @param arrays pointer to the data to be read. This holds nvars
+ * arrays, one after another, each the size of the portion of the
+ * distributed array that is on this processor.
+ * @return 0 for success, error code otherwise.
+ * @ingroup PIO_read_darray_c
+ * @author Jim Edwards
+ */
+int
+PIOc_read_darray_multi(int ncid, int nvars, const int *varids, int ioid,
+                       const int *frames, void *arrays)
+{
+    iosystem_desc_t *ios;  /* Pointer to io system information. */
+    file_desc_t *file;     /* Pointer to file information. */
+    io_desc_t *iodesc;     /* Pointer to IO description information. */
+    var_desc_t *vdesc;     /* Pointer to var info struct. */
+    void *iobuf = NULL;    /* holds the data as read on the io node. */
+    size_t rlen = 0;       /* the length of data in iobuf. */
+    PIO_Offset iobuf_bytes = 0; /* the size of iobuf in bytes. */
+    size_t arraybytes;     /* size of the data of one var on this task. */
+    void *tmparray;        /* unsorted copy of arrays if required */
+    bool sortcopy;         /* True if the data is received into a sorted copy. */
+    int mpierr = MPI_SUCCESS, mpierr2;  /* Return code from MPI function calls. */
+    int ierr;              /* Return code. */
+
+    PLOG((1, "PIOc_read_darray_multi ncid %d nvars %d ioid %d", ncid, nvars, ioid));
+
+    /* Get the file info. */
+    if ((ierr = pio_get_file(ncid, &file)))
+        return pio_err(NULL, NULL, PIO_EBADID, __FILE__, __LINE__);
+    ios = file->iosystem;
+
+    /* Check inputs. */
+    if (nvars <= 0 || !varids)
+        return pio_err(ios, file, PIO_EINVAL, __FILE__, __LINE__);
+    for (int v = 0; v < nvars; v++)
+        if (varids[v] < 0 || varids[v] > PIO_MAX_VARS)
+            return pio_err(ios, file, PIO_EINVAL, __FILE__, __LINE__);
+
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
+    /* If async is in use, and this is not an IO task, bcast the
+     * parameters. */
+    if (ios->async)
+    {
+        if (!ios->ioproc)
+        {
+            int msg = PIO_MSG_READDARRAYMULTI;
+            char frame_present = frames ? true : false;
+
+            if (ios->compmain == MPI_ROOT)
+                mpierr = MPI_Send(&msg, 1, MPI_INT, ios->ioroot, 1, ios->union_comm);
+
+            /* Send the function parameters and associated informaiton
+             * to the msg handler. */
+            if (!mpierr)
+                mpierr = MPI_Bcast(&ncid, 1, MPI_INT, ios->compmain, ios->intercomm);
+            if (!mpierr)
+                mpierr = MPI_Bcast(&nvars, 1, MPI_INT, ios->compmain, ios->intercomm);
+            if (!mpierr)
+                mpierr = MPI_Bcast((void *)varids, nvars, MPI_INT, ios->compmain, ios->intercomm);
+            if (!mpierr)
+                mpierr = MPI_Bcast(&ioid, 1, MPI_INT, ios->compmain, ios->intercomm);
+            if (!mpierr)
+                mpierr = MPI_Bcast(&frame_present, 1, MPI_CHAR, ios->compmain, ios->intercomm);
+            if (!mpierr && frame_present)
+                mpierr = MPI_Bcast((void *)frames, nvars, MPI_INT, ios->compmain, ios->intercomm);
+            PLOG((2, "PIOc_read_darray_multi ncid %d nvars %d ioid %d frame_present %d",
+                  ncid, nvars, ioid, frame_present));
+        }
+
+        /* Handle MPI errors. */
+        if ((mpierr2 = MPI_Bcast(&mpierr, 1, MPI_INT, ios->comproot, ios->my_comm)))
+            return check_mpi(NULL, file, mpierr2, __FILE__, __LINE__);
+        if (mpierr)
+            return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+    }
+
+    /* Get the iodesc. */
+    if (!(iodesc = pio_get_iodesc_from_id(ioid)))
+        return pio_err(ios, file, PIO_EBADID, __FILE__, __LINE__);
+    pioassert(iodesc->rearranger == PIO_REARR_BOX || iodesc->rearranger == PIO_REARR_SUBSET ||
+              iodesc->rearranger == PIO_REARR_HIER, "unknown rearranger", __FILE__, __LINE__);
+
+    /* Set the frame of each variable. */
+    if (frames)
+        for (int v = 0; v < nvars; v++)
+        {
+            if ((ierr = get_var_desc(varids[v], &file->varlist, &vdesc)))
+                return pio_err(ios, file, ierr, __FILE__, __LINE__);
+            if (vdesc->rec_var)
+                vdesc->record = frames[v];
+        }
+
+    /* Each var gets llen elements of the buffer. For the serial
+     * iotypes, the last var also needs room for the data of the
+     * other IO tasks on iomain. */
+    rlen = (size_t)iodesc->llen * nvars;
+    if (ios->iomain == MPI_ROOT)
+        rlen += iodesc->maxiobuflen - iodesc->llen;
+
+    /* Allocate a buffer for all the vars. */
+    if (ios->ioproc && rlen > 0)
+        if (!(iobuf = pio_iobuf_alloc(ios, (PIO_Offset)iodesc->mpitype_size * rlen, &iobuf_bytes)))
+            return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
+
+    /* Call the correct darray read function based on iotype. From
+     * here on errors free the buffer. */
+    switch (file->iotype)
+    {
+    case PIO_IOTYPE_NETCDF:
+    case PIO_IOTYPE_NETCDF4C:
+        for (int v = 0; v < nvars; v++)
+            if ((ierr = pio_read_darray_nc_serial(file, iodesc, varids[v], iobuf ?
+                                                  (char *)iobuf + (size_t)v * iodesc->llen *
+                                                  iodesc->mpitype_size : NULL)))
+            {
+                ierr = pio_err(ios, file, ierr, __FILE__, __LINE__);
+                goto exit;
+            }
+        break;
+    case PIO_IOTYPE_PNETCDF:
+    case PIO_IOTYPE_NETCDF4P:
+        if ((ierr = pio_read_darray_multi_nc(file, iodesc, nvars, varids, iobuf)))
+        {
+            ierr = pio_err(ios, file, ierr, __FILE__, __LINE__);
+            goto exit;
+        }
+        break;
+    default:
+        ierr = pio_err(NULL, NULL, PIO_EBADIOTYPE, __FILE__, __LINE__);
+        goto exit;
+    }
+
+    /* Elements of the map which get no data are read as 0. */
+    arraybytes = (size_t)iodesc->maplen * iodesc->piotype_size;
+    if ((ierr = needs_sorted_copy(ios, iodesc, &sortcopy)))
+    {
+        ierr = pio_err(ios, file, ierr, __FILE__, __LINE__);
+        goto exit;
+    }
+    if (sortcopy)
+    {
+        if (!(tmparray = pio_get_sortbuf(iodesc, arraybytes * nvars)))
+        {
+            ierr = pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+            goto exit;
+        }
+        memset(tmparray, 0, arraybytes * nvars);
+    }
+    else
+    {
+        tmparray = arrays;
+        if (iodesc->needssort && ios->compproc)
+            memset(arrays, 0, arraybytes * nvars);
+    }
+
+    /* Rearrange the data of all vars at once. */
+    if ((ierr = rearrange_io2comp(ios, iodesc, iobuf, tmparray, nvars)))
+    {
+        ierr = pio_err(ios, file, ierr, __FILE__, __LINE__);
+        goto exit;
+    }
+
+    /* If we need to sort the map, do it. */
+    if (sortcopy && ios->compproc)
+        pio_sorted_copy(tmparray, arrays, iodesc, nvars, 1);
+
+    PLOG((2, "done with PIOc_read_darray_multi()"));
+
+exit:
+    /* Free the buffer. */
+    if (iobuf)
+        pio_iobuf_free(ios, iobuf, iobuf_bytes);
+
+    return ierr;
+}
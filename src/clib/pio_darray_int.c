@@ -13,6 +13,9 @@
 #include <config.h>
 #include <pio.h>
 #include <pio_internal.h>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 
 #if USE_VARD
 #define USE_VARD_READ 1
@@ -423,6 +426,11 @@ write_darray_multi_par(file_desc_t *file, int nvars, int fndims, const int *vari
         size_t start[fndims];
         size_t count[fndims];
         int ndims = iodesc->ndims;
+#ifdef _NETCDF4
+        PIO_Offset nc4start[num_regions * fndims]; /* Start of each region (netCDF-4 only). */
+        PIO_Offset nc4count[num_regions * fndims]; /* Count of each region (netCDF-4 only). */
+        PIO_Offset nc4loffset[num_regions];    /* Data offset of each region (netCDF-4 only). */
+#endif /* _NETCDF4 */
 #ifdef _PNETCDF
         int rrcnt = 0; /* Number of subarray requests (pnetcdf only). */
         PIO_Offset *startlist[num_regions]; /* Array of start arrays for ncmpi_iput_varn(). */
@@ -449,25 +457,71 @@ write_darray_multi_par(file_desc_t *file, int nvars, int fndims, const int *vari
             {
 #ifdef _NETCDF4
             case PIO_IOTYPE_NETCDF4P:
-                /* For each variable to be written. */
-                for (int nv = 0; nv < nvars; nv++)
+                /* Save the start/count of this region. */
+                for (int i = 0; i < fndims; i++)
+                {
+                    nc4start[regioncnt * fndims + i] = start[i];
+                    nc4count[regioncnt * fndims + i] = count[i];
+                }
+                nc4loffset[regioncnt] = region ? region->loffset : 0;
+
+                /* Do this when we reach the last region. Each write
+                 * is a collective HDF5 call, so merge the regions
+                 * first, and make all IO tasks do the number of
+                 * writes needed by the task with the most merged
+                 * regions. */
+                if (regioncnt == num_regions - 1)
                 {
-                    /* Set the start of the record dimension. (Hasn't
-                     * this already been set above ???) */
-                    if (vdesc->record >= 0 && ndims < fndims)
-                        start[0] = frame[nv];
-
-                    /* If there is data for this region, get a pointer to it. */
-                    if (region)
-                        bufptr = (void *)((char *)iobuf + iodesc->mpitype_size * (nv * llen + region->loffset));
-
-                    /* Ensure collective access. */
-                    if((ierr = nc_var_par_access(file->fh, varids[nv], NC_COLLECTIVE)))
-                        return pio_err(ios, file, ierr, __FILE__, __LINE__);
-
-                    /* Write the data for this variable. */
-                    if((ierr = nc_put_vara(file->fh, varids[nv], (size_t *)start, (size_t *)count, bufptr)))
-                        return pio_err(ios, file, ierr, __FILE__, __LINE__);
+                    int nmerged;  /* Number of merged regions on this task. */
+                    int ncalls;   /* Number of collective writes per variable. */
+                    int mpierr;
+
+                    nmerged = coalesce_regions(fndims, num_regions, nc4start, nc4count,
+                                               nc4loffset);
+                    if ((mpierr = MPI_Allreduce(&nmerged, &ncalls, 1, MPI_INT, MPI_MAX,
+                                                ios->io_comm)))
+                        return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+                    PLOG((2, "write_darray_multi_par num_regions = %d nmerged = %d ncalls = %d",
+                          num_regions, nmerged, ncalls));
+
+                    /* For each variable to be written. */
+                    for (int nv = 0; nv < nvars; nv++)
+                    {
+                        /* Ensure collective access. */
+                        if((ierr = nc_var_par_access(file->fh, varids[nv], NC_COLLECTIVE)))
+                            return pio_err(ios, file, ierr, __FILE__, __LINE__);
+
+                        for (int c = 0; c < ncalls; c++)
+                        {
+                            /* Tasks with fewer regions write nothing. */
+                            for (int i = 0; i < fndims; i++)
+                            {
+                                start[i] = c < nmerged ? nc4start[c * fndims + i] : 0;
+                                count[i] = c < nmerged ? nc4count[c * fndims + i] : 0;
+                            }
+                            bufptr = iobuf;
+                            if (c < nmerged)
+                                bufptr = (void *)((char *)iobuf + iodesc->mpitype_size *
+                                                  (nv * llen + nc4loffset[c]));
+
+                            /* Set the start of the record dimension. */
+                            if (vdesc->record >= 0 && ndims < fndims)
+                                start[0] = frame[nv];
+
+                            /* Write the data for this variable. */
+#ifdef TIMING
+                            if ((ierr = pio_start_timer("PIO:write_darray_nc4p_collective")))
+                                return pio_err(ios, file, ierr, __FILE__, __LINE__);
+#endif /* TIMING */
+                            if((ierr = nc_put_vara(file->fh, varids[nv], start, count, bufptr)))
+                                return pio_err(ios, file, ierr, __FILE__, __LINE__);
+#ifdef TIMING
+                            if ((ierr = pio_stop_timer("PIO:write_darray_nc4p_collective")))
+                                return pio_err(ios, file, ierr, __FILE__, __LINE__);
+#endif /* TIMING */
+                            file->num_collective_writes++;
+                        }
+                    }
                 }
                 break;
 #endif
@@ -782,11 +836,25 @@ find_all_start_count(io_region *region, int maxregions, int fndims,
 
 /**
  * Internal function called by IO tasks other than IO task 0 to send
- * their tmp_start/tmp_count arrays to IO task 0.
+ * their tmp_start/tmp_count arrays and their data to IO task 0.
+ *
+ * The length of the data, the number of regions and the start/count
+ * arrays are packed into one message, which is followed by the data
+ * (which may be empty). Both are sent after IO task 0 has posted the
+ * receives and sent the handshake.
  *
  * This is an internal function which is only called on io tasks other
  * than IO task 0. It is called by write_darray_multi_serial().
  *
+ * @param ios pointer to the IO system info.
+ * @param iodesc pointer to the decomposition info.
+ * @param llen length of the iobuffer on this task for a single field.
+ * @param maxregions number of regions on this task.
+ * @param nvars the number of variables.
+ * @param fndims the number of dimensions in the file.
+ * @param tmp_start the start arrays of all regions.
+ * @param tmp_count the count arrays of all regions.
+ * @param iobuf the data.
  * @return 0 for success, error code otherwise.
  * @ingroup PIO_write_darray_c
  * @author Jim Edwards, Ed Hartnett
@@ -796,6 +864,8 @@ send_all_start_count(iosystem_desc_t *ios, io_desc_t *iodesc, PIO_Offset llen,
                      int maxregions, int nvars, int fndims, size_t *tmp_start,
                      size_t *tmp_count, void *iobuf)
 {
+    PIO_Offset meta[2 + 2 * maxregions * fndims]; /* Packed metadata. */
+    int nmeta = 2;         /* Length of the packed metadata. */
     MPI_Status status;     /* Recv status for MPI. */
     int mpierr;  /* Return code from MPI function codes. */
     int ierr;    /* Return code. */
@@ -804,34 +874,137 @@ send_all_start_count(iosystem_desc_t *ios, io_desc_t *iodesc, PIO_Offset llen,
     pioassert(ios && ios->ioproc && ios->io_rank > 0 && maxregions >= 0,
               "invalid inputs", __FILE__, __LINE__);
 
+    /* Pack the local length of iobuffer for each field (all fields
+     * are the same length), the number of data regions, and the
+     * start/count for all regions. */
+    meta[0] = llen;
+    meta[1] = llen > 0 ? maxregions : 0;
+    for (int i = 0; i < meta[1] * fndims; i++)
+    {
+        meta[nmeta + i] = tmp_start[i];
+        meta[nmeta + meta[1] * fndims + i] = tmp_count[i];
+    }
+    nmeta += 2 * meta[1] * fndims;
+
     /* Do a handshake. */
     if ((mpierr = MPI_Recv(&ierr, 1, MPI_INT, 0, 0, ios->io_comm, &status)))
         return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
 
-    /* Send local length of iobuffer for each field (all
-     * fields are the same length). */
-    if ((mpierr = MPI_Send((void *)&llen, 1, MPI_OFFSET, 0, ios->io_rank, ios->io_comm)))
+    if ((mpierr = MPI_Send(meta, nmeta, MPI_OFFSET, 0, ios->io_rank + ios->num_iotasks,
+                           ios->io_comm)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Send(iobuf, llen > 0 ? nvars * llen : 0, iodesc->mpitype, 0,
+                           ios->io_rank + 2 * ios->num_iotasks, ios->io_comm)))
         return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    PLOG((3, "sent llen = %d", llen));
+    PLOG((3, "sent llen = %d maxregions = %d", llen, meta[1]));
+
+    return PIO_NOERR;
+}
+
+/**
+ * Write the data of one IO task to disk with netCDF. This is called
+ * on IO task 0 by recv_and_write_data().
+ *
+ * @param file a pointer to the open file descriptor.
+ * @param varids an array of the variable ids to be written.
+ * @param frame the record dimension for each of the nvars variables
+ * in iobuf. NULL if this iodesc contains non-record vars.
+ * @param iodesc pointer to the decomposition info.
+ * @param rlen length of the data of one field.
+ * @param rregions number of regions.
+ * @param nvars the number of variables.
+ * @param fndims the number of dimensions in the file.
+ * @param tmp_start the start arrays of all regions.
+ * @param tmp_count the count arrays of all regions.
+ * @param iobuf the data.
+ * @return 0 for success, error code otherwise.
+ * @ingroup PIO_write_darray_c
+ * @author Jim Edwards, Ed Hartnett
+ */
+static int
+write_task_data(file_desc_t *file, const int *varids, const int *frame,
+                io_desc_t *iodesc, PIO_Offset rlen, int rregions, int nvars,
+                int fndims, size_t *tmp_start, size_t *tmp_count, void *iobuf)
+{
+    iosystem_desc_t *ios = file->iosystem;  /* Pointer to io system information. */
+    size_t start[fndims], count[fndims];
+    size_t loffset = 0;
+    void *bufptr;
+    var_desc_t *vdesc;    /* Contains info about the variable. */
+    int ierr;    /* Return code. */
 
-    /* Send the number of data regions, the start/count for
-     * all regions, and the data buffer with all the data. */
-    if (llen > 0)
+    for (int regioncnt = 0; regioncnt < rregions; regioncnt++)
     {
-        if ((mpierr = MPI_Send((void *)&maxregions, 1, MPI_INT, 0, ios->io_rank + ios->num_iotasks,
-                               ios->io_comm)))
-            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-        if ((mpierr = MPI_Send(tmp_start, maxregions * fndims, MPI_OFFSET, 0,
-                               ios->io_rank + 2 * ios->num_iotasks, ios->io_comm)))
-            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-        if ((mpierr = MPI_Send(tmp_count, maxregions * fndims, MPI_OFFSET, 0,
-                               ios->io_rank + 3 * ios->num_iotasks, ios->io_comm)))
-            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-        if ((mpierr = MPI_Send(iobuf, nvars * llen, iodesc->mpitype, 0,
-                               ios->io_rank + 4 * ios->num_iotasks, ios->io_comm)))
-            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-        PLOG((3, "sent data for maxregions = %d", maxregions));
-    }
+        PLOG((3, "writing data for region with regioncnt = %d", regioncnt));
+        bool needtowrite = true;
+
+        if ((ierr = get_var_desc(varids[0], &file->varlist, &vdesc)))
+            return pio_err(NULL, file, ierr, __FILE__, __LINE__);
+
+        /* Get the start/count arrays for this region. */
+        for (int i = 0; i < fndims; i++)
+        {
+            start[i] = tmp_start[i + regioncnt * fndims];
+            count[i] = tmp_count[i + regioncnt * fndims];
+            PLOG((3, "needtowrite %d count[%d] %d\n",needtowrite, i, count[i]));
+            if(i>0 || vdesc->record <0)
+                needtowrite = (count[i] > 0 && needtowrite);
+        }
+
+        /* Process each variable in the buffer. */
+        for (int nv = 0; nv < nvars; nv++)
+        {
+            PLOG((3, "writing buffer var %d", nv));
+
+            /* Get a pointer to the correct part of the buffer. */
+            bufptr = (void *)((char *)iobuf + iodesc->mpitype_size * (nv * rlen + loffset));
+
+            /* If this var has an unlimited dim, set
+             * the start on that dim to the frame
+             * value for this variable. */
+            if (vdesc->record >= 0)
+            {
+                if (fndims > 1 && iodesc->ndims < fndims && count[1] > 0)
+                {
+                    count[0] = 1;
+                    start[0] = frame[nv];
+                }
+                else if (fndims == iodesc->ndims)
+                {
+                    start[0] += vdesc->record;
+                }
+            }
+
+#ifdef LOGGING
+            if(needtowrite)
+                for (int i = 1; i < fndims; i++)
+                    PLOG((3, "(serial) start[%d] %d count[%d] %d needtowrite %d", i, start[i], i, count[i], needtowrite));
+#endif /* LOGGING */
+
+            /* Call the netCDF functions to write the data. */
+            if (needtowrite) {
+#ifdef PIO_ENABLE_GDAL
+                if (file->iotype == PIO_IOTYPE_GDAL)
+                    ierr = GDALc_shp_write_float_field(file->pio_ncid, varids[nv], start, count, bufptr);
+                else
+#endif
+                if ((ierr = nc_put_vara(file->fh, varids[nv], start, count, bufptr)))
+                    return check_netcdf2(ios, NULL, ierr, __FILE__, __LINE__);
+            }
+
+        } /* next var */
+
+        /* Calculate the total size. */
+        size_t tsize = 1;
+        for (int i = 0; i < fndims; i++)
+            tsize *= count[i];
+
+        /* Keep track of where we are in the buffer. */
+        loffset += tsize;
+
+        PLOG((3, " at bottom of loop regioncnt = %d tsize = %d loffset = %d", regioncnt,
+              tsize, loffset));
+    } /* next regioncnt */
 
     return PIO_NOERR;
 }
@@ -841,6 +1014,15 @@ send_all_start_count(iosystem_desc_t *ios, io_desc_t *iodesc, PIO_Offset llen,
  * receives data from all the other IO tasks, and write that data to
  * disk. This is called from write_darray_multi_serial().
  *
+ * The receives are pipelined with the writes. While the data of one
+ * IO task is written, the metadata and data of the next IO task are
+ * received into a second buffer. The first buffer is iobuf, so IO
+ * task 0 holds at most two buffers of maxlen elements per variable.
+ *
+ * If a write fails, the data of the remaining IO tasks is still
+ * received, but not written, so that none of them is left waiting.
+ * The caller shares the error with the other IO tasks.
+ *
  * @param file a pointer to the open file descriptor for the file
  * that will be written to.
  * @param varids an array of the variable ids to be written
@@ -849,8 +1031,10 @@ send_all_start_count(iosystem_desc_t *ios, io_desc_t *iodesc, PIO_Offset llen,
  * @param iodesc pointer to the decomposition info.
  * @param llen length of the iobuffer on this task for a single
  * field.
+ * @param maxlen the largest llen of all IO tasks. iobuf must hold
+ * nvars * maxlen elements.
  * @param maxregions max number of blocks to be written from this
- * iotask.
+ * iotask. This is also the largest number on all IO tasks.
  * @param nvars the number of variables to be written with this
  * decomposition.
  * @param fndims the number of dimensions in the file.
@@ -873,66 +1057,70 @@ send_all_start_count(iosystem_desc_t *ios, io_desc_t *iodesc, PIO_Offset llen,
  */
 int
 recv_and_write_data(file_desc_t *file, const int *varids, const int *frame,
-                    io_desc_t *iodesc, PIO_Offset llen, int maxregions, int nvars,
-                    int fndims, size_t *tmp_start, size_t *tmp_count, void *iobuf)
+                    io_desc_t *iodesc, PIO_Offset llen, PIO_Offset maxlen, int maxregions,
+                    int nvars, int fndims, size_t *tmp_start, size_t *tmp_count, void *iobuf)
 {
     iosystem_desc_t *ios;  /* Pointer to io system information. */
-    size_t rlen;    /* Length of IO buffer on this task. */
-    int rregions;   /* Number of regions in buffer for this task. */
-    size_t start[fndims], count[fndims];
-    size_t loffset;
-    void *bufptr;
-    var_desc_t *vdesc;    /* Contains info about the variable. */
-    MPI_Status status;     /* Recv status for MPI. */
+    int nmeta = 2 + 2 * maxregions * fndims; /* Max length of packed metadata. */
+    PIO_Offset *meta[2] = {NULL, NULL};  /* Packed metadata of each slot. */
+    void *buf[2];         /* Data buffer of each slot. */
+    MPI_Request req[2][2] = {{MPI_REQUEST_NULL, MPI_REQUEST_NULL},
+                             {MPI_REQUEST_NULL, MPI_REQUEST_NULL}}; /* Receives of each slot. */
+    PIO_Offset rlen;      /* Length of IO buffer on this task. */
+    int rregions;         /* Number of regions in buffer for this task. */
     int mpierr;  /* Return code from MPI function codes. */
-    int ierr;    /* Return code. */
+    int ierr = PIO_NOERR;    /* Return code. */
+    int write_err = PIO_NOERR; /* Return code of the first failed write. */
 
     /* Check inputs. */
-    pioassert(file && varids && iodesc && tmp_start && tmp_count, "invalid input",
-              __FILE__, __LINE__);
+    pioassert(file && varids && iodesc && tmp_start && tmp_count && maxlen >= llen,
+              "invalid input", __FILE__, __LINE__);
 
-    PLOG((2, "recv_and_write_data llen = %d maxregions = %d nvars = %d fndims = %d",
-          llen, maxregions, nvars, fndims));
+    PLOG((2, "recv_and_write_data llen = %d maxlen = %d maxregions = %d nvars = %d fndims = %d",
+          llen, maxlen, maxregions, nvars, fndims));
 
     /* Get pointer to IO system. */
     ios = file->iosystem;
 
-    /* For each of the other tasks that are using this task
-     * for IO. */
+    /* Slot 0 is iobuf, which holds the data of this task. Slot 1 is
+     * only needed if there are other IO tasks. */
+    buf[0] = iobuf;
+    buf[1] = NULL;
+    if (ios->num_iotasks > 1)
+    {
+        if (!(meta[0] = malloc(2 * nmeta * sizeof(PIO_Offset))))
+            return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
+        meta[1] = meta[0] + nmeta;
+        if (maxlen > 0 && !(buf[1] = malloc(nvars * maxlen * iodesc->mpitype_size)))
+        {
+            free(meta[0]);
+            return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
+        }
+    }
+
+    /* For each of the tasks that are using this task for IO. */
     for (int rtask = 0; rtask < ios->num_iotasks; rtask++)
     {
-        /* From the remote tasks, we send information about
-         * the data regions. and also the data. */
+        int slot = rtask % 2;
+
         if (rtask)
         {
-            /* handshake - tell the sending task I'm ready */
-            if ((mpierr = MPI_Send(&ierr, 1, MPI_INT, rtask, 0, ios->io_comm)))
-                return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-
-            /* Get length of iobuffer for each field on this
-             * task (all fields are the same length). */
-            if ((mpierr = MPI_Recv(&rlen, 1, MPI_OFFSET, rtask, rtask, ios->io_comm,
-                                   &status)))
-                return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-            PLOG((3, "received rlen = %d", rlen));
-
-            /* Get the number of regions, the start/count
-             * values for all regions, and the data buffer. */
-            if (rlen > 0)
+            /* Wait for the metadata and data of this task. */
+            if ((mpierr = MPI_Waitall(2, req[slot], MPI_STATUSES_IGNORE)))
+            {
+                ierr = check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+                break;
+            }
+            rlen = meta[slot][0];
+            rregions = meta[slot][1];
+            PLOG((3, "received rlen = %d rregions = %d", rlen, rregions));
+
+            /* Unpack the start/count arrays. The arrays of task 0
+             * are not needed any more. */
+            for (int i = 0; i < rregions * fndims; i++)
             {
-                if ((mpierr = MPI_Recv(&rregions, 1, MPI_INT, rtask, rtask + ios->num_iotasks,
-                                       ios->io_comm, &status)))
-                    return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-                if ((mpierr = MPI_Recv(tmp_start, rregions * fndims, MPI_OFFSET, rtask,
-                                       rtask + 2 * ios->num_iotasks, ios->io_comm, &status)))
-                    return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-                if ((mpierr = MPI_Recv(tmp_count, rregions * fndims, MPI_OFFSET, rtask,
-                                       rtask + 3 * ios->num_iotasks, ios->io_comm, &status)))
-                    return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-                if ((mpierr = MPI_Recv(iobuf, nvars * rlen, iodesc->mpitype, rtask,
-                                       rtask + 4 * ios->num_iotasks, ios->io_comm, &status)))
-                    return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-                PLOG((3, "received data rregions = %d fndims = %d", rregions, fndims));
+                tmp_start[i] = meta[slot][2 + i];
+                tmp_count[i] = meta[slot][2 + rregions * fndims + i];
             }
         }
         else /* task 0 */
@@ -942,189 +1130,983 @@ recv_and_write_data(file_desc_t *file, const int *varids, const int *frame,
         }
         PLOG((3, "rtask = %d rlen = %d rregions = %d", rtask, rlen, rregions));
 
-        /* If there is data from this task, write it. */
-        if (rlen > 0)
+        /* Post the receives for the next task into the other slot,
+         * then tell that task I'm ready. Its data arrive while this
+         * task's data are written. */
+        if (rtask + 1 < ios->num_iotasks)
         {
-            loffset = 0;
-            for (int regioncnt = 0; regioncnt < rregions; regioncnt++)
-            {
-                PLOG((3, "writing data for region with regioncnt = %d", regioncnt));
-                bool needtowrite = true;
+            int next = rtask + 1;
+            int nslot = next % 2;
+
+            if ((mpierr = MPI_Irecv(meta[nslot], nmeta, MPI_OFFSET, next,
+                                    next + ios->num_iotasks, ios->io_comm, &req[nslot][0])))
+                ierr = check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+            else if ((mpierr = MPI_Irecv(buf[nslot], nvars * maxlen, iodesc->mpitype, next,
+                                         next + 2 * ios->num_iotasks, ios->io_comm,
+                                         &req[nslot][1])))
+                ierr = check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+            else if ((mpierr = MPI_Send(&ierr, 1, MPI_INT, next, 0, ios->io_comm)))
+                ierr = check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+            if (ierr)
+                break;
+        }
 
-                if ((ierr = get_var_desc(varids[0], &file->varlist, &vdesc)))
-                    return pio_err(NULL, file, ierr, __FILE__, __LINE__);
+        /* If there is data from this task, write it. After an
+         * error, only receive the data of the other tasks. */
+        if (rlen > 0 && !write_err)
+            write_err = write_task_data(file, varids, frame, iodesc, rlen, rregions, nvars,
+                                        fndims, tmp_start, tmp_count, buf[slot]);
+    } /* next rtask */
 
-                /* Get the start/count arrays for this region. */
-                for (int i = 0; i < fndims; i++)
-                {
-                    start[i] = tmp_start[i + regioncnt * fndims];
-                    count[i] = tmp_count[i + regioncnt * fndims];
-                    PLOG((3, "needtowrite %d count[%d] %d\n",needtowrite, i, count[i]));
-                    if(i>0 || vdesc->record <0)
-                        needtowrite = (count[i] > 0 && needtowrite);
-                }
+    /* Don't free the buffers under receives which are still
+     * posted. */
+    for (int s = 0; s < 2; s++)
+        for (int r = 0; r < 2; r++)
+            if (req[s][r] != MPI_REQUEST_NULL)
+            {
+                MPI_Cancel(&req[s][r]);
+                MPI_Wait(&req[s][r], MPI_STATUS_IGNORE);
+            }
 
-                /* Process each variable in the buffer. */
-                for (int nv = 0; nv < nvars; nv++)
-                {
-                    PLOG((3, "writing buffer var %d", nv));
+    free(meta[0]);
+    free(buf[1]);
 
-                    /* Get a pointer to the correct part of the buffer. */
-                    bufptr = (void *)((char *)iobuf + iodesc->mpitype_size * (nv * rlen + loffset));
+    return ierr ? ierr : write_err;
+}
 
-                    /* If this var has an unlimited dim, set
-                     * the start on that dim to the frame
-                     * value for this variable. */
-                    if (vdesc->record >= 0)
-                    {
-                        if (fndims > 1 && iodesc->ndims < fndims && count[1] > 0)
-                        {
-                            count[0] = 1;
-                            start[0] = frame[nv];
-                        }
-                        else if (fndims == iodesc->ndims)
-                        {
-                            start[0] += vdesc->record;
-                        }
-                    }
+/**
+ * Size of the first read of a classic netCDF header in the
+ * multi-writer mode. The read is doubled until the whole header
+ * fits.
+ */
+#define MW_HEADER_CHUNK 8192
 
-#ifdef LOGGING
-                    if(needtowrite)
-                        for (int i = 1; i < fndims; i++)
-                            PLOG((3, "(serial) start[%d] %d count[%d] %d needtowrite %d", i, start[i], i, count[i], needtowrite));
-#endif /* LOGGING */
+/**
+ * A cursor into a classic netCDF header held in memory.
+ */
+typedef struct mw_header
+{
+    /** The bytes read from the start of the file. */
+    const unsigned char *buf;
 
-                    /* Call the netCDF functions to write the data. */
-                    if (needtowrite) {
-#ifdef PIO_ENABLE_GDAL
-			if (file->iotype == PIO_IOTYPE_GDAL)
-			    ierr = GDALc_shp_write_float_field(file->pio_ncid, varids[nv], start, count, bufptr);
-			else
-#endif		        
-                        if ((ierr = nc_put_vara(file->fh, varids[nv], start, count, bufptr)))
-                            return check_netcdf2(ios, NULL, ierr, __FILE__, __LINE__);
-		      }
-
-                } /* next var */
-
-                /* Calculate the total size. */
-                size_t tsize = 1;
-                for (int i = 0; i < fndims; i++)
-                    tsize *= count[i];
+    /** Number of bytes in buf. */
+    PIO_Offset len;
 
-                /* Keep track of where we are in the buffer. */
-                loffset += tsize;
+    /** Current position in buf. */
+    PIO_Offset pos;
 
-                PLOG((3, " at bottom of loop regioncnt = %d tsize = %d loffset = %d", regioncnt,
-                      tsize, loffset));
-            } /* next regioncnt */
-        } /* endif (rlen > 0) */
-    } /* next rtask */
+    /** Non-zero once a read went past the end of buf. */
+    int truncated;
+} mw_header_t;
 
-    return PIO_NOERR;
+/**
+ * Get the external size of a classic netCDF type.
+ *
+ * @param xtype the netCDF type.
+ * @returns the size in bytes, or 0 if the type is not valid.
+ * @author Jim Edwards
+ */
+static int
+mw_xsz(int xtype)
+{
+    switch (xtype)
+    {
+    case NC_BYTE:
+    case NC_CHAR:
+    case NC_UBYTE:
+        return 1;
+    case NC_SHORT:
+    case NC_USHORT:
+        return 2;
+    case NC_INT:
+    case NC_FLOAT:
+    case NC_UINT:
+        return 4;
+    case NC_DOUBLE:
+    case NC_INT64:
+    case NC_UINT64:
+        return 8;
+    }
+    return 0;
 }
 
 /**
- * Write a set of one or more aggregated arrays to output file in
- * serial mode. This function is called for netCDF classic and
- * netCDF-4 serial iotypes. Parallel iotypes use
- * write_darray_multi_par().
+ * Read a big-endian unsigned integer from the header.
  *
- * @param file a pointer to the open file descriptor for the file
- * that will be written to.
- * @param nvars the number of variables to be written with this
- * decomposition.
- * @param fndims number of dims in the vars in the file.
- * @param varids an array of the variable ids to be written
- * @param iodesc pointer to the decomposition info.
- * @param fill Non-zero if this write is fill data.
- * @param frame the record dimension for each of the nvars variables
- * in iobuf. NULL if this iodesc contains non-record vars.
- * @return 0 for success, error code otherwise.
- * @ingroup PIO_write_darray_c
- * @author Jim Edwards, Ed Hartnett
+ * @param h pointer to the header cursor.
+ * @param nbytes size of the integer, 4 or 8.
+ * @returns the value, or 0 if the header is truncated.
+ * @author Jim Edwards
  */
-int
-write_darray_multi_serial(file_desc_t *file, int nvars, int fndims, const int *varids,
-                          io_desc_t *iodesc, int fill, const int *frame)
+static PIO_Offset
+mw_get(mw_header_t *h, int nbytes)
 {
-    iosystem_desc_t *ios;  /* Pointer to io system information. */
-    var_desc_t *vdesc;     /* Contains info about the variable. */
-    int ierr;              /* Return code. */
+    PIO_Offset val = 0;
 
-    /* Check inputs. */
-    pioassert(file && file->iosystem && varids && varids[0] >= 0 &&
-              varids[0] <= PIO_MAX_VARS && iodesc, "invalid input", __FILE__, __LINE__);
+    if (h->truncated || h->pos + nbytes > h->len)
+    {
+        h->truncated = 1;
+        return 0;
+    }
+    for (int i = 0; i < nbytes; i++)
+        val = (val << 8) | h->buf[h->pos++];
 
-    PLOG((1, "write_darray_multi_serial nvars = %d fndims = %d iodesc->ndims = %d "
-          "iodesc->mpitype = %d", nvars, fndims, iodesc->ndims, iodesc->mpitype));
+    return val;
+}
 
-    /* Get the iosystem info. */
-    ios = file->iosystem;
+/**
+ * Skip over a name, or over the values of an attribute, in the
+ * header. These are padded to a multiple of 4 bytes.
+ *
+ * @param h pointer to the header cursor.
+ * @param nbytes number of unpadded bytes to skip.
+ * @author Jim Edwards
+ */
+static void
+mw_skip(mw_header_t *h, PIO_Offset nbytes)
+{
+    nbytes = (nbytes + 3) & ~(PIO_Offset)3;
+    if (nbytes < 0 || h->pos + nbytes > h->len)
+        h->truncated = 1;
+    else
+        h->pos += nbytes;
+}
 
-    /* Get the var info. */
-    if ((ierr = get_var_desc(varids[0], &file->varlist, &vdesc)))
-        return pio_err(NULL, file, ierr, __FILE__, __LINE__);
+/**
+ * Skip over an attribute list in the header.
+ *
+ * @param h pointer to the header cursor.
+ * @param nsz size of a NON_NEG value in this format.
+ * @author Jim Edwards
+ */
+static void
+mw_skip_atts(mw_header_t *h, int nsz)
+{
+    PIO_Offset natts;
 
-    /* Set these differently for data and fill writing. iobuf may be
-     * null if array size < number of nodes. */
-    int num_regions = fill ? iodesc->maxfillregions: iodesc->maxregions;
-    io_region *region = fill ? iodesc->fillregion : iodesc->firstregion;
-    PIO_Offset llen = fill ? iodesc->holegridsize : iodesc->llen;
-    void *iobuf = fill ? vdesc->fillbuf : file->iobuf;
+    mw_get(h, 4);
+    natts = mw_get(h, nsz);
+    for (PIO_Offset a = 0; a < natts && !h->truncated; a++)
+    {
+        int xtype;
+        PIO_Offset nelems;
 
-#ifdef TIMING
-    /* Start timer if desired. */
-    if ((ierr = pio_start_timer("PIO:write_darray_multi_serial")))
-        return pio_err(ios, NULL, ierr, __FILE__, __LINE__);
-#endif /* TIMING */
+        mw_skip(h, mw_get(h, nsz));
+        xtype = mw_get(h, 4);
+        nelems = mw_get(h, nsz);
+        mw_skip(h, nelems * mw_xsz(xtype));
+    }
+}
 
-    /* Only IO tasks participate in this code. */
-    if (ios->ioproc)
+/**
+ * Parse the header of a CDF-1, CDF-2 or CDF-5 file and find where
+ * each variable is stored. The layout array is described in
+ * file_desc_t.
+ *
+ * @param h pointer to the header cursor, at the start of the file.
+ * @param layoutp pointer that gets the malloced layout array.
+ * @param nlayoutp pointer that gets the length of the layout array.
+ * @param nvarsp pointer that gets the number of variables.
+ * @param recsizep pointer that gets the size of one record.
+ * @returns 0 for success, 1 if the header is longer than the buffer,
+ * error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+mw_parse_header(mw_header_t *h, PIO_Offset **layoutp, PIO_Offset *nlayoutp,
+                int *nvarsp, PIO_Offset *recsizep)
+{
+    PIO_Offset *dimlen = NULL;
+    PIO_Offset *layout = NULL;
+    PIO_Offset ndims, nvars;
+    PIO_Offset nlayout = 0, maxlayout = 0;
+    PIO_Offset recsize = 0, lastrecsize = 0;
+    int nrecvars = 0;
+    int nsz, osz;
+    int ret = PIO_NOERR;
+
+    if (h->len < 4)
+        return 1;
+    if (h->buf[0] != 'C' || h->buf[1] != 'D' || h->buf[2] != 'F')
+        return PIO_ENOTNC;
+
+    /* Sizes of NON_NEG values and of variable offsets depend on the
+     * format version. */
+    switch (h->buf[3])
     {
-        size_t tmp_start[fndims * num_regions]; /* A start array for each region. */
-        size_t tmp_count[fndims * num_regions]; /* A count array for each region. */
+    case 1:
+        nsz = 4;
+        osz = 4;
+        break;
+    case 2:
+        nsz = 4;
+        osz = 8;
+        break;
+    case 5:
+        nsz = 8;
+        osz = 8;
+        break;
+    default:
+        return PIO_ENOTNC;
+    }
+    h->pos = 4;
 
-        PLOG((3, "num_regions = %d", num_regions));
+    /* Skip numrecs. */
+    mw_get(h, nsz);
 
-        /* Fill the tmp_start and tmp_count arrays, which contain the
-         * start and count arrays for all regions. */
-        if ((ierr = find_all_start_count(region, num_regions, fndims, iodesc->ndims, vdesc,
-                                         tmp_start, tmp_count)))
-            return pio_err(ios, file, ierr, __FILE__, __LINE__);
+    /* Read the dimension lengths. The record dimension has length 0. */
+    mw_get(h, 4);
+    ndims = mw_get(h, nsz);
+    if (!h->truncated && ndims > 0)
+    {
+        if (ndims > PIO_MAX_DIMS)
+            return PIO_ENOTNC;
+        if (!(dimlen = malloc(ndims * sizeof(PIO_Offset))))
+            return PIO_ENOMEM;
+    }
+    for (PIO_Offset d = 0; d < ndims && !h->truncated; d++)
+    {
+        mw_skip(h, mw_get(h, nsz));
+        dimlen[d] = mw_get(h, nsz);
+    }
 
-        /* Tasks other than 0 will send their data to task 0. */
-        if (ios->io_rank > 0)
+    mw_skip_atts(h, nsz);
+
+    /* Read the variables. */
+    mw_get(h, 4);
+    nvars = mw_get(h, nsz);
+    if (nvars > PIO_MAX_VARS)
+        ret = PIO_ENOTNC;
+    for (PIO_Offset v = 0; v < nvars && !h->truncated && !ret; v++)
+    {
+        PIO_Offset vndims;
+        PIO_Offset vsize;
+        int isrec;
+        int xsz;
+
+        mw_skip(h, mw_get(h, nsz));
+        vndims = mw_get(h, nsz);
+        if (vndims < 0 || vndims > ndims)
         {
-            /* Send the tmp_start and tmp_count arrays from this IO task
-             * to task 0. */
-            if ((ierr = send_all_start_count(ios, iodesc, llen, num_regions, nvars, fndims,
-                                             tmp_start, tmp_count, iobuf)))
-                return pio_err(ios, file, ierr, __FILE__, __LINE__);
+            ret = PIO_ENOTNC;
+            break;
         }
-        else
+
+        /* Make room for begin, xsz, ndims and the dimension lengths. */
+        if (nlayout + 3 + vndims > maxlayout)
         {
-            /* Task 0 will receive data from all other IO tasks. */
+            PIO_Offset *tmp;
 
-            if ((ierr = recv_and_write_data(file, varids, frame, iodesc, llen, num_regions, nvars, fndims,
-                                            tmp_start, tmp_count, iobuf)))
-                return pio_err(ios, file, ierr, __FILE__, __LINE__);
+            maxlayout = 2 * (nlayout + 3 + vndims);
+            if (!(tmp = realloc(layout, maxlayout * sizeof(PIO_Offset))))
+            {
+                ret = PIO_ENOMEM;
+                break;
+            }
+            layout = tmp;
         }
-    }
+        layout[nlayout + 2] = vndims;
+        for (PIO_Offset d = 0; d < vndims && !h->truncated; d++)
+        {
+            PIO_Offset dimid = mw_get(h, nsz);
 
-#ifdef TIMING
-    if ((ierr = pio_stop_timer("PIO:write_darray_multi_serial")))
-        return pio_err(ios, NULL, ierr, __FILE__, __LINE__);
-#endif /* TIMING */
+            if (dimid < 0 || dimid >= ndims)
+            {
+                ret = PIO_ENOTNC;
+                break;
+            }
+            layout[nlayout + 3 + d] = dimlen[dimid];
+        }
+        if (ret)
+            break;
 
-    return PIO_NOERR;
-}
+        mw_skip_atts(h, nsz);
+        xsz = mw_xsz(mw_get(h, 4));
+        mw_get(h, nsz);
+        layout[nlayout] = mw_get(h, osz);
+        layout[nlayout + 1] = xsz;
+        if (h->truncated)
+            break;
+        if (!xsz)
+        {
+            ret = PIO_ENOTNC;
+            break;
+        }
 
-/**
- * Read an array of data from a file using distributed arrays.
- *
- * @param file a pointer to the open file descriptor for the file
- * that will be read from.
+        /* Add record variables to the record size. Each one is
+         * padded to 4 bytes, unless it is the only one. */
+        isrec = vndims > 0 && layout[nlayout + 3] == 0;
+        vsize = xsz;
+        for (PIO_Offset d = isrec; d < vndims; d++)
+            vsize *= layout[nlayout + 3 + d];
+        if (isrec)
+        {
+            nrecvars++;
+            lastrecsize = vsize;
+            recsize += (vsize + 3) & ~(PIO_Offset)3;
+        }
+        nlayout += 3 + vndims;
+    }
+
+    free(dimlen);
+
+    if (!ret && h->truncated)
+        ret = 1;
+    if (ret)
+    {
+        free(layout);
+        return ret;
+    }
+
+    *layoutp = layout;
+    *nlayoutp = nlayout;
+    *nvarsp = nvars;
+    *recsizep = nrecvars == 1 ? lastrecsize : recsize;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Open a PIO_IOTYPE_NETCDF file with MPI-IO on all IO tasks, for the
+ * multi-writer mode. This is called on all tasks after the file has
+ * been created or opened by IO task 0.
+ *
+ * @param file pointer to the file descriptor.
+ * @param filename the name of the file.
+ * @returns 0 for success, error code otherwise.
+ * @ingroup PIO_write_darray_c
+ * @author Jim Edwards
+ */
+int
+multiwriter_open(file_desc_t *file, const char *filename)
+{
+    iosystem_desc_t *ios = file->iosystem;
+    int mpierr;
+
+    file->mw_fh = MPI_FILE_NULL;
+    if (!file->multiwriter || !ios->ioproc)
+        return PIO_NOERR;
+
+    PLOG((2, "multiwriter_open filename = %s", filename));
+    if ((mpierr = MPI_File_open(ios->io_comm, (char *)filename, MPI_MODE_RDWR,
+                                ios->info, &file->mw_fh)))
+        return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Free the variable layout of a multi-writer file. It is read again
+ * from the header at the next write.
+ *
+ * @param file pointer to the file descriptor.
+ * @author Jim Edwards
+ */
+void
+multiwriter_free_layout(file_desc_t *file)
+{
+    free(file->mw_layout);
+    free(file->mw_varpos);
+    file->mw_layout = NULL;
+    file->mw_varpos = NULL;
+    file->mw_nvars = 0;
+}
+
+/**
+ * Close the MPI-IO handle of a multi-writer file. This is called on
+ * IO tasks before IO task 0 closes the file with netCDF, so that all
+ * data are on disk before the header is written for the last time.
+ *
+ * @param file pointer to the file descriptor.
+ * @returns 0 for success, error code otherwise.
+ * @ingroup PIO_write_darray_c
+ * @author Jim Edwards
+ */
+int
+multiwriter_close(file_desc_t *file)
+{
+    int mpierr;
+
+    multiwriter_free_layout(file);
+    if (file->mw_fh != MPI_FILE_NULL)
+        if ((mpierr = MPI_File_close(&file->mw_fh)))
+            return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Read the variable layout of a multi-writer file, if it is not
+ * already known. IO task 0 syncs the file, reads the header and
+ * broadcasts the layout to the other IO tasks.
+ *
+ * This is called on all IO tasks.
+ *
+ * @param file pointer to the file descriptor.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+multiwriter_get_layout(file_desc_t *file)
+{
+    iosystem_desc_t *ios = file->iosystem;
+    PIO_Offset nlayout = 0;
+    PIO_Offset hdr[3];
+    int ierr = PIO_NOERR;
+    int mpierr;
+
+    if (file->mw_varpos)
+        return PIO_NOERR;
+
+    if (!ios->io_rank)
+    {
+        unsigned char *buf = NULL;
+        int hlen = MW_HEADER_CHUNK;
+
+        /* Make sure the header on disk is up to date. */
+        ierr = nc_sync(file->fh);
+
+        while (!ierr)
+        {
+            mw_header_t h = {0};
+            unsigned char *tmp;
+            MPI_Status status;
+            int nread;
+
+            if (!(tmp = realloc(buf, hlen)))
+            {
+                ierr = PIO_ENOMEM;
+                break;
+            }
+            buf = tmp;
+            if ((mpierr = MPI_File_read_at(file->mw_fh, 0, buf, hlen, MPI_BYTE, &status)))
+            {
+                ierr = PIO_EIO;
+                break;
+            }
+            if ((mpierr = MPI_Get_count(&status, MPI_BYTE, &nread)))
+            {
+                ierr = PIO_EIO;
+                break;
+            }
+            h.buf = buf;
+            h.len = nread;
+            ierr = mw_parse_header(&h, &file->mw_layout, &nlayout, &file->mw_nvars,
+                                   &file->mw_recsize);
+
+            /* Read more of the file if the header did not fit. */
+            if (ierr == 1)
+            {
+                ierr = nread < hlen ? PIO_ENOTNC : PIO_NOERR;
+                hlen *= 2;
+                continue;
+            }
+            break;
+        }
+        free(buf);
+        PLOG((2, "multiwriter_get_layout ierr = %d nvars = %d recsize = %lld", ierr,
+              file->mw_nvars, file->mw_recsize));
+    }
+
+    /* Share the layout with the other IO tasks. */
+    if ((mpierr = MPI_Bcast(&ierr, 1, MPI_INT, 0, ios->io_comm)))
+        return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+    if (ierr)
+        return pio_err(NULL, file, ierr, __FILE__, __LINE__);
+
+    hdr[0] = nlayout;
+    hdr[1] = file->mw_nvars;
+    hdr[2] = file->mw_recsize;
+    if ((mpierr = MPI_Bcast(hdr, 3, MPI_OFFSET, 0, ios->io_comm)))
+        return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+    nlayout = hdr[0];
+    file->mw_nvars = hdr[1];
+    file->mw_recsize = hdr[2];
+
+    if (ios->io_rank)
+        if (!(file->mw_layout = malloc(max(1, nlayout) * sizeof(PIO_Offset))))
+            return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
+    if (nlayout)
+        if ((mpierr = MPI_Bcast(file->mw_layout, nlayout, MPI_OFFSET, 0, ios->io_comm)))
+            return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+
+    /* Index the layout by varid. */
+    if (!(file->mw_varpos = malloc(max(1, file->mw_nvars) * sizeof(int))))
+        return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
+    for (int v = 0, pos = 0; v < file->mw_nvars; v++)
+    {
+        file->mw_varpos[v] = pos;
+        pos += 3 + file->mw_layout[pos + 2];
+    }
+
+    return PIO_NOERR;
+}
+
+/**
+ * Find the start/count of one region of one variable in the file,
+ * in the same way as recv_and_write_data().
+ *
+ * @param fndims the number of dimensions in the file.
+ * @param ndims the number of dimensions in the decomposition.
+ * @param record the record dimension of the variable, or -1.
+ * @param frame the record of the variable, if it is a record var.
+ * @param tmp_start the start arrays of all regions.
+ * @param tmp_count the count arrays of all regions.
+ * @param r the index of the region.
+ * @param start array that gets the start of the region.
+ * @param count array that gets the count of the region.
+ * @returns the number of elements in the region.
+ * @author Jim Edwards
+ */
+static PIO_Offset
+mw_start_count(int fndims, int ndims, int record, int frame, const size_t *tmp_start,
+               const size_t *tmp_count, int r, size_t *start, size_t *count)
+{
+    PIO_Offset tsize = 1;
+
+    for (int i = 0; i < fndims; i++)
+    {
+        start[i] = tmp_start[i + r * fndims];
+        count[i] = tmp_count[i + r * fndims];
+    }
+    if (record >= 0)
+    {
+        if (fndims > 1 && ndims < fndims && count[1] > 0)
+        {
+            count[0] = 1;
+            start[0] = frame;
+        }
+        else if (fndims == ndims)
+        {
+            start[0] += record;
+        }
+    }
+    for (int i = 0; i < fndims; i++)
+        tsize *= count[i];
+
+    return tsize;
+}
+
+/**
+ * Check whether the variables of a write can be written directly by
+ * the IO tasks. The layout must be known, and the decomposition type
+ * must have the size of the type of each variable in the file.
+ *
+ * @param file pointer to the file descriptor.
+ * @param nvars the number of variables.
+ * @param fndims the number of dimensions in the file.
+ * @param varids the variable IDs.
+ * @param iodesc pointer to the decomposition info.
+ * @returns non-zero if the multi-writer path can be used.
+ * @author Jim Edwards
+ */
+static int
+multiwriter_can_write(file_desc_t *file, int nvars, int fndims, const int *varids,
+                      io_desc_t *iodesc)
+{
+    for (int nv = 0; nv < nvars; nv++)
+    {
+        PIO_Offset *layout;
+
+        if (varids[nv] < 0 || varids[nv] >= file->mw_nvars)
+            return 0;
+        layout = file->mw_layout + file->mw_varpos[varids[nv]];
+        if (layout[1] != iodesc->mpitype_size || layout[2] != fndims || fndims < 1)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Write a set of aggregated arrays to a classic netCDF file from all
+ * IO tasks with MPI-IO. IO task 0 first adds any new records with
+ * netCDF, so that netCDF keeps a correct numrecs, and the file is
+ * synced so the other IO tasks see them. Then each IO task writes
+ * its regions at the offsets found in the header, converting the
+ * data to big-endian.
+ *
+ * This is called on all IO tasks by write_darray_multi_serial().
+ *
+ * @param file pointer to the file descriptor.
+ * @param nvars the number of variables.
+ * @param fndims the number of dimensions in the file.
+ * @param varids the variable IDs.
+ * @param iodesc pointer to the decomposition info.
+ * @param llen length of the IO buffer of one variable.
+ * @param num_regions the number of regions.
+ * @param tmp_start the start arrays of all regions.
+ * @param tmp_count the count arrays of all regions.
+ * @param iobuf the data.
+ * @param record the record dimension of the variables, or -1.
+ * @param frame the record of each variable, or NULL.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+write_darray_multi_direct(file_desc_t *file, int nvars, int fndims, const int *varids,
+                          io_desc_t *iodesc, PIO_Offset llen, int num_regions,
+                          const size_t *tmp_start, const size_t *tmp_count, void *iobuf,
+                          int record, const int *frame)
+{
+    iosystem_desc_t *ios = file->iosystem;
+    size_t start[fndims], count[fndims];
+    PIO_Offset nruns[nvars];
+    PIO_Offset maxruns = 0;
+    long long numrecs = 0, maxrecs;
+    const int one = 1;
+    int swap = *(const char *)&one && iodesc->mpitype_size > 1;
+    void *swapbuf = NULL;
+    MPI_Aint *displs = NULL;
+    int *blocklens = NULL;
+    int recvarid = -1;
+    int ierr = PIO_NOERR;
+    int mpierr;
+
+    /* Count the contiguous runs of each variable, and the records
+     * that are needed. */
+    for (int nv = 0; nv < nvars; nv++)
+    {
+        PIO_Offset *dimlen = file->mw_layout + file->mw_varpos[varids[nv]] + 3;
+        int isrec = dimlen[0] == 0;
+
+        if (isrec && recvarid < 0)
+            recvarid = varids[nv];
+        nruns[nv] = 0;
+        for (int r = 0; r < num_regions; r++)
+        {
+            PIO_Offset regionruns;
+
+            if (!mw_start_count(fndims, iodesc->ndims, record, frame ? frame[nv] : 0,
+                                tmp_start, tmp_count, r, start, count))
+                continue;
+            regionruns = isrec && fndims == 1 ? count[0] : 1;
+            for (int d = 0; d < fndims - 1; d++)
+                regionruns *= count[d];
+            nruns[nv] += regionruns;
+            if (isrec && (long long)(start[0] + count[0]) > numrecs)
+                numrecs = start[0] + count[0];
+        }
+        maxruns = max(maxruns, nruns[nv]);
+    }
+
+    /* IO task 0 extends the record dimension with netCDF, writing a
+     * fill value to the first element of the last record. */
+    if (recvarid >= 0)
+    {
+        int result[2] = {PIO_NOERR, 0}; /* Return code, and whether records were added. */
+
+        if ((mpierr = MPI_Allreduce(&numrecs, &maxrecs, 1, MPI_LONG_LONG, MPI_MAX,
+                                    ios->io_comm)))
+            return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+        if (!ios->io_rank)
+        {
+            int unlimdimid;
+            size_t curlen;
+
+            if (!(ierr = nc_inq_unlimdim(file->fh, &unlimdimid)) &&
+                !(ierr = nc_inq_dimlen(file->fh, unlimdimid, &curlen)) &&
+                maxrecs > (long long)curlen)
+            {
+                size_t fstart[fndims], fcount[fndims];
+                char fillvalue[8];
+                int no_fill;
+
+                for (int d = 0; d < fndims; d++)
+                {
+                    fstart[d] = 0;
+                    fcount[d] = 1;
+                }
+                fstart[0] = maxrecs - 1;
+                PLOG((3, "extending numrecs from %d to %lld", curlen, maxrecs));
+                if (!(ierr = nc_inq_var_fill(file->fh, recvarid, &no_fill, fillvalue)) &&
+                    !(ierr = nc_put_vara(file->fh, recvarid, fstart, fcount, fillvalue)))
+                    ierr = nc_sync(file->fh);
+                result[1] = 1;
+            }
+            result[0] = ierr;
+        }
+        if ((mpierr = MPI_Bcast(result, 2, MPI_INT, 0, ios->io_comm)))
+            return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+        if (result[0])
+            return pio_err(NULL, file, result[0], __FILE__, __LINE__);
+
+        /* The new records were written outside of MPI-IO. Make them
+         * visible to all IO tasks, and keep the tasks from writing
+         * before they exist. */
+        if (result[1])
+        {
+            if ((mpierr = MPI_File_sync(file->mw_fh)))
+                return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+            if ((mpierr = MPI_Barrier(ios->io_comm)))
+                return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+            if ((mpierr = MPI_File_sync(file->mw_fh)))
+                return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+        }
+    }
+
+    /* The writes are collective, so all IO tasks must agree that
+     * they have their buffers before any of them starts. */
+    if (swap && llen > 0 && !(swapbuf = malloc(llen * iodesc->mpitype_size)))
+        ierr = PIO_ENOMEM;
+    if (maxruns && !ierr &&
+        (!(displs = malloc(maxruns * sizeof(MPI_Aint))) ||
+         !(blocklens = malloc(maxruns * sizeof(int)))))
+        ierr = PIO_ENOMEM;
+    if ((mpierr = MPI_Allreduce(MPI_IN_PLACE, &ierr, 1, MPI_INT, MPI_MIN, ios->io_comm)))
+        ierr = check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+    if (ierr)
+    {
+        free(swapbuf);
+        free(displs);
+        free(blocklens);
+        return pio_err(ios, file, ierr, __FILE__, __LINE__);
+    }
+
+    for (int nv = 0; nv < nvars; nv++)
+    {
+        PIO_Offset *layout = file->mw_layout + file->mw_varpos[varids[nv]];
+        PIO_Offset begin = layout[0];
+        int xsz = layout[1];
+        PIO_Offset *dimlen = layout + 3;
+        int isrec = dimlen[0] == 0;
+        int last = fndims - 1;
+        MPI_Datatype filetype = MPI_BYTE;
+        PIO_Offset loffset = 0;
+        int n = 0;
+        char *bufptr = (char *)iobuf + (PIO_Offset)xsz * nv * llen;
+        MPI_Status status;
+
+        /* Find the file offset of each run along the fastest
+         * dimension. Runs follow the order of the data in iobuf, and
+         * adjacent runs are merged. */
+        for (int r = 0; r < num_regions; r++)
+        {
+            PIO_Offset tsize;
+            size_t idx[fndims];
+            int ilen;
+
+            if (!(tsize = mw_start_count(fndims, iodesc->ndims, record, frame ? frame[nv] : 0,
+                                         tmp_start, tmp_count, r, start, count)))
+                continue;
+            loffset += tsize;
+
+            /* A 1D record var has one element per record. */
+            ilen = isrec && fndims == 1 ? 1 : count[last];
+            for (int d = 0; d < fndims; d++)
+                idx[d] = start[d];
+
+            while (idx[0] < start[0] + count[0])
+            {
+                PIO_Offset off = 0;
+                MPI_Aint displ;
+
+                for (int d = isrec; d < fndims; d++)
+                    off = off * dimlen[d] + idx[d];
+                displ = begin + off * xsz + (isrec ? idx[0] * file->mw_recsize : 0);
+
+                if (n && displs[n - 1] + blocklens[n - 1] == displ)
+                    blocklens[n - 1] += ilen * xsz;
+                else
+                {
+                    displs[n] = displ;
+                    blocklens[n++] = ilen * xsz;
+                }
+
+                /* Move to the next run. */
+                int d = isrec && fndims == 1 ? 0 : last - 1;
+                if (d < 0)
+                    break;
+                for (idx[d]++; d > 0 && idx[d] == start[d] + count[d]; idx[--d]++)
+                    idx[d] = start[d];
+            }
+        }
+        pioassert(loffset * xsz <= INT_MAX, "multi-writer buffer too large", __FILE__, __LINE__);
+        PLOG((3, "write_darray_multi_direct varid %d nruns %lld merged %d bytes %lld",
+              varids[nv], nruns[nv], n, loffset * xsz));
+
+        /* Classic files are big-endian. */
+        if (swap)
+        {
+            for (PIO_Offset i = 0; i < loffset; i++)
+            {
+                char *src = bufptr + i * xsz;
+                char *dst = (char *)swapbuf + i * xsz;
+
+                for (int b = 0; b < xsz; b++)
+                    dst[b] = src[xsz - 1 - b];
+            }
+            bufptr = swapbuf;
+        }
+
+        if (n)
+        {
+            if (!(mpierr = MPI_Type_create_hindexed(n, blocklens, displs, MPI_BYTE, &filetype)))
+                mpierr = MPI_Type_commit(&filetype);
+        }
+        else
+            mpierr = MPI_SUCCESS;
+
+        /* Every IO task writes, even with no data, because the write
+         * is collective. */
+        if (!mpierr)
+            mpierr = MPI_File_set_view(file->mw_fh, 0, MPI_BYTE, filetype, "native", ios->info);
+        if (!mpierr)
+            mpierr = MPI_File_write_all(file->mw_fh, bufptr, (int)(loffset * xsz), MPI_BYTE,
+                                        &status);
+        if (filetype != MPI_BYTE)
+            MPI_Type_free(&filetype);
+        if (mpierr)
+            break;
+    }
+    free(swapbuf);
+    free(displs);
+    free(blocklens);
+    if (mpierr)
+        return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+
+    /* Restore the default view, so that IO task 0 can read the
+     * header again after a redef. */
+    if ((mpierr = MPI_File_set_view(file->mw_fh, 0, MPI_BYTE, MPI_BYTE, "native", ios->info)))
+        return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Write a set of one or more aggregated arrays to output file in
+ * serial mode. This function is called for netCDF classic and
+ * netCDF-4 serial iotypes. Parallel iotypes use
+ * write_darray_multi_par().
+ *
+ * IO tasks send their data to IO task 0, which writes it, unless the
+ * file uses the multi-writer mode. Then each IO task writes its own
+ * data with MPI-IO.
+ *
+ * @param file a pointer to the open file descriptor for the file
+ * that will be written to.
+ * @param nvars the number of variables to be written with this
+ * decomposition.
+ * @param fndims number of dims in the vars in the file.
+ * @param varids an array of the variable ids to be written
+ * @param iodesc pointer to the decomposition info.
+ * @param fill Non-zero if this write is fill data.
+ * @param frame the record dimension for each of the nvars variables
+ * in iobuf. NULL if this iodesc contains non-record vars.
+ * @return 0 for success, error code otherwise.
+ * @ingroup PIO_write_darray_c
+ * @author Jim Edwards, Ed Hartnett
+ */
+int
+write_darray_multi_serial(file_desc_t *file, int nvars, int fndims, const int *varids,
+                          io_desc_t *iodesc, int fill, const int *frame)
+{
+    iosystem_desc_t *ios;  /* Pointer to io system information. */
+    var_desc_t *vdesc;     /* Contains info about the variable. */
+    int mpierr;            /* Return code from MPI functions. */
+    int ierr;              /* Return code. */
+
+    /* Check inputs. */
+    pioassert(file && file->iosystem && varids && varids[0] >= 0 &&
+              varids[0] <= PIO_MAX_VARS && iodesc, "invalid input", __FILE__, __LINE__);
+
+    PLOG((1, "write_darray_multi_serial nvars = %d fndims = %d iodesc->ndims = %d "
+          "iodesc->mpitype = %d", nvars, fndims, iodesc->ndims, iodesc->mpitype));
+
+    /* Get the iosystem info. */
+    ios = file->iosystem;
+
+    /* Get the var info. */
+    if ((ierr = get_var_desc(varids[0], &file->varlist, &vdesc)))
+        return pio_err(NULL, file, ierr, __FILE__, __LINE__);
+
+    /* Set these differently for data and fill writing. iobuf may be
+     * null if array size < number of nodes. */
+    int num_regions = fill ? iodesc->maxfillregions: iodesc->maxregions;
+    io_region *region = fill ? iodesc->fillregion : iodesc->firstregion;
+    PIO_Offset llen = fill ? iodesc->holegridsize : iodesc->llen;
+    void *iobuf = fill ? vdesc->fillbuf : file->iobuf;
+
+#ifdef TIMING
+    /* Start timer if desired. */
+    if ((ierr = pio_start_timer("PIO:write_darray_multi_serial")))
+        return pio_err(ios, NULL, ierr, __FILE__, __LINE__);
+#endif /* TIMING */
+
+    /* Only IO tasks participate in this code. */
+    if (ios->ioproc)
+    {
+        size_t tmp_start[fndims * num_regions]; /* A start array for each region. */
+        size_t tmp_count[fndims * num_regions]; /* A count array for each region. */
+        int direct = 0; /* Non-zero if each IO task writes its own data. */
+
+        PLOG((3, "num_regions = %d", num_regions));
+
+        /* Fill the tmp_start and tmp_count arrays, which contain the
+         * start and count arrays for all regions. */
+        if ((ierr = find_all_start_count(region, num_regions, fndims, iodesc->ndims, vdesc,
+                                         tmp_start, tmp_count)))
+            return pio_err(ios, file, ierr, __FILE__, __LINE__);
+
+        /* In the multi-writer mode, all IO tasks write their own
+         * data to classic files. */
+        if (file->multiwriter)
+        {
+            if ((ierr = multiwriter_get_layout(file)))
+                return pio_err(ios, file, ierr, __FILE__, __LINE__);
+            direct = multiwriter_can_write(file, nvars, fndims, varids, iodesc);
+            PLOG((3, "multiwriter direct = %d", direct));
+        }
+
+        if (direct)
+        {
+            if ((ierr = write_darray_multi_direct(file, nvars, fndims, varids, iodesc, llen,
+                                                  num_regions, tmp_start, tmp_count, iobuf,
+                                                  vdesc->record, frame)))
+                return pio_err(ios, file, ierr, __FILE__, __LINE__);
+        }
+        else
+        {
+            if (ios->io_rank > 0)
+            {
+                /* Tasks other than 0 will send their data to task
+                 * 0. Send the tmp_start and tmp_count arrays from
+                 * this IO task to task 0. */
+                if ((ierr = send_all_start_count(ios, iodesc, llen, num_regions, nvars,
+                                                 fndims, tmp_start, tmp_count, iobuf)))
+                    return pio_err(ios, file, ierr, __FILE__, __LINE__);
+            }
+            else
+            {
+                /* Task 0 will receive data from all other IO tasks. */
+                ierr = recv_and_write_data(file, varids, frame, iodesc, llen,
+                                           fill ? iodesc->maxholegridsize : iodesc->maxiobuflen,
+                                           num_regions, nvars, fndims, tmp_start, tmp_count,
+                                           iobuf);
+            }
+
+            /* Task 0 tells the other IO tasks whether the data was
+             * written. */
+            if (ios->num_iotasks > 1)
+                if ((mpierr = MPI_Bcast(&ierr, 1, MPI_INT, 0, ios->io_comm)))
+                    return check_mpi(ios, file, mpierr, __FILE__, __LINE__);
+            if (ierr)
+                return pio_err(ios, file, ierr, __FILE__, __LINE__);
+        }
+    }
+
+#ifdef TIMING
+    if ((ierr = pio_stop_timer("PIO:write_darray_multi_serial")))
+        return pio_err(ios, NULL, ierr, __FILE__, __LINE__);
+#endif /* TIMING */
+
+    return PIO_NOERR;
+}
+
+/**
+ * Read an array of data from a file using distributed arrays.
+ *
+ * @param file a pointer to the open file descriptor for the file
+ * that will be read from.
  * @param iodesc a pointer to the defined iodescriptor for the buffer.
  * @param vid the variable id to be read.
  * @param iobuf the buffer to be read into from this mpi task. May be
@@ -1350,48 +2332,216 @@ pio_read_darray_nc(file_desc_t *file, io_desc_t *iodesc, int vid, void *iobuf)
                     else
                         unlimdimoffset = gdim0;
 
-                    ierr = get_vard_mpidatatype(iodesc, gdim0, unlimdimoffset,
-                                                rrlen, ndims, fndims,
-                                                vdesc->record, startlist, countlist, &filetype);
-                    ierr = ncmpi_get_vard_all(file->fh, vid, filetype, iobuf, iodesc->llen, iodesc->mpitype);
-                    if(filetype != MPI_DATATYPE_NULL && (mpierr = MPI_Type_free(&filetype)))
-                        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+                    ierr = get_vard_mpidatatype(iodesc, gdim0, unlimdimoffset,
+                                                rrlen, ndims, fndims,
+                                                vdesc->record, startlist, countlist, &filetype);
+                    ierr = ncmpi_get_vard_all(file->fh, vid, filetype, iobuf, iodesc->llen, iodesc->mpitype);
+                    if(filetype != MPI_DATATYPE_NULL && (mpierr = MPI_Type_free(&filetype)))
+                        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+
+#else
+                    //printf("rllen %d mpitype %d\n",iodesc->rllen, iodesc->mpitype);
+                    /* Read a list of subarrays. */
+                    ierr = ncmpi_get_varn_all(file->fh, vid, rrlen, startlist,
+                                              countlist, iobuf, iodesc->rllen, iodesc->mpitype);
+#endif
+                    /* Release the start and count arrays. */
+                    for (int i = 0; i < rrlen; i++)
+                    {
+//                        PLOG((3,"startlist %d %d countlist %d %d",startlist[i][0],startlist[i][1],countlist[i][0],countlist[i][1]));
+                        free(startlist[i]);
+                        free(countlist[i]);
+                    }
+                }
+            }
+            break;
+#endif
+            default:
+                return pio_err(ios, file, PIO_EBADIOTYPE, __FILE__, __LINE__);
+            }
+
+            /* Check return code. */
+            if (ierr)
+                return check_netcdf(file, ierr, __FILE__,__LINE__);
+
+            /* Move to next region. */
+            if (region)
+                region = region->next;
+        } /* next regioncnt */
+    }
+
+#ifdef TIMING
+    if ((ierr = pio_stop_timer("PIO:read_darray_nc")))
+        return pio_err(ios, NULL, ierr, __FILE__, __LINE__);
+#endif /* TIMING */
+
+    return PIO_NOERR;
+}
+
+/**
+ * Read nvars variables with the same decomposition from a file into
+ * the IO buffer, in one pass over the file. With pnetcdf, the reads
+ * of all variables are posted with ncmpi_iget_varn(), and completed
+ * with a single ncmpi_wait_all(), so pnetcdf can combine them in one
+ * collective operation. With parallel netCDF-4, which has no
+ * nonblocking reads, the variables are read one after another with
+ * pio_read_darray_nc().
+ *
+ * The data of variable v goes to iobuf at an offset of v * llen
+ * elements.
+ *
+ * @param file a pointer to the open file descriptor for the file
+ * that will be read from.
+ * @param iodesc a pointer to the defined iodescriptor for the buffer.
+ * @param nvars the number of variables to be read.
+ * @param varids an array of nvars variable ids.
+ * @param iobuf the buffer to be read into from this mpi task. May be
+ * NULL if llen is 0.
+ * @return 0 on success, error code otherwise.
+ * @ingroup PIO_read_darray_c
+ * @author Jim Edwards
+ */
+int
+pio_read_darray_multi_nc(file_desc_t *file, io_desc_t *iodesc, int nvars,
+                         const int *varids, void *iobuf)
+{
+    iosystem_desc_t *ios;  /* Pointer to io system information. */
+    int ierr;              /* Return code from netCDF functions. */
+
+    /* Check inputs. */
+    pioassert(file && file->iosystem && iodesc && nvars > 0 && varids, "invalid input",
+              __FILE__, __LINE__);
+
+    ios = file->iosystem;
+    PLOG((3, "pio_read_darray_multi_nc nvars %d ios->ioproc %d", nvars, ios->ioproc));
+
+    if (file->iotype != PIO_IOTYPE_PNETCDF)
+    {
+        for (int v = 0; v < nvars; v++)
+            if ((ierr = pio_read_darray_nc(file, iodesc, varids[v], iobuf ?
+                                           (char *)iobuf + (size_t)v * iodesc->llen *
+                                           iodesc->mpitype_size : NULL)))
+                return ierr;
+        return PIO_NOERR;
+    }
+
+#ifdef _PNETCDF
+#ifdef TIMING
+    /* Start timer if desired. */
+    if ((ierr = pio_start_timer("PIO:read_darray_multi_nc")))
+        return pio_err(ios, NULL, ierr, __FILE__, __LINE__);
+#endif /* TIMING */
+
+    /* IO procs will read the data. */
+    if (ios->ioproc)
+    {
+        int maxdims = iodesc->ndims + 1; /* Largest ndims of a var in the file. */
+        int maxregions = iodesc->maxregions;
+        PIO_Offset *startcount;  /* Storage for all start/count arrays. */
+        PIO_Offset **lists;      /* Start and count lists for all vars. */
+        int request[nvars];      /* Requests from ncmpi_iget_varn(). */
+        int status[nvars];       /* Status of each request. */
+        int nreqs = 0;
+        int wait_ierr;           /* Return code of ncmpi_wait_all(). */
+
+        if (!(startcount = malloc(2 * (size_t)nvars * maxregions * maxdims * sizeof(PIO_Offset))))
+            return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
+        if (!(lists = malloc(2 * (size_t)nvars * maxregions * sizeof(PIO_Offset *))))
+        {
+            free(startcount);
+            return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
+        }
+
+        for (int v = 0; v < nvars; v++)
+        {
+            var_desc_t *vdesc;
+            io_region *region = iodesc->firstregion;
+            PIO_Offset **startlist = &lists[2 * (size_t)v * maxregions];
+            PIO_Offset **countlist = startlist + maxregions;
+            int fndims;
+            int rrlen = 0;
+
+            if ((ierr = get_var_desc(varids[v], &file->varlist, &vdesc)))
+                break;
+            fndims = vdesc->ndims;
+            pioassert(fndims <= maxdims, "unexpected ndims", __FILE__, __LINE__);
+
+            /* If the user did not call setframe, use a default frame
+             * of 0. This is required for backward compatibility. */
+            if (fndims > iodesc->ndims && vdesc->record < 0)
+                vdesc->record = 0;
+
+            /* Put together start/count arrays for the regions with
+             * data. */
+            for (int regioncnt = 0; regioncnt < maxregions && region && iodesc->llen > 0;
+                 regioncnt++, region = region->next)
+            {
+                PIO_Offset *start = &startcount[(2 * ((size_t)v * maxregions + rrlen)) * maxdims];
+                PIO_Offset *count = start + maxdims;
+                PIO_Offset size = 1;
 
-#else
-                    //printf("rllen %d mpitype %d\n",iodesc->rllen, iodesc->mpitype);
-                    /* Read a list of subarrays. */
-                    ierr = ncmpi_get_varn_all(file->fh, vid, rrlen, startlist,
-                                              countlist, iobuf, iodesc->rllen, iodesc->mpitype);
-#endif
-                    /* Release the start and count arrays. */
-                    for (int i = 0; i < rrlen; i++)
+                if (vdesc->record >= 0 && fndims > 1)
+                {
+                    /* This is a record var. Read one record. */
+                    start[0] = vdesc->record;
+                    for (int i = 1; i < fndims; i++)
                     {
-//                        PLOG((3,"startlist %d %d countlist %d %d",startlist[i][0],startlist[i][1],countlist[i][0],countlist[i][1]));
-                        free(startlist[i]);
-                        free(countlist[i]);
+                        start[i] = region->start[i - 1];
+                        count[i] = region->count[i - 1];
                     }
+                    count[0] = count[1] > 0 ? 1 : 0;
+                }
+                else
+                {
+                    for (int i = 0; i < fndims; i++)
+                    {
+                        start[i] = region->start[i];
+                        count[i] = region->count[i];
+                    }
+                }
+
+                for (int i = 0; i < fndims; i++)
+                    size *= count[i];
+                if (size > 0)
+                {
+                    startlist[rrlen] = start;
+                    countlist[rrlen] = count;
+                    rrlen++;
                 }
-            }
-            break;
-#endif
-            default:
-                return pio_err(ios, file, PIO_EBADIOTYPE, __FILE__, __LINE__);
             }
 
-            /* Check return code. */
-            if (ierr)
-                return check_netcdf(file, ierr, __FILE__,__LINE__);
+            /* Post the read of this variable. Tasks with no data
+             * post an empty read. */
+            if ((ierr = ncmpi_iget_varn(file->fh, varids[v], rrlen, startlist, countlist,
+                                        iobuf ? (char *)iobuf + (size_t)v * iodesc->llen *
+                                        iodesc->mpitype_size : NULL,
+                                        rrlen ? iodesc->rllen : 0, iodesc->mpitype,
+                                        &request[nreqs])))
+                break;
+            nreqs++;
+        }
 
-            /* Move to next region. */
-            if (region)
-                region = region->next;
-        } /* next regioncnt */
+        /* Complete all the reads at once. If a read could not be
+         * posted, the reads already posted are still completed, so
+         * that pnetcdf does not keep requests into iobuf, and the
+         * first error is returned. */
+        wait_ierr = ncmpi_wait_all(file->fh, nreqs, request, status);
+        if (!ierr)
+            ierr = wait_ierr;
+        for (int r = 0; !ierr && r < nreqs; r++)
+            ierr = status[r];
+
+        free(lists);
+        free(startcount);
+        if (ierr)
+            return check_netcdf(file, ierr, __FILE__, __LINE__);
     }
 
 #ifdef TIMING
-    if ((ierr = pio_stop_timer("PIO:read_darray_nc")))
+    if ((ierr = pio_stop_timer("PIO:read_darray_multi_nc")))
         return pio_err(ios, NULL, ierr, __FILE__, __LINE__);
 #endif /* TIMING */
+#endif /* _PNETCDF */
 
     return PIO_NOERR;
 }
@@ -1729,143 +2879,555 @@ flush_output_buffer(file_desc_t *file, bool force, PIO_Offset addsize)
     PIO_Offset usage = 0;
     int mpierr;  /* Return code from MPI functions. */
 
-    /* Check inputs. */
-    pioassert(file, "invalid input", __FILE__, __LINE__);
-    PLOG((1, "flush_output_buffer"));
-    /* Find out the buffer usage. */
-    if ((ierr = ncmpi_inq_buffer_usage(file->fh, &usage)))
-        /* allow the buffer to be undefined */
-        if (ierr != NC_ENULLABUF)
-            return pio_err(NULL, file, PIO_EBADID, __FILE__, __LINE__);
+    /* Check inputs. */
+    pioassert(file, "invalid input", __FILE__, __LINE__);
+    PLOG((1, "flush_output_buffer"));
+    /* Find out the buffer usage. */
+    if ((ierr = ncmpi_inq_buffer_usage(file->fh, &usage)))
+        /* allow the buffer to be undefined */
+        if (ierr != NC_ENULLABUF)
+            return pio_err(NULL, file, PIO_EBADID, __FILE__, __LINE__);
+
+    /* If we are not forcing a flush, spread the usage to all IO
+     * tasks. */
+    if (!force && file->iosystem->ioproc)
+    {
+        usage += addsize;
+        if ((mpierr = MPI_Allreduce(MPI_IN_PLACE, &usage, 1,  MPI_OFFSET,  MPI_MAX,
+                                    file->iosystem->io_comm)))
+            return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+    }
+
+    /* Keep track of the maximum usage. */
+    if (usage > maxusage)
+        maxusage = usage;
+
+    PLOG((2, "flush_output_buffer usage=%ld force=%d",usage, force));
+    /* If the user forces it, or the buffer has exceeded the size
+     * limit, then flush to disk. */
+    if (force || (usage >= pio_pnetcdf_buffer_size_limit))
+    {
+        int  maxreq;
+        maxreq = 0;
+
+        for (int i = 0; i < file->nvars; i++)
+        {
+            if ((ierr = get_var_desc(i, &file->varlist, &vdesc)))
+                return pio_err(NULL, file, ierr, __FILE__, __LINE__);
+            if (vdesc->nreqs > 0)
+                maxreq = i;
+        }
+        if (file->varlist)
+        {
+            for (int i = 0; i <= maxreq; i++)
+            {
+                if ((ierr = get_var_desc(i, &file->varlist, &vdesc)))
+                    return pio_err(NULL, file, ierr, __FILE__, __LINE__);
+
+                vdesc->nreqs = 0;
+
+#ifdef FLUSH_EVERY_VAR
+                ierr = ncmpi_wait_all(file->fh, NC_REQ_ALL, NULL, NULL);
+                //ierr = ncmpi_wait_all(file->fh, rcnt, request, status);
+                rcnt = 0;
+#endif
+            }
+        }
+        /* make sure all buffers are now clean */
+        ierr = ncmpi_wait_all(file->fh, NC_REQ_ALL, NULL, NULL);
+
+        /* Release resources. */
+        PLOG((3,"freeing variable buffer in flush_output_buffer"));
+        pio_free_iobuf(file);
+
+        for (int v = 0; v < file->nvars; v++)
+        {
+            if ((ierr = get_var_desc(v, &file->varlist, &vdesc)))
+                return pio_err(NULL, file, ierr, __FILE__, __LINE__);
+            pio_free_fillbuf(file, vdesc);
+        }
+    }
+
+#endif /* _PNETCDF */
+    return ierr;
+}
+
+/**
+ * Flush the buffer.
+ *
+ * @param ncid identifies the netCDF file.
+ * @param wmb pointer to the wmulti_buffer structure.
+ * @param flushtodisk if true, then flush data to disk.
+ * @returns 0 for success, error code otherwise.
+ * @ingroup PIO_write_darray_c
+ * @author Jim Edwards, Ed Hartnett
+ */
+int
+flush_buffer(int ncid, wmulti_buffer *wmb, bool flushtodisk)
+{
+    file_desc_t *file;
+    int ret;
+
+    /* Check input. */
+    pioassert(wmb, "invalid input", __FILE__, __LINE__);
+
+    /* Get the file info (to get error handler). */
+    if ((ret = pio_get_file(ncid, &file)))
+        return pio_err(NULL, NULL, ret, __FILE__, __LINE__);
+
+    PLOG((1, "flush_buffer ncid = %d flushtodisk = %d", ncid, flushtodisk));
+
+    /* If there are any variables in this buffer... */
+    if (wmb->num_arrays > 0)
+    {
+        /* Write any data in the buffer. The data of all arrays is
+         * contiguous, so it is passed without a copy. */
+        ret = PIOc_write_darray_multi(ncid, wmb->vid,  wmb->ioid, wmb->num_arrays,
+                                      wmb->arraylen, wmb->data,
+                                      wmb->use_frame ? wmb->frame : NULL,
+                                      wmb->use_fill ? wmb->fillvalue : NULL, flushtodisk);
+        PLOG((2, "return from PIOc_write_darray_multi ret = %d", ret));
+
+        /* Empty the buffer. Its memory is kept for the next writes. */
+        wmb->num_arrays = 0;
+        wmb->use_frame = 0;
+        wmb->use_fill = 0;
+
+        if (ret)
+            return pio_err(NULL, file, ret, __FILE__, __LINE__);
+    }
+
+    return PIO_NOERR;
+}
+
+/**
+ * Grow a buffer of a write multi-buffer to hold at least size
+ * bytes. The buffer at least doubles, unless that fails, when it is
+ * grown to exactly size bytes.
+ *
+ * @param bufp pointer to the buffer.
+ * @param capacityp pointer to the size of the buffer in bytes.
+ * @param size the number of bytes needed.
+ * @returns 0 for success, PIO_ENOMEM if out of memory, in which case
+ * the buffer is unchanged.
+ * @author Jim Edwards
+ */
+static int
+wmb_grow(void **bufp, size_t *capacityp, size_t size)
+{
+    void *buf;
+
+    if (size <= *capacityp)
+        return PIO_NOERR;
+
+    if (size < 2 * *capacityp && (buf = realloc(*bufp, 2 * *capacityp)))
+    {
+        *capacityp *= 2;
+    }
+    else
+    {
+        if (!(buf = realloc(*bufp, size)))
+            return PIO_ENOMEM;
+        *capacityp = size;
+    }
+    *bufp = buf;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Make room in a write multi-buffer for one more array. The buffers
+ * are not freed when the multi-buffer is flushed, so once they have
+ * grown to the size needed by a set of writes, repeating those
+ * writes does not allocate memory.
+ *
+ * @param wmb pointer to the write multi-buffer.
+ * @param array_size size in bytes of the data of one array.
+ * @param fill_size size in bytes of the fill value of one array, 0
+ * if no fill value is needed.
+ * @returns 0 for success, PIO_ENOMEM if out of memory. The buffers
+ * stay valid, so the multi-buffer can still be flushed.
+ * @author Jim Edwards
+ */
+int
+pio_wmb_reserve(wmulti_buffer *wmb, size_t array_size, size_t fill_size)
+{
+    size_t narrays;
+    int ret;
+
+    pioassert(wmb, "invalid input", __FILE__, __LINE__);
+    narrays = wmb->num_arrays + 1;
+
+    if (narrays > wmb->capacity)
+    {
+        size_t capacity = wmb->capacity * sizeof(int);
+        size_t frame_capacity = capacity;
+
+        if ((ret = wmb_grow((void **)&wmb->vid, &capacity, narrays * sizeof(int))))
+            return ret;
+        if ((ret = wmb_grow((void **)&wmb->frame, &frame_capacity, capacity)))
+            return ret;
+        wmb->capacity = capacity / sizeof(int);
+    }
+
+    if ((ret = wmb_grow(&wmb->data, &wmb->data_capacity, narrays * array_size)))
+        return ret;
+
+    if (fill_size)
+        if ((ret = wmb_grow(&wmb->fillvalue, &wmb->fill_capacity, narrays * fill_size)))
+            return ret;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Get the number of bytes of memory held by a write multi-buffer.
+ *
+ * @param wmb pointer to the write multi-buffer.
+ * @returns the size in bytes of its buffers.
+ * @author Jim Edwards
+ */
+PIO_Offset
+pio_wmb_bytes(const wmulti_buffer *wmb)
+{
+    return (PIO_Offset)wmb->capacity * 2 * sizeof(int) + wmb->data_capacity +
+        wmb->fill_capacity;
+}
+
+/**
+ * Free the buffers of an empty write multi-buffer. The multi-buffer
+ * stays valid, and its buffers are allocated again by
+ * pio_wmb_reserve() when it is used.
+ *
+ * @param wmb pointer to the write multi-buffer.
+ * @author Jim Edwards
+ */
+void
+pio_wmb_release(wmulti_buffer *wmb)
+{
+    pioassert(wmb && !wmb->num_arrays, "invalid input", __FILE__, __LINE__);
+
+    free(wmb->vid);
+    free(wmb->frame);
+    free(wmb->data);
+    free(wmb->fillvalue);
+    wmb->vid = NULL;
+    wmb->frame = NULL;
+    wmb->data = NULL;
+    wmb->fillvalue = NULL;
+    wmb->capacity = 0;
+    wmb->data_capacity = 0;
+    wmb->fill_capacity = 0;
+}
+
+/**
+ * Free a write multi-buffer and its buffers.
+ *
+ * @param wmb pointer to the write multi-buffer.
+ * @author Jim Edwards
+ */
+void
+pio_wmb_free(wmulti_buffer *wmb)
+{
+    free(wmb->vid);
+    free(wmb->frame);
+    free(wmb->data);
+    free(wmb->fillvalue);
+    free(wmb);
+}
+
+/**
+ * Account for buffer memory allocated or freed for the files of an
+ * IO system, and keep track of the largest usage.
+ *
+ * @param ios pointer to the IO system info.
+ * @param bytes number of bytes allocated, negative if freed.
+ * @author Jim Edwards
+ */
+void
+pio_mem_add(iosystem_desc_t *ios, PIO_Offset bytes)
+{
+    pioassert(ios, "invalid input", __FILE__, __LINE__);
+
+    ios->mem_usage += bytes;
+    if (ios->mem_usage > ios->mem_highwater)
+        ios->mem_highwater = ios->mem_usage;
+}
+
+/**
+ * Free the IO buffer of a file, if there is one.
+ *
+ * @param file pointer to the file info.
+ * @author Jim Edwards
+ */
+void
+pio_free_iobuf(file_desc_t *file)
+{
+    if (file->iobuf)
+    {
+        pio_mem_add(file->iosystem, -file->iobuf_bytes);
+        pio_iobuf_free(file->iosystem, file->iobuf, file->iobuf_bytes);
+        file->iobuf = NULL;
+        file->iobuf_bytes = 0;
+    }
+}
+
+/**
+ * Free the holegrid fill buffer of a variable, if there is one.
+ *
+ * @param file pointer to the file info.
+ * @param vdesc pointer to the variable info.
+ * @author Jim Edwards
+ */
+void
+pio_free_fillbuf(file_desc_t *file, var_desc_t *vdesc)
+{
+    if (vdesc->fillbuf)
+    {
+        pio_mem_add(file->iosystem, -vdesc->fillbuf_bytes);
+        pio_iobuf_free(file->iosystem, vdesc->fillbuf, vdesc->fillbuf_bytes);
+        vdesc->fillbuf = NULL;
+        vdesc->fillbuf_bytes = 0;
+    }
+}
+
+/**
+ * Fill a buffer with copies of one value.
+ *
+ * Values of 1, 2, 4 and 8 bytes are copied as integers of that size,
+ * in loops the compiler can vectorize. Other sizes are filled by
+ * copying the part of the buffer already filled, doubling it each
+ * time.
+ *
+ * @param buf pointer to the buffer, which must hold nelems values.
+ * @param fillvalue pointer to the value.
+ * @param nelems number of values to fill.
+ * @param size size of the value in bytes.
+ * @author Jim Edwards
+ */
+void
+pio_fill_buffer(void *buf, const void *fillvalue, PIO_Offset nelems, int size)
+{
+    pioassert(size > 0 && (buf || !nelems) && fillvalue, "invalid input",
+              __FILE__, __LINE__);
+
+    if (nelems <= 0)
+        return;
 
-    /* If we are not forcing a flush, spread the usage to all IO
-     * tasks. */
-    if (!force && file->iosystem->ioproc)
+    switch (size)
     {
-        usage += addsize;
-        if ((mpierr = MPI_Allreduce(MPI_IN_PLACE, &usage, 1,  MPI_OFFSET,  MPI_MAX,
-                                    file->iosystem->io_comm)))
-            return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+    case 1:
+        memset(buf, *(const unsigned char *)fillvalue, nelems);
+        break;
+    case 2:
+    {
+        uint16_t v, *p = buf;
+
+        memcpy(&v, fillvalue, sizeof(v));
+        for (PIO_Offset i = 0; i < nelems; i++)
+            p[i] = v;
+        break;
     }
+    case 4:
+    {
+        uint32_t v, *p = buf;
 
-    /* Keep track of the maximum usage. */
-    if (usage > maxusage)
-        maxusage = usage;
+        memcpy(&v, fillvalue, sizeof(v));
+        for (PIO_Offset i = 0; i < nelems; i++)
+            p[i] = v;
+        break;
+    }
+    case 8:
+    {
+        uint64_t v, *p = buf;
 
-    PLOG((2, "flush_output_buffer usage=%ld force=%d",usage, force));
-    /* If the user forces it, or the buffer has exceeded the size
-     * limit, then flush to disk. */
-    if (force || (usage >= pio_pnetcdf_buffer_size_limit))
+        memcpy(&v, fillvalue, sizeof(v));
+        for (PIO_Offset i = 0; i < nelems; i++)
+            p[i] = v;
+        break;
+    }
+    default:
     {
-        int  maxreq;
-        maxreq = 0;
+        PIO_Offset total = nelems * size;
+        PIO_Offset done = size;
 
-        for (int i = 0; i < file->nvars; i++)
-        {
-            if ((ierr = get_var_desc(i, &file->varlist, &vdesc)))
-                return pio_err(NULL, file, ierr, __FILE__, __LINE__);
-            if (vdesc->nreqs > 0)
-                maxreq = i;
-        }
-        if (file->varlist)
+        memcpy(buf, fillvalue, size);
+        while (done < total)
         {
-            for (int i = 0; i <= maxreq; i++)
-            {
-                if ((ierr = get_var_desc(i, &file->varlist, &vdesc)))
-                    return pio_err(NULL, file, ierr, __FILE__, __LINE__);
+            PIO_Offset n = done < total - done ? done : total - done;
 
-                vdesc->nreqs = 0;
-
-#ifdef FLUSH_EVERY_VAR
-                ierr = ncmpi_wait_all(file->fh, NC_REQ_ALL, NULL, NULL);
-                //ierr = ncmpi_wait_all(file->fh, rcnt, request, status);
-                rcnt = 0;
-#endif
-            }
+            memcpy((char *)buf + done, buf, n);
+            done += n;
         }
-        /* make sure all buffers are now clean */
-        ierr = ncmpi_wait_all(file->fh, NC_REQ_ALL, NULL, NULL);
+    }
+    }
+}
 
-        /* Release resources. */
-        if (file->iobuf)
-        {
-            PLOG((3,"freeing variable buffer in flush_output_buffer"));
-            free(file->iobuf);
-            file->iobuf = NULL;
-        }
+/** Number of map elements reordered for all variables before moving
+ * on, so that this part of remap stays in cache. */
+#define PIO_REMAP_BLOCK 4096
+
+/** Maps shorter than this are reordered without OpenMP threads. */
+#define PIO_REMAP_OMP_MIN 65536
+
+/* Vector loops of the 4 and 8 byte kernels. Each handles whole
+ * vectors from m up to m1, and leaves m at the first element left
+ * for the scalar loop. The remap of a decomposition is a
+ * permutation, so the scatters have no conflicts. */
+#if defined(__AVX512F__)
+#define PIO_GATHER_VEC4(s, d, remap, m, m1)                             \
+    for (; m + 16 <= m1; m += 16)                                       \
+        _mm512_storeu_si512(&d[m], _mm512_i32gather_epi32(_mm512_loadu_si512(&remap[m]), s, 4))
+#define PIO_GATHER_VEC8(s, d, remap, m, m1)                             \
+    for (; m + 8 <= m1; m += 8)                                         \
+        _mm512_storeu_si512(&d[m], _mm512_i32gather_epi64(              \
+                                _mm256_loadu_si256((const __m256i *)&remap[m]), s, 8))
+#define PIO_SCATTER_VEC4(s, d, remap, m, m1)                            \
+    for (; m + 16 <= m1; m += 16)                                       \
+        _mm512_i32scatter_epi32(d, _mm512_loadu_si512(&remap[m]), _mm512_loadu_si512(&s[m]), 4)
+#define PIO_SCATTER_VEC8(s, d, remap, m, m1)                            \
+    for (; m + 8 <= m1; m += 8)                                         \
+        _mm512_i32scatter_epi64(d, _mm256_loadu_si256((const __m256i *)&remap[m]), \
+                                _mm512_loadu_si512(&s[m]), 8)
+#elif defined(__AVX2__)
+#define PIO_GATHER_VEC4(s, d, remap, m, m1)                             \
+    for (; m + 8 <= m1; m += 8)                                         \
+        _mm256_storeu_si256((__m256i *)&d[m], _mm256_i32gather_epi32(   \
+                                (const int *)s, _mm256_loadu_si256((const __m256i *)&remap[m]), 4))
+#define PIO_GATHER_VEC8(s, d, remap, m, m1)                             \
+    for (; m + 4 <= m1; m += 4)                                         \
+        _mm256_storeu_si256((__m256i *)&d[m], _mm256_i32gather_epi64(   \
+                                (const long long *)s, _mm_loadu_si128((const __m128i *)&remap[m]), 8))
+#endif
+#ifndef PIO_GATHER_VEC4
+#define PIO_GATHER_VEC4(s, d, remap, m, m1)
+#define PIO_GATHER_VEC8(s, d, remap, m, m1)
+#endif
+#ifndef PIO_SCATTER_VEC4
+#define PIO_SCATTER_VEC4(s, d, remap, m, m1)
+#define PIO_SCATTER_VEC8(s, d, remap, m, m1)
+#endif
+#define PIO_GATHER_VEC1(s, d, remap, m, m1)
+#define PIO_GATHER_VEC2(s, d, remap, m, m1)
+#define PIO_SCATTER_VEC1(s, d, remap, m, m1)
+#define PIO_SCATTER_VEC2(s, d, remap, m, m1)
 
-        for (int v = 0; v < file->nvars; v++)
-        {
-            if ((ierr = get_var_desc(v, &file->varlist, &vdesc)))
-                return pio_err(NULL, file, ierr, __FILE__, __LINE__);
-            if (vdesc->fillbuf)
-            {
-                free(vdesc->fillbuf);
-                vdesc->fillbuf = NULL;
-            }
-        }
+/**
+ * Define the gather and scatter kernels for values of SIZE bytes,
+ * which are copied as TYPE. The map is done in blocks of
+ * PIO_REMAP_BLOCK elements, for all variables in turn. With OpenMP,
+ * the blocks of long maps are shared among the threads.
+ *
+ * remap_gatherSIZE() sets sorted[m] = array[remap[m]], and
+ * remap_scatterSIZE() sets sorted[remap[m]] = array[m], for each
+ * variable.
+ */
+#define PIO_REMAP_KERNELS(SIZE, TYPE)                                   \
+    static void                                                         \
+    remap_gather##SIZE(const void *array, void *sorted, const int *remap, int maplen, int nvars) \
+    {                                                                   \
+        int nblocks = (maplen + PIO_REMAP_BLOCK - 1) / PIO_REMAP_BLOCK; \
+                                                                        \
+        PIO_REMAP_OMP_FOR                                               \
+        for (int b = 0; b < nblocks; b++)                               \
+        {                                                               \
+            int m1 = (b + 1) * PIO_REMAP_BLOCK < maplen ? (b + 1) * PIO_REMAP_BLOCK : maplen; \
+                                                                        \
+            for (int v = 0; v < nvars; v++)                             \
+            {                                                           \
+                const TYPE *s = (const TYPE *)array + (size_t)maplen * v; \
+                TYPE *d = (TYPE *)sorted + (size_t)maplen * v;          \
+                int m = b * PIO_REMAP_BLOCK;                            \
+                                                                        \
+                PIO_GATHER_VEC##SIZE(s, d, remap, m, m1);               \
+                for (; m < m1; m++)                                     \
+                    d[m] = s[remap[m]];                                 \
+            }                                                           \
+        }                                                               \
+    }                                                                   \
+                                                                        \
+    static void                                                         \
+    remap_scatter##SIZE(const void *array, void *sorted, const int *remap, int maplen, int nvars) \
+    {                                                                   \
+        int nblocks = (maplen + PIO_REMAP_BLOCK - 1) / PIO_REMAP_BLOCK; \
+                                                                        \
+        PIO_REMAP_OMP_FOR                                               \
+        for (int b = 0; b < nblocks; b++)                               \
+        {                                                               \
+            int m1 = (b + 1) * PIO_REMAP_BLOCK < maplen ? (b + 1) * PIO_REMAP_BLOCK : maplen; \
+                                                                        \
+            for (int v = 0; v < nvars; v++)                             \
+            {                                                           \
+                const TYPE *s = (const TYPE *)array + (size_t)maplen * v; \
+                TYPE *d = (TYPE *)sorted + (size_t)maplen * v;          \
+                int m = b * PIO_REMAP_BLOCK;                            \
+                                                                        \
+                PIO_SCATTER_VEC##SIZE(s, d, remap, m, m1);              \
+                for (; m < m1; m++)                                     \
+                    d[remap[m]] = s[m];                                 \
+            }                                                           \
+        }                                                               \
     }
 
-#endif /* _PNETCDF */
-    return ierr;
-}
+#ifdef _OPENMP
+#define PIO_REMAP_OMP_FOR _Pragma("omp parallel for schedule(static) if (maplen >= PIO_REMAP_OMP_MIN)")
+#else
+#define PIO_REMAP_OMP_FOR
+#endif
+
+PIO_REMAP_KERNELS(1, uint8_t)
+PIO_REMAP_KERNELS(2, uint16_t)
+PIO_REMAP_KERNELS(4, uint32_t)
+PIO_REMAP_KERNELS(8, uint64_t)
 
 /**
- * Flush the buffer.
+ * Copy nvars arrays of maplen elements with an index map, using the
+ * kernel for the size of the elements. Elements of other sizes are
+ * copied with memcpy().
  *
- * @param ncid identifies the netCDF file.
- * @param wmb pointer to the wmulti_buffer structure.
- * @param flushtodisk if true, then flush data to disk.
+ * @param array pointer to the source arrays.
+ * @param sortedarray pointer that gets the copied arrays.
+ * @param remap the index map, of length maplen.
+ * @param maplen the number of elements in each array.
+ * @param nvars number of arrays.
+ * @param size size of an element in bytes.
+ * @param direction 0 to gather (sortedarray[m] = array[remap[m]]),
+ * 1 to scatter (sortedarray[remap[m]] = array[m]).
  * @returns 0 for success, error code otherwise.
- * @ingroup PIO_write_darray_c
- * @author Jim Edwards, Ed Hartnett
+ * @author Jim Edwards
  */
 int
-flush_buffer(int ncid, wmulti_buffer *wmb, bool flushtodisk)
+pio_remap_copy(const void *array, void *sortedarray, const int *remap, int maplen,
+               int nvars, int size, int direction)
 {
-    file_desc_t *file;
-    int ret;
-
-    /* Check input. */
-    pioassert(wmb, "invalid input", __FILE__, __LINE__);
-
-    /* Get the file info (to get error handler). */
-    if ((ret = pio_get_file(ncid, &file)))
-        return pio_err(NULL, NULL, ret, __FILE__, __LINE__);
-
-    PLOG((1, "flush_buffer ncid = %d flushtodisk = %d", ncid, flushtodisk));
-
-    /* If there are any variables in this buffer... */
-    if (wmb->num_arrays > 0)
+    switch (size)
     {
-        /* Write any data in the buffer. */
-        ret = PIOc_write_darray_multi(ncid, wmb->vid,  wmb->ioid, wmb->num_arrays,
-                                      wmb->arraylen, wmb->data, wmb->frame,
-                                      wmb->fillvalue, flushtodisk);
-        PLOG((2, "return from PIOc_write_darray_multi ret = %d", ret));
-
-        wmb->num_arrays = 0;
-
-        /* Release the list of variable IDs. */
-        free(wmb->vid);
-        wmb->vid = NULL;
-
-        /* Release the data memory. */
-        free(wmb->data);
-        wmb->data = NULL;
-
-        /* If there is a fill value, release it. */
-        if (wmb->fillvalue)
-            free(wmb->fillvalue);
-        wmb->fillvalue = NULL;
-
-        /* Release the record number. */
-        if (wmb->frame)
-            free(wmb->frame);
-        wmb->frame = NULL;
+    case 1:
+        (direction ? remap_scatter1 : remap_gather1)(array, sortedarray, remap, maplen, nvars);
+        break;
+    case 2:
+        (direction ? remap_scatter2 : remap_gather2)(array, sortedarray, remap, maplen, nvars);
+        break;
+    case 4:
+        (direction ? remap_scatter4 : remap_gather4)(array, sortedarray, remap, maplen, nvars);
+        break;
+    case 8:
+        (direction ? remap_scatter8 : remap_gather8)(array, sortedarray, remap, maplen, nvars);
+        break;
+    default:
+        if (size <= 0)
+            return pio_err(NULL, NULL, PIO_EBADTYPE, __FILE__, __LINE__);
+        for (int v = 0; v < nvars; v++)
+        {
+            const char *s = (const char *)array + (size_t)size * maplen * v;
+            char *d = (char *)sortedarray + (size_t)size * maplen * v;
 
-        if (ret)
-            return pio_err(NULL, file, ret, __FILE__, __LINE__);
+            for (int m = 0; m < maplen; m++)
+                if (direction)
+                    memcpy(d + (size_t)size * remap[m], s + (size_t)size * m, size);
+                else
+                    memcpy(d + (size_t)size * m, s + (size_t)size * remap[m], size);
+        }
     }
 
     return PIO_NOERR;
@@ -1874,11 +3436,16 @@ flush_buffer(int ncid, wmulti_buffer *wmb, bool flushtodisk)
 /**
  * Sort the contents of an array.
  *
+ * Only the size of the data type matters, so the data is copied by
+ * the kernel for that size. See pio_remap_copy().
+ *
  * @param array pointer to the array
  * @param sortedarray pointer that gets the sorted array.
  * @param iodesc pointer to the iodesc.
  * @param nvars number of variables.
- * @param direction sort direction.
+ * @param direction sort direction: 0 to gather the data in the order
+ * of the sorted map, 1 to scatter it back to the order of the
+ * original map.
  * @returns 0 for success, error code otherwise.
  * @ingroup PIO_write_darray_c
  * @author Jim Edwards
@@ -1887,242 +3454,36 @@ int
 pio_sorted_copy(const void *array, void *sortedarray, io_desc_t *iodesc,
                 int nvars, int direction)
 {
-    int maplen = iodesc->maplen;
+    return pio_remap_copy(array, sortedarray, iodesc->remap, iodesc->maplen, nvars,
+                          iodesc->piotype_size, direction);
+}
 
-    if (direction == 0){
-        switch (iodesc->piotype)
-        {
-        case PIO_BYTE:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((signed char *)sortedarray)[m+maplen*v] = ((signed char *)array)[iodesc->remap[m]+maplen*v];
-                }
-            }
-            break;
-        case PIO_CHAR:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((char *)sortedarray)[m+maplen*v] = ((char *)array)[iodesc->remap[m]+maplen*v];
-                }
-            }
-            break;
-        case PIO_SHORT:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((short *)sortedarray)[m+maplen*v] = ((short *)array)[iodesc->remap[m]+maplen*v];
-                }
-            }
+/**
+ * Get the sort buffer of a decomposition, which holds data in the
+ * order of the sorted map. The buffer is kept with the decomposition,
+ * and only reallocated when it is too small. It is freed with the
+ * decomposition.
+ *
+ * @param iodesc pointer to the iodesc.
+ * @param bytes the number of bytes needed.
+ * @returns pointer to the buffer, or NULL if out of memory.
+ * @author Jim Edwards
+ */
+void *
+pio_get_sortbuf(io_desc_t *iodesc, size_t bytes)
+{
+    pioassert(iodesc, "invalid input", __FILE__, __LINE__);
 
-            break;
-        case PIO_INT:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((int *)sortedarray)[m+maplen*v] = ((int *)array)[iodesc->remap[m]+maplen*v];
-                }
-            }
-            break;
-        case PIO_FLOAT:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((float *)sortedarray)[m+maplen*v] = ((float *)array)[iodesc->remap[m]+maplen*v];
-                }
-            }
-            break;
-        case PIO_DOUBLE:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((double *)sortedarray)[m+maplen*v] = ((double *)array)[iodesc->remap[m]+maplen*v];
-                }
-            }
-            break;
-        case PIO_UBYTE:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((unsigned char *)sortedarray)[m+maplen*v] = ((unsigned char *)array)[iodesc->remap[m]+maplen*v];
-                }
-            }
-            break;
-        case PIO_USHORT:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((unsigned short *)sortedarray)[m+maplen*v] = ((unsigned short *)array)[iodesc->remap[m]+maplen*v];
-                }
-            }
-            break;
-        case PIO_UINT:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((unsigned int *)sortedarray)[m+maplen*v] = ((unsigned int *)array)[iodesc->remap[m]+maplen*v];
-                }
-            }
-            break;
-        case PIO_INT64:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((long long *)sortedarray)[m+maplen*v] = ((long long *)array)[iodesc->remap[m]+maplen*v];
-                }
-            }
-            break;
-        case PIO_UINT64:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((unsigned long long *)sortedarray)[m+maplen*v] = ((unsigned long long *)array)[iodesc->remap[m]+maplen*v];
-                }
-            }
-            break;
-        case PIO_STRING:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((char **)sortedarray)[m+maplen*v] = ((char **)array)[iodesc->remap[m]+maplen*v];
-                }
-            }
-            break;
-        default:
-            return pio_err(NULL, NULL, PIO_EBADTYPE, __FILE__, __LINE__);
-        }
-    }
-    else
+    if (bytes > iodesc->sortbuf_bytes)
     {
-        switch (iodesc->piotype)
-        {
-        case PIO_BYTE:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((signed char *)sortedarray)[iodesc->remap[m]+maplen*v] = ((signed char *)array)[m+maplen*v];
-                }
-            }
-            break;
-        case PIO_CHAR:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((char *)sortedarray)[iodesc->remap[m]+maplen*v] = ((char *)array)[m+maplen*v];
-                }
-            }
-            break;
-        case PIO_SHORT:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((short *)sortedarray)[iodesc->remap[m]+maplen*v] = ((short *)array)[m+maplen*v];
-                }
-            }
-
-            break;
-        case PIO_INT:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((int *)sortedarray)[iodesc->remap[m]+maplen*v] = ((int *)array)[m+maplen*v];
-                }
-            }
-            break;
-        case PIO_FLOAT:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((float *)sortedarray)[iodesc->remap[m]+maplen*v] = ((float *)array)[m+maplen*v];
-                }
-            }
-            break;
-        case PIO_DOUBLE:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((double *)sortedarray)[iodesc->remap[m]+maplen*v] = ((double *)array)[m+maplen*v];
-                }
-            }
-            break;
-        case PIO_UBYTE:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((unsigned char *)sortedarray)[iodesc->remap[m]+maplen*v] = ((unsigned char *)array)[m+maplen*v];
-                }
-            }
-            break;
-        case PIO_USHORT:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((unsigned short *)sortedarray)[iodesc->remap[m]+maplen*v] = ((unsigned short *)array)[m+maplen*v];
-                }
-            }
-            break;
-        case PIO_UINT:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((unsigned int *)sortedarray)[iodesc->remap[m]+maplen*v] = ((unsigned int *)array)[m+maplen*v];
-                }
-            }
-            break;
-        case PIO_INT64:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((long long *)sortedarray)[iodesc->remap[m]+maplen*v] = ((long long *)array)[m+maplen*v];
-                }
-            }
-            break;
-        case PIO_UINT64:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((unsigned long long *)sortedarray)[iodesc->remap[m]+maplen*v] = ((unsigned long long *)array)[m+maplen*v];
-                }
-            }
-            break;
-        case PIO_STRING:
-            for (int v=0; v < nvars; v++)
-            {
-                for (int m=0; m < maplen; m++)
-                {
-                    ((char **)sortedarray)[iodesc->remap[m]+maplen*v] = ((char **)array)[m+maplen*v];
-                }
-            }
-            break;
-        default:
-            return pio_err(NULL, NULL, PIO_EBADTYPE, __FILE__, __LINE__);
-        }
+        free(iodesc->sortbuf);
+        iodesc->sortbuf_bytes = 0;
+        if (!(iodesc->sortbuf = malloc(bytes)))
+            return NULL;
+        iodesc->sortbuf_bytes = bytes;
     }
-    return PIO_NOERR;
+
+    return iodesc->sortbuf;
 }
 
 /**
@@ -2140,6 +3501,7 @@ compute_maxaggregate_bytes(iosystem_desc_t *ios, io_desc_t *iodesc)
     int maxbytesoniotask = INT_MAX;
     int maxbytesoncomputetask = INT_MAX;
     int maxbytes;
+    PIO_Offset limits[2]; /* Negative of maxbytes, and maxiobuflen. */
     int mpierr;  /* Return code from MPI functions. */
 
     /* Check inputs. */
@@ -2161,15 +3523,23 @@ compute_maxaggregate_bytes(iosystem_desc_t *ios, io_desc_t *iodesc)
     PLOG((2, "compute_maxaggregate_bytes maxbytesoniotask = %d maxbytesoncomputetask = %d",
           maxbytesoniotask, maxbytesoncomputetask));
 
-    /* Get the min value of this on all tasks. */
+    /* Get the min value of this on all tasks. In the same call, share
+     * maxiobuflen (known only on the IO tasks) with the computation
+     * tasks, so that they can decide when to flush without
+     * communicating. The min of maxbytes is the max of its
+     * negative. */
     PLOG((3, "before allreaduce maxbytes = %d", maxbytes));
-    if ((mpierr = MPI_Allreduce(MPI_IN_PLACE, &maxbytes, 1, MPI_INT, MPI_MIN,
+    limits[0] = -(PIO_Offset)maxbytes;
+    limits[1] = ios->ioproc ? iodesc->maxiobuflen : 0;
+    if ((mpierr = MPI_Allreduce(MPI_IN_PLACE, limits, 2, MPI_OFFSET, MPI_MAX,
                                 ios->union_comm)))
         return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
-    PLOG((3, "after allreaduce maxbytes = %d", maxbytes));
+    maxbytes = -limits[0];
+    PLOG((3, "after allreaduce maxbytes = %d maxiobuflen = %lld", maxbytes, limits[1]));
 
     /* Remember the result. */
     iodesc->maxbytes = maxbytes;
+    iodesc->maxiobuflen = limits[1];
 
     return PIO_NOERR;
 }
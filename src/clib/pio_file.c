@@ -234,6 +234,11 @@ PIOc_closefile(int ncid)
     if (!ios->async || !ios->ioproc)
         if (file->writable)
             PIOc_sync(ncid);
+    PLOG((1, "PIOc_closefile num_collective_writes = %lld", file->num_collective_writes));
+
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
 
     /* If async is in use and this is a comp tasks, then the compmain
      * sends a msg to the pio_msg_handler running on the IO main and
@@ -271,14 +276,25 @@ PIOc_closefile(int ncid)
         case PIO_IOTYPE_NETCDF4C:
 #endif
         case PIO_IOTYPE_NETCDF:
+            /* Close the netCDF file even if the MPI-IO handle could
+             * not be closed, and keep the first error. */
+            if (file->multiwriter)
+                ierr = multiwriter_close(file);
             if (ios->io_rank == 0)
-                ierr = nc_close(file->fh);
+            {
+                int ret = nc_close(file->fh);
+
+                if (!ierr)
+                    ierr = ret;
+            }
             break;
 #ifdef _PNETCDF
         case PIO_IOTYPE_PNETCDF:
             if (file->writable){
                 ierr = ncmpi_wait_all(file->fh, NC_REQ_ALL, NULL, NULL);
                 ierr = ncmpi_buffer_detach(file->fh);
+                pio_mem_add(ios, -file->attached_bytes);
+                file->attached_bytes = 0;
             }
             ierr = ncmpi_close(file->fh);
             break;
@@ -295,11 +311,17 @@ PIOc_closefile(int ncid)
         }
     }
 
-    /* Broadcast and check the return code. */
+    /* Broadcast and check the return code. The file is closed
+     * either way, so it is deleted from the list before an error is
+     * returned. */
     if ((mpierr = MPI_Bcast(&ierr, 1, MPI_INT, ios->ioroot, ios->my_comm)))
         return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
     if (ierr)
-        return check_netcdf(file, ierr, __FILE__, __LINE__);
+    {
+        ierr = check_netcdf(file, ierr, __FILE__, __LINE__);
+        pio_delete_file_from_list(ncid);
+        return ierr;
+    }
 
     /* Delete file from our list of open files. */
     if ((ierr = pio_delete_file_from_list(ncid)))
@@ -420,21 +442,27 @@ PIOc_sync(int ncid)
         {
             wmulti_buffer *wmb, *twmb;
 
+            /* Complete the writes started with PIOc_iwrite_darray(). */
+            if ((ierr = pio_wait_file_requests(ncid)))
+                return pio_err(ios, file, ierr, __FILE__, __LINE__);
+
             PLOG((3, "PIOc_sync checking buffers"));
             HASH_ITER(hh, file->buffer, wmb, twmb)
             {
                 /* If there are any data arrays waiting in the
-                 * multibuffer, flush it. */
+                 * multibuffer, flush it. The multibuffers are kept
+                 * for later writes, and freed when the file is
+                 * closed. */
                 if (wmb->num_arrays > 0)
                     flush_buffer(ncid, wmb, true);
-                HASH_DEL(file->buffer, wmb);
-                free(wmb);
-
             }
-            file->buffer = NULL;
         }
     }
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, send message to IO main tasks. */
     if (ios->async)
     {
@@ -470,6 +498,9 @@ PIOc_sync(int ncid)
             case PIO_IOTYPE_NETCDF4C:
 #endif
             case PIO_IOTYPE_NETCDF:
+                if (file->multiwriter)
+                    if ((mpierr = MPI_File_sync(file->mw_fh)))
+                        return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
                 if (ios->io_rank == 0)
                     ierr = nc_sync(file->fh);
                 break;
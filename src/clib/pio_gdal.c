@@ -945,20 +945,19 @@ GDALc_def_field(int ncid, const char *name, nc_type xtype, int ndims, int *varid
         {
             int msg = PIO_MSG_DEF_VAR;
             int namelen = strlen(name);
+            pio_msgbuf mb; /* The packed parameters. */
 
-            if (ios->compmain == MPI_ROOT)
-                mpierr = MPI_Send(&msg, 1, MPI_INT, ios->ioroot, 1, ios->union_comm);
-
-            if (!mpierr)
-                mpierr = MPI_Bcast(&(ncid), 1, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&namelen, 1, MPI_INT,  ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast((void *)name, namelen + 1, MPI_CHAR, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&xtype, 1, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&ndims, 1, MPI_INT, ios->compmain, ios->intercomm);
+            /* Fields have no dimids to send. */
+            if (!(mpierr = pio_msgbuf_start(ios, &mb, msg)))
+            {
+                pio_msgbuf_put(&mb, &ncid, sizeof(int));
+                pio_msgbuf_put(&mb, &namelen, sizeof(int));
+                pio_msgbuf_put(&mb, name, namelen + 1);
+                pio_msgbuf_put(&mb, &xtype, sizeof(nc_type));
+                pio_msgbuf_put(&mb, &ndims, sizeof(int));
+                pio_msgbuf_put(&mb, NULL, 0);
+                mpierr = pio_msgbuf_send(ios, &mb);
+            }
         }
 
         /* Handle MPI errors. */
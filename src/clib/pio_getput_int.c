@@ -11,6 +11,114 @@
 #include <pio.h>
 #include <pio_internal.h>
 
+/**
+ * Write an attribute on the IO tasks. This is the part of
+ * PIOc_put_att_tc() which runs on the IO tasks. It does no
+ * communication with the computation tasks, so it is also used to
+ * replay deferred calls (see PIOc_set_batch_define()).
+ *
+ * @param file pointer to the file info.
+ * @param varid the variable ID.
+ * @param name the name of the attribute.
+ * @param atttype the nc_type of the attribute in the file.
+ * @param len the length of the attribute array.
+ * @param memtype the nc_type of the attribute data in memory.
+ * @param op a pointer with the attribute data.
+ * @return netCDF error code.
+ * @author Jim Edwards
+ */
+int
+pioc_put_att_io(file_desc_t *file, int varid, const char *name, nc_type atttype,
+                PIO_Offset len, nc_type memtype, const void *op)
+{
+    int ierr = PIO_NOERR;
+
+#ifdef _PNETCDF
+    if (file->iotype == PIO_IOTYPE_PNETCDF)
+    {
+        switch(memtype)
+        {
+        case NC_BYTE:
+            ierr = ncmpi_put_att_schar(file->fh, varid, name, atttype, len, op);
+            break;
+        case NC_CHAR:
+            ierr = ncmpi_put_att_text(file->fh, varid, name, len, op);
+            break;
+        case NC_SHORT:
+            ierr = ncmpi_put_att_short(file->fh, varid, name, atttype, len, op);
+            break;
+        case NC_INT:
+            ierr = ncmpi_put_att_int(file->fh, varid, name, atttype, len, op);
+            break;
+        case PIO_LONG_INTERNAL:
+            ierr = ncmpi_put_att_long(file->fh, varid, name, atttype, len, op);
+            break;
+        case NC_FLOAT:
+            ierr = ncmpi_put_att_float(file->fh, varid, name, atttype, len, op);
+            break;
+        case NC_DOUBLE:
+            ierr = ncmpi_put_att_double(file->fh, varid, name, atttype, len, op);
+            break;
+        default:
+            ierr = PIO_EBADTYPE;
+        }
+    }
+#endif /* _PNETCDF */
+
+    if (file->iotype != PIO_IOTYPE_PNETCDF && file->do_io)
+    {
+        switch(memtype)
+        {
+        case NC_CHAR:
+            ierr = nc_put_att_text(file->fh, varid, name, len, op);
+            break;
+        case NC_BYTE:
+            ierr = nc_put_att_schar(file->fh, varid, name, atttype, len, op);
+            break;
+        case NC_SHORT:
+            ierr = nc_put_att_short(file->fh, varid, name, atttype, len, op);
+            break;
+        case NC_INT:
+            ierr = nc_put_att_int(file->fh, varid, name, atttype, len, op);
+            break;
+        case PIO_LONG_INTERNAL:
+            ierr = nc_put_att_long(file->fh, varid, name, atttype, len, op);
+            break;
+        case NC_FLOAT:
+            ierr = nc_put_att_float(file->fh, varid, name, atttype, len, op);
+            break;
+        case NC_DOUBLE:
+            ierr = nc_put_att_double(file->fh, varid, name, atttype, len, op);
+            break;
+#ifdef _NETCDF4
+        case NC_UBYTE:
+            ierr = nc_put_att_uchar(file->fh, varid, name, atttype, len, op);
+            break;
+        case NC_USHORT:
+            ierr = nc_put_att_ushort(file->fh, varid, name, atttype, len, op);
+            break;
+        case NC_UINT:
+            ierr = nc_put_att_uint(file->fh, varid, name, atttype, len, op);
+            break;
+        case NC_INT64:
+            PLOG((3, "about to call nc_put_att_longlong"));
+            ierr = nc_put_att_longlong(file->fh, varid, name, atttype, len, op);
+            break;
+        case NC_UINT64:
+            ierr = nc_put_att_ulonglong(file->fh, varid, name, atttype, len, op);
+            break;
+            /* case NC_STRING: */
+            /*      ierr = nc_put_att_string(file->fh, varid, name, atttype, len, op); */
+            /*      break; */
+#endif /* _NETCDF4 */
+        default:
+            ierr = PIO_EBADTYPE;
+        }
+    }
+
+    return ierr;
+}
+
 /**
  * Write a netCDF attribute of any type, converting to any type.
  *
@@ -51,6 +159,17 @@ PIOc_put_att_tc(int ncid, int varid, const char *name, nc_type atttype,
     PLOG((1, "PIOc_put_att_tc ncid = %d varid = %d name = %s atttype = %d len = %d memtype = %d",
           ncid, varid, name, atttype, len, memtype));
 
+    /* In async mode, the call may be deferred until enddef, if the
+     * types are atomic. */
+    if (ios->async && !ios->ioproc)
+    {
+        if (ios->batch_define && atttype >= PIO_BYTE && atttype <= PIO_UINT64 &&
+            ((memtype >= PIO_BYTE && memtype <= PIO_UINT64) || memtype == PIO_LONG_INTERNAL))
+            return pio_batch_put_att(file, varid, name, atttype, len, memtype, op);
+        if ((ierr = pio_batch_flush(file)))
+            return ierr;
+    }
+
     /* Run these on all tasks if async is not in use, but only on
      * non-IO tasks if async is in use. */
     if (!ios->async || !ios->ioproc)
@@ -76,32 +195,23 @@ PIOc_put_att_tc(int ncid, int varid, const char *name, nc_type atttype,
         if (!ios->ioproc)
         {
             int msg = PIO_MSG_PUT_ATT;
-
-            if (ios->compmain == MPI_ROOT)
-                mpierr = MPI_Send(&msg, 1, MPI_INT, ios->ioroot, 1, ios->union_comm);
-
-            if (!mpierr)
-                mpierr = MPI_Bcast(&ncid, 1, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&varid, 1, MPI_INT, ios->compmain, ios->intercomm);
             int namelen = strlen(name);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&namelen, 1, MPI_INT,  ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast((void *)name, namelen + 1, MPI_CHAR, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&atttype, 1, MPI_INT,  ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&len, 1, MPI_OFFSET,  ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&atttype_len, 1, MPI_OFFSET,  ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&memtype, 1, MPI_INT,  ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&memtype_len, 1, MPI_OFFSET,  ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast((void *)op, len * memtype_len, MPI_BYTE, ios->compmain,
-                                   ios->intercomm);
+            pio_msgbuf mb; /* The packed parameters. */
+
+            if (!(mpierr = pio_msgbuf_start(ios, &mb, msg)))
+            {
+                pio_msgbuf_put(&mb, &ncid, sizeof(int));
+                pio_msgbuf_put(&mb, &varid, sizeof(int));
+                pio_msgbuf_put(&mb, &namelen, sizeof(int));
+                pio_msgbuf_put(&mb, name, namelen + 1);
+                pio_msgbuf_put(&mb, &atttype, sizeof(nc_type));
+                pio_msgbuf_put(&mb, &len, sizeof(PIO_Offset));
+                pio_msgbuf_put(&mb, &atttype_len, sizeof(PIO_Offset));
+                pio_msgbuf_put(&mb, &memtype, sizeof(nc_type));
+                pio_msgbuf_put(&mb, &memtype_len, sizeof(PIO_Offset));
+                pio_msgbuf_put_bulk(&mb, op, len * memtype_len);
+                mpierr = pio_msgbuf_send(ios, &mb);
+            }
             PLOG((2, "PIOc_put_att finished bcast ncid = %d varid = %d namelen = %d name = %s "
                   "len = %d atttype_len = %d memtype = %d memtype_len = %d", ncid, varid, namelen,
                   name, len, atttype_len, memtype, memtype_len));
@@ -124,90 +234,7 @@ PIOc_put_att_tc(int ncid, int varid, const char *name, nc_type atttype,
 
     /* If this is an IO task, then call the netCDF function. */
     if (ios->ioproc)
-    {
-#ifdef _PNETCDF
-        if (file->iotype == PIO_IOTYPE_PNETCDF)
-        {
-            switch(memtype)
-            {
-            case NC_BYTE:
-                ierr = ncmpi_put_att_schar(file->fh, varid, name, atttype, len, op);
-                break;
-            case NC_CHAR:
-                ierr = ncmpi_put_att_text(file->fh, varid, name, len, op);
-                break;
-            case NC_SHORT:
-                ierr = ncmpi_put_att_short(file->fh, varid, name, atttype, len, op);
-                break;
-            case NC_INT:
-                ierr = ncmpi_put_att_int(file->fh, varid, name, atttype, len, op);
-                break;
-            case PIO_LONG_INTERNAL:
-                ierr = ncmpi_put_att_long(file->fh, varid, name, atttype, len, op);
-                break;
-            case NC_FLOAT:
-                ierr = ncmpi_put_att_float(file->fh, varid, name, atttype, len, op);
-                break;
-            case NC_DOUBLE:
-                ierr = ncmpi_put_att_double(file->fh, varid, name, atttype, len, op);
-                break;
-            default:
-                return pio_err(ios, file, PIO_EBADTYPE, __FILE__, __LINE__);
-            }
-        }
-#endif /* _PNETCDF */
-
-        if (file->iotype != PIO_IOTYPE_PNETCDF && file->do_io)
-        {
-            switch(memtype)
-            {
-            case NC_CHAR:
-                ierr = nc_put_att_text(file->fh, varid, name, len, op);
-                break;
-            case NC_BYTE:
-                ierr = nc_put_att_schar(file->fh, varid, name, atttype, len, op);
-                break;
-            case NC_SHORT:
-                ierr = nc_put_att_short(file->fh, varid, name, atttype, len, op);
-                break;
-            case NC_INT:
-                ierr = nc_put_att_int(file->fh, varid, name, atttype, len, op);
-                break;
-            case PIO_LONG_INTERNAL:
-                ierr = nc_put_att_long(file->fh, varid, name, atttype, len, op);
-                break;
-            case NC_FLOAT:
-                ierr = nc_put_att_float(file->fh, varid, name, atttype, len, op);
-                break;
-            case NC_DOUBLE:
-                ierr = nc_put_att_double(file->fh, varid, name, atttype, len, op);
-                break;
-#ifdef _NETCDF4
-            case NC_UBYTE:
-                ierr = nc_put_att_uchar(file->fh, varid, name, atttype, len, op);
-                break;
-            case NC_USHORT:
-                ierr = nc_put_att_ushort(file->fh, varid, name, atttype, len, op);
-                break;
-            case NC_UINT:
-                ierr = nc_put_att_uint(file->fh, varid, name, atttype, len, op);
-                break;
-            case NC_INT64:
-                PLOG((3, "about to call nc_put_att_longlong"));
-                ierr = nc_put_att_longlong(file->fh, varid, name, atttype, len, op);
-                break;
-            case NC_UINT64:
-                ierr = nc_put_att_ulonglong(file->fh, varid, name, atttype, len, op);
-                break;
-                /* case NC_STRING: */
-                /*      ierr = nc_put_att_string(file->fh, varid, name, atttype, len, op); */
-                /*      break; */
-#endif /* _NETCDF4 */
-            default:
-                return pio_err(ios, file, PIO_EBADTYPE, __FILE__, __LINE__);
-            }
-        }
-    }
+        ierr = pioc_put_att_io(file, varid, name, atttype, len, memtype, op);
 
     /* Broadcast and check the return code. */
     if ((mpierr = MPI_Bcast(&ierr, 1, MPI_INT, ios->ioroot, ios->my_comm)))
@@ -290,6 +317,10 @@ PIOc_get_att_tc(int ncid, int varid, const char *name, nc_type memtype, void *ip
     }
     PLOG((2, "atttype_len = %d memtype_len = %d", atttype_len, memtype_len));
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the
      * parameters and the attribute and type information we fetched. */
     if (ios->async)
@@ -556,6 +587,10 @@ PIOc_get_vars_tc(int ncid, int varid, const PIO_Offset *start, const PIO_Offset
         PLOG((2, "PIOc_get_vars_tc num_elem = %d", num_elem));
     }
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -1003,50 +1038,43 @@ PIOc_put_vars_tc(int ncid, int varid, const PIO_Offset *start, const PIO_Offset
                 num_elem *= count[vd];
     }
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
         if (!ios->ioproc)
         {
             int msg = PIO_MSG_PUT_VARS;
-
-            if (ios->compmain == MPI_ROOT)
-                mpierr = MPI_Send(&msg, 1, MPI_INT, ios->ioroot, 1, ios->union_comm);
+            pio_msgbuf mb; /* The packed parameters. */
 
             /* Send the function parameters and associated informaiton
-             * to the msg handler. */
-            if (!mpierr)
-                mpierr = MPI_Bcast(&ncid, 1, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&varid, 1, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&ndims, 1, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&start_present, 1, MPI_CHAR, ios->compmain, ios->intercomm);
-            if (!mpierr && start_present)
-                mpierr = MPI_Bcast((PIO_Offset *)start, ndims, MPI_OFFSET, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&count_present, 1, MPI_CHAR, ios->compmain, ios->intercomm);
-            if (!mpierr && count_present)
-                mpierr = MPI_Bcast((PIO_Offset *)count, ndims, MPI_OFFSET, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&stride_present, 1, MPI_CHAR, ios->compmain, ios->intercomm);
-            if (!mpierr && stride_present)
-                mpierr = MPI_Bcast((PIO_Offset *)stride, ndims, MPI_OFFSET, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&xtype, 1, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&num_elem, 1, MPI_OFFSET, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&typelen, 1, MPI_OFFSET, ios->compmain, ios->intercomm);
+             * to the msg handler, packed into one message. */
+            if (!(mpierr = pio_msgbuf_start(ios, &mb, msg)))
+            {
+                pio_msgbuf_put(&mb, &ncid, sizeof(int));
+                pio_msgbuf_put(&mb, &varid, sizeof(int));
+                pio_msgbuf_put(&mb, &ndims, sizeof(int));
+                pio_msgbuf_put(&mb, &start_present, 1);
+                if (start_present)
+                    pio_msgbuf_put(&mb, start, ndims * sizeof(PIO_Offset));
+                pio_msgbuf_put(&mb, &count_present, 1);
+                if (count_present)
+                    pio_msgbuf_put(&mb, count, ndims * sizeof(PIO_Offset));
+                pio_msgbuf_put(&mb, &stride_present, 1);
+                if (stride_present)
+                    pio_msgbuf_put(&mb, stride, ndims * sizeof(PIO_Offset));
+                pio_msgbuf_put(&mb, &xtype, sizeof(nc_type));
+                pio_msgbuf_put(&mb, &num_elem, sizeof(PIO_Offset));
+                pio_msgbuf_put(&mb, &typelen, sizeof(PIO_Offset));
+                pio_msgbuf_put_bulk(&mb, buf, num_elem * typelen);
+                mpierr = pio_msgbuf_send(ios, &mb);
+            }
             PLOG((2, "PIOc_put_vars_tc ncid = %d varid = %d ndims = %d start_present = %d "
                   "count_present = %d stride_present = %d xtype = %d num_elem = %d", ncid, varid,
                   ndims, start_present, count_present, stride_present, xtype, num_elem));
-
-            /* Send the data. */
-            if (!mpierr)
-                mpierr = MPI_Bcast((void *)buf, num_elem * typelen, MPI_BYTE, ios->compmain,
-                                   ios->intercomm);
         }
 
         /* Handle MPI errors. */
@@ -0,0 +1,431 @@
+/**
+ * @file
+ * The hierarchical rearranger, PIO_REARR_HIER.
+ *
+ * With the box and subset rearrangers every compute task is a peer of
+ * the IO tasks, so with many tasks on a node an IO task gets many
+ * small messages for each variable. The hierarchical rearranger first
+ * combines the data of all the tasks on a node in a buffer in an
+ * MPI-3 shared memory window of the node leader (rank 0 on the node).
+ * Each task stores its own data straight into the window, so no
+ * messages are sent within the node. Only the node leaders then
+ * exchange data with the IO tasks, with the box rearranger built on
+ * the combined map of the node.
+ *
+ * @author Jim Edwards
+ */
+#include <config.h>
+#include <pio.h>
+#include <pio_internal.h>
+
+/**
+ * Create the hierarchical rearranger for a decomposition.
+ *
+ * The maps of the tasks on each node are gathered on the node
+ * leader, which sorts the combined map. The box rearranger is then
+ * created with the combined map on the leaders, and no data on the
+ * other tasks. Each task gets the position in the node buffer of each
+ * of its elements. If the map of the task was not sorted, this is
+ * composed with the remap of the task, so the data is stored in the
+ * node buffer straight from the array of the caller, and needssort is
+ * cleared.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param maplen the length of the map of this task.
+ * @param compmap a 1 based array of offsets into the global space,
+ * sorted.
+ * @param gdimlen an array length ndims with the sizes of the global
+ * dimensions.
+ * @param ndims the number of dimensions.
+ * @param iodesc a pointer to the io_desc_t struct, which must be
+ * allocated before this function is called.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+hier_rearrange_create(iosystem_desc_t *ios, int maplen, const PIO_Offset *compmap,
+                      const int *gdimlen, int ndims, io_desc_t *iodesc)
+{
+    pio_hier_desc *hier;
+    PIO_Offset *nodemap = NULL;  /* Combined map of the node, on the leader. */
+    int *nodepos = NULL;         /* Sorted position of each element of nodemap. */
+    int mpierr;
+    int ret;
+
+    /* Check inputs. */
+    pioassert(ios && maplen >= 0 && gdimlen && ndims > 0 && iodesc,
+              "invalid input", __FILE__, __LINE__);
+    PLOG((1, "hier_rearrange_create maplen = %d ndims = %d", maplen, ndims));
+
+    /* The tasks of a node share the window of the leader, and all of
+     * them must take part in the exchange. */
+    if (ios->async)
+        return pio_err(ios, NULL, PIO_EBADREARR, __FILE__, __LINE__);
+
+#ifdef TIMING
+    if ((ret = pio_start_timer("PIO:hier_rearrange_create")))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+#endif /* TIMING */
+
+    if (!(hier = calloc(1, sizeof(pio_hier_desc))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    hier->node_comm = MPI_COMM_NULL;
+    hier->win = MPI_WIN_NULL;
+    iodesc->hier = hier;
+
+    /* Find the tasks on this node. */
+    if ((mpierr = MPI_Comm_split_type(ios->union_comm, MPI_COMM_TYPE_SHARED, ios->union_rank,
+                                      MPI_INFO_NULL, &hier->node_comm)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Comm_rank(hier->node_comm, &hier->node_rank)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Comm_size(hier->node_comm, &hier->node_size)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+
+    {
+        int counts[hier->node_size];
+        int displs[hier->node_size];
+        PIO_Offset nodelen = 0;
+
+        /* Gather the maps of the node on the leader. */
+        if ((mpierr = MPI_Gather(&maplen, 1, MPI_INT, counts, 1, MPI_INT, 0, hier->node_comm)))
+            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+        if (!hier->node_rank)
+        {
+            for (int r = 0; r < hier->node_size; r++)
+            {
+                displs[r] = nodelen;
+                nodelen += counts[r];
+            }
+        }
+
+        /* Every task finds the variables of the node buffer at
+         * multiples of the length of the combined map. */
+        if ((mpierr = MPI_Bcast(&nodelen, 1, PIO_OFFSET, 0, hier->node_comm)))
+            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+        if (nodelen > INT_MAX)
+            return pio_err(ios, NULL, PIO_EINVAL, __FILE__, __LINE__);
+        hier->nodelen = nodelen;
+        if (!hier->node_rank)
+        {
+            if (!(nodemap = malloc(max(1, nodelen) * sizeof(PIO_Offset))))
+                return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+            if (!(nodepos = malloc(max(1, nodelen) * sizeof(int))))
+                return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+        }
+        if ((mpierr = MPI_Gatherv(compmap, maplen, PIO_OFFSET, nodemap, counts, displs,
+                                  PIO_OFFSET, 0, hier->node_comm)))
+            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+
+        /* Sort the combined map, and remember where each element
+         * went. */
+        if (!hier->node_rank && hier->nodelen > 0)
+        {
+            mapsort *sortmap;
+
+            if (!(sortmap = malloc(hier->nodelen * sizeof(mapsort))))
+                return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+            for (int j = 0; j < hier->nodelen; j++)
+            {
+                sortmap[j].rfrom = 0;
+                sortmap[j].soffset = j;
+                sortmap[j].iomap = nodemap[j];
+            }
+            qsort(sortmap, hier->nodelen, sizeof(mapsort), compare_offsets);
+            for (int k = 0; k < hier->nodelen; k++)
+            {
+                nodemap[k] = sortmap[k].iomap;
+                nodepos[sortmap[k].soffset] = k;
+            }
+            free(sortmap);
+        }
+
+        /* Each task gets the positions of its elements. */
+        if (!(hier->winidx = malloc(max(1, maplen) * sizeof(int))))
+            return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+        if ((mpierr = MPI_Scatterv(nodepos, counts, displs, MPI_INT, hier->winidx, maplen,
+                                   MPI_INT, 0, hier->node_comm)))
+            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    }
+    PLOG((2, "node_rank = %d node_size = %d nodelen = %d", hier->node_rank,
+          hier->node_size, hier->nodelen));
+
+    /* Only the leaders have data for the box rearranger. */
+    if ((ret = box_rearrange_create(ios, hier->node_rank ? 0 : hier->nodelen,
+                                    hier->node_rank ? compmap : nodemap,
+                                    gdimlen, ndims, iodesc)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+    iodesc->rearranger = PIO_REARR_HIER;
+    iodesc->ndof = maplen;
+    free(nodemap);
+    free(nodepos);
+
+    /* Store the data in the node buffer straight from the original
+     * order of the map. */
+    if (iodesc->needssort)
+    {
+        int *winidx;
+
+        if (!(winidx = malloc(max(1, maplen) * sizeof(int))))
+            return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+        for (int m = 0; m < maplen; m++)
+            winidx[iodesc->remap[m]] = hier->winidx[m];
+        free(hier->winidx);
+        hier->winidx = winidx;
+        free(iodesc->remap);
+        iodesc->remap = NULL;
+        iodesc->needssort = false;
+    }
+
+#ifdef TIMING
+    if ((ret = pio_stop_timer("PIO:hier_rearrange_create")))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+#endif /* TIMING */
+
+    return PIO_NOERR;
+}
+
+/**
+ * Free the shared window of a hierarchical rearranger. This is
+ * collective over the tasks of the node.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param hier pointer to the node level of the decomposition.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+hier_free_window(iosystem_desc_t *ios, pio_hier_desc *hier)
+{
+    int mpierr;
+
+    if (hier->win == MPI_WIN_NULL)
+        return PIO_NOERR;
+
+    if ((mpierr = MPI_Win_unlock_all(hier->win)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Win_free(&hier->win)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    pio_mem_add(ios, -hier->win_bytes);
+    hier->win_bytes = 0;
+    hier->win_nvars = 0;
+    hier->winbuf = NULL;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Make sure the node buffer holds nvars variables, allocating a
+ * larger shared window if needed. This is collective over the tasks
+ * of the node. The window stays in a passive target epoch for all
+ * tasks while it exists, and is synchronized with hier_sync().
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param nvars number of variables.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+hier_window(iosystem_desc_t *ios, io_desc_t *iodesc, int nvars)
+{
+    pio_hier_desc *hier = iodesc->hier;
+    MPI_Aint bytes;
+    MPI_Aint segsize;
+    int disp_unit;
+    void *base;
+    int mpierr;
+    int ret;
+
+    if (nvars <= hier->win_nvars)
+        return PIO_NOERR;
+
+    if ((ret = hier_free_window(ios, hier)))
+        return ret;
+
+    /* The whole node buffer is in the segment of the leader. */
+    bytes = hier->node_rank ? 0 : (MPI_Aint)nvars * hier->nodelen * iodesc->piotype_size;
+    if ((mpierr = MPI_Win_allocate_shared(bytes, 1, MPI_INFO_NULL, hier->node_comm,
+                                          &base, &hier->win)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Win_shared_query(hier->win, 0, &segsize, &disp_unit, &hier->winbuf)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Win_lock_all(MPI_MODE_NOCHECK, hier->win)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    hier->win_nvars = nvars;
+    hier->win_bytes = bytes;
+    pio_mem_add(ios, bytes);
+    PLOG((2, "hier_window nvars = %d bytes = %lld", nvars, (long long)bytes));
+
+    return PIO_NOERR;
+}
+
+/**
+ * Synchronize the tasks of the node, so that the stores of each task
+ * into the node buffer are seen by all of them.
+ *
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+hier_sync(io_desc_t *iodesc)
+{
+    pio_hier_desc *hier = iodesc->hier;
+    int mpierr;
+
+    pioassert(hier && hier->win != MPI_WIN_NULL, "invalid input", __FILE__, __LINE__);
+
+    if ((mpierr = MPI_Win_sync(hier->win)))
+        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Barrier(hier->node_comm)))
+        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Win_sync(hier->win)))
+        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Store the data of this task in the node buffer, before the leader
+ * sends it to the IO tasks. The caller must call hier_sync() after
+ * the exchange, before the node buffer is used again.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param sbuf the data of this task, nvars arrays of ndof
+ * elements. May be NULL.
+ * @param nvars number of variables.
+ * @param nodebufp pointer that gets the node buffer on the leader,
+ * and NULL on the other tasks.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+hier_comp2io_begin(iosystem_desc_t *ios, io_desc_t *iodesc, const void *sbuf,
+                   int nvars, void **nodebufp)
+{
+    pio_hier_desc *hier = iodesc->hier;
+    int size = iodesc->piotype_size;
+    int ret;
+
+    pioassert(ios && iodesc && hier && nvars > 0 && nodebufp, "invalid input",
+              __FILE__, __LINE__);
+
+    if ((ret = hier_window(ios, iodesc, nvars)))
+        return ret;
+
+    if (sbuf && iodesc->ndof > 0)
+        for (int v = 0; v < nvars; v++)
+            if ((ret = pio_remap_copy((const char *)sbuf + (size_t)v * iodesc->ndof * size,
+                                      (char *)hier->winbuf + (size_t)v * hier->nodelen * size,
+                                      hier->winidx, iodesc->ndof, 1, size, 1)))
+                return ret;
+
+    if ((ret = hier_sync(iodesc)))
+        return ret;
+    *nodebufp = hier->node_rank ? NULL : hier->winbuf;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Get the node buffer ready to receive data from the IO tasks. Its
+ * elements which get no data are read as 0.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param nvars number of variables.
+ * @param nodebufp pointer that gets the node buffer on the leader,
+ * and NULL on the other tasks.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+hier_io2comp_begin(iosystem_desc_t *ios, io_desc_t *iodesc, int nvars, void **nodebufp)
+{
+    pio_hier_desc *hier = iodesc->hier;
+    int ret;
+
+    pioassert(ios && iodesc && hier && nvars > 0 && nodebufp, "invalid input",
+              __FILE__, __LINE__);
+
+    if ((ret = hier_window(ios, iodesc, nvars)))
+        return ret;
+
+    *nodebufp = NULL;
+    if (!hier->node_rank)
+    {
+        memset(hier->winbuf, 0, (size_t)nvars * hier->nodelen * iodesc->piotype_size);
+        *nodebufp = hier->winbuf;
+    }
+
+    return PIO_NOERR;
+}
+
+/**
+ * Copy the data of this task out of the node buffer, after the
+ * leader has received it from the IO tasks.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param rbuf gets the data of this task, nvars arrays of ndof
+ * elements. May be NULL.
+ * @param nvars number of variables.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+hier_io2comp_end(iosystem_desc_t *ios, io_desc_t *iodesc, void *rbuf, int nvars)
+{
+    pio_hier_desc *hier = iodesc->hier;
+    int size = iodesc->piotype_size;
+    int ret;
+
+    pioassert(ios && iodesc && hier && nvars > 0, "invalid input", __FILE__, __LINE__);
+
+    if ((ret = hier_sync(iodesc)))
+        return ret;
+
+    if (rbuf && iodesc->ndof > 0)
+        for (int v = 0; v < nvars; v++)
+            if ((ret = pio_remap_copy((const char *)hier->winbuf + (size_t)v * hier->nodelen * size,
+                                      (char *)rbuf + (size_t)v * iodesc->ndof * size,
+                                      hier->winidx, iodesc->ndof, 1, size, 0)))
+                return ret;
+
+    /* The leader must not reuse the node buffer before all tasks have
+     * their data. */
+    return hier_sync(iodesc);
+}
+
+/**
+ * Free the node level of a decomposition with the hierarchical
+ * rearranger. This is collective over the tasks of the node.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+hier_free(iosystem_desc_t *ios, io_desc_t *iodesc)
+{
+    pio_hier_desc *hier = iodesc->hier;
+    int mpierr;
+    int ret;
+
+    if (!hier)
+        return PIO_NOERR;
+
+    if ((ret = hier_free_window(ios, hier)))
+        return ret;
+    if (hier->node_comm != MPI_COMM_NULL)
+        if ((mpierr = MPI_Comm_free(&hier->node_comm)))
+            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    free(hier->winidx);
+    free(hier);
+    iodesc->hier = NULL;
+
+    return PIO_NOERR;
+}
@@ -123,6 +123,11 @@ void pio_log(int severity, const char *fmt, ...);
 /** Request allocation size. */
 #define PIO_REQUEST_ALLOC_CHUNK 16
 
+/** MPI tag of the messages of PIOc_iwrite_darray(), and of the
+ * persistent requests of PIO_REARR_COMM_PERSIST. pio_swapm() tags are
+ * never less than the number of tasks, so they never use it. */
+#define PIO_IWRITE_TAG 0
+
 /** This is needed to handle _long() functions. It may not be used as
  * a data type when creating attributes or varaibles, it is only used
  * internally. */
@@ -175,6 +180,149 @@ extern "C" {
         bool isend; /**< is end? */
     } pio_swapm_defaults;
 
+    /** Number of bytes of a packed async message that are sent with
+     * its first broadcast. */
+#define PIO_MSGBUF_INLINE_SIZE 1024
+
+    /** The arguments of an async message, packed into one buffer
+     * so they can be sent to the IO tasks without a broadcast per
+     * argument. */
+    typedef struct pio_msgbuf
+    {
+        char *buf;          /**< Packed arguments, starting with the header. */
+        PIO_Offset size;    /**< Allocated size of buf. */
+        PIO_Offset pos;     /**< Current pack/unpack position in buf. */
+        PIO_Offset len;     /**< Length of the packed arguments (unpacking only). */
+        void *bulk;         /**< Large payload sent without packing, or NULL. */
+        PIO_Offset bulklen; /**< Length of bulk in bytes. */
+        int active;         /**< Non-zero on the task which packs and sends. */
+        int err;            /**< Non-zero if packing ran out of memory. */
+        PIO_Offset inline_buf[PIO_MSGBUF_INLINE_SIZE / sizeof(PIO_Offset)]; /**< Storage for small messages. */
+    } pio_msgbuf;
+
+    /** Define-mode calls deferred on the computation tasks when
+     * PIOc_set_batch_define() is in use, and a shadow of the metadata
+     * they define, so that IDs can be returned without asking the IO
+     * tasks. */
+    typedef struct pio_def_batch
+    {
+        pio_msgbuf mb;       /**< The deferred calls, packed for the IO tasks. */
+        int nops;            /**< Number of deferred calls. */
+        int ndims;           /**< Number of dims in the file, including deferred ones. */
+        int nvars;           /**< Number of vars in the file, including deferred ones. */
+        int first_dimid;     /**< ID of the first deferred dim. */
+        int first_varid;     /**< ID of the first deferred var. */
+        char **dimnames;     /**< Names of the deferred dims. */
+        PIO_Offset *dimlens; /**< Lengths of the deferred dims. */
+        char **varnames;     /**< Names of the deferred vars. */
+        int nunlimdims;      /**< Number of unlimited dims, including deferred ones. */
+        int *unlimdimids;    /**< IDs of the unlimited dims. */
+    } pio_def_batch;
+
+    /** A write started with PIOc_iwrite_darray(). The data is on its
+     * way to the IO tasks, and is written to the file by PIOc_wait(). */
+    typedef struct pio_write_req
+    {
+        int id;               /**< The PIO_Request of the write. */
+        int ncid;             /**< The file written to. */
+        int varid;            /**< The variable written. */
+        int ioid;             /**< The decomposition of the data. */
+        int frame;            /**< Record written, -1 for non-record vars. */
+        int fndims;           /**< Number of dims of the var in the file. */
+        void *fillvalue;      /**< Fill value for holes, or NULL. */
+        void *sortbuf;        /**< Sorted copy of the data, if the decomposition needs one. */
+        void *iobuf;          /**< Buffer the data is received into on IO tasks. */
+        PIO_Offset iobuf_bytes; /**< Size in bytes of iobuf. */
+        iosystem_desc_t *ios; /**< The IO system of the file. */
+        int nreqs;            /**< Number of MPI requests of the exchange. */
+        MPI_Request *reqs;    /**< MPI requests of the exchange. */
+        int progress;         /**< Non-zero while the progress thread owns the requests. */
+        int done;             /**< Set by the progress thread when the exchange is complete. */
+        int mpierr;           /**< MPI error seen by the progress thread. */
+        struct pio_write_req *progress_next; /**< Next in the progress thread queue. */
+        UT_hash_handle hh;    /**< Hash table entry. */
+    } pio_write_req;
+
+    /** Number of powers of two with pooled IO buffer sizes. */
+#define PIO_IOBUF_POOL_SHIFTS 40
+
+    /** Number of IO buffer size classes for each power of two. */
+#define PIO_IOBUF_POOL_STEPS 4
+
+    /** Number of IO buffer size classes. */
+#define PIO_IOBUF_POOL_NCLASS (PIO_IOBUF_POOL_SHIFTS * PIO_IOBUF_POOL_STEPS)
+
+    /** Number of free IO buffers kept for each size class. */
+#define PIO_IOBUF_POOL_DEPTH 4
+
+    /** The IO buffers kept for reuse by an IO system. See
+     * PIOc_set_iobuf_pool(). */
+    typedef struct pio_iobuf_pool
+    {
+        int flags;                /**< The PIO_IOBUF_POOL flags. */
+        PIO_Offset max_cached;    /**< Most bytes to keep, 0 for no limit. */
+        PIO_Offset cached_bytes;  /**< Bytes kept now. */
+        PIO_Offset hits;          /**< Buffers reused. */
+        PIO_Offset misses;        /**< Buffers allocated. */
+        PIO_Offset bytes_saved;   /**< Bytes of the reused buffers. */
+        int ncached[PIO_IOBUF_POOL_NCLASS]; /**< Buffers kept for each class. */
+        void *cached[PIO_IOBUF_POOL_NCLASS][PIO_IOBUF_POOL_DEPTH]; /**< The buffers kept. */
+    } pio_iobuf_pool;
+
+    /** The node level of a decomposition with the hierarchical
+     * rearranger, PIO_REARR_HIER. The tasks of a node put their data
+     * in a shared memory window of the node leader (rank 0 of
+     * node_comm), and only the leader exchanges data with the IO
+     * tasks. */
+    typedef struct pio_hier_desc
+    {
+        MPI_Comm node_comm;  /**< The tasks of the union comm on this node. */
+        int node_rank;       /**< Rank of this task in node_comm. */
+        int node_size;       /**< Number of tasks in node_comm. */
+        int nodelen;         /**< Length of the combined map of the node. */
+        int *winidx;         /**< Position in the node buffer of each element of this task. */
+        MPI_Win win;         /**< The shared window, MPI_WIN_NULL until first use. */
+        void *winbuf;        /**< The node buffer, in the segment of the leader. */
+        int win_nvars;       /**< Number of variables the node buffer holds. */
+        PIO_Offset win_bytes; /**< Size of the segment of this task. */
+    } pio_hier_desc;
+
+    /** The node level of a decomposition with PIO_REARR_COMM_SHM. Each
+     * task has a segment of a shared memory window on node_comm, in
+     * which it packs the data for the IO tasks of its node, one block
+     * for each IO task. */
+    typedef struct pio_shm_desc
+    {
+        MPI_Comm node_comm;  /**< The tasks of the rearranger comm on this node. */
+        int node_size;       /**< Number of tasks in node_comm. */
+        int *io_node_rank;   /**< Node rank of each IO task, or MPI_UNDEFINED. */
+        int *recv_node_rank; /**< Node rank of each task received from, or MPI_UNDEFINED. */
+        PIO_Offset *send_off; /**< Offset in elements of the block for each IO task, or -1. */
+        PIO_Offset *recv_off; /**< Offset of our block in the segment of each task received from, or -1. */
+        PIO_Offset seglen;   /**< Length in elements of one variable in the segment. */
+        int active;          /**< Non-zero if any task of the node uses the window. */
+        MPI_Win win;         /**< The shared window, MPI_WIN_NULL until first use. */
+        void *winbuf;        /**< The segment of this task. */
+        int win_nvars;       /**< Number of variables the segment holds. */
+        PIO_Offset win_bytes; /**< Size of the segment of this task. */
+    } pio_shm_desc;
+
+    /** The window of a decomposition with PIO_REARR_COMM_RMA. On each
+     * IO task the window holds one block for each compute task it
+     * exchanges data with, in the order of the ranks of the compute
+     * tasks. The compute tasks put their data in, or get it from,
+     * their block with MPI_Put() or MPI_Get(). */
+    typedef struct pio_rma_desc
+    {
+        PIO_Offset *send_off; /**< Offset in elements of the block of this task on each IO task. */
+        PIO_Offset *recv_off; /**< Offset in elements of the block of each task received from. */
+        PIO_Offset winlen;   /**< Length in elements of one variable in the window. */
+        MPI_Win win;         /**< The window, MPI_WIN_NULL until first use. */
+        void *winbuf;        /**< The window memory of this task. */
+        int win_nvars;       /**< Number of variables the window holds. */
+        PIO_Offset win_bytes; /**< Size of the window memory of this task. */
+    } pio_rma_desc;
+
     /* Handle an error in the PIO library. */
     int pio_err(iosystem_desc_t *ios, file_desc_t *file, int err_num, const char *fname,
                 int line);
@@ -200,6 +348,22 @@ extern "C" {
     int pio_msg_handler2(int io_rank, int component_count, iosystem_desc_t **iosys,
                          MPI_Comm io_comm);
 
+    /* Pack the arguments of an async message on computation tasks
+     * and send them to the IO tasks. */
+    int pio_msgbuf_start(iosystem_desc_t *ios, pio_msgbuf *mb, int msg);
+    void pio_msgbuf_put(pio_msgbuf *mb, const void *data, PIO_Offset len);
+    void pio_msgbuf_put_bulk(pio_msgbuf *mb, const void *data, PIO_Offset len);
+    int pio_msgbuf_send(iosystem_desc_t *ios, pio_msgbuf *mb);
+
+    void pio_msgbuf_init(iosystem_desc_t *ios, pio_msgbuf *mb);
+
+    /* Receive and unpack the arguments of an async message on IO tasks. */
+    int pio_msgbuf_recv(iosystem_desc_t *ios, pio_msgbuf *mb);
+    int pio_msgbuf_get(pio_msgbuf *mb, void *data, PIO_Offset len);
+    void *pio_msgbuf_getp(pio_msgbuf *mb, PIO_Offset len);
+    void *pio_msgbuf_get_bulk(pio_msgbuf *mb, PIO_Offset len);
+    void pio_msgbuf_free(pio_msgbuf *mb);
+
     /* List operations for iosystem list. */
     int pio_add_to_iosystem_list(iosystem_desc_t *ios);
     int pio_delete_iosystem_from_list(int piosysid);
@@ -209,6 +373,12 @@ extern "C" {
     int  pio_add_to_iodesc_list(io_desc_t *iodesc);
     io_desc_t *pio_get_iodesc_from_id(int ioid);
     int pio_delete_iodesc_from_list(int ioid);
+
+    /* List operations for writes started with PIOc_iwrite_darray(). */
+    int pio_add_to_request_list(pio_write_req *req);
+    pio_write_req *pio_get_request_from_id(int id);
+    pio_write_req *pio_get_file_request(int ncid);
+    void pio_delete_request_from_list(pio_write_req *req);
     int pio_num_iosystem(int *niosysid);
 
     /* Allocate and initialize storage for decomposition information. */
@@ -263,6 +433,12 @@ extern "C" {
                   void *recvbuf, int *recvcounts, int *rdispls, MPI_Datatype *recvtypes,
                   MPI_Comm comm, rearr_comm_fc_opt_t *fc);
 
+    /* Like pio_swapm(), but only exchanges data with a list of peers. */
+    int pio_swapm_sparse(int npeers, const int *peers, void *sendbuf, int *sendcounts,
+                         int *sdispls, MPI_Datatype *sendtypes, void *recvbuf,
+                         int *recvcounts, int *rdispls, MPI_Datatype *recvtypes,
+                         MPI_Comm comm, MPI_Comm *graph_comm, rearr_comm_fc_opt_t *fc);
+
     /* Return the greatest common devisor of array ain as int_64. */
     long long lgcd_array(int nain, long long* ain);
 
@@ -283,13 +459,20 @@ extern "C" {
     /* Allocation memory for a data region. */
     int alloc_region2(iosystem_desc_t *ios, int ndims, io_region **region);
 
+    /* Allocate memory for a contiguous array of data regions. */
+    int alloc_region_array(iosystem_desc_t *ios, int ndims, int nregions, io_region **region);
+
     /* Set start and count so that they describe the first region in map.*/
     int find_region(int ndims, const int *gdims, int maplen, const PIO_Offset *map,
                     PIO_Offset *start, PIO_Offset *count, PIO_Offset *regionlen);
 
     /* Calculate start and count regions for the subset rearranger. */
     int get_regions(int ndims, const int *gdimlen, int maplen, const PIO_Offset *map,
-                    int *maxregions, io_region *firstregion);
+                    int *maxregions, io_region **firstregionp);
+
+    /* Merge adjacent regions into larger hyperslabs. */
+    int coalesce_regions(int ndims, int nregions, PIO_Offset *start, PIO_Offset *count,
+                         PIO_Offset *loffset);
 
     /* Expand a region along dimension dim, by incrementing count[i] as
      * much as possible, consistent with the map. */
@@ -308,13 +491,57 @@ extern "C" {
     int box_rearrange_create(iosystem_desc_t *ios, int maplen, const PIO_Offset *compmap, const int *gsize,
                              int ndim, io_desc_t *iodesc);
 
+    /* Create a hierarchical rearranger. */
+    int hier_rearrange_create(iosystem_desc_t *ios, int maplen, const PIO_Offset *compmap,
+                              const int *gsize, int ndim, io_desc_t *iodesc);
+
+    /* Free the node level of a hierarchical rearranger. */
+    int hier_free(iosystem_desc_t *ios, io_desc_t *iodesc);
+
+    /* Move data through the node buffer of a hierarchical rearranger. */
+    int hier_comp2io_begin(iosystem_desc_t *ios, io_desc_t *iodesc, const void *sbuf,
+                           int nvars, void **nodebufp);
+    int hier_io2comp_begin(iosystem_desc_t *ios, io_desc_t *iodesc, int nvars,
+                           void **nodebufp);
+    int hier_io2comp_end(iosystem_desc_t *ios, io_desc_t *iodesc, void *rbuf, int nvars);
+    int hier_sync(io_desc_t *iodesc);
+
+    /* Set up, size, synchronize and free the shared window of
+     * PIO_REARR_COMM_SHM. */
+    int shm_create(iosystem_desc_t *ios, io_desc_t *iodesc, MPI_Comm comm, int niotasks);
+    int shm_window(iosystem_desc_t *ios, io_desc_t *iodesc, int nvars);
+    int shm_sync(io_desc_t *iodesc);
+    int shm_free(iosystem_desc_t *ios, io_desc_t *iodesc);
+
+    /* Set up, size and free the windows of PIO_REARR_COMM_RMA. */
+    int rma_create(iosystem_desc_t *ios, io_desc_t *iodesc, MPI_Comm comm, int niotasks);
+    int rma_window(iosystem_desc_t *ios, io_desc_t *iodesc, MPI_Comm comm, int nvars);
+    int rma_free(iosystem_desc_t *ios, io_desc_t *iodesc);
+
     /* Move data from IO tasks to compute tasks. */
-    int rearrange_io2comp(iosystem_desc_t *ios, io_desc_t *iodesc, void *sbuf, void *rbuf);
+    int rearrange_io2comp(iosystem_desc_t *ios, io_desc_t *iodesc, void *sbuf, void *rbuf,
+                          int nvars);
 
     /* Move data from compute tasks to IO tasks. */
     int rearrange_comp2io(iosystem_desc_t *ios, io_desc_t *iodesc, void *sbuf, void *rbuf,
                           int nvars);
 
+    /* Start and finish moving data from compute tasks to IO tasks
+     * with nonblocking MPI. */
+    int rearrange_comp2io_start(iosystem_desc_t *ios, io_desc_t *iodesc, void *sbuf,
+                                void *rbuf, int nvars, int *nreqsp, MPI_Request **reqsp);
+    int rearrange_comp2io_finish(iosystem_desc_t *ios, int nreqs, MPI_Request *reqs);
+
+    /* Complete the writes to a file started with PIOc_iwrite_darray(). */
+    int pio_wait_file_requests(int ncid);
+
+    /* Hand the exchanges of nonblocking writes to the progress thread,
+     * and take them back. */
+    void pio_progress_submit(pio_write_req *req);
+    int pio_progress_release(pio_write_req *req);
+    bool pio_progress_test(pio_write_req *req, int *flagp);
+    void pio_progress_stop(void);
+
     void performance_tune_rearranger(iosystem_desc_t *ios, io_desc_t *iodesc);
 
     /* Flush contents of multi-buffer to disk. */
@@ -343,6 +570,9 @@ extern "C" {
     /* Create MPI datatypes used for comp2io and io2comp data transfers. */
     int define_iodesc_datatypes(iosystem_desc_t *ios, io_desc_t *iodesc);
 
+    /* Free the cached MPI datatypes of an iodesc. */
+    int free_type_cache(io_desc_t *iodesc);
+
     /* Create the derived MPI datatypes used for comp2io and io2comp
      * transfers. */
     int create_mpi_datatypes(MPI_Datatype basetype, int msgcnt, const PIO_Offset *mindex,
@@ -357,6 +587,31 @@ extern "C" {
     /* Flush PIO's data buffer. */
     int flush_buffer(int ncid, wmulti_buffer *wmb, bool flushtodisk);
 
+    /* Make room for one more array in a write multi-buffer, or free it. */
+    int pio_wmb_reserve(wmulti_buffer *wmb, size_t array_size, size_t fill_size);
+    void pio_wmb_free(wmulti_buffer *wmb);
+
+    /* Find the memory of a write multi-buffer, or free it but keep
+     * the multi-buffer. */
+    PIO_Offset pio_wmb_bytes(const wmulti_buffer *wmb);
+    void pio_wmb_release(wmulti_buffer *wmb);
+
+    /* Keep track of the buffer memory of an IO system. */
+    void pio_mem_add(iosystem_desc_t *ios, PIO_Offset bytes);
+    void pio_free_iobuf(file_desc_t *file);
+    void pio_free_fillbuf(file_desc_t *file, var_desc_t *vdesc);
+
+    /* Get and give back IO buffers, using the pool of the IO system
+     * if it is enabled. */
+    void *pio_iobuf_alloc(iosystem_desc_t *ios, PIO_Offset bytes, PIO_Offset *alloc_bytesp);
+    void pio_iobuf_free(iosystem_desc_t *ios, void *buf, PIO_Offset alloc_bytes);
+    void pio_iobuf_pool_drain(iosystem_desc_t *ios);
+    void pio_iobuf_pool_free(iosystem_desc_t *ios);
+
+    /* Choose the write multi-buffer to flush when the memory budget
+     * is reached. */
+    wmulti_buffer *pio_find_flush_victim(iosystem_desc_t *ios, file_desc_t **filep);
+
     /* Compute an element of start/count arrays. */
     void compute_one_dim(int gdim, int ioprocs, int rank, PIO_Offset *start,
                          PIO_Offset *count);
@@ -371,8 +626,15 @@ extern "C" {
     int write_darray_multi_serial(file_desc_t *file, int nvars, int fndims, const int *vid,
                                   io_desc_t *iodesc, int fill, const int *frame);
 
+    /* Multi-writer support for classic netCDF files. */
+    int multiwriter_open(file_desc_t *file, const char *filename);
+    int multiwriter_close(file_desc_t *file);
+    void multiwriter_free_layout(file_desc_t *file);
+
     int pio_read_darray_nc(file_desc_t *file, io_desc_t *iodesc, int vid, void *iobuf);
     int pio_read_darray_nc_serial(file_desc_t *file, io_desc_t *iodesc, int vid, void *iobuf);
+    int pio_read_darray_multi_nc(file_desc_t *file, io_desc_t *iodesc, int nvars,
+                                 const int *varids, void *iobuf);
     int find_var_fillvalue(file_desc_t *file, int varid, var_desc_t *vdesc);
 
     /* Read atts with type conversion. */
@@ -408,6 +670,26 @@ extern "C" {
     /* Handle end and re-defs. */
     int pioc_change_def(int ncid, int is_enddef);
 
+    /* The parts of define-mode calls which run on the IO tasks. */
+    int pioc_def_dim_io(file_desc_t *file, const char *name, PIO_Offset len, int *idp);
+    int pioc_def_var_io(file_desc_t *file, const char *name, nc_type xtype, int ndims,
+                        const int *dimidsp, int *varidp);
+    int pioc_put_att_io(file_desc_t *file, int varid, const char *name, nc_type atttype,
+                        PIO_Offset len, nc_type memtype, const void *op);
+
+    /* Defer define-mode calls on computation tasks (see PIOc_set_batch_define()). */
+    int pio_batch_def_dim(file_desc_t *file, const char *name, PIO_Offset len, int *idp);
+    int pio_batch_def_var(file_desc_t *file, const char *name, nc_type xtype, int ndims,
+                          const int *dimidsp, int *varidp);
+    int pio_batch_put_att(file_desc_t *file, int varid, const char *name, nc_type atttype,
+                          PIO_Offset len, nc_type memtype, const void *op);
+    int pio_batch_inq_dimid(file_desc_t *file, const char *name, int *idp);
+    int pio_batch_inq_dim(file_desc_t *file, int dimid, char *name, PIO_Offset *lenp);
+    int pio_batch_inq_varid(file_desc_t *file, const char *name, int *varidp);
+    int pio_batch_inq_unlimdims(file_desc_t *file, int *nunlimdimsp, int *unlimdimidsp);
+    int pio_batch_flush(file_desc_t *file);
+    void pio_batch_free(pio_def_batch *batch);
+
     /* Initialize and finalize logging, use --enable-logging at configure. */
     int pio_init_logging(void);
     void pio_finalize_logging(void );
@@ -432,8 +714,22 @@ extern "C" {
     int determine_procs(int num_io_procs, int component_count, int *num_procs_per_comp,
                         int **proc_list, int **my_proc_list);
 
+    /* Find the node of each task, and choose IO tasks by node. */
+    int pio_get_node_of_task(MPI_Comm comm, int *node_of_task, int *nnodesp);
+    int pio_select_node_ioranks(int ntasks, const int *node_of_task, int iotasks_per_node,
+                                int *num_iotasksp, int *ioranks);
+
+    /* Copy arrays with an index map. */
+    int pio_remap_copy(const void *array, void *sortedarray, const int *remap, int maplen,
+                       int nvars, int size, int direction);
     int pio_sorted_copy(const void *array, void *tmparray, io_desc_t *iodesc, int nvars, int direction);
 
+    /* Get the buffer of a decomposition for data in sorted map order. */
+    void *pio_get_sortbuf(io_desc_t *iodesc, size_t bytes);
+
+    /* Fill a buffer with copies of one value. */
+    void pio_fill_buffer(void *buf, const void *fillvalue, PIO_Offset nelems, int size);
+
     int PIOc_inq_att_eh(int ncid, int varid, const char *name, int eh,
                         nc_type *xtypep, PIO_Offset *lenp);
 
@@ -683,6 +979,10 @@ enum PIO_MSG
     PIO_MSG_DEF_VAR_QUANTIZE,
     PIO_MSG_INQ_VAR_QUANTIZE,
 #endif
+    PIO_MSG_DEF_BATCH,
+    PIO_MSG_SET_IOBUF_POOL,
+    PIO_MSG_READDARRAYMULTI,
+    PIO_MSG_SET_MEM_BUDGET
 };
 
 #endif /* __PIO_INTERNAL__ */
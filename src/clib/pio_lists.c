@@ -14,6 +14,8 @@ static io_desc_t *current_iodesc = NULL;
 static iosystem_desc_t *pio_iosystem_list = NULL;
 static file_desc_t *pio_file_list = NULL;
 static file_desc_t *current_file = NULL;
+static pio_write_req *pio_request_list = NULL;
+static int pio_next_request_id = 0;
 
 /**
  * Add a new entry to the global list of open files.
@@ -82,6 +84,74 @@ pio_get_file(int ncid, file_desc_t **cfile1)
     return PIO_NOERR;
 }
 
+/**
+ * Choose the write multi-buffer to flush and free when the memory
+ * budget of an IO system is reached. Only multi-buffers holding
+ * memory are considered. Empty ones are chosen first, then the one
+ * needing the largest IO buffer, or the one which got its data
+ * first, depending on the flush order of the IO system.
+ *
+ * The choice only depends on values which are the same on all
+ * computation tasks, so all tasks choose the same multi-buffer. The
+ * size of the IO buffer is found with maxiobuflen, which
+ * compute_maxaggregate_bytes() gives to all tasks of the
+ * decomposition, not only to the IO tasks.
+ *
+ * @param ios pointer to the IO system info.
+ * @param filep pointer that gets the file of the multi-buffer.
+ * @returns pointer to the multi-buffer, or NULL if there is none.
+ * @author Jim Edwards
+ */
+wmulti_buffer *
+pio_find_flush_victim(iosystem_desc_t *ios, file_desc_t **filep)
+{
+    file_desc_t *cfile, *tfile;
+    wmulti_buffer *victim = NULL;
+    PIO_Offset victim_size = 0;
+
+    assert(ios && filep);
+
+    HASH_ITER(hh, pio_file_list, cfile, tfile)
+    {
+        wmulti_buffer *wmb, *twmb;
+
+        if (cfile->iosystem != ios)
+            continue;
+
+        HASH_ITER(hh, cfile->buffer, wmb, twmb)
+        {
+            io_desc_t *iodesc;
+            PIO_Offset size = 0;
+
+            if (!wmb->capacity)
+                continue;
+
+            /* An empty multi-buffer can be freed without a write. */
+            if (!wmb->num_arrays)
+            {
+                *filep = cfile;
+                return wmb;
+            }
+
+            /* The size of the IO buffer needed to flush it, the same
+             * on all tasks. */
+            if ((iodesc = pio_get_iodesc_from_id(wmb->ioid)))
+                size = (PIO_Offset)wmb->num_arrays * iodesc->maxiobuflen * iodesc->mpitype_size;
+
+            if (!victim ||
+                (ios->mem_flush_order == PIO_MEM_FLUSH_LARGEST && size > victim_size) ||
+                (ios->mem_flush_order == PIO_MEM_FLUSH_OLDEST && wmb->seq < victim->seq))
+            {
+                victim = wmb;
+                victim_size = size;
+                *filep = cfile;
+            }
+        }
+    }
+
+    return victim;
+}
+
 /**
  * Delete a file from the list of open files.
  *
@@ -113,6 +183,21 @@ pio_delete_file_from_list(int ncid)
             if ((ret = delete_var_desc(cfile->varlist->varid, &cfile->varlist)))
                 return pio_err(NULL, cfile, ret, __FILE__, __LINE__);
 
+        /* Free the write multi-buffers of this file. */
+        {
+            wmulti_buffer *wmb, *twmb;
+
+            HASH_ITER(hh, cfile->buffer, wmb, twmb)
+            {
+                HASH_DEL(cfile->buffer, wmb);
+                pio_mem_add(cfile->iosystem, -pio_wmb_bytes(wmb));
+                pio_wmb_free(wmb);
+            }
+        }
+
+        /* Free any define-mode calls which were never sent. */
+        pio_batch_free(cfile->def_batch);
+
         /* Free the memory used for this file. */
         free(cfile);
 
@@ -296,6 +381,77 @@ pio_delete_iodesc_from_list(int ioid)
     return PIO_EBADID;
 }
 
+/**
+ * Add a write started with PIOc_iwrite_darray() to the list of
+ * pending writes, and give it an ID. The IDs are the same on all
+ * tasks, as long as all tasks start their writes in the same order.
+ *
+ * @param req pointer to the pio_write_req to add to the list.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+pio_add_to_request_list(pio_write_req *req)
+{
+    assert(req);
+
+    req->id = pio_next_request_id++;
+    HASH_ADD_INT(pio_request_list, id, req);
+    return PIO_NOERR;
+}
+
+/**
+ * Get a pending write.
+ *
+ * @param id the PIO_Request of the write.
+ * @returns pointer to the pio_write_req, or NULL if there is no
+ * pending write with this ID.
+ * @author Jim Edwards
+ */
+pio_write_req *
+pio_get_request_from_id(int id)
+{
+    pio_write_req *req = NULL;
+
+    HASH_FIND_INT(pio_request_list, &id, req);
+    return req;
+}
+
+/**
+ * Get the oldest pending write to a file.
+ *
+ * @param ncid the ncid of the file.
+ * @returns pointer to the pio_write_req, or NULL if there are no
+ * pending writes to the file.
+ * @author Jim Edwards
+ */
+pio_write_req *
+pio_get_file_request(int ncid)
+{
+    pio_write_req *req, *treq;
+
+    /* The hash keeps the order in which writes were added. */
+    HASH_ITER(hh, pio_request_list, req, treq)
+        if (req->ncid == ncid)
+            return req;
+    return NULL;
+}
+
+/**
+ * Remove a pending write from the list. The pio_write_req is not
+ * freed.
+ *
+ * @param req pointer to the pio_write_req to remove.
+ * @author Jim Edwards
+ */
+void
+pio_delete_request_from_list(pio_write_req *req)
+{
+    assert(req);
+
+    HASH_DEL(pio_request_list, req);
+}
+
 /**
  * Add var_desc_t info to the list.
  *
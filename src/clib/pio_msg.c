@@ -28,6 +28,494 @@ extern int pio_log_level;
 extern int event_num[2][NUM_EVENTS];
 #endif /* USE_MPE */
 
+/* Size of the packed message header: the length of the packed
+ * arguments and the length of the bulk payload. */
+#define PIO_MSGBUF_HDR_SIZE (2 * sizeof(PIO_Offset))
+
+/* Packed fields are padded so that each starts 8-byte aligned, and
+ * may be used in place on the IO tasks. */
+#define PIO_MSGBUF_PAD(len) (((len) + 7) & ~(PIO_Offset)7)
+
+/* MPI counts are int, so longer parts of a message are described
+ * with a datatype of chunks of this many bytes. */
+#define PIO_MSGBUF_CHUNK (1 << 30)
+
+/* Tag of the message from the IO root to the computation main
+ * task, telling it whether the IO tasks can receive the rest of a
+ * long message. */
+#define PIO_MSGBUF_READY_TAG 2
+
+/**
+ * Reset a message buffer to use its inline storage.
+ *
+ * @param mb pointer to the message buffer.
+ * @param active non-zero if this task packs the message.
+ * @author Jim Edwards
+ */
+static void
+msgbuf_init(pio_msgbuf *mb, int active)
+{
+    mb->buf = (char *)mb->inline_buf;
+    mb->size = PIO_MSGBUF_INLINE_SIZE;
+    mb->pos = PIO_MSGBUF_HDR_SIZE;
+    mb->len = 0;
+    mb->bulk = NULL;
+    mb->bulklen = 0;
+    mb->active = active;
+    mb->err = 0;
+}
+
+/**
+ * Make a message buffer ready to pack arguments on the computation
+ * tasks, without sending anything. Only the computation main task
+ * packs arguments; on the other computation tasks the put functions
+ * do nothing.
+ *
+ * @param ios pointer to the iosystem info.
+ * @param mb pointer to the message buffer.
+ * @author Jim Edwards
+ */
+void
+pio_msgbuf_init(iosystem_desc_t *ios, pio_msgbuf *mb)
+{
+    msgbuf_init(mb, ios->compmain == MPI_ROOT);
+}
+
+/**
+ * Start an async message on the computation tasks. The message
+ * number is sent to the IO root, and the buffer is made ready to
+ * pack the arguments of the call. Only the computation main task
+ * packs arguments; on the other computation tasks the put functions
+ * do nothing.
+ *
+ * Arguments are then added with pio_msgbuf_put() and
+ * pio_msgbuf_put_bulk(), and sent with pio_msgbuf_send(). The
+ * handler on the IO tasks must unpack them in the same order.
+ *
+ * @param ios pointer to the iosystem info.
+ * @param mb pointer to the message buffer.
+ * @param msg the message number.
+ * @returns MPI_SUCCESS, or the error from MPI_Send().
+ * @author Jim Edwards
+ */
+int
+pio_msgbuf_start(iosystem_desc_t *ios, pio_msgbuf *mb, int msg)
+{
+    int mpierr = MPI_SUCCESS;
+
+    pioassert(ios && mb, "invalid input", __FILE__, __LINE__);
+
+    pio_msgbuf_init(ios, mb);
+    if (mb->active)
+        mpierr = MPI_Send(&msg, 1, MPI_INT, ios->ioroot, 1, ios->union_comm);
+
+    return mpierr;
+}
+
+/**
+ * Pack an argument into an async message. The buffer grows as
+ * needed. If memory cannot be allocated, the error is remembered and
+ * reported by pio_msgbuf_send().
+ *
+ * @param mb pointer to the message buffer.
+ * @param data pointer to the argument. Ignored if len is 0.
+ * @param len length of the argument in bytes.
+ * @author Jim Edwards
+ */
+void
+pio_msgbuf_put(pio_msgbuf *mb, const void *data, PIO_Offset len)
+{
+    PIO_Offset padlen = PIO_MSGBUF_PAD(len);
+
+    if (!mb->active || mb->err)
+        return;
+
+    if (mb->pos + padlen > mb->size)
+    {
+        PIO_Offset newsize = mb->size;
+        char *newbuf;
+
+        while (mb->pos + padlen > newsize)
+            newsize *= 2;
+        if (!(newbuf = malloc(newsize)))
+        {
+            mb->err = 1;
+            return;
+        }
+        memcpy(newbuf, mb->buf, mb->pos);
+        if (mb->buf != (char *)mb->inline_buf)
+            free(mb->buf);
+        mb->buf = newbuf;
+        mb->size = newsize;
+    }
+
+    if (len)
+        memcpy(mb->buf + mb->pos, data, len);
+    mb->pos += padlen;
+}
+
+/**
+ * Add the bulk payload (data array) of an async message. If it fits
+ * in the inline part of the message it is packed like any other
+ * argument. Otherwise it is sent directly from the caller's buffer,
+ * which must remain valid until pio_msgbuf_send() returns. Only one
+ * bulk payload is allowed per message.
+ *
+ * @param mb pointer to the message buffer.
+ * @param data pointer to the payload.
+ * @param len length of the payload in bytes.
+ * @author Jim Edwards
+ */
+void
+pio_msgbuf_put_bulk(pio_msgbuf *mb, const void *data, PIO_Offset len)
+{
+    if (!mb->active)
+        return;
+    pioassert(!mb->bulk, "only one bulk payload per message", __FILE__, __LINE__);
+
+    if (mb->pos + PIO_MSGBUF_PAD(len) <= PIO_MSGBUF_INLINE_SIZE)
+        pio_msgbuf_put(mb, data, len);
+    else
+    {
+        mb->bulk = (void *)data;
+        mb->bulklen = len;
+    }
+}
+
+/**
+ * Make a datatype of len contiguous bytes. Lengths which do not fit
+ * in an MPI count are described in chunks of PIO_MSGBUF_CHUNK bytes.
+ * The type is not committed.
+ *
+ * @param len the number of bytes.
+ * @param typep pointer that gets the datatype.
+ * @returns MPI_SUCCESS, or the error from MPI.
+ * @author Jim Edwards
+ */
+static int
+msgbuf_bytes_type(PIO_Offset len, MPI_Datatype *typep)
+{
+    MPI_Datatype types[2];
+    int blocklens[2];
+    MPI_Aint displs[2];
+    int mpierr;
+
+    if (len <= INT_MAX)
+        return MPI_Type_contiguous((int)len, MPI_BYTE, typep);
+
+    if ((mpierr = MPI_Type_contiguous(PIO_MSGBUF_CHUNK, MPI_BYTE, &types[0])))
+        return mpierr;
+    types[1] = MPI_BYTE;
+    blocklens[0] = len / PIO_MSGBUF_CHUNK;
+    blocklens[1] = len % PIO_MSGBUF_CHUNK;
+    displs[0] = 0;
+    displs[1] = (MPI_Aint)blocklens[0] * PIO_MSGBUF_CHUNK;
+    mpierr = MPI_Type_create_struct(2, blocklens, displs, types, typep);
+    MPI_Type_free(&types[0]);
+
+    return mpierr;
+}
+
+/**
+ * Broadcast the part of a message which did not fit inline, and the
+ * bulk payload, from the computation main task. When both are
+ * present, or one is longer than an MPI count, they are described
+ * with one datatype.
+ *
+ * @param ios pointer to the iosystem info.
+ * @param mb pointer to the message buffer.
+ * @param taillen length of the arguments which did not fit inline.
+ * @param bulklen length of the bulk payload.
+ * @returns MPI_SUCCESS, or the error from MPI.
+ * @author Jim Edwards
+ */
+static int
+msgbuf_send_rest(iosystem_desc_t *ios, pio_msgbuf *mb, PIO_Offset taillen,
+                 PIO_Offset bulklen)
+{
+    MPI_Datatype piecetype[2];
+    MPI_Datatype resttype;
+    MPI_Aint displs[2];
+    int blocklens[2] = {1, 1};
+    int npieces = 0;
+    int mpierr = MPI_SUCCESS;
+
+    if (!taillen && bulklen <= INT_MAX)
+        return MPI_Bcast(mb->bulk, bulklen, MPI_BYTE, ios->compmain, ios->intercomm);
+    if (!bulklen && taillen <= INT_MAX)
+        return MPI_Bcast(mb->buf + PIO_MSGBUF_INLINE_SIZE, taillen, MPI_BYTE,
+                         ios->compmain, ios->intercomm);
+
+    if (taillen)
+    {
+        if (!(mpierr = MPI_Get_address(mb->buf + PIO_MSGBUF_INLINE_SIZE, &displs[npieces])))
+            mpierr = msgbuf_bytes_type(taillen, &piecetype[npieces]);
+        if (!mpierr)
+            npieces++;
+    }
+    if (bulklen && !mpierr)
+    {
+        if (!(mpierr = MPI_Get_address(mb->bulk, &displs[npieces])))
+            mpierr = msgbuf_bytes_type(bulklen, &piecetype[npieces]);
+        if (!mpierr)
+            npieces++;
+    }
+    if (!mpierr)
+        mpierr = MPI_Type_create_struct(npieces, blocklens, displs, piecetype, &resttype);
+    if (!mpierr)
+    {
+        if (!(mpierr = MPI_Type_commit(&resttype)))
+            mpierr = MPI_Bcast(MPI_BOTTOM, 1, resttype, ios->compmain, ios->intercomm);
+        MPI_Type_free(&resttype);
+    }
+    for (int p = 0; p < npieces; p++)
+        MPI_Type_free(&piecetype[p]);
+
+    return mpierr;
+}
+
+/**
+ * Send a packed async message from the computation tasks to the IO
+ * tasks, and free the buffer.
+ *
+ * Every message takes exactly two broadcasts over the intercomm, so
+ * that all computation tasks make the same calls whatever the size
+ * of the message. The first carries the header and the inline part
+ * of the arguments. The second carries whatever did not fit inline,
+ * and the bulk payload; for small messages it is empty and moves no
+ * data. Before the second broadcast of a long message, the
+ * computation main task waits for the IO root to tell it whether all
+ * IO tasks could allocate the memory to receive it. If not, the
+ * second broadcast is empty, and both sides return an error.
+ *
+ * @param ios pointer to the iosystem info.
+ * @param mb pointer to the message buffer.
+ * @returns MPI_SUCCESS, MPI_ERR_NO_MEM if the arguments could not be
+ * packed or received, or the error from MPI.
+ * @author Jim Edwards
+ */
+int
+pio_msgbuf_send(iosystem_desc_t *ios, pio_msgbuf *mb)
+{
+    PIO_Offset *hdr = (PIO_Offset *)mb->buf;
+    PIO_Offset taillen = 0;
+    PIO_Offset bulklen = 0;
+    int ready = 1;
+    int mpierr;
+
+    if (mb->active)
+    {
+        if (!mb->err)
+        {
+            taillen = mb->pos > PIO_MSGBUF_INLINE_SIZE ? mb->pos - PIO_MSGBUF_INLINE_SIZE : 0;
+            bulklen = mb->bulklen;
+        }
+        hdr[0] = mb->err ? -1 : mb->pos;
+        hdr[1] = bulklen;
+        PLOG((3, "pio_msgbuf_send len = %lld bulklen = %lld", hdr[0], hdr[1]));
+    }
+
+    mpierr = MPI_Bcast(mb->buf, PIO_MSGBUF_INLINE_SIZE, MPI_BYTE, ios->compmain, ios->intercomm);
+
+    /* Find out whether the IO tasks can receive the rest. */
+    if (!mpierr && taillen + bulklen)
+    {
+        if (!(mpierr = MPI_Recv(&ready, 1, MPI_INT, ios->ioroot, PIO_MSGBUF_READY_TAG,
+                                ios->union_comm, MPI_STATUS_IGNORE)) && !ready)
+            taillen = bulklen = 0;
+    }
+
+    /* Send the rest of the arguments and the payload. */
+    if (!mpierr)
+        mpierr = msgbuf_send_rest(ios, mb, taillen, bulklen);
+
+    if (!mpierr && (mb->err || !ready))
+        mpierr = MPI_ERR_NO_MEM;
+
+    pio_msgbuf_free(mb);
+
+    return mpierr;
+}
+
+/**
+ * Receive a packed async message on the IO tasks. This matches
+ * pio_msgbuf_send() on the computation tasks. The arguments are then
+ * unpacked in order with pio_msgbuf_get(), pio_msgbuf_getp() and
+ * pio_msgbuf_get_bulk(), and the buffer released with
+ * pio_msgbuf_free().
+ *
+ * @param ios pointer to the iosystem info.
+ * @param mb pointer to the message buffer.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+pio_msgbuf_recv(iosystem_desc_t *ios, pio_msgbuf *mb)
+{
+    PIO_Offset *hdr;
+    PIO_Offset len, bulklen, taillen = 0;
+    int ready = 1;
+    int mpierr;
+
+    msgbuf_init(mb, 0);
+
+    if ((mpierr = MPI_Bcast(mb->buf, PIO_MSGBUF_INLINE_SIZE, MPI_BYTE, 0, ios->intercomm)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    hdr = (PIO_Offset *)mb->buf;
+    len = hdr[0];
+    bulklen = len < 0 ? 0 : hdr[1];
+    if (len > PIO_MSGBUF_INLINE_SIZE)
+        taillen = len - PIO_MSGBUF_INLINE_SIZE;
+    PLOG((3, "pio_msgbuf_recv len = %lld bulklen = %lld", len, bulklen));
+
+    /* The arguments which did not fit inline, and the payload, are
+     * received after the inline part. The IO tasks agree whether
+     * they all have the memory for them, and the IO root tells the
+     * computation main task, which sends nothing if they don't. */
+    if (taillen + bulklen)
+    {
+        char *newbuf;
+
+        if ((newbuf = malloc(PIO_MSGBUF_INLINE_SIZE + taillen + bulklen)))
+        {
+            memcpy(newbuf, mb->buf, PIO_MSGBUF_INLINE_SIZE);
+            mb->buf = newbuf;
+            mb->size = PIO_MSGBUF_INLINE_SIZE + taillen + bulklen;
+        }
+        else
+            ready = 0;
+        if ((mpierr = MPI_Allreduce(MPI_IN_PLACE, &ready, 1, MPI_INT, MPI_MIN, ios->io_comm)))
+            ready = 0;
+        else if (ios->iomain == MPI_ROOT)
+            mpierr = MPI_Send(&ready, 1, MPI_INT, ios->comproot, PIO_MSGBUF_READY_TAG,
+                              ios->union_comm);
+        if (mpierr)
+        {
+            pio_msgbuf_free(mb);
+            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+        }
+        if (!ready)
+            taillen = bulklen = 0;
+    }
+    if (taillen + bulklen <= INT_MAX)
+        mpierr = MPI_Bcast(mb->buf + PIO_MSGBUF_INLINE_SIZE, taillen + bulklen, MPI_BYTE, 0,
+                           ios->intercomm);
+    else
+    {
+        MPI_Datatype resttype;
+
+        if (!(mpierr = msgbuf_bytes_type(taillen + bulklen, &resttype)))
+        {
+            if (!(mpierr = MPI_Type_commit(&resttype)))
+                mpierr = MPI_Bcast(mb->buf + PIO_MSGBUF_INLINE_SIZE, 1, resttype, 0,
+                                   ios->intercomm);
+            MPI_Type_free(&resttype);
+        }
+    }
+    if (mpierr)
+    {
+        pio_msgbuf_free(mb);
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    }
+
+    /* The sender could not pack the arguments, or this side could
+     * not receive them. */
+    if (len < 0 || !ready)
+    {
+        pio_msgbuf_free(mb);
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    }
+
+    mb->len = len;
+    if (bulklen)
+    {
+        mb->bulk = mb->buf + PIO_MSGBUF_INLINE_SIZE + taillen;
+        mb->bulklen = bulklen;
+    }
+
+    return PIO_NOERR;
+}
+
+/**
+ * Unpack the next argument of an async message, returning a pointer
+ * to it inside the message buffer. The pointer is valid until
+ * pio_msgbuf_free() is called.
+ *
+ * @param mb pointer to the message buffer.
+ * @param len length of the argument in bytes.
+ * @returns pointer to the argument, or NULL if the message is too
+ * short.
+ * @author Jim Edwards
+ */
+void *
+pio_msgbuf_getp(pio_msgbuf *mb, PIO_Offset len)
+{
+    void *data;
+
+    if (len < 0 || mb->pos + PIO_MSGBUF_PAD(len) > mb->len)
+        return NULL;
+    data = mb->buf + mb->pos;
+    mb->pos += PIO_MSGBUF_PAD(len);
+
+    return data;
+}
+
+/**
+ * Unpack the next argument of an async message into a variable.
+ *
+ * @param mb pointer to the message buffer.
+ * @param data pointer that gets the argument.
+ * @param len length of the argument in bytes.
+ * @returns 0 for success, PIO_EINVAL if the message is too short.
+ * @author Jim Edwards
+ */
+int
+pio_msgbuf_get(pio_msgbuf *mb, void *data, PIO_Offset len)
+{
+    void *src;
+
+    if (!(src = pio_msgbuf_getp(mb, len)))
+        return PIO_EINVAL;
+    if (len)
+        memcpy(data, src, len);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Get the bulk payload of an async message, at the point where the
+ * sender called pio_msgbuf_put_bulk().
+ *
+ * @param mb pointer to the message buffer.
+ * @param len expected length of the payload in bytes.
+ * @returns pointer to the payload, or NULL if it does not have the
+ * expected length.
+ * @author Jim Edwards
+ */
+void *
+pio_msgbuf_get_bulk(pio_msgbuf *mb, PIO_Offset len)
+{
+    if (mb->bulk)
+        return mb->bulklen == len ? mb->bulk : NULL;
+
+    return pio_msgbuf_getp(mb, len);
+}
+
+/**
+ * Free any memory allocated for a message buffer.
+ *
+ * @param mb pointer to the message buffer.
+ * @author Jim Edwards
+ */
+void
+pio_msgbuf_free(pio_msgbuf *mb)
+{
+    if (mb->buf != (char *)mb->inline_buf)
+        free(mb->buf);
+    mb->buf = (char *)mb->inline_buf;
+    mb->size = PIO_MSGBUF_INLINE_SIZE;
+}
+
 /**
  * This function is run on the IO tasks to handle nc_inq_type*()
  * functions.
@@ -623,40 +1111,43 @@ int att_put_handler(iosystem_desc_t *ios)
     PIO_Offset atttype_len; /* Length in bytes of one elementy of type atttype. */
     nc_type memtype;    /* Type of att data in memory. */
     PIO_Offset memtype_len; /* Length of element of memtype. */
-    void *op;
-    int mpierr;
+    void *op = NULL;
+    pio_msgbuf mb;
+    int ret;
 
     PLOG((1, "att_put_handler"));
     assert(ios);
 
     /* Get the parameters for this function that the the comp main
-     * task is broadcasting. */
-    if ((mpierr = MPI_Bcast(&ncid, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&varid, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&namelen, 1, MPI_INT,  ios->compmain, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(name, namelen + 1, MPI_CHAR, ios->compmain, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&atttype, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&attlen, 1, MPI_OFFSET, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&atttype_len, 1, MPI_OFFSET, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&memtype, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&memtype_len, 1, MPI_OFFSET, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-
-    /* Allocate memory for the attribute data. */
-    if (!(op = malloc(attlen * memtype_len)))
-        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(op, attlen * memtype_len, MPI_BYTE, 0, ios->intercomm)))
+     * task is broadcasting. The attribute data is used in place in
+     * the message buffer. */
+    if ((ret = pio_msgbuf_recv(ios, &mb)))
+        return ret;
+    ret = pio_msgbuf_get(&mb, &ncid, sizeof(int));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &varid, sizeof(int));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &namelen, sizeof(int));
+    if (!ret && (namelen < 0 || namelen > PIO_MAX_NAME))
+        ret = PIO_EINVAL;
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, name, namelen + 1);
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &atttype, sizeof(nc_type));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &attlen, sizeof(PIO_Offset));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &atttype_len, sizeof(PIO_Offset));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &memtype, sizeof(nc_type));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &memtype_len, sizeof(PIO_Offset));
+    if (!ret && !(op = pio_msgbuf_get_bulk(&mb, attlen * memtype_len)))
+        ret = PIO_EINVAL;
+    if (ret)
     {
-        free(op);
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+        pio_msgbuf_free(&mb);
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
     }
     PLOG((1, "att_put_handler ncid = %d varid = %d namelen = %d name = %s"
           "atttype = %d attlen = %d atttype_len = %d memtype = %d memtype_len = 5d",
@@ -666,7 +1157,7 @@ int att_put_handler(iosystem_desc_t *ios)
     PIOc_put_att_tc(ncid, varid, name, atttype, attlen, memtype, op);
 
     /* Free resources. */
-    free(op);
+    pio_msgbuf_free(&mb);
 
     PLOG((2, "att_put_handler complete!"));
     return PIO_NOERR;
@@ -758,68 +1249,54 @@ int put_vars_handler(iosystem_desc_t *ios)
     PIO_Offset *countp = NULL;
     PIO_Offset *stridep = NULL;
     int ndims;           /* Number of dimensions. */
-    void *buf;           /* Buffer for data storage. */
+    void *buf = NULL;    /* Buffer for data storage. */
     PIO_Offset num_elem; /* Number of data elements in the buffer. */
-    int mpierr;          /* Error code from MPI function calls. */
+    pio_msgbuf mb;       /* The packed parameters. */
+    int ret;
 
     PLOG((1, "put_vars_handler"));
     assert(ios);
 
     /* Get the parameters for this function that the the comp main
-     * task is broadcasting. */
-    if ((mpierr = MPI_Bcast(&ncid, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&varid, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&ndims, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-
-    /* Now we know how big to make these arrays. */
-    PIO_Offset start[ndims], count[ndims], stride[ndims];
-
-    if ((mpierr = MPI_Bcast(&start_present, 1, MPI_CHAR, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if (start_present)
-        if ((mpierr = MPI_Bcast(start, ndims, MPI_OFFSET, 0, ios->intercomm)))
-            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    /* PLOG((1, "put_vars_handler getting start[0] = %d ndims = %d", start[0], ndims)); */
-    if ((mpierr = MPI_Bcast(&count_present, 1, MPI_CHAR, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if (count_present)
-        if ((mpierr = MPI_Bcast(count, ndims, MPI_OFFSET, 0, ios->intercomm)))
-            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&stride_present, 1, MPI_CHAR, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if (stride_present)
-        if ((mpierr = MPI_Bcast(stride, ndims, MPI_OFFSET, 0, ios->intercomm)))
-            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&xtype, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&num_elem, 1, MPI_OFFSET, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&typelen, 1, MPI_OFFSET, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+     * task is broadcasting. The arrays and the data are used in place
+     * in the message buffer. */
+    if ((ret = pio_msgbuf_recv(ios, &mb)))
+        return ret;
+    ret = pio_msgbuf_get(&mb, &ncid, sizeof(int));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &varid, sizeof(int));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &ndims, sizeof(int));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &start_present, 1);
+    if (!ret && start_present && !(startp = pio_msgbuf_getp(&mb, ndims * sizeof(PIO_Offset))))
+        ret = PIO_EINVAL;
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &count_present, 1);
+    if (!ret && count_present && !(countp = pio_msgbuf_getp(&mb, ndims * sizeof(PIO_Offset))))
+        ret = PIO_EINVAL;
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &stride_present, 1);
+    if (!ret && stride_present && !(stridep = pio_msgbuf_getp(&mb, ndims * sizeof(PIO_Offset))))
+        ret = PIO_EINVAL;
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &xtype, sizeof(nc_type));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &num_elem, sizeof(PIO_Offset));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &typelen, sizeof(PIO_Offset));
+    if (!ret && !(buf = pio_msgbuf_get_bulk(&mb, num_elem * typelen)))
+        ret = PIO_EINVAL;
+    if (ret)
+    {
+        pio_msgbuf_free(&mb);
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+    }
     PLOG((1, "put_vars_handler ncid = %d varid = %d ndims = %d "
           "start_present = %d count_present = %d stride_present = %d xtype = %d "
           "num_elem = %d typelen = %d", ncid, varid, ndims, start_present, count_present,
           stride_present, xtype, num_elem, typelen));
 
-    /* Allocate room for our data. */
-    if (!(buf = malloc(num_elem * typelen)))
-        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
-
-    /* Get the data. */
-    if ((mpierr = MPI_Bcast(buf, num_elem * typelen, MPI_BYTE, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-
-    /* Set the non-NULL pointers. */
-    if (start_present)
-        startp = start;
-    if (count_present)
-        countp = count;
-    if (stride_present)
-        stridep = stride;
-
     /* Call the function to write the data. No need to check return
      * values, they are bcast to computation tasks inside function. */
     switch(xtype)
@@ -871,7 +1348,7 @@ int put_vars_handler(iosystem_desc_t *ios)
 #endif /* _NETCDF4 */
     }
 
-    free(buf);
+    pio_msgbuf_free(&mb);
 
     return PIO_NOERR;
 }
@@ -1840,30 +2317,35 @@ int def_var_handler(iosystem_desc_t *ios)
     int varid;
     nc_type xtype;
     int ndims;
-    int *dimids;
-    int mpierr;
+    int *dimids = NULL;
+    pio_msgbuf mb;
+    int ret;
 
     PLOG((1, "def_var_handler comproot = %d", ios->comproot));
     assert(ios);
 
     /* Get the parameters for this function that the he comp main
-     * task is broadcasting. */
-    if ((mpierr = MPI_Bcast(&ncid, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&namelen, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(name, namelen + 1, MPI_CHAR, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&xtype, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&ndims, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if (!(dimids = malloc(ndims * sizeof(int))))
-        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(dimids, ndims, MPI_INT, 0, ios->intercomm)))
+     * task is broadcasting. The dimids are used in place in the
+     * message buffer. */
+    if ((ret = pio_msgbuf_recv(ios, &mb)))
+        return ret;
+    ret = pio_msgbuf_get(&mb, &ncid, sizeof(int));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &namelen, sizeof(int));
+    if (!ret && (namelen < 0 || namelen > PIO_MAX_NAME))
+        ret = PIO_EINVAL;
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, name, namelen + 1);
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &xtype, sizeof(nc_type));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &ndims, sizeof(int));
+    if (!ret && !(dimids = pio_msgbuf_getp(&mb, ndims * sizeof(int))))
+        ret = PIO_EINVAL;
+    if (ret)
     {
-        free(dimids);
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+        pio_msgbuf_free(&mb);
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
     }
     PLOG((1, "def_var_handler got parameters namelen = %d "
           "name = %s ncid = %d", namelen, name, ncid));
@@ -1872,12 +2354,233 @@ int def_var_handler(iosystem_desc_t *ios)
     PIOc_def_var(ncid, name, xtype, ndims, dimids, &varid);
 
     /* Free resources. */
-    free(dimids);
+    pio_msgbuf_free(&mb);
 
     PLOG((1, "def_var_handler succeeded!"));
     return PIO_NOERR;
 }
 
+/**
+ * Replay a deferred call to PIOc_def_dim() on the IO tasks.
+ *
+ * @param file pointer to the file info.
+ * @param mb pointer to the message buffer, positioned after the call
+ * type.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+replay_def_dim(file_desc_t *file, pio_msgbuf *mb)
+{
+    char name[PIO_MAX_NAME + 1];
+    int namelen;
+    PIO_Offset len;
+    int dimid, expected_dimid;
+    int ret;
+
+    ret = pio_msgbuf_get(mb, &namelen, sizeof(int));
+    if (!ret && (namelen < 0 || namelen > PIO_MAX_NAME))
+        ret = PIO_EINVAL;
+    if (!ret)
+        ret = pio_msgbuf_get(mb, name, namelen + 1);
+    if (!ret)
+        ret = pio_msgbuf_get(mb, &len, sizeof(PIO_Offset));
+    if (!ret)
+        ret = pio_msgbuf_get(mb, &expected_dimid, sizeof(int));
+    if (ret)
+        return ret;
+    PLOG((2, "replay_def_dim name = %s len = %lld", name, len));
+
+    if ((ret = pioc_def_dim_io(file, name, len, &dimid)))
+        return ret;
+
+    /* The computation tasks have already returned this ID. */
+    if ((file->iotype == PIO_IOTYPE_PNETCDF || file->do_io) && dimid != expected_dimid)
+        return PIO_EINVAL;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Replay a deferred call to PIOc_def_var() on the IO tasks.
+ *
+ * @param file pointer to the file info.
+ * @param mb pointer to the message buffer, positioned after the call
+ * type.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+replay_def_var(file_desc_t *file, pio_msgbuf *mb)
+{
+    char name[PIO_MAX_NAME + 1];
+    int namelen;
+    nc_type xtype;
+    int ndims;
+    int *dimids = NULL;
+    int rec_var;
+    int varid, expected_varid;
+    MPI_Datatype mpi_type;
+    int type_size;
+    int mpi_type_size = 0;
+    int mpierr;
+    int ret;
+
+    ret = pio_msgbuf_get(mb, &namelen, sizeof(int));
+    if (!ret && (namelen < 0 || namelen > PIO_MAX_NAME))
+        ret = PIO_EINVAL;
+    if (!ret)
+        ret = pio_msgbuf_get(mb, name, namelen + 1);
+    if (!ret)
+        ret = pio_msgbuf_get(mb, &xtype, sizeof(nc_type));
+    if (!ret)
+        ret = pio_msgbuf_get(mb, &ndims, sizeof(int));
+    if (!ret && !(dimids = pio_msgbuf_getp(mb, ndims * sizeof(int))))
+        ret = PIO_EINVAL;
+    if (!ret)
+        ret = pio_msgbuf_get(mb, &rec_var, sizeof(int));
+    if (!ret)
+        ret = pio_msgbuf_get(mb, &expected_varid, sizeof(int));
+    if (ret)
+        return ret;
+    PLOG((2, "replay_def_var name = %s xtype = %d ndims = %d", name, xtype, ndims));
+
+    if ((ret = pioc_def_var_io(file, name, xtype, ndims, dimids, &varid)))
+        return ret;
+
+    /* The computation tasks have already returned this ID. */
+    if ((file->iotype == PIO_IOTYPE_PNETCDF || file->do_io) && varid != expected_varid)
+        return PIO_EINVAL;
+
+    /* Add to the list of var_desc_t structs for this file, as
+     * PIOc_def_var() does. */
+    if ((ret = find_mpi_type(xtype, &mpi_type, &type_size)))
+        return ret;
+    if (mpi_type != MPI_DATATYPE_NULL)
+        if ((mpierr = MPI_Type_size(mpi_type, &mpi_type_size)))
+            return PIO_EIO;
+    if ((ret = add_to_varlist(expected_varid, rec_var, xtype, type_size, mpi_type,
+                              mpi_type_size, ndims, &file->varlist)))
+        return ret;
+    file->nvars++;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Replay a deferred call to PIOc_put_att_tc() on the IO tasks.
+ *
+ * @param file pointer to the file info.
+ * @param mb pointer to the message buffer, positioned after the call
+ * type.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+replay_put_att(file_desc_t *file, pio_msgbuf *mb)
+{
+    int varid;
+    char name[PIO_MAX_NAME + 1];
+    int namelen;
+    nc_type atttype;
+    PIO_Offset attlen;
+    nc_type memtype;
+    PIO_Offset memtype_len;
+    void *op = NULL;
+    int ret;
+
+    ret = pio_msgbuf_get(mb, &varid, sizeof(int));
+    if (!ret)
+        ret = pio_msgbuf_get(mb, &namelen, sizeof(int));
+    if (!ret && (namelen < 0 || namelen > PIO_MAX_NAME))
+        ret = PIO_EINVAL;
+    if (!ret)
+        ret = pio_msgbuf_get(mb, name, namelen + 1);
+    if (!ret)
+        ret = pio_msgbuf_get(mb, &atttype, sizeof(nc_type));
+    if (!ret)
+        ret = pio_msgbuf_get(mb, &attlen, sizeof(PIO_Offset));
+    if (!ret)
+        ret = pio_msgbuf_get(mb, &memtype, sizeof(nc_type));
+    if (!ret)
+        ret = pio_msgbuf_get(mb, &memtype_len, sizeof(PIO_Offset));
+    if (!ret && !(op = pio_msgbuf_getp(mb, attlen * memtype_len)))
+        ret = PIO_EINVAL;
+    if (ret)
+        return ret;
+    PLOG((2, "replay_put_att varid = %d name = %s attlen = %lld", varid, name, attlen));
+
+    return pioc_put_att_io(file, varid, name, atttype, attlen, memtype, op);
+}
+
+/**
+ * This function is run on the IO tasks to replay the define-mode
+ * calls which the computation tasks deferred (see
+ * PIOc_set_batch_define()). The calls are made in order, until one
+ * fails. The error, and the number of the call which failed, are
+ * then returned to the computation tasks.
+ *
+ * @param ios pointer to the iosystem_desc_t.
+ * @returns 0 for success, error code otherwise.
+ * @internal
+ * @author Jim Edwards
+ */
+int def_batch_handler(iosystem_desc_t *ios)
+{
+    int ncid;
+    file_desc_t *file = NULL;
+    int result[2] = {PIO_NOERR, 0}; /* Error code, and the call which failed. */
+    pio_msgbuf mb;                  /* The deferred calls. */
+    int mpierr = MPI_SUCCESS, mpierr2;
+    int ret;
+
+    PLOG((1, "def_batch_handler"));
+    assert(ios);
+
+    if ((ret = pio_msgbuf_recv(ios, &mb)))
+        return ret;
+
+    /* Handle MPI errors. */
+    if ((mpierr2 = MPI_Bcast(&mpierr, 1, MPI_INT, ios->comproot, ios->my_comm)))
+        mpierr = mpierr2;
+    if (mpierr)
+    {
+        pio_msgbuf_free(&mb);
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    }
+
+    if ((ret = pio_msgbuf_get(&mb, &ncid, sizeof(int))) || (ret = pio_get_file(ncid, &file)))
+        result[0] = ret;
+
+    /* Replay the calls in the order they were made. */
+    while (!result[0] && mb.pos < mb.len)
+    {
+        int op;
+
+        result[1]++;
+        if ((ret = pio_msgbuf_get(&mb, &op, sizeof(int))))
+            result[0] = ret;
+        else if (op == PIO_MSG_DEF_DIM)
+            result[0] = replay_def_dim(file, &mb);
+        else if (op == PIO_MSG_DEF_VAR)
+            result[0] = replay_def_var(file, &mb);
+        else if (op == PIO_MSG_PUT_ATT)
+            result[0] = replay_put_att(file, &mb);
+        else
+            result[0] = PIO_EINVAL;
+    }
+    pio_msgbuf_free(&mb);
+    PLOG((2, "def_batch_handler replayed %d calls, result = %d", result[1], result[0]));
+
+    /* Return the result to the computation tasks. */
+    if ((mpierr = MPI_Bcast(result, 2, MPI_INT, ios->ioroot, ios->my_comm)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if (result[0])
+        check_netcdf2(ios, file, result[0], __FILE__, __LINE__);
+
+    return PIO_NOERR;
+}
+
 /**
  * This function is run on the IO tasks to define chunking for a
  *  netCDF variable.
@@ -2118,21 +2821,28 @@ int def_dim_handler(iosystem_desc_t *ios)
     int len, namelen;
     char name[PIO_MAX_NAME + 1];
     int dimid;
-    int mpierr;
+    pio_msgbuf mb;
+    int ret;
 
     PLOG((1, "def_dim_handler comproot = %d", ios->comproot));
     assert(ios);
 
     /* Get the parameters for this function that the he comp main
      * task is broadcasting. */
-    if ((mpierr = MPI_Bcast(&ncid, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&namelen, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(name, namelen + 1, MPI_CHAR, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&len, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((ret = pio_msgbuf_recv(ios, &mb)))
+        return ret;
+    ret = pio_msgbuf_get(&mb, &ncid, sizeof(int));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &namelen, sizeof(int));
+    if (!ret && (namelen < 0 || namelen > PIO_MAX_NAME))
+        ret = PIO_EINVAL;
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, name, namelen + 1);
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &len, sizeof(int));
+    pio_msgbuf_free(&mb);
+    if (ret)
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
     PLOG((2, "def_dim_handler got parameters namelen = %d "
           "name = %s len = %d ncid = %d", namelen, name, len, ncid));
 
@@ -2444,63 +3154,47 @@ int initdecomp_dof_handler(iosystem_desc_t *ios)
     PIO_Offset *iostartp = NULL;
     char iocount_present;
     PIO_Offset *iocountp = NULL;
-    int mpierr = MPI_SUCCESS;  /* Return code from MPI function codes. */
+    int *dims = NULL;
+    PIO_Offset *compmap = NULL;
+    pio_msgbuf mb;     /* The packed parameters. */
+    int ret;
 
     PLOG((1, "initdecomp_dof_handler called"));
     assert(ios);
 
     /* Get the parameters for this function that the the comp main
-     * task is broadcasting. */
-    if ((mpierr = MPI_Bcast(&iosysid, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    PLOG((3, "initdecomp_dof_handler iosysid %d",iosysid));
-    if ((mpierr = MPI_Bcast(&pio_type, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    PLOG((3, "initdecomp_dof_handler pio_type %d", pio_type));
-    if ((mpierr = MPI_Bcast(&ndims, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    PLOG((3, "initdecomp_dof_handler ndims %d", ndims));
-
-    /* Now we know the size of these arrays. */
-    int dims[ndims];
-    PIO_Offset iostart[ndims];
-    PIO_Offset iocount[ndims];
-
-    if ((mpierr = MPI_Bcast(dims, ndims, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    for(int i=0; i<ndims; i++)
-        PLOG((3, "initdecomp_dof_handler dims[%d] %d", i, dims[i]));
-    if ((mpierr = MPI_Bcast(&maplen, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    PLOG((3, "initdecomp_dof_handler maplen %d", maplen));
-
-    PIO_Offset *compmap;
-    if (!(compmap = malloc(maplen * sizeof(PIO_Offset))))
-        return pio_err(NULL, NULL, PIO_ENOMEM, __FILE__, __LINE__);
-
-    if ((mpierr = MPI_Bcast(compmap, maplen, MPI_OFFSET, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-
-    if ((mpierr = MPI_Bcast(&rearranger_present, 1, MPI_CHAR, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-
-    if (rearranger_present)
-        if ((mpierr = MPI_Bcast(&rearranger, 1, MPI_INT, 0, ios->intercomm)))
-            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-
-    if ((mpierr = MPI_Bcast(&iostart_present, 1, MPI_CHAR, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-
-    if (iostart_present)
-        if ((mpierr = MPI_Bcast(iostart, ndims, MPI_OFFSET, 0, ios->intercomm)))
-            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-
-    if ((mpierr = MPI_Bcast(&iocount_present, 1, MPI_CHAR, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-
-    if (iocount_present)
-        if ((mpierr = MPI_Bcast(iocount, ndims, MPI_OFFSET, 0, ios->intercomm)))
-            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+     * task is broadcasting. The arrays are used in place in the
+     * message buffer. */
+    if ((ret = pio_msgbuf_recv(ios, &mb)))
+        return ret;
+    ret = pio_msgbuf_get(&mb, &iosysid, sizeof(int));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &pio_type, sizeof(int));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &ndims, sizeof(int));
+    if (!ret && !(dims = pio_msgbuf_getp(&mb, ndims * sizeof(int))))
+        ret = PIO_EINVAL;
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &maplen, sizeof(int));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &rearranger_present, 1);
+    if (!ret && rearranger_present)
+        ret = pio_msgbuf_get(&mb, &rearranger, sizeof(int));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &iostart_present, 1);
+    if (!ret && iostart_present && !(iostartp = pio_msgbuf_getp(&mb, ndims * sizeof(PIO_Offset))))
+        ret = PIO_EINVAL;
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &iocount_present, 1);
+    if (!ret && iocount_present && !(iocountp = pio_msgbuf_getp(&mb, ndims * sizeof(PIO_Offset))))
+        ret = PIO_EINVAL;
+    if (!ret && !(compmap = pio_msgbuf_get_bulk(&mb, maplen * sizeof(PIO_Offset))))
+        ret = PIO_EINVAL;
+    if (ret)
+    {
+        pio_msgbuf_free(&mb);
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+    }
 
     PLOG((2, "initdecomp_dof_handler iosysid = %d pio_type = %d ndims = %d maplen = %d "
           "rearranger_present = %d iostart_present = %d iocount_present = %d ",
@@ -2508,10 +3202,6 @@ int initdecomp_dof_handler(iosystem_desc_t *ios)
 
     if (rearranger_present)
         rearrangerp = &rearranger;
-    if (iostart_present)
-        iostartp = iostart;
-    if (iocount_present)
-        iocountp = iocount;
 
     /* Call the function. */
     PIOc_InitDecomp(iosysid, pio_type, ndims, dims, maplen, compmap, &ioid, rearrangerp,
@@ -2519,7 +3209,7 @@ int initdecomp_dof_handler(iosystem_desc_t *ios)
 
     PLOG((1, "PIOc_InitDecomp returned"));
 
-    free(compmap);
+    pio_msgbuf_free(&mb);
     return PIO_NOERR;
 }
 
@@ -2538,85 +3228,77 @@ int write_darray_multi_handler(iosystem_desc_t *ios)
     int ncid;
     file_desc_t *file;     /* Pointer to file information. */
     int nvars;
+    int *varids = NULL;
     int ioid;
     io_desc_t *iodesc;     /* The IO description. */
     char frame_present;
     int *framep = NULL;
-    int *frame;
     PIO_Offset arraylen;
-    void *array;
+    void *array = NULL;
     char fillvalue_present;
     void *fillvaluep = NULL;
-    void *fillvalue;
     int flushtodisk;
-    int mpierr;
+    pio_msgbuf mb;         /* The packed parameters. */
     int ret;
 
     PLOG((1, "write_darray_multi_handler"));
     assert(ios);
 
     /* Get the parameters for this function that the the comp main
-     * task is broadcasting. */
-    if ((mpierr = MPI_Bcast(&ncid, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&nvars, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    int varids[nvars];
-    if ((mpierr = MPI_Bcast(varids, nvars, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&ioid, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+     * task is broadcasting. The arrays and the data are used in place
+     * in the message buffer. */
+    if ((ret = pio_msgbuf_recv(ios, &mb)))
+        return ret;
+    ret = pio_msgbuf_get(&mb, &ncid, sizeof(int));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &nvars, sizeof(int));
+    if (!ret && !(varids = pio_msgbuf_getp(&mb, nvars * sizeof(int))))
+        ret = PIO_EINVAL;
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &ioid, sizeof(int));
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &arraylen, sizeof(PIO_Offset));
+    if (ret)
+    {
+        pio_msgbuf_free(&mb);
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+    }
 
     /* Get decomposition information. */
     if (!(iodesc = pio_get_iodesc_from_id(ioid)))
-        return pio_err(ios, NULL, PIO_EBADID, __FILE__, __LINE__);
-
-    if ((mpierr = MPI_Bcast(&arraylen, 1, MPI_OFFSET, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if (!(array = malloc(arraylen * iodesc->piotype_size)))
-        return pio_err(NULL, NULL, PIO_ENOMEM, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(array, arraylen * iodesc->piotype_size, MPI_CHAR, 0,
-                            ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if ((mpierr = MPI_Bcast(&frame_present, 1, MPI_CHAR, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if (frame_present)
     {
-        if (!(frame = malloc(nvars * sizeof(int))))
-            return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
-        if ((mpierr = MPI_Bcast(frame, nvars, MPI_INT, 0, ios->intercomm)))
-            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+        pio_msgbuf_free(&mb);
+        return pio_err(ios, NULL, PIO_EBADID, __FILE__, __LINE__);
     }
-    if ((mpierr = MPI_Bcast(&fillvalue_present, 1, MPI_CHAR, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
-    if (fillvalue_present)
+
+    if (!(array = pio_msgbuf_get_bulk(&mb, arraylen * iodesc->piotype_size)))
+        ret = PIO_EINVAL;
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &frame_present, 1);
+    if (!ret && frame_present && !(framep = pio_msgbuf_getp(&mb, nvars * sizeof(int))))
+        ret = PIO_EINVAL;
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &fillvalue_present, 1);
+    if (!ret && fillvalue_present &&
+        !(fillvaluep = pio_msgbuf_getp(&mb, nvars * iodesc->piotype_size)))
+        ret = PIO_EINVAL;
+    if (!ret)
+        ret = pio_msgbuf_get(&mb, &flushtodisk, sizeof(int));
+    if (ret)
     {
-        if (!(fillvalue = malloc(nvars * iodesc->piotype_size)))
-            return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
-        if ((mpierr = MPI_Bcast(fillvalue, nvars * iodesc->piotype_size, MPI_CHAR, 0, ios->intercomm)))
-            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+        pio_msgbuf_free(&mb);
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
     }
-    if ((mpierr = MPI_Bcast(&flushtodisk, 1, MPI_INT, 0, ios->intercomm)))
-        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
     PLOG((1, "write_darray_multi_handler ncid = %d nvars = %d ioid = %d arraylen = %d "
           "frame_present = %d fillvalue_present flushtodisk = %d", ncid, nvars,
           ioid, arraylen, frame_present, fillvalue_present, flushtodisk));
 
     /* Get file info based on ncid. */
     if ((ret = pio_get_file(ncid, &file)))
+    {
+        pio_msgbuf_free(&mb);
         return pio_err(NULL, NULL, ret, __FILE__, __LINE__);
-
-    /* Get decomposition information. */
-    if (!(iodesc = pio_get_iodesc_from_id(ioid)))
-        return pio_err(ios, file, PIO_EBADID, __FILE__, __LINE__);
-
-    /* Was a frame array provided? */
-    if (frame_present)
-        framep = frame;
-
-    /* Was a fillvalue array provided? */
-    if (fillvalue_present)
-        fillvaluep = fillvalue;
+    }
 
     /* Call the function from IO tasks. Errors are handled within
      * function. */
@@ -2624,11 +3306,7 @@ int write_darray_multi_handler(iosystem_desc_t *ios)
                             fillvaluep, flushtodisk);
 
     /* Free resources. */
-    if (frame_present)
-        free(frame);
-    if (fillvalue_present)
-        free(fillvalue);
-    free(array);
+    pio_msgbuf_free(&mb);
 
     PLOG((1, "write_darray_multi_handler succeeded!"));
     return PIO_NOERR;
@@ -2676,6 +3354,65 @@ int read_darray_handler(iosystem_desc_t *ios)
     return PIO_NOERR;
 }
 
+/**
+ * This function is run on the IO tasks to read several distributed
+ * arrays with the same decomposition.
+ *
+ * @param ios pointer to the iosystem_desc_t data.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+int read_darray_multi_handler(iosystem_desc_t *ios)
+{
+    int ncid;
+    int nvars;
+    int ioid;
+    char frame_present;
+    int *varids;
+    int *frames = NULL;
+    int mpierr;
+
+    PLOG((1, "read_darray_multi_handler called"));
+    assert(ios);
+
+    /* Get the parameters for this function that the the comp main
+     * task is broadcasting. */
+    if ((mpierr = MPI_Bcast(&ncid, 1, MPI_INT, 0, ios->intercomm)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Bcast(&nvars, 1, MPI_INT, 0, ios->intercomm)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if (!(varids = malloc(2 * max(1, nvars) * sizeof(int))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    if ((mpierr = MPI_Bcast(varids, nvars, MPI_INT, 0, ios->intercomm)))
+    {
+        free(varids);
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    }
+    if (!(mpierr = MPI_Bcast(&ioid, 1, MPI_INT, 0, ios->intercomm)))
+        mpierr = MPI_Bcast(&frame_present, 1, MPI_CHAR, 0, ios->intercomm);
+    if (!mpierr && frame_present)
+    {
+        frames = varids + max(1, nvars);
+        mpierr = MPI_Bcast(frames, nvars, MPI_INT, 0, ios->intercomm);
+    }
+    if (mpierr)
+    {
+        free(varids);
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    }
+    PLOG((2, "ncid %d nvars %d ioid %d frame_present %d", ncid, nvars, ioid,
+          frame_present));
+
+    /* Call the function from IO tasks. Errors are handled within
+     * function. */
+    PIOc_read_darray_multi(ncid, nvars, varids, ioid, frames, NULL);
+
+    free(varids);
+
+    PLOG((1, "read_darray_multi_handler succeeded!"));
+    return PIO_NOERR;
+}
+
 /**
  * This function is run on the IO tasks to set the error handler.
  *
@@ -2717,6 +3454,70 @@ int seterrorhandling_handler(iosystem_desc_t *ios)
     return PIO_NOERR;
 }
 
+/**
+ * This function is run on the IO tasks to set the IO buffer pool.
+ *
+ * @param ios pointer to the iosystem_desc_t data.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+int set_iobuf_pool_handler(iosystem_desc_t *ios)
+{
+    int flags;
+    PIO_Offset max_cached;
+    int mpierr;
+
+    PLOG((1, "set_iobuf_pool_handler called"));
+    assert(ios);
+
+    /* Get the parameters for this function that the the comp main
+     * task is broadcasting. */
+    if ((mpierr = MPI_Bcast(&flags, 1, MPI_INT, 0, ios->intercomm)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Bcast(&max_cached, 1, MPI_OFFSET, 0, ios->intercomm)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    PLOG((1, "set_iobuf_pool_handler got params flags = %d max_cached = %lld",
+          flags, max_cached));
+
+    /* Call the function. */
+    PIOc_set_iobuf_pool(ios->iosysid, flags, max_cached);
+
+    PLOG((1, "set_iobuf_pool_handler succeeded!"));
+    return PIO_NOERR;
+}
+
+/**
+ * This function is run on the IO tasks to set the memory budget.
+ *
+ * @param ios pointer to the iosystem_desc_t data.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+int set_mem_budget_handler(iosystem_desc_t *ios)
+{
+    PIO_Offset budget;
+    int flush_order;
+    int mpierr;
+
+    PLOG((1, "set_mem_budget_handler called"));
+    assert(ios);
+
+    /* Get the parameters for this function that the the comp main
+     * task is broadcasting. */
+    if ((mpierr = MPI_Bcast(&budget, 1, MPI_OFFSET, 0, ios->intercomm)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Bcast(&flush_order, 1, MPI_INT, 0, ios->intercomm)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    PLOG((1, "set_mem_budget_handler got params budget = %lld flush_order = %d",
+          budget, flush_order));
+
+    /* Call the function. */
+    PIOc_set_mem_budget(ios->iosysid, budget, flush_order);
+
+    PLOG((1, "set_mem_budget_handler succeeded!"));
+    return PIO_NOERR;
+}
+
 /**
  * This function is run on the IO tasks to set the chunk cache
  * parameters for netCDF-4.
@@ -3177,6 +3978,9 @@ int pio_msg_handler2(int io_rank, int component_count, iosystem_desc_t **iosys,
 	    case PIO_MSG_DEF_VAR:
 	      ret = def_var_handler(my_iosys);
 	      break;
+	    case PIO_MSG_DEF_BATCH:
+	      ret = def_batch_handler(my_iosys);
+	      break;
 #ifdef PIO_HAS_PAR_FILTERS
 #ifdef NC_HAS_ZSTD
 	    case PIO_MSG_INQ_VAR_ZSTANDARD:
@@ -3271,12 +4075,21 @@ int pio_msg_handler2(int io_rank, int component_count, iosystem_desc_t **iosys,
 	    case PIO_MSG_READDARRAY:
 	      ret = read_darray_handler(my_iosys);
 	      break;
+	    case PIO_MSG_READDARRAYMULTI:
+	      ret = read_darray_multi_handler(my_iosys);
+	      break;
 	    case PIO_MSG_SETERRORHANDLING:
 	      ret = seterrorhandling_handler(my_iosys);
 	      break;
 	    case PIO_MSG_SET_CHUNK_CACHE:
 	      ret = set_chunk_cache_handler(my_iosys);
 	      break;
+	    case PIO_MSG_SET_IOBUF_POOL:
+	      ret = set_iobuf_pool_handler(my_iosys);
+	      break;
+	    case PIO_MSG_SET_MEM_BUDGET:
+	      ret = set_mem_budget_handler(my_iosys);
+	      break;
 	    case PIO_MSG_GET_CHUNK_CACHE:
 	      ret = get_chunk_cache_handler(my_iosys);
 	      break;
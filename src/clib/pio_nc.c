@@ -107,6 +107,10 @@ PIOc_inq(int ncid, int *ndimsp, int *nvarsp, int *ngattsp, int *unlimdimidp)
         return pio_err(NULL, NULL, ierr, __FILE__, __LINE__);
     ios = file->iosystem;
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -304,6 +308,11 @@ PIOc_inq_unlimdims(int ncid, int *nunlimdimsp, int *unlimdimidsp)
         return pio_err(NULL, NULL, ierr, __FILE__, __LINE__);
     ios = file->iosystem;
 
+    /* With deferred define-mode calls, the computation tasks know
+     * the answer. */
+    if (pio_batch_inq_unlimdims(file, nunlimdimsp, unlimdimidsp))
+        return PIO_NOERR;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -530,6 +539,10 @@ PIOc_inq_format(int ncid, int *formatp)
         return pio_err(NULL, NULL, ierr, __FILE__, __LINE__);
     ios = file->iosystem;
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -615,6 +628,11 @@ PIOc_inq_dim(int ncid, int dimid, char *name, PIO_Offset *lenp)
         return pio_err(NULL, NULL, ierr, __FILE__, __LINE__);
     ios = file->iosystem;
 
+    /* A deferred dimension is known to the computation tasks. Other
+     * dimensions are not changed by the deferred calls. */
+    if (pio_batch_inq_dim(file, dimid, name, lenp))
+        return PIO_NOERR;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -763,6 +781,10 @@ PIOc_inq_dimid(int ncid, const char *name, int *idp)
 
     PLOG((1, "PIOc_inq_dimid ncid = %d name = %s", ncid, name));
 
+    /* A deferred dimension is known to the computation tasks. */
+    if (pio_batch_inq_dimid(file, name, idp))
+        return PIO_NOERR;
+
     /* If using async, and not an IO task, then send parameters. */
     if (ios->async)
     {
@@ -861,6 +883,10 @@ PIOc_inq_var(int ncid, int varid, char *name, nc_type *xtypep, int *ndimsp,
         return pio_err(NULL, NULL, ierr, __FILE__, __LINE__);
     ios = file->iosystem;
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -1119,6 +1145,10 @@ PIOc_inq_varid(int ncid, const char *name, int *varidp)
 
     PLOG((1, "PIOc_inq_varid ncid = %d name = %s", ncid, name));
 
+    /* A deferred variable is known to the computation tasks. */
+    if (pio_batch_inq_varid(file, name, varidp))
+        return PIO_NOERR;
+
     if (ios->async)
     {
         if (!ios->ioproc)
@@ -1212,6 +1242,10 @@ PIOc_inq_att_eh(int ncid, int varid, const char *name, int eh,
 
     PLOG((1, "PIOc_inq_att ncid = %d varid = %d", ncid, varid));
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -1374,6 +1408,10 @@ PIOc_inq_attname(int ncid, int varid, int attnum, char *name)
         return pio_err(NULL, NULL, ierr, __FILE__, __LINE__);
     ios = file->iosystem;
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -1473,6 +1511,10 @@ PIOc_inq_attid(int ncid, int varid, const char *name, int *idp)
 
     PLOG((1, "PIOc_inq_attid ncid = %d varid = %d name = %s", ncid, varid, name));
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -1567,6 +1609,10 @@ PIOc_rename_dim(int ncid, int dimid, const char *name)
 
     PLOG((1, "PIOc_rename_dim ncid = %d dimid = %d name = %s", ncid, dimid, name));
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -1656,6 +1702,10 @@ PIOc_rename_var(int ncid, int varid, const char *name)
 
     PLOG((1, "PIOc_rename_var ncid = %d varid = %d name = %s", ncid, varid, name));
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -1749,6 +1799,10 @@ PIOc_rename_att(int ncid, int varid, const char *name,
     PLOG((1, "PIOc_rename_att ncid = %d varid = %d name = %s newname = %s",
           ncid, varid, name, newname));
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -1839,6 +1893,10 @@ PIOc_del_att(int ncid, int varid, const char *name)
 
     PLOG((1, "PIOc_del_att ncid = %d varid = %d name = %s", ncid, varid, name));
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -1919,6 +1977,10 @@ PIOc_set_fill(int ncid, int fillmode, int *old_modep)
         return pio_err(NULL, NULL, ierr, __FILE__, __LINE__);
     ios = file->iosystem;
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -2021,6 +2083,36 @@ PIOc_redef(int ncid)
     return pioc_change_def(ncid, 0);
 }
 
+/**
+ * Define a dimension on the IO tasks. This is the part of
+ * PIOc_def_dim() which runs on the IO tasks. It does no communication
+ * with the computation tasks, so it is also used to replay deferred
+ * calls (see PIOc_set_batch_define()).
+ *
+ * @param file pointer to the file info.
+ * @param name name of the dimension.
+ * @param len length of the dimension.
+ * @param idp a pointer that will get the id of the dimension. Only
+ * set on tasks that do IO. Ignored if NULL.
+ * @return netCDF error code.
+ * @author Jim Edwards
+ */
+int
+pioc_def_dim_io(file_desc_t *file, const char *name, PIO_Offset len, int *idp)
+{
+    int ierr = PIO_NOERR;
+
+#ifdef _PNETCDF
+    if (file->iotype == PIO_IOTYPE_PNETCDF)
+        ierr = ncmpi_def_dim(file->fh, name, len, idp);
+#endif /* _PNETCDF */
+
+    if (file->iotype != PIO_IOTYPE_PNETCDF && file->do_io)
+        ierr = nc_def_dim(file->fh, name, (size_t)len, idp);
+
+    return ierr;
+}
+
 /**
  * The PIO-C interface for the NetCDF function nc_def_dim.
  *
@@ -2057,6 +2149,15 @@ PIOc_def_dim(int ncid, const char *name, PIO_Offset len, int *idp)
 
     PLOG((1, "PIOc_def_dim ncid = %d name = %s len = %d", ncid, name, len));
 
+    /* In async mode, the call may be deferred until enddef. */
+    if (ios->async && !ios->ioproc)
+    {
+        if (ios->batch_define)
+            return pio_batch_def_dim(file, name, len, idp);
+        if ((ierr = pio_batch_flush(file)))
+            return ierr;
+    }
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -2064,19 +2165,16 @@ PIOc_def_dim(int ncid, const char *name, PIO_Offset len, int *idp)
         {
             int msg = PIO_MSG_DEF_DIM;
             int namelen = strlen(name);
+            pio_msgbuf mb; /* The packed parameters. */
 
-            if (ios->compmain == MPI_ROOT)
-                mpierr = MPI_Send(&msg, 1,MPI_INT, ios->ioroot, 1, ios->union_comm);
-
-            if (!mpierr)
-                mpierr = MPI_Bcast(&ncid, 1, MPI_INT, ios->compmain, ios->intercomm);
-
-            if (!mpierr)
-                mpierr = MPI_Bcast(&namelen, 1, MPI_INT,  ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast((void *)name, namelen + 1, MPI_CHAR, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&len, 1, MPI_INT,  ios->compmain, ios->intercomm);
+            if (!(mpierr = pio_msgbuf_start(ios, &mb, msg)))
+            {
+                pio_msgbuf_put(&mb, &ncid, sizeof(int));
+                pio_msgbuf_put(&mb, &namelen, sizeof(int));
+                pio_msgbuf_put(&mb, name, namelen + 1);
+                pio_msgbuf_put(&mb, &len, sizeof(int));
+                mpierr = pio_msgbuf_send(ios, &mb);
+            }
         }
 
 
@@ -2089,16 +2187,7 @@ PIOc_def_dim(int ncid, const char *name, PIO_Offset len, int *idp)
 
     /* If this is an IO task, then call the netCDF function. */
     if (ios->ioproc)
-    {
-#ifdef _PNETCDF
-
-        if (file->iotype == PIO_IOTYPE_PNETCDF)
-            ierr = ncmpi_def_dim(file->fh, name, len, idp);
-#endif /* _PNETCDF */
-
-        if (file->iotype != PIO_IOTYPE_PNETCDF && file->do_io)
-            ierr = nc_def_dim(file->fh, name, (size_t)len, idp);
-    }
+        ierr = pioc_def_dim_io(file, name, len, idp);
 
     /* Broadcast and check the return code. */
     if ((mpierr = MPI_Bcast(&ierr, 1, MPI_INT, ios->ioroot, ios->my_comm)))
@@ -2115,6 +2204,46 @@ PIOc_def_dim(int ncid, const char *name, PIO_Offset len, int *idp)
     return PIO_NOERR;
 }
 
+/**
+ * Define a variable on the IO tasks. This is the part of
+ * PIOc_def_var() which runs on the IO tasks. It does no communication
+ * with the computation tasks, so it is also used to replay deferred
+ * calls (see PIOc_set_batch_define()).
+ *
+ * @param file pointer to the file info.
+ * @param name the variable name.
+ * @param xtype the PIO_TYPE of the variable.
+ * @param ndims the number of dimensions.
+ * @param dimidsp pointer to array of dimension IDs.
+ * @param varidp a pointer that will get the variable ID. Only set on
+ * tasks that do IO.
+ * @return netCDF error code.
+ * @author Jim Edwards
+ */
+int
+pioc_def_var_io(file_desc_t *file, const char *name, nc_type xtype, int ndims,
+                const int *dimidsp, int *varidp)
+{
+    int ierr = PIO_NOERR;
+
+#ifdef _PNETCDF
+    if (file->iotype == PIO_IOTYPE_PNETCDF)
+        ierr = ncmpi_def_var(file->fh, name, xtype, ndims, dimidsp, varidp);
+#endif /* _PNETCDF */
+
+    if (file->iotype != PIO_IOTYPE_PNETCDF && file->do_io)
+        ierr = nc_def_var(file->fh, name, xtype, ndims, dimidsp, varidp);
+    PLOG((3, "defined var ierr %d file->iotype %d", ierr, file->iotype));
+
+#ifdef _NETCDF4
+    /* For netCDF-4 parallel files, set parallel access to collective. */
+    if (!ierr && file->iotype == PIO_IOTYPE_NETCDF4P)
+        ierr = nc_var_par_access(file->fh, *varidp, NC_COLLECTIVE);
+#endif /* _NETCDF4 */
+
+    return ierr;
+}
+
 /**
  * The PIO-C interface for the NetCDF function nc_def_var
  *
@@ -2161,6 +2290,17 @@ PIOc_def_var(int ncid, const char *name, nc_type xtype, int ndims,
     PLOG((1, "PIOc_def_var ncid = %d name = %s xtype = %d ndims = %d", ncid, name,
           xtype, ndims));
 
+    /* In async mode, the call may be deferred until enddef. Only
+     * atomic types are deferred, since the computation tasks cannot
+     * learn the size of user-defined types without asking. */
+    if (ios->async && !ios->ioproc)
+    {
+        if (ios->batch_define && xtype >= PIO_BYTE && xtype <= PIO_UINT64)
+            return pio_batch_def_var(file, name, xtype, ndims, dimidsp, varidp);
+        if ((ierr = pio_batch_flush(file)))
+            return ierr;
+    }
+
     /* Run this on all tasks if async is not in use, but only on
      * non-IO tasks if async is in use. Learn whether each dimension
      * is unlimited. */
@@ -2230,22 +2370,18 @@ PIOc_def_var(int ncid, const char *name, nc_type xtype, int ndims,
         {
             int msg = PIO_MSG_DEF_VAR;
             int namelen = strlen(name);
+            pio_msgbuf mb; /* The packed parameters. */
 
-            if (ios->compmain == MPI_ROOT)
-                mpierr = MPI_Send(&msg, 1, MPI_INT, ios->ioroot, 1, ios->union_comm);
-
-            if (!mpierr)
-                mpierr = MPI_Bcast(&(ncid), 1, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&namelen, 1, MPI_INT,  ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast((void *)name, namelen + 1, MPI_CHAR, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&xtype, 1, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&ndims, 1, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast((void *)dimidsp, ndims, MPI_INT, ios->compmain, ios->intercomm);
+            if (!(mpierr = pio_msgbuf_start(ios, &mb, msg)))
+            {
+                pio_msgbuf_put(&mb, &ncid, sizeof(int));
+                pio_msgbuf_put(&mb, &namelen, sizeof(int));
+                pio_msgbuf_put(&mb, name, namelen + 1);
+                pio_msgbuf_put(&mb, &xtype, sizeof(nc_type));
+                pio_msgbuf_put(&mb, &ndims, sizeof(int));
+                pio_msgbuf_put(&mb, dimidsp, ndims * sizeof(int));
+                mpierr = pio_msgbuf_send(ios, &mb);
+            }
         }
 
         /* Handle MPI errors. */
@@ -2274,22 +2410,7 @@ PIOc_def_var(int ncid, const char *name, nc_type xtype, int ndims,
 
     /* If this is an IO task, then call the netCDF function. */
     if (ios->ioproc)
-    {
-#ifdef _PNETCDF
-        if (file->iotype == PIO_IOTYPE_PNETCDF)
-            ierr = ncmpi_def_var(file->fh, name, xtype, ndims, dimidsp, &varid);
-#endif /* _PNETCDF */
-
-        if (file->iotype != PIO_IOTYPE_PNETCDF && file->do_io)
-            ierr = nc_def_var(file->fh, name, xtype, ndims, dimidsp, &varid);
-        PLOG((3, "defined var ierr %d file->iotype %d", ierr, file->iotype));
-
-#ifdef _NETCDF4
-        /* For netCDF-4 parallel files, set parallel access to collective. */
-        if (!ierr && file->iotype == PIO_IOTYPE_NETCDF4P)
-            ierr = nc_var_par_access(file->fh, varid, NC_COLLECTIVE);
-#endif /* _NETCDF4 */
-    }
+        ierr = pioc_def_var_io(file, name, xtype, ndims, dimidsp, &varid);
 
     /* Broadcast and check the return code. */
     if ((mpierr = MPI_Bcast(&ierr, 1, MPI_INT, ios->ioroot, ios->my_comm)))
@@ -2374,6 +2495,10 @@ PIOc_def_var_fill(int ncid, int varid, int fill_mode, const void *fill_valuep)
         PLOG((2, "PIOc_def_var_fill type_size = %d", type_size));
     }
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -2502,6 +2627,10 @@ PIOc_inq_var_fill(int ncid, int varid, int *no_fill, void *fill_valuep)
         PLOG((2, "PIOc_inq_var_fill type_size = %d", type_size));
     }
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -51,6 +51,10 @@ PIOc_def_var_deflate(int ncid, int varid, int shuffle, int deflate,
     PLOG((1, "PIOc_def_var_deflate ncid = %d varid = %d shuffle = %d deflate = %d deflate_level = %d",
           ncid, varid, shuffle, deflate, deflate_level));
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -141,6 +145,10 @@ PIOc_def_var_szip(int ncid, int varid, int options_mask, int pixels_per_block)
     PLOG((1, "PIOc_def_var_szip ncid = %d varid = %d mask = %d ppb = %d",
           ncid, varid, options_mask, pixels_per_block));
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -225,6 +233,10 @@ PIOc_def_var_bzip2(int ncid, int varid, int level)
     PLOG((1, "PIOc_def_var_bzip2 ncid = %d varid = %d level = %d",
           ncid, varid, level));
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -308,6 +320,10 @@ PIOc_def_var_zstandard(int ncid, int varid, int level)
     PLOG((1, "PIOc_def_var_zstandard ncid = %d varid = %d level = %d",
           ncid, varid, level));
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -395,6 +411,10 @@ PIOc_inq_var_deflate(int ncid, int varid, int *shufflep, int *deflatep,
 
     PLOG((1, "PIOc_inq_var_deflate ncid = %d varid = %d", ncid, varid));
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -517,6 +537,10 @@ PIOc_def_var_chunking(int ncid, int varid, int storage, const PIO_Offset *chunks
             return check_netcdf(file, ierr, __FILE__, __LINE__);
     PLOG((2, "PIOc_def_var_chunking first ndims = %d", ndims));
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -641,6 +665,10 @@ PIOc_inq_var_chunking(int ncid, int varid, int *storagep, PIO_Offset *chunksizes
         PLOG((2, "ndims = %d", ndims));
     }
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -759,6 +787,10 @@ PIOc_def_var_endian(int ncid, int varid, int endian)
     if (file->iotype != PIO_IOTYPE_NETCDF4P && file->iotype != PIO_IOTYPE_NETCDF4C)
         return pio_err(ios, file, PIO_ENOTNC4, __FILE__, __LINE__);
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -838,6 +870,10 @@ PIOc_inq_var_endian(int ncid, int varid, int *endianp)
     if (file->iotype != PIO_IOTYPE_NETCDF4P && file->iotype != PIO_IOTYPE_NETCDF4C)
         return pio_err(ios, file, PIO_ENOTNC4, __FILE__, __LINE__);
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -1153,6 +1189,10 @@ PIOc_set_var_chunk_cache(int ncid, int varid, PIO_Offset size, PIO_Offset nelems
     if (file->iotype != PIO_IOTYPE_NETCDF4P && file->iotype != PIO_IOTYPE_NETCDF4C)
         return pio_err(ios, file, PIO_ENOTNC4, __FILE__, __LINE__);
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -1242,6 +1282,10 @@ PIOc_get_var_chunk_cache(int ncid, int varid, PIO_Offset *sizep, PIO_Offset *nel
     if (file->iotype != PIO_IOTYPE_NETCDF4P && file->iotype != PIO_IOTYPE_NETCDF4C)
         return pio_err(ios, file, PIO_ENOTNC4, __FILE__, __LINE__);
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -1349,6 +1393,10 @@ PIOc_def_var_filter(int ncid, int varid, unsigned int id, size_t nparams, unsign
     if (file->iotype != PIO_IOTYPE_NETCDF4P && file->iotype != PIO_IOTYPE_NETCDF4C)
         return pio_err(ios, file, PIO_ENOTNC4, __FILE__, __LINE__);
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -1436,6 +1484,10 @@ PIOc_inq_var_filter_ids(int ncid, int varid, size_t *nfiltersp, unsigned int *id
     if (file->iotype != PIO_IOTYPE_NETCDF4P && file->iotype != PIO_IOTYPE_NETCDF4C)
         return pio_err(ios, file, PIO_ENOTNC4, __FILE__, __LINE__);
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -1539,6 +1591,10 @@ PIOc_inq_var_filter_info(int ncid, int varid, unsigned int id, size_t *nparamsp,
     if (file->iotype != PIO_IOTYPE_NETCDF4P && file->iotype != PIO_IOTYPE_NETCDF4C)
         return pio_err(ios, file, PIO_ENOTNC4, __FILE__, __LINE__);
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -1641,6 +1697,10 @@ PIOc_inq_var_bzip2(int ncid, int varid, int* hasfilterp, int *levelp)
     if (file->iotype != PIO_IOTYPE_NETCDF4P && file->iotype != PIO_IOTYPE_NETCDF4C)
         return pio_err(ios, file, PIO_ENOTNC4, __FILE__, __LINE__);
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -1737,6 +1797,10 @@ PIOc_inq_var_zstandard(int ncid, int varid, int* hasfilterp, int *levelp)
     if (file->iotype != PIO_IOTYPE_NETCDF4P && file->iotype != PIO_IOTYPE_NETCDF4C)
         return pio_err(ios, file, PIO_ENOTNC4, __FILE__, __LINE__);
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -1835,6 +1899,10 @@ PIOc_inq_filter_avail(int ncid, unsigned int id )
     if (file->iotype != PIO_IOTYPE_NETCDF4P && file->iotype != PIO_IOTYPE_NETCDF4C)
         return pio_err(ios, file, PIO_ENOTNC4, __FILE__, __LINE__);
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -1919,6 +1987,10 @@ PIOc_def_var_quantize(int ncid, int varid, int quantize_mode, int nsd )
     if (file->iotype != PIO_IOTYPE_NETCDF4P && file->iotype != PIO_IOTYPE_NETCDF4C)
         return pio_err(ios, file, PIO_ENOTNC4, __FILE__, __LINE__);
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -2003,6 +2075,10 @@ PIOc_inq_var_quantize(int ncid, int varid, int *quantize_mode, int *nsdp )
     if (file->iotype != PIO_IOTYPE_NETCDF4P && file->iotype != PIO_IOTYPE_NETCDF4C)
         return pio_err(ios, file, PIO_ENOTNC4, __FILE__, __LINE__);
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -0,0 +1,292 @@
+/**
+ * @file
+ * A progress thread for the nonblocking writes of
+ * PIOc_iwrite_darray().
+ *
+ * Many MPI libraries only move the data of nonblocking messages
+ * while the application is inside an MPI call. The progress thread
+ * keeps testing the requests of the pending writes, so the data of
+ * the writes moves to the IO tasks while the application computes.
+ * The writes to the file are still made by PIOc_wait() on the
+ * calling thread, since they are collective, and the netCDF and
+ * pnetcdf libraries are not thread safe.
+ *
+ * The API threads hand pending writes to the progress thread by
+ * pushing them on a lock-free stack. The progress thread owns the
+ * MPI requests of a write until the exchange is complete, or the
+ * thread is stopped.
+ *
+ * @author Jim Edwards
+ */
+#include <config.h>
+#include <pio.h>
+#include <pio_internal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+/** Microseconds the progress thread sleeps when it has no pending
+ * writes. */
+#define PIO_PROGRESS_IDLE_USEC 100
+
+/** The progress thread. */
+static pthread_t progress_thread;
+
+/** Non-zero while the progress thread should run. */
+static int progress_running = 0;
+
+/** Writes handed to the progress thread, not yet picked up by it. */
+static pio_write_req *progress_queue = NULL;
+
+/**
+ * Give a pending write back to the API threads. The progress thread
+ * must not touch it afterwards.
+ *
+ * @param req pointer to the pio_write_req.
+ * @author Jim Edwards
+ */
+static void
+progress_hand_back(pio_write_req *req)
+{
+    __atomic_store_n(&req->progress, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * The body of the progress thread. It picks up the writes submitted
+ * with pio_progress_submit(), and tests their MPI requests until the
+ * exchanges are complete.
+ *
+ * @param arg not used.
+ * @returns NULL.
+ * @author Jim Edwards
+ */
+static void *
+progress_loop(void *arg)
+{
+    pio_write_req **active = NULL; /* Writes owned by this thread. */
+    int nactive = 0;
+    int maxactive = 0;
+
+    while (__atomic_load_n(&progress_running, __ATOMIC_ACQUIRE))
+    {
+        pio_write_req *req, *next;
+        int n = 0;
+
+        /* Take all the writes submitted since the last pass. */
+        req = __atomic_exchange_n(&progress_queue, NULL, __ATOMIC_ACQUIRE);
+        for (; req; req = next)
+        {
+            next = req->progress_next;
+            if (nactive == maxactive)
+            {
+                pio_write_req **tmp;
+                int newmax = maxactive ? 2 * maxactive : PIO_REQUEST_ALLOC_CHUNK;
+
+                if (!(tmp = realloc(active, newmax * sizeof(pio_write_req *))))
+                {
+                    /* The caller will wait for this one itself. */
+                    progress_hand_back(req);
+                    continue;
+                }
+                active = tmp;
+                maxactive = newmax;
+            }
+            active[nactive++] = req;
+        }
+
+        /* Test the requests of each write, and drop the finished
+         * ones. */
+        for (int a = 0; a < nactive; a++)
+        {
+            int flag = 1;
+            int mpierr;
+
+            req = active[a];
+            if (req->nreqs > 0)
+                if ((mpierr = MPI_Testall(req->nreqs, req->reqs, &flag, MPI_STATUSES_IGNORE)))
+                {
+                    req->mpierr = mpierr;
+                    flag = 1;
+                }
+            if (flag)
+                __atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+            else
+                active[n++] = req;
+        }
+        nactive = n;
+
+        if (nactive)
+            sched_yield();
+        else
+        {
+            struct timespec idle = {0, PIO_PROGRESS_IDLE_USEC * 1000};
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    /* Give back the writes which are not finished. */
+    for (int a = 0; a < nactive; a++)
+        progress_hand_back(active[a]);
+    for (pio_write_req *req = __atomic_exchange_n(&progress_queue, NULL, __ATOMIC_ACQUIRE),
+             *next; req; req = next)
+    {
+        next = req->progress_next;
+        progress_hand_back(req);
+    }
+    free(active);
+
+    return NULL;
+}
+
+/**
+ * Hand the MPI requests of a pending write to the progress thread,
+ * if it is running. Otherwise, the requests stay with the caller.
+ *
+ * @param req pointer to the pio_write_req.
+ * @author Jim Edwards
+ */
+void
+pio_progress_submit(pio_write_req *req)
+{
+    pio_write_req *head;
+
+    pioassert(req, "invalid input", __FILE__, __LINE__);
+
+    if (!__atomic_load_n(&progress_running, __ATOMIC_ACQUIRE) || !req->nreqs)
+        return;
+
+    req->done = 0;
+    req->mpierr = MPI_SUCCESS;
+    __atomic_store_n(&req->progress, 1, __ATOMIC_RELEASE);
+
+    /* Push the write on the queue. */
+    head = __atomic_load_n(&progress_queue, __ATOMIC_RELAXED);
+    do
+        req->progress_next = head;
+    while (!__atomic_compare_exchange_n(&progress_queue, &head, req, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * Take back the MPI requests of a pending write from the progress
+ * thread, waiting until the thread has finished the exchange or
+ * given the write back. Returns at once if the thread does not own
+ * the write.
+ *
+ * @param req pointer to the pio_write_req.
+ * @returns the MPI error code seen by the progress thread, if any.
+ * @author Jim Edwards
+ */
+int
+pio_progress_release(pio_write_req *req)
+{
+    pioassert(req, "invalid input", __FILE__, __LINE__);
+
+    while (__atomic_load_n(&req->progress, __ATOMIC_ACQUIRE))
+    {
+        if (__atomic_load_n(&req->done, __ATOMIC_ACQUIRE))
+        {
+            req->progress = 0;
+            break;
+        }
+        sched_yield();
+    }
+
+    return req->mpierr;
+}
+
+/**
+ * Find out whether the exchange of a pending write is complete, if
+ * the progress thread owns its MPI requests.
+ *
+ * @param req pointer to the pio_write_req.
+ * @param flagp pointer that gets 1 if the exchange is complete, 0
+ * otherwise. Only set if the thread owns the requests.
+ * @returns true if the thread owns the requests of the write.
+ * @author Jim Edwards
+ */
+bool
+pio_progress_test(pio_write_req *req, int *flagp)
+{
+    pioassert(req && flagp, "invalid input", __FILE__, __LINE__);
+
+    if (!__atomic_load_n(&req->progress, __ATOMIC_ACQUIRE))
+        return false;
+
+    *flagp = __atomic_load_n(&req->done, __ATOMIC_ACQUIRE);
+    return true;
+}
+
+/**
+ * Stop the progress thread, if it is running. Writes it has not
+ * finished are given back, and completed by PIOc_wait() on the
+ * calling thread. This is called when the last IO system is freed.
+ *
+ * @author Jim Edwards
+ */
+void
+pio_progress_stop(void)
+{
+    if (!__atomic_load_n(&progress_running, __ATOMIC_ACQUIRE))
+        return;
+
+    __atomic_store_n(&progress_running, 0, __ATOMIC_RELEASE);
+    pthread_join(progress_thread, NULL);
+    PLOG((1, "stopped progress thread"));
+}
+
+/**
+ * Start or stop the progress thread of this task.
+ *
+ * While the thread runs, the data of writes started with
+ * PIOc_iwrite_darray() moves to the IO tasks while the application
+ * computes, and PIOc_wait() only has to write it to the file. The
+ * thread makes MPI calls at the same time as the application, so MPI
+ * must have been initialized with MPI_Init_thread() and
+ * MPI_THREAD_MULTIPLE.
+ *
+ * This is a setting for the task, not for an IO system, and it is
+ * not collective. It must not be called at the same time as other
+ * PIO functions. The thread is stopped when the last IO system is
+ * freed.
+ *
+ * @param enable non-zero to start the thread, 0 to stop it.
+ * @returns 0 for success, PIO_EINVAL if MPI does not provide
+ * MPI_THREAD_MULTIPLE, error code otherwise.
+ * @ingroup PIO_write_darray_c
+ * @author Jim Edwards
+ */
+int
+PIOc_set_progress_thread(int enable)
+{
+    int provided;
+    int mpierr;
+    int ret;
+
+    PLOG((1, "PIOc_set_progress_thread enable = %d", enable));
+
+    if (!enable)
+    {
+        pio_progress_stop();
+        return PIO_NOERR;
+    }
+
+    if (__atomic_load_n(&progress_running, __ATOMIC_ACQUIRE))
+        return PIO_NOERR;
+
+    /* The thread calls MPI while the application does. */
+    if ((mpierr = MPI_Query_thread(&provided)))
+        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+    if (provided < MPI_THREAD_MULTIPLE)
+        return pio_err(NULL, NULL, PIO_EINVAL, __FILE__, __LINE__);
+
+    __atomic_store_n(&progress_running, 1, __ATOMIC_RELEASE);
+    if ((ret = pthread_create(&progress_thread, NULL, progress_loop, NULL)))
+    {
+        __atomic_store_n(&progress_running, 0, __ATOMIC_RELEASE);
+        return pio_err(NULL, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    }
+    PLOG((1, "started progress thread"));
+
+    return PIO_NOERR;
+}
@@ -12,6 +12,17 @@
 #define MPI_Type_create_hvector MPI_Type_hvector
 #endif
 
+/** The box rearranger looks up the destination of each compmap
+ * element in a grid of cells built from the IO task boxes. If the
+ * grid would have more than this many cells per IO task, the boxes
+ * are searched one at a time instead. */
+#define BOX_CELLS_PER_IOTASK 64
+
+/** Send types which take data in the order of an unsorted map are
+ * only used if they have at most this many times as many contiguous
+ * blocks as the types for the sorted data. */
+#define PIO_REMAP_TYPE_MAX_FRAG 2
+
 /**
  * Convert a 1-D index into a coordinate value in an arbitrary
  * dimension space. E.g., for index 4 into a array defined as a[3][2],
@@ -413,6 +424,107 @@ exit:
     return ret;
 }
 
+/**
+ * Try to create send types for the computation tasks which take the
+ * data in the order of the original, unsorted map, so that the data
+ * does not have to be copied to the order of the sorted map for each
+ * write and read. The index of each element sent is looked up in
+ * iodesc->remap.
+ *
+ * The types are only created if the remapped elements are not much
+ * more fragmented than the sorted ones: they must form no more than
+ * PIO_REMAP_TYPE_MAX_FRAG times as many contiguous runs.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param ntypes the number of send types.
+ * @param createdp pointer that gets true if the types were created.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+create_remapped_stypes(iosystem_desc_t *ios, io_desc_t *iodesc, int ntypes, bool *createdp)
+{
+    int numinds = 0;
+    int sorted_runs = 0;
+    int remapped_runs = 0;
+    int *displace;
+    int *blocklen;
+    int pos;
+    int mpierr = MPI_SUCCESS;
+
+    pioassert(iodesc->remap && createdp, "invalid input", __FILE__, __LINE__);
+
+    *createdp = false;
+
+    /* Count the contiguous runs of elements sent, in sorted and in
+     * original order. */
+    pos = 0;
+    for (int i = 0; i < ntypes; i++)
+    {
+        for (int j = 0; j < iodesc->scount[i]; j++)
+        {
+            PIO_Offset k = iodesc->sindex[pos + j];
+
+            if (!j || k != iodesc->sindex[pos + j - 1] + 1)
+                sorted_runs++;
+            if (!j || iodesc->remap[k] != iodesc->remap[iodesc->sindex[pos + j - 1]] + 1)
+                remapped_runs++;
+        }
+        pos += iodesc->scount[i];
+    }
+    numinds = pos;
+    PLOG((2, "create_remapped_stypes sorted_runs = %d remapped_runs = %d", sorted_runs,
+          remapped_runs));
+    if (remapped_runs > PIO_REMAP_TYPE_MAX_FRAG * sorted_runs)
+        return PIO_NOERR;
+
+    if (!(displace = malloc(sizeof(int) * (numinds ? numinds : 1))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    if (!(blocklen = malloc(sizeof(int) * (numinds ? numinds : 1))))
+    {
+        free(displace);
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    }
+
+    /* One indexed type for each message, with a block for each run. */
+    pos = 0;
+    for (int i = 0; i < ntypes; i++)
+    {
+        int nruns = 0;
+
+        if (!iodesc->scount[i])
+            continue;
+
+        for (int j = 0; j < iodesc->scount[i]; j++)
+        {
+            int k = iodesc->remap[iodesc->sindex[pos + j]];
+
+            if (nruns && k == displace[nruns - 1] + blocklen[nruns - 1])
+                blocklen[nruns - 1]++;
+            else
+            {
+                displace[nruns] = k;
+                blocklen[nruns++] = 1;
+            }
+        }
+        pos += iodesc->scount[i];
+
+        if ((mpierr = MPI_Type_indexed(nruns, blocklen, displace, iodesc->mpitype,
+                                       &iodesc->stype[i])))
+            break;
+        if ((mpierr = MPI_Type_commit(&iodesc->stype[i])))
+            break;
+    }
+    free(displace);
+    free(blocklen);
+    if (mpierr)
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+
+    *createdp = true;
+    return PIO_NOERR;
+}
+
 /**
  * If needed, create the derived MPI datatypes used for comp2io and
  * io2comp transfers.
@@ -485,7 +597,9 @@ define_iodesc_datatypes(iosystem_desc_t *ios, io_desc_t *iodesc)
             int ntypes;
 
             /* Subset rearranger gets one type; box rearranger gets one
-             * type per IO task. */
+             * type per IO task. So does the hierarchical rearranger,
+             * whose send types on the node leader index the node
+             * buffer, and are empty on the other tasks. */
             ntypes = iodesc->rearranger == PIO_REARR_SUBSET ? 1 : ios->num_iotasks;
 
             /* Allocate memory for array of MPI types for the computation tasks. */
@@ -500,11 +614,22 @@ define_iodesc_datatypes(iosystem_desc_t *ios, io_desc_t *iodesc)
             /* Remember how many types we created for the send side. */
             iodesc->num_stypes = ntypes;
 
+            /* If the map is not sorted, send straight from the
+             * data in the order of the original map, if this
+             * does not fragment the types too much. */
+            iodesc->stype_unsorted = false;
+            if (iodesc->needssort)
+                if ((ret = create_remapped_stypes(ios, iodesc, ntypes, &iodesc->stype_unsorted)))
+                    return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
             /* Create the MPI data types. */
-            PLOG((2, "Calling create_mpi_datatypes at line %d",__LINE__));
-            if ((ret = create_mpi_datatypes(iodesc->mpitype, ntypes, iodesc->sindex,
-                                            iodesc->scount, NULL, iodesc->stype)))
-                return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+            if (!iodesc->stype_unsorted)
+            {
+                PLOG((2, "Calling create_mpi_datatypes at line %d",__LINE__));
+                if ((ret = create_mpi_datatypes(iodesc->mpitype, ntypes, iodesc->sindex,
+                                                iodesc->scount, NULL, iodesc->stype)))
+                    return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+            }
 
         }
     }
@@ -513,6 +638,170 @@ define_iodesc_datatypes(iosystem_desc_t *ios, io_desc_t *iodesc)
     return PIO_NOERR;
 }
 
+/**
+ * Compare two ints. This function is passed to qsort when sorting
+ * the peer list in define_swap_peers().
+ *
+ * @param a pointer to an int.
+ * @param b pointer to another int.
+ * @returns -1, 0 or 1 as a is less than, equal to or greater than b.
+ * @author Jim Edwards
+ */
+static int
+compare_ints(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Build the sorted list of the tasks in the rearranger communicator
+ * that this task exchanges data with: the IO tasks it sends data to
+ * (scount > 0), and on IO tasks the compute tasks it receives data
+ * from (rcount > 0). These are the only tasks pio_swapm_sparse() needs
+ * to talk to. The list is the same for comp2io and io2comp, and is
+ * symmetric between tasks, as MPI_Dist_graph_create_adjacent()
+ * requires. This is called once per iodesc, when the rearranger is
+ * created.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+define_swap_peers(iosystem_desc_t *ios, io_desc_t *iodesc)
+{
+    int niotasks = iodesc->rearranger == PIO_REARR_SUBSET ? 1 : ios->num_iotasks;
+    int maxpeers = niotasks;
+    int npeers = 0;
+
+    pioassert(ios && iodesc, "invalid input", __FILE__, __LINE__);
+
+    if (ios->ioproc)
+        maxpeers += iodesc->nrecvs;
+    free(iodesc->peers);
+    if (!(iodesc->peers = malloc(max(1, maxpeers) * sizeof(int))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+
+    /* The IO tasks this task sends to. */
+    if (iodesc->scount)
+        for (int i = 0; i < niotasks; i++)
+            if (iodesc->scount[i] > 0)
+                iodesc->peers[npeers++] = iodesc->rearranger == PIO_REARR_SUBSET ? 0 : ios->ioranks[i];
+
+    /* The compute tasks this IO task receives from. */
+    if (ios->ioproc && iodesc->rcount)
+        for (int i = 0; i < iodesc->nrecvs; i++)
+            if (iodesc->rcount[i] > 0)
+                iodesc->peers[npeers++] = iodesc->rearranger == PIO_REARR_SUBSET ? i : iodesc->rfrom[i];
+
+    /* Sort and remove duplicates (a task may be both). */
+    qsort(iodesc->peers, npeers, sizeof(int), compare_ints);
+    if (npeers > 0)
+    {
+        int n = 1;
+        for (int k = 1; k < npeers; k++)
+            if (iodesc->peers[k] != iodesc->peers[n - 1])
+                iodesc->peers[n++] = iodesc->peers[k];
+        npeers = n;
+    }
+    iodesc->npeers = npeers;
+    PLOG((2, "define_swap_peers npeers = %d", iodesc->npeers));
+
+    return PIO_NOERR;
+}
+
+/**
+ * Is the sparse peer exchange in use for this iodesc?
+ *
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @returns true if the rearranger comm type is
+ * PIO_REARR_COMM_SPARSE, PIO_REARR_COMM_NEIGHBOR or
+ * PIO_REARR_COMM_SHM.
+ * @author Jim Edwards
+ */
+static bool
+use_sparse_swap(const io_desc_t *iodesc)
+{
+    return iodesc->rearr_opts.comm_type == PIO_REARR_COMM_SPARSE ||
+        iodesc->rearr_opts.comm_type == PIO_REARR_COMM_NEIGHBOR ||
+        iodesc->rearr_opts.comm_type == PIO_REARR_COMM_SHM;
+}
+
+/**
+ * Find the index into the pio_swapm() argument arrays for a task in
+ * the rearranger communicator. This is the rank itself, or with the
+ * sparse exchange, the position of the rank in the peer list.
+ *
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param rank rank of the task in the rearranger communicator.
+ * @returns the array index.
+ * @author Jim Edwards
+ */
+static int
+swap_slot(const io_desc_t *iodesc, int rank)
+{
+    int lo = 0;
+    int hi = iodesc->npeers - 1;
+
+    if (!use_sparse_swap(iodesc))
+        return rank;
+
+    while (lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (iodesc->peers[mid] == rank)
+            return mid;
+        if (iodesc->peers[mid] < rank)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    pioassert(0, "rank not in peer list", __FILE__, __LINE__);
+    return -1;
+}
+
+/**
+ * Exchange data between compute and IO tasks with the comm type of
+ * the iodesc. The arrays are indexed with swap_slot().
+ *
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param sendbuf starting address of send buffer.
+ * @param sendcounts array of the number of elements to send.
+ * @param sdispls array of send displacements in bytes.
+ * @param sendtypes array of send datatypes.
+ * @param recvbuf address of receive buffer.
+ * @param recvcounts array of the number of elements to receive.
+ * @param rdispls array of receive displacements in bytes.
+ * @param recvtypes array of receive datatypes.
+ * @param comm the rearranger communicator.
+ * @param fc pointer to the struct that provided flow control options.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+swap_data(io_desc_t *iodesc, void *sendbuf, int *sendcounts, int *sdispls,
+          MPI_Datatype *sendtypes, void *recvbuf, int *recvcounts, int *rdispls,
+          MPI_Datatype *recvtypes, MPI_Comm comm, rearr_comm_fc_opt_t *fc)
+{
+    if (use_sparse_swap(iodesc))
+    {
+        MPI_Comm *graph_comm = NULL;
+
+        if (iodesc->rearr_opts.comm_type == PIO_REARR_COMM_NEIGHBOR)
+            graph_comm = &iodesc->neighbor_comm;
+        return pio_swapm_sparse(iodesc->npeers, iodesc->peers, sendbuf, sendcounts, sdispls,
+                                sendtypes, recvbuf, recvcounts, rdispls, recvtypes, comm,
+                                graph_comm, fc);
+    }
+
+    return pio_swapm(sendbuf, sendcounts, sdispls, sendtypes, recvbuf, recvcounts,
+                     rdispls, recvtypes, comm, fc);
+}
+
 /**
  * Completes the mapping for the box rearranger. This function is
  * called from box_rearrange_create(). It is not used for the subset
@@ -793,220 +1082,1385 @@ compute_counts(iosystem_desc_t *ios, io_desc_t *iodesc,
     if(s2rindex)
         free(s2rindex);
 
+    /* Remember which tasks this task exchanges data with. */
+    if ((ierr = define_swap_peers(ios, iodesc)))
+        return pio_err(ios, NULL, ierr, __FILE__, __LINE__);
+
     return PIO_NOERR;
 }
 
 /**
- * Moves data from compute tasks to IO tasks. This is called from
- * PIOc_write_darray_multi().
+ * Free the persistent requests of PIO_REARR_COMM_PERSIST for one
+ * direction of a datatype cache entry. The requests are not active.
+ *
+ * @param preq pointer to the requests.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+free_persist_req(rearr_persist_req_t *preq)
+{
+    int mpierr;
+
+    for (int r = 0; r < preq->nreqs; r++)
+        if ((mpierr = MPI_Request_free(&preq->reqs[r])))
+            return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+    free(preq->reqs);
+    preq->reqs = NULL;
+    preq->nreqs = 0;
+    preq->cbuf = NULL;
+    preq->iobuf = NULL;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Free the MPI datatypes held in one entry of the datatype cache of
+ * an iodesc, and mark the entry as unused.
+ *
+ * @param entry pointer to the cache entry.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+free_type_cache_entry(rearr_type_cache_t *entry)
+{
+    int mpierr;
+    int ret;
+
+    /* The persistent requests use the types, so go first. */
+    if ((ret = free_persist_req(&entry->comp2io)))
+        return ret;
+    if ((ret = free_persist_req(&entry->io2comp)))
+        return ret;
+
+    for (int i = 0; i < entry->ntasks; i++)
+    {
+        if (entry->sendtypes && entry->sendtypes[i] != PIO_DATATYPE_NULL)
+            if ((mpierr = MPI_Type_free(&entry->sendtypes[i])))
+                return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+
+        if (entry->recvtypes && entry->recvtypes[i] != PIO_DATATYPE_NULL)
+            if ((mpierr = MPI_Type_free(&entry->recvtypes[i])))
+                return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+    }
+
+    free(entry->sendtypes);
+    free(entry->recvtypes);
+    entry->sendtypes = NULL;
+    entry->recvtypes = NULL;
+    entry->ntasks = 0;
+    entry->nvars = 0;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Free all the MPI datatypes in the datatype cache of an iodesc. This
+ * is called from PIOc_freedecomp().
  *
- * @param ios pointer to the iosystem_desc_t struct.
  * @param iodesc a pointer to the io_desc_t struct.
- * @param sbuf send buffer. May be NULL.
- * @param rbuf receive buffer. May be NULL.
- * @param nvars number of variables.
  * @returns 0 on success, error code otherwise.
  * @author Jim Edwards
  */
 int
-rearrange_comp2io(iosystem_desc_t *ios, io_desc_t *iodesc, void *sbuf,
-                  void *rbuf, int nvars)
+free_type_cache(io_desc_t *iodesc)
 {
-    int ntasks;       /* Number of tasks in communicator. */
-    int niotasks;     /* Number of IO tasks. */
-    MPI_Comm mycomm;  /* Communicator that data is transferred over. */
-    int mpierr;       /* Return code from MPI calls. */
     int ret;
 
-#ifdef TIMING
-    /* Start timer if desired. */
-    if ((ret = pio_start_timer("PIO:rearrange_comp2io")))
-        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
-#endif /* TIMING */
+    pioassert(iodesc, "invalid input", __FILE__, __LINE__);
+    PLOG((2, "free_type_cache ioid = %d hits = %lld misses = %lld", iodesc->ioid,
+          iodesc->type_cache_hits, iodesc->type_cache_misses));
 
-    /* Caller must provide these. */
-    pioassert(ios && iodesc && nvars > 0, "invalid input", __FILE__, __LINE__);
+    for (int c = 0; c < PIO_TYPE_CACHE_SIZE; c++)
+        if (iodesc->type_cache[c].nvars)
+            if ((ret = free_type_cache_entry(&iodesc->type_cache[c])))
+                return ret;
 
-    PLOG((1, "rearrange_comp2io nvars = %d iodesc->rearranger = %d", nvars,
-          iodesc->rearranger));
+    return PIO_NOERR;
+}
 
-    /* Different rearraangers use different communicators. */
-    if (iodesc->rearranger == PIO_REARR_BOX)
-    {
-        mycomm = ios->union_comm;
-        niotasks = ios->num_iotasks;
-    }
-    else
+/**
+ * Get the MPI datatypes used by rearrange_comp2io() to move nvars
+ * variables at once. These are vectors of nvars of the iodesc rtype
+ * and stype types. If they are in the datatype cache of the iodesc,
+ * for the same number of tasks and comm_type, they are reused,
+ * otherwise they are created, committed and added to the cache,
+ * replacing the least recently used entry if the cache is full.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param nvars number of variables.
+ * @param ntasks length of the type arrays: the number of tasks in the
+ * rearranger communicator, or of peers with the sparse exchange.
+ * @param niotasks number of IO tasks in the rearranger communicator.
+ * @param entryp pointer that gets the cache entry with the types.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+get_comp2io_types(iosystem_desc_t *ios, io_desc_t *iodesc, int nvars, int ntasks,
+                  int niotasks, rearr_type_cache_t **entryp)
+{
+    rearr_type_cache_t *entry = NULL;
+    int mpierr;  /* Return code from MPI calls. */
+    int ret;
+
+    pioassert(ios && iodesc && nvars > 0 && entryp, "invalid input", __FILE__, __LINE__);
+
+    iodesc->type_cache_clock++;
+
+    /* Look for the types in the cache, and remember the least
+     * recently used entry in case they are not there. */
+    for (int c = 0; c < PIO_TYPE_CACHE_SIZE; c++)
     {
-        mycomm = iodesc->subset_comm;
-        niotasks = 1;
-    }
+        rearr_type_cache_t *cur = &iodesc->type_cache[c];
 
-    /* Get the number of tasks. */
-    if ((mpierr = MPI_Comm_size(mycomm, &ntasks)))
-        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+        if (cur->nvars == nvars && cur->ntasks == ntasks &&
+            cur->comm_type == iodesc->rearr_opts.comm_type)
+        {
+            cur->last_use = iodesc->type_cache_clock;
+            iodesc->type_cache_hits++;
+            *entryp = cur;
+            return PIO_NOERR;
+        }
+        if (!entry || (entry->nvars && (!cur->nvars || cur->last_use < entry->last_use)))
+            entry = cur;
+    }
+    iodesc->type_cache_misses++;
+    PLOG((2, "get_comp2io_types nvars = %d not cached, hits = %lld misses = %lld", nvars,
+          iodesc->type_cache_hits, iodesc->type_cache_misses));
 
-    /* These are parameters to pio_swapm to send data from compute to
-     * IO tasks. */
-    int sendcounts[ntasks];
-    int recvcounts[ntasks];
-    int sdispls[ntasks];
-    int rdispls[ntasks];
-    MPI_Datatype sendtypes[ntasks];
-    MPI_Datatype recvtypes[ntasks];
+    /* Evict the least recently used entry. */
+    if (entry->nvars)
+        if ((ret = free_type_cache_entry(entry)))
+            return pio_err(ios, NULL, ret, __FILE__, __LINE__);
 
-    /* Initialize pio_swapm parameter arrays. */
+    if (!(entry->sendtypes = malloc(max(1, ntasks) * sizeof(MPI_Datatype))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    if (!(entry->recvtypes = malloc(max(1, ntasks) * sizeof(MPI_Datatype))))
+    {
+        /* Leave the entry unused. */
+        free(entry->sendtypes);
+        entry->sendtypes = NULL;
+        entry->ntasks = 0;
+        entry->nvars = 0;
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    }
     for (int i = 0; i < ntasks; i++)
     {
-        sendcounts[i] = 0;
-        recvcounts[i] = 0;
-        sdispls[i] = 0;
-        rdispls[i] = 0;
-        recvtypes[i] = PIO_DATATYPE_NULL;
-        sendtypes[i] =  PIO_DATATYPE_NULL;
+        entry->sendtypes[i] = PIO_DATATYPE_NULL;
+        entry->recvtypes[i] = PIO_DATATYPE_NULL;
     }
-
-    /* If it has not already been done, define the MPI data types that
-     * will be used for this io_desc_t. */
-//    PLOG((2, "Calling define_iodesc_datatypes at line %d sindex[20] = %d",__LINE__,iodesc->sindex[20]));
-    if ((ret = define_iodesc_datatypes(ios, iodesc)))
-        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+    entry->ntasks = ntasks;
+    entry->nvars = nvars;
+    entry->comm_type = iodesc->rearr_opts.comm_type;
+    entry->last_use = iodesc->type_cache_clock;
 
     /* If this io proc, we need to exchange data with compute
      * tasks. Create a MPI DataType for that exchange. */
-//    PLOG((2, "ios->ioproc %d iodesc->nrecvs = %d", ios->ioproc, iodesc->nrecvs));
     if (ios->ioproc && iodesc->nrecvs > 0)
     {
         for (int i = 0; i < iodesc->nrecvs; i++)
         {
             if (iodesc->rtype[i] != PIO_DATATYPE_NULL)
             {
-                PLOG((3, "iodesc->rtype[%d] = %d iodesc->rearranger = %d", i, iodesc->rtype[i],
-                      iodesc->rearranger));
-                if (iodesc->rearranger == PIO_REARR_SUBSET)
-                {
-                    PLOG((3, "exchanging data for subset rearranger"));
-                    recvcounts[i] = 1;
-
-                    /*  Create an MPI derived data type from equally
-                     *  spaced blocks of the same size. The block size
-                     *  is 1, the stride here is the length of the
-                     *  collected array (llen). */
-                    if ((mpierr = MPI_Type_create_hvector(nvars, 1, (MPI_Aint)iodesc->llen * iodesc->mpitype_size,
-                                                          iodesc->rtype[i], &recvtypes[i])))
-                        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
-
-                    pioassert(recvtypes[i] != PIO_DATATYPE_NULL, "bad mpi type", __FILE__, __LINE__);
-
-                    if ((mpierr = MPI_Type_commit(&recvtypes[i])))
-                        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
-                }
-                else
-                {
-                    recvcounts[iodesc->rfrom[i]] = 1;
-                    PLOG((3, "exchanging data for box rearranger i = %d iodesc->rfrom[i] = %d "
-                          "recvcounts[iodesc->rfrom[i]] = %d", i, iodesc->rfrom[i],
-                          recvcounts[iodesc->rfrom[i]]));
-
-                    if ((mpierr = MPI_Type_create_hvector(nvars, 1, (MPI_Aint)iodesc->llen * iodesc->mpitype_size,
-                                                          iodesc->rtype[i], &recvtypes[iodesc->rfrom[i]])))
-                        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
-
-                    pioassert(recvtypes[iodesc->rfrom[i]] != PIO_DATATYPE_NULL,  "bad mpi type",
-                              __FILE__, __LINE__);
+                int peer = swap_slot(iodesc, iodesc->rearranger == PIO_REARR_SUBSET ?
+                                     i : iodesc->rfrom[i]);
+
+                PLOG((3, "iodesc->rtype[%d] = %d iodesc->rearranger = %d peer = %d", i,
+                      iodesc->rtype[i], iodesc->rearranger, peer));
+
+                /*  Create an MPI derived data type from equally
+                 *  spaced blocks of the same size. The block size
+                 *  is 1, the stride here is the length of the
+                 *  collected array (llen). */
+                if ((mpierr = MPI_Type_create_hvector(nvars, 1, (MPI_Aint)iodesc->llen * iodesc->mpitype_size,
+                                                      iodesc->rtype[i], &entry->recvtypes[peer])))
+                    return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
 
-                    if ((mpierr = MPI_Type_commit(&recvtypes[iodesc->rfrom[i]])))
-                        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+                pioassert(entry->recvtypes[peer] != PIO_DATATYPE_NULL, "bad mpi type",
+                          __FILE__, __LINE__);
 
-                    rdispls[iodesc->rfrom[i]] = 0;
-                }
+                if ((mpierr = MPI_Type_commit(&entry->recvtypes[peer])))
+                    return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
             }
         }
     }
 
     /* On compute tasks loop over iotasks and create a data type for
      * each exchange.  */
-    if(!ios->async || ios->compproc)
+    if (!ios->async || ios->compproc)
     {
         for (int i = 0; i < niotasks; i++)
         {
             int io_comprank = ios->ioranks[i];
-//            PLOG((3, "ios->ioranks[%d] = %d", i, ios->ioranks[i]));
+
             if (iodesc->rearranger == PIO_REARR_SUBSET)
                 io_comprank = 0;
 
-            PLOG((3, "i = %d iodesc->scount[i] = %d", i, iodesc->scount[i]));
-            if (iodesc->scount[i] > 0 && sbuf)
+            if (iodesc->scount[i] > 0)
             {
-                PLOG((3, "io task %d creating sendtypes[%d]", i, io_comprank));
-                sendcounts[io_comprank] = 1;
-                if ((mpierr = MPI_Type_create_hvector(nvars, 1, (MPI_Aint)iodesc->ndof * iodesc->mpitype_size,
-                                                      iodesc->stype[i], &sendtypes[io_comprank])))
+                int slot = swap_slot(iodesc, io_comprank);
+                /* With the hierarchical rearranger, the data is sent
+                 * from the node buffer. */
+                PIO_Offset stride = iodesc->hier ? iodesc->hier->nodelen : iodesc->ndof;
+
+                PLOG((3, "io task %d creating sendtypes[%d]", i, slot));
+                if ((mpierr = MPI_Type_create_hvector(nvars, 1, (MPI_Aint)stride * iodesc->mpitype_size,
+                                                      iodesc->stype[i], &entry->sendtypes[slot])))
                     return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
-                pioassert(sendtypes[io_comprank] != PIO_DATATYPE_NULL,  "bad mpi type", __FILE__, __LINE__);
+                pioassert(entry->sendtypes[slot] != PIO_DATATYPE_NULL, "bad mpi type",
+                          __FILE__, __LINE__);
 
-                if ((mpierr = MPI_Type_commit(&sendtypes[io_comprank])))
+                if ((mpierr = MPI_Type_commit(&entry->sendtypes[slot])))
                     return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
             }
-            else
-            {
-                sendcounts[io_comprank] = 0;
-            }
         }
     }
 
-    /* Data in sbuf on the compute nodes is sent to rbuf on the ionodes */
-//    PLOG((2, "about to call pio_swapm for sbuf"));
-    if ((ret = pio_swapm(sbuf, sendcounts, sdispls, sendtypes,
-                         rbuf, recvcounts, rdispls, recvtypes, mycomm,
-                         &iodesc->rearr_opts.comp2io)))
-        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
-
-    /* Free the MPI types. */
-    for (int i = 0; i < ntasks; i++)
-    {
-        PLOG((3, "freeing MPI types for task %d", i));
-        if (sendtypes[i] != PIO_DATATYPE_NULL)
-            if ((mpierr = MPI_Type_free(&sendtypes[i])))
-                return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
-
-        if (recvtypes[i] != PIO_DATATYPE_NULL)
-            if ((mpierr = MPI_Type_free(&recvtypes[i])))
-                return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
-    }
-
-#ifdef TIMING
-    if ((ret = pio_stop_timer("PIO:rearrange_comp2io")))
-        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
-#endif /* TIMING */
+    *entryp = entry;
 
     return PIO_NOERR;
 }
 
 /**
- * Moves data from IO tasks to compute tasks. This function is used in
- * PIOc_read_darray().
+ * Get the size of the buffer MPI_Pack() and MPI_Unpack() need for
+ * one element of a send or receive type of the rearranger, which
+ * moves count elements of each of nvars variables. These functions
+ * take an int size, so the data may not be more than INT_MAX bytes.
  *
  * @param ios pointer to the iosystem_desc_t struct.
  * @param iodesc a pointer to the io_desc_t struct.
- * @param sbuf send buffer.
- * @param rbuf receive buffer.
+ * @param type the send or receive type.
+ * @param nvars number of variables.
+ * @param count number of elements of each variable.
+ * @param comm the rearranger communicator.
+ * @param sizep pointer that gets the size in bytes.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+get_pack_size(iosystem_desc_t *ios, io_desc_t *iodesc, MPI_Datatype type, int nvars,
+              PIO_Offset count, MPI_Comm comm, int *sizep)
+{
+    int mpierr;
+
+    if ((PIO_Offset)nvars * count * iodesc->mpitype_size > INT_MAX)
+        return pio_err(ios, NULL, PIO_EINVAL, __FILE__, __LINE__);
+    if ((mpierr = MPI_Pack_size(1, type, comm, sizep)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Move the data of rearrange_comp2io() between the tasks of a node
+ * through the shared window of PIO_REARR_COMM_SHM. Each compute task
+ * packs the data for each IO task of its node into its segment, with
+ * the send types of the exchange. After the node is synchronized each
+ * IO task unpacks the data of the compute tasks of its node straight
+ * into rbuf, with the receive types, which are built from rindex. The
+ * data for tasks on other nodes is left to swap_data(). This is
+ * collective over the tasks of the node.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param types the cached MPI types for nvars variables.
+ * @param sbuf send buffer. May be NULL.
+ * @param rbuf receive buffer. May be NULL.
+ * @param nvars number of variables.
+ * @param niotasks number of IO tasks.
+ * @param comm the rearranger communicator.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+shm_comp2io(iosystem_desc_t *ios, io_desc_t *iodesc, rearr_type_cache_t *types,
+            void *sbuf, void *rbuf, int nvars, int niotasks, MPI_Comm comm)
+{
+    pio_shm_desc *shm = iodesc->shm;
+    int mpierr;
+    int ret;
+
+    if ((ret = shm_window(ios, iodesc, nvars)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
+    /* Pack the data for the IO tasks of the node into the segment of
+     * this task. */
+    if (sbuf)
+    {
+        for (int i = 0; i < niotasks; i++)
+        {
+            if (shm->send_off[i] >= 0)
+            {
+                int slot = swap_slot(iodesc, iodesc->rearranger == PIO_REARR_SUBSET ?
+                                     0 : ios->ioranks[i]);
+                int bytes;
+                int position = 0;
+
+                if ((ret = get_pack_size(ios, iodesc, types->sendtypes[slot], nvars,
+                                         iodesc->scount[i], comm, &bytes)))
+                    return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+                if ((mpierr = MPI_Pack(sbuf, 1, types->sendtypes[slot],
+                                       (char *)shm->winbuf + (MPI_Aint)nvars * shm->send_off[i] *
+                                       iodesc->mpitype_size, bytes, &position, comm)))
+                    return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+                iodesc->onnode_bytes += bytes;
+            }
+        }
+    }
+
+    if ((ret = shm_sync(iodesc)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
+    /* Unpack the data of the compute tasks of the node. */
+    if (ios->ioproc)
+    {
+        for (int j = 0; j < iodesc->nrecvs; j++)
+        {
+            if (shm->recv_off[j] >= 0 && iodesc->rtype[j] != PIO_DATATYPE_NULL)
+            {
+                int peer = swap_slot(iodesc, iodesc->rearranger == PIO_REARR_SUBSET ?
+                                     j : iodesc->rfrom[j]);
+                int bytes;
+                int position = 0;
+                MPI_Aint segsize;
+                int disp_unit;
+                void *base;
+
+                if ((ret = get_pack_size(ios, iodesc, types->recvtypes[peer], nvars,
+                                         iodesc->rcount[j], comm, &bytes)))
+                    return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+                if ((mpierr = MPI_Win_shared_query(shm->win, shm->recv_node_rank[j], &segsize,
+                                                   &disp_unit, &base)))
+                    return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+                if ((mpierr = MPI_Unpack((char *)base + (MPI_Aint)nvars * shm->recv_off[j] *
+                                         iodesc->mpitype_size, bytes, &position, rbuf, 1,
+                                         types->recvtypes[peer], comm)))
+                    return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+            }
+        }
+    }
+
+    /* The segments may not be reused before the IO tasks have
+     * unpacked them. */
+    if ((ret = shm_sync(iodesc)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Copy a block of the RMA window, which holds count contiguous
+ * elements of the type of the decomposition, to or from the layout
+ * of one element of a receive type in buf. The blocks are raw data,
+ * not the packed format of MPI_Pack(), so the copy is a send to this
+ * task.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param block pointer to the block in the window.
+ * @param count number of elements in the block.
+ * @param buf the buffer laid out by type.
+ * @param type the receive type.
+ * @param to_block true to copy from buf into the block, false to copy
+ * from the block into buf.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+rma_copy_block(iosystem_desc_t *ios, io_desc_t *iodesc, void *block, PIO_Offset count,
+               void *buf, MPI_Datatype type, bool to_block)
+{
+    int mpierr;
+
+    if (count > INT_MAX)
+        return pio_err(ios, NULL, PIO_EINVAL, __FILE__, __LINE__);
+
+    if (to_block)
+        mpierr = MPI_Sendrecv(buf, 1, type, 0, 0, block, (int)count, iodesc->mpitype, 0, 0,
+                              MPI_COMM_SELF, MPI_STATUS_IGNORE);
+    else
+        mpierr = MPI_Sendrecv(block, (int)count, iodesc->mpitype, 0, 0, buf, 1, type, 0, 0,
+                              MPI_COMM_SELF, MPI_STATUS_IGNORE);
+    if (mpierr)
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Move the data of rearrange_comp2io() with one-sided communication,
+ * for PIO_REARR_COMM_RMA. In one fence epoch each compute task puts
+ * its data, with its send types, into its block of the window of
+ * each IO task it sends to. Each IO task then copies the blocks into
+ * rbuf with its receive types. This is collective over the rearranger
+ * communicator.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param types the cached MPI types for nvars variables.
+ * @param sbuf send buffer. May be NULL.
+ * @param rbuf receive buffer. May be NULL.
+ * @param nvars number of variables.
+ * @param niotasks number of IO tasks.
+ * @param comm the rearranger communicator.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+rma_comp2io(iosystem_desc_t *ios, io_desc_t *iodesc, rearr_type_cache_t *types,
+            void *sbuf, void *rbuf, int nvars, int niotasks, MPI_Comm comm)
+{
+    pio_rma_desc *rma;
+    int mpierr;
+    int ret;
+
+    /* Lay out and allocate the windows. */
+    if (!iodesc->rma)
+        if ((ret = rma_create(ios, iodesc, comm, niotasks)))
+            return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+    if ((ret = rma_window(ios, iodesc, comm, nvars)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+    rma = iodesc->rma;
+
+    /* No task stores to its window between the epochs. */
+    if ((mpierr = MPI_Win_fence(MPI_MODE_NOPRECEDE | MPI_MODE_NOSTORE, rma->win)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+
+    /* Put the data for each IO task in its window. */
+    if (sbuf && (!ios->async || ios->compproc))
+    {
+        for (int i = 0; i < niotasks; i++)
+        {
+            if (iodesc->scount[i] > 0)
+            {
+                int io_comprank = iodesc->rearranger == PIO_REARR_SUBSET ? 0 : ios->ioranks[i];
+                int slot = swap_slot(iodesc, io_comprank);
+
+                if ((mpierr = MPI_Put(sbuf, 1, types->sendtypes[slot], io_comprank,
+                                      (MPI_Aint)nvars * rma->send_off[i],
+                                      nvars * iodesc->scount[i], iodesc->mpitype, rma->win)))
+                    return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+            }
+        }
+    }
+
+    if ((mpierr = MPI_Win_fence(MPI_MODE_NOSUCCEED | MPI_MODE_NOSTORE, rma->win)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+
+    /* Copy the blocks into the IO buffer. */
+    if (ios->ioproc)
+    {
+        for (int j = 0; j < iodesc->nrecvs; j++)
+        {
+            if (iodesc->rtype[j] != PIO_DATATYPE_NULL)
+            {
+                int peer = swap_slot(iodesc, iodesc->rearranger == PIO_REARR_SUBSET ?
+                                     j : iodesc->rfrom[j]);
+
+                if ((ret = rma_copy_block(ios, iodesc, (char *)rma->winbuf + (MPI_Aint)nvars *
+                                          rma->recv_off[j] * iodesc->mpitype_size,
+                                          (PIO_Offset)nvars * iodesc->rcount[j], rbuf,
+                                          types->recvtypes[peer], false)))
+                    return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+            }
+        }
+    }
+
+    return PIO_NOERR;
+}
+
+/**
+ * Move the data of rearrange_io2comp() with one-sided communication,
+ * for PIO_REARR_COMM_RMA. Each IO task copies the data of each compute
+ * task into its block of the window, with the receive types of
+ * rearrange_comp2io(). Then in one fence epoch each compute task gets
+ * its blocks into rbuf with its send types. This is collective over
+ * the rearranger communicator.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param types the cached MPI types for nvars variables.
+ * @param sbuf send buffer. May be NULL.
+ * @param rbuf receive buffer. May be NULL.
+ * @param nvars number of variables.
+ * @param niotasks number of IO tasks.
+ * @param comm the rearranger communicator.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+rma_io2comp(iosystem_desc_t *ios, io_desc_t *iodesc, rearr_type_cache_t *types,
+            void *sbuf, void *rbuf, int nvars, int niotasks, MPI_Comm comm)
+{
+    pio_rma_desc *rma;
+    int mpierr;
+    int ret;
+
+    /* Lay out and allocate the windows. */
+    if (!iodesc->rma)
+        if ((ret = rma_create(ios, iodesc, comm, niotasks)))
+            return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+    if ((ret = rma_window(ios, iodesc, comm, nvars)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+    rma = iodesc->rma;
+
+    /* Copy the data of each compute task into its block. */
+    if (ios->ioproc && sbuf)
+    {
+        for (int j = 0; j < iodesc->nrecvs; j++)
+        {
+            if (iodesc->rtype[j] != PIO_DATATYPE_NULL)
+            {
+                int peer = swap_slot(iodesc, iodesc->rearranger == PIO_REARR_SUBSET ?
+                                     j : iodesc->rfrom[j]);
+
+                if ((ret = rma_copy_block(ios, iodesc, (char *)rma->winbuf + (MPI_Aint)nvars *
+                                          rma->recv_off[j] * iodesc->mpitype_size,
+                                          (PIO_Offset)nvars * iodesc->rcount[j], sbuf,
+                                          types->recvtypes[peer], true)))
+                    return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+            }
+        }
+    }
+
+    /* Nothing is put in the windows in this epoch. */
+    if ((mpierr = MPI_Win_fence(MPI_MODE_NOPRECEDE | MPI_MODE_NOPUT, rma->win)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+
+    /* Get the data from each IO task. */
+    for (int i = 0; i < niotasks; i++)
+    {
+        if (iodesc->scount[i] > 0 && iodesc->stype[i] != PIO_DATATYPE_NULL)
+        {
+            int io_comprank = iodesc->rearranger == PIO_REARR_SUBSET ? 0 : ios->ioranks[i];
+            int slot = swap_slot(iodesc, io_comprank);
+
+            if ((mpierr = MPI_Get(rbuf, 1, types->sendtypes[slot], io_comprank,
+                                  (MPI_Aint)nvars * rma->send_off[i],
+                                  nvars * iodesc->scount[i], iodesc->mpitype, rma->win)))
+                return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+        }
+    }
+
+    if ((mpierr = MPI_Win_fence(MPI_MODE_NOSUCCEED | MPI_MODE_NOSTORE | MPI_MODE_NOPUT,
+                                rma->win)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Create the index lists of PIO_REARR_COMM_ALLTOALLV, the first time
+ * the decomposition is used with it. On compute tasks pack_sidx holds
+ * the index in the data of each element of sindex, through the remap
+ * of the data when the send types use it. On IO tasks pack_ridx holds
+ * rindex in the order the elements arrive: by message for the box
+ * rearranger, while for the subset rearranger rindex is in IO order,
+ * and is sorted by sender with rfrom.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param niotasks number of IO tasks.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+define_pack_index(iosystem_desc_t *ios, io_desc_t *iodesc, int niotasks)
+{
+    /* On compute tasks, the index of each element sent. */
+    if (!iodesc->pack_sidx && iodesc->scount && (!ios->async || ios->compproc))
+    {
+        PIO_Offset nsend = 0;
+
+        for (int i = 0; i < niotasks; i++)
+            nsend += iodesc->scount[i];
+        if (!(iodesc->pack_sidx = malloc(max(1, nsend) * sizeof(int))))
+            return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+        for (PIO_Offset n = 0; n < nsend; n++)
+            iodesc->pack_sidx[n] = iodesc->stype_unsorted ?
+                iodesc->remap[iodesc->sindex[n]] : iodesc->sindex[n];
+    }
+
+    /* On IO tasks, the index of each element received. */
+    if (!iodesc->pack_ridx && ios->ioproc)
+    {
+        PIO_Offset nrecv = 0;
+
+        for (int j = 0; j < iodesc->nrecvs; j++)
+            nrecv += iodesc->rcount[j];
+        if (!(iodesc->pack_ridx = malloc(max(1, nrecv) * sizeof(int))))
+            return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+
+        if (iodesc->rearranger == PIO_REARR_SUBSET)
+        {
+            PIO_Offset *pos;
+
+            if (!(pos = malloc(max(1, iodesc->nrecvs) * sizeof(PIO_Offset))))
+            {
+                free(iodesc->pack_ridx);
+                iodesc->pack_ridx = NULL;
+                return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+            }
+            for (int j = 0; j < iodesc->nrecvs; j++)
+                pos[j] = j ? pos[j - 1] + iodesc->rcount[j - 1] : 0;
+            for (PIO_Offset k = 0; k < nrecv; k++)
+                iodesc->pack_ridx[pos[iodesc->rfrom[k]]++] = iodesc->rindex[k];
+            free(pos);
+        }
+        else
+        {
+            for (PIO_Offset k = 0; k < nrecv; k++)
+                iodesc->pack_ridx[k] = iodesc->rindex[k];
+        }
+    }
+
+    return PIO_NOERR;
+}
+
+/**
+ * Copy the data of a compute task between its buffer and its packed
+ * buffer for PIO_REARR_COMM_ALLTOALLV. The packed buffer holds a block
+ * for each IO task the task exchanges data with, in the order of the
+ * IO tasks, and each block holds the elements of each variable in
+ * turn. The copies are done by the kernels of pio_remap_copy().
+ *
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param data the data of the compute task.
+ * @param packed the packed buffer.
+ * @param nvars number of variables.
+ * @param niotasks number of IO tasks.
+ * @param direction 0 to pack the data, 1 to unpack it.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+pack_comp_blocks(io_desc_t *iodesc, void *data, void *packed, int nvars, int niotasks,
+                 int direction)
+{
+    /* With the hierarchical rearranger, the data is in the node
+     * buffer. */
+    PIO_Offset stride = iodesc->hier ? iodesc->hier->nodelen : iodesc->ndof;
+    int size = iodesc->mpitype_size;
+    PIO_Offset spos = 0;
+    char *block = packed;
+    int ret;
+
+    for (int i = 0; i < niotasks; i++)
+    {
+        for (int v = 0; v < nvars && iodesc->scount[i] > 0; v++)
+        {
+            char *d = (char *)data + (size_t)v * stride * size;
+
+            if ((ret = direction ?
+                 pio_remap_copy(block, d, &iodesc->pack_sidx[spos], iodesc->scount[i], 1, size, 1) :
+                 pio_remap_copy(d, block, &iodesc->pack_sidx[spos], iodesc->scount[i], 1, size, 0)))
+                return ret;
+            block += (size_t)iodesc->scount[i] * size;
+        }
+        spos += iodesc->scount[i];
+    }
+
+    return PIO_NOERR;
+}
+
+/**
+ * Copy the data of an IO task between the IO buffer and its packed
+ * buffer for PIO_REARR_COMM_ALLTOALLV. The packed buffer holds a block
+ * for each compute task the IO task exchanges data with, in the order
+ * of the messages, and each block holds the elements of each variable
+ * in turn.
+ *
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param iobuf the IO buffer.
+ * @param packed the packed buffer.
+ * @param nvars number of variables.
+ * @param direction 0 to pack the data, 1 to unpack it.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+pack_io_blocks(io_desc_t *iodesc, void *iobuf, void *packed, int nvars, int direction)
+{
+    int size = iodesc->mpitype_size;
+    PIO_Offset rpos = 0;
+    char *block = packed;
+    int ret;
+
+    for (int j = 0; j < iodesc->nrecvs; j++)
+    {
+        for (int v = 0; v < nvars && iodesc->rcount[j] > 0; v++)
+        {
+            char *d = (char *)iobuf + (size_t)v * iodesc->llen * size;
+
+            if ((ret = direction ?
+                 pio_remap_copy(block, d, &iodesc->pack_ridx[rpos], iodesc->rcount[j], 1, size, 1) :
+                 pio_remap_copy(d, block, &iodesc->pack_ridx[rpos], iodesc->rcount[j], 1, size, 0)))
+                return ret;
+            block += (size_t)iodesc->rcount[j] * size;
+        }
+        rpos += iodesc->rcount[j];
+    }
+
+    return PIO_NOERR;
+}
+
+/**
+ * Move the data of rearrange_comp2io() or rearrange_io2comp() with
+ * PIO_REARR_COMM_ALLTOALLV. The sending tasks pack the data for each
+ * peer into one contiguous buffer with the index lists of the
+ * decomposition, the buffers are exchanged with one MPI_Alltoallv() of
+ * the basic type of the decomposition, and the receiving tasks unpack
+ * them. Unlike PIO_REARR_COMM_COLL, no derived types are used, so MPI
+ * only moves contiguous blocks. This is collective over the
+ * rearranger communicator.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param cbuf the data of the compute task. May be NULL.
+ * @param iobuf the IO buffer. May be NULL.
+ * @param nvars number of variables.
+ * @param niotasks number of IO tasks.
+ * @param comm the rearranger communicator.
+ * @param io2comp true to move the data from the IO tasks to the
+ * compute tasks, false for the other way around.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+alltoallv_rearrange(iosystem_desc_t *ios, io_desc_t *iodesc, void *cbuf, void *iobuf,
+                    int nvars, int niotasks, MPI_Comm comm, bool io2comp)
+{
+    int *ccounts, *cdispls;    /* Counts and offsets of the compute task. */
+    int *iocounts, *iodispls;  /* Counts and offsets of the IO task. */
+    void *cpack = NULL;        /* Packed buffer of the compute task. */
+    void *iopack = NULL;       /* Packed buffer of the IO task. */
+    PIO_Offset clen = 0, iolen = 0;
+    PIO_Offset cbytes, iobytes;
+    bool comp = cbuf && iodesc->scount && (!ios->async || ios->compproc);
+    bool io = iobuf && ios->ioproc;
+    int ntasks;
+    int mpierr;
+    int ret = PIO_NOERR;
+
+    if ((ret = define_pack_index(ios, iodesc, niotasks)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
+    if ((mpierr = MPI_Comm_size(comm, &ntasks)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if (!(ccounts = calloc(4 * (size_t)ntasks, sizeof(int))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    cdispls = ccounts + ntasks;
+    iocounts = cdispls + ntasks;
+    iodispls = iocounts + ntasks;
+
+    /* The block of each IO task in the packed buffer of a compute
+     * task, in elements. */
+    if (comp)
+    {
+        for (int i = 0; i < niotasks; i++)
+        {
+            int rank = iodesc->rearranger == PIO_REARR_SUBSET ? 0 : ios->ioranks[i];
+
+            ccounts[rank] = nvars * iodesc->scount[i];
+            cdispls[rank] = clen;
+            clen += ccounts[rank];
+        }
+    }
+
+    /* The block of each compute task in the packed buffer of an IO
+     * task. */
+    if (io)
+    {
+        for (int j = 0; j < iodesc->nrecvs; j++)
+        {
+            int rank = iodesc->rearranger == PIO_REARR_SUBSET ? j : iodesc->rfrom[j];
+
+            iocounts[rank] = nvars * iodesc->rcount[j];
+            iodispls[rank] = iolen;
+            iolen += iocounts[rank];
+        }
+    }
+    PLOG((2, "alltoallv_rearrange io2comp = %d clen = %lld iolen = %lld", io2comp,
+          (long long)clen, (long long)iolen));
+
+    /* MPI_Alltoallv() takes int offsets. */
+    if (clen > INT_MAX || iolen > INT_MAX)
+    {
+        ret = pio_err(ios, NULL, PIO_EINVAL, __FILE__, __LINE__);
+        goto exit;
+    }
+
+    if (clen > 0)
+        if (!(cpack = pio_iobuf_alloc(ios, clen * iodesc->mpitype_size, &cbytes)))
+        {
+            ret = pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+            goto exit;
+        }
+    if (iolen > 0)
+        if (!(iopack = pio_iobuf_alloc(ios, iolen * iodesc->mpitype_size, &iobytes)))
+        {
+            ret = pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+            goto exit;
+        }
+
+    /* Pack, exchange, and unpack. */
+    if (io2comp)
+    {
+        if (iopack)
+            if ((ret = pack_io_blocks(iodesc, iobuf, iopack, nvars, 0)))
+            {
+                ret = pio_err(ios, NULL, ret, __FILE__, __LINE__);
+                goto exit;
+            }
+        if ((mpierr = MPI_Alltoallv(iopack, iocounts, iodispls, iodesc->mpitype, cpack,
+                                    ccounts, cdispls, iodesc->mpitype, comm)))
+        {
+            ret = check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+            goto exit;
+        }
+        if (cpack)
+            if ((ret = pack_comp_blocks(iodesc, cbuf, cpack, nvars, niotasks, 1)))
+            {
+                ret = pio_err(ios, NULL, ret, __FILE__, __LINE__);
+                goto exit;
+            }
+    }
+    else
+    {
+        if (cpack)
+            if ((ret = pack_comp_blocks(iodesc, cbuf, cpack, nvars, niotasks, 0)))
+            {
+                ret = pio_err(ios, NULL, ret, __FILE__, __LINE__);
+                goto exit;
+            }
+        if ((mpierr = MPI_Alltoallv(cpack, ccounts, cdispls, iodesc->mpitype, iopack,
+                                    iocounts, iodispls, iodesc->mpitype, comm)))
+        {
+            ret = check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+            goto exit;
+        }
+        if (iopack)
+            if ((ret = pack_io_blocks(iodesc, iobuf, iopack, nvars, 1)))
+            {
+                ret = pio_err(ios, NULL, ret, __FILE__, __LINE__);
+                goto exit;
+            }
+    }
+
+exit:
+    /* Free resources. */
+    if (cpack)
+        pio_iobuf_free(ios, cpack, cbytes);
+    if (iopack)
+        pio_iobuf_free(ios, iopack, iobytes);
+    free(ccounts);
+
+    return ret;
+}
+
+/**
+ * Move the data of rearrange_comp2io() or rearrange_io2comp() with
+ * the persistent requests of PIO_REARR_COMM_PERSIST. The requests are
+ * made with MPI_Send_init() and MPI_Recv_init() the first time the
+ * types of the cache entry are used with these buffers, and kept in
+ * the entry. Each exchange is then just MPI_Startall() and
+ * MPI_Waitall(). When a decomposition is written every timestep from
+ * the same array into the same IO buffer (which the IO buffer pool
+ * hands back), the requests are made only once.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param types the cached MPI types for nvars variables.
+ * @param cbuf the data of the compute task. May be NULL.
+ * @param iobuf the IO buffer. May be NULL.
+ * @param niotasks number of IO tasks.
+ * @param comm the rearranger communicator.
+ * @param io2comp true to move the data from the IO tasks to the
+ * compute tasks, false for the other way around.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+persist_rearrange(iosystem_desc_t *ios, io_desc_t *iodesc, rearr_type_cache_t *types,
+                  void *cbuf, void *iobuf, int niotasks, MPI_Comm comm, bool io2comp)
+{
+    rearr_persist_req_t *preq = io2comp ? &types->io2comp : &types->comp2io;
+    int mpierr;
+    int ret;
+
+    /* The requests are bound to the buffers. */
+    if (preq->reqs && (preq->cbuf != cbuf || preq->iobuf != iobuf))
+        if ((ret = free_persist_req(preq)))
+            return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
+    if (!preq->reqs)
+    {
+        PLOG((2, "persist_rearrange making requests io2comp = %d nvars = %d", io2comp,
+              types->nvars));
+
+        /* There is at most one request for each message. */
+        if (!(preq->reqs = malloc((max(0, iodesc->nrecvs) + niotasks) * sizeof(MPI_Request))))
+            return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+        preq->cbuf = cbuf;
+        preq->iobuf = iobuf;
+
+        /* The requests of the IO tasks come first, so that the
+         * receives are started before the sends when writing. */
+        if (ios->ioproc && iobuf)
+        {
+            for (int j = 0; j < iodesc->nrecvs; j++)
+            {
+                if (iodesc->rtype[j] != PIO_DATATYPE_NULL)
+                {
+                    int rank = iodesc->rearranger == PIO_REARR_SUBSET ? j : iodesc->rfrom[j];
+                    int peer = swap_slot(iodesc, rank);
+
+                    if (io2comp)
+                        mpierr = MPI_Send_init(iobuf, 1, types->recvtypes[peer], rank,
+                                               PIO_IWRITE_TAG, comm, &preq->reqs[preq->nreqs++]);
+                    else
+                        mpierr = MPI_Recv_init(iobuf, 1, types->recvtypes[peer], rank,
+                                               PIO_IWRITE_TAG, comm, &preq->reqs[preq->nreqs++]);
+                    if (mpierr)
+                        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+                }
+            }
+        }
+
+        /* Then the requests of the compute tasks. */
+        if (cbuf && iodesc->scount && (!ios->async || ios->compproc))
+        {
+            for (int i = 0; i < niotasks; i++)
+            {
+                if (iodesc->scount[i] > 0 && iodesc->stype[i] != PIO_DATATYPE_NULL)
+                {
+                    int io_comprank = iodesc->rearranger == PIO_REARR_SUBSET ? 0 : ios->ioranks[i];
+                    int slot = swap_slot(iodesc, io_comprank);
+
+                    if (io2comp)
+                        mpierr = MPI_Recv_init(cbuf, 1, types->sendtypes[slot], io_comprank,
+                                               PIO_IWRITE_TAG, comm, &preq->reqs[preq->nreqs++]);
+                    else
+                        mpierr = MPI_Send_init(cbuf, 1, types->sendtypes[slot], io_comprank,
+                                               PIO_IWRITE_TAG, comm, &preq->reqs[preq->nreqs++]);
+                    if (mpierr)
+                        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+                }
+            }
+        }
+    }
+
+    /* Start the exchange and wait for it. */
+    if (preq->nreqs)
+    {
+        if ((mpierr = MPI_Startall(preq->nreqs, preq->reqs)))
+            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+        if ((mpierr = MPI_Waitall(preq->nreqs, preq->reqs, MPI_STATUSES_IGNORE)))
+            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    }
+
+    return PIO_NOERR;
+}
+
+/**
+ * Moves data from compute tasks to IO tasks. This is called from
+ * PIOc_write_darray_multi().
+ *
+ * The MPI datatypes for the transfer are kept in the datatype cache
+ * of the iodesc, so repeated calls with the same nvars reuse them.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param sbuf send buffer. May be NULL.
+ * @param rbuf receive buffer. May be NULL.
+ * @param nvars number of variables.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+rearrange_comp2io(iosystem_desc_t *ios, io_desc_t *iodesc, void *sbuf,
+                  void *rbuf, int nvars)
+{
+    int ntasks;       /* Number of tasks in communicator. */
+    int niotasks;     /* Number of IO tasks. */
+    MPI_Comm mycomm;  /* Communicator that data is transferred over. */
+    rearr_type_cache_t *types; /* Cached MPI types for this nvars. */
+    int mpierr;       /* Return code from MPI calls. */
+    int ret;
+
+#ifdef TIMING
+    /* Start timer if desired. */
+    if ((ret = pio_start_timer("PIO:rearrange_comp2io")))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+#endif /* TIMING */
+
+    /* Caller must provide these. */
+    pioassert(ios && iodesc && nvars > 0, "invalid input", __FILE__, __LINE__);
+
+    PLOG((1, "rearrange_comp2io nvars = %d iodesc->rearranger = %d", nvars,
+          iodesc->rearranger));
+
+    /* Different rearraangers use different communicators. */
+    if (iodesc->rearranger != PIO_REARR_SUBSET)
+    {
+        mycomm = ios->union_comm;
+        niotasks = ios->num_iotasks;
+    }
+    else
+    {
+        mycomm = iodesc->subset_comm;
+        niotasks = 1;
+    }
+
+    /* Get the number of tasks. */
+    if ((mpierr = MPI_Comm_size(mycomm, &ntasks)))
+        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+
+    /* With the sparse exchange, the arrays only hold the peers. */
+    if (use_sparse_swap(iodesc))
+        ntasks = iodesc->npeers;
+
+    /* These are parameters to pio_swapm to send data from compute to
+     * IO tasks. */
+    int sendcounts[max(1, ntasks)];
+    int recvcounts[max(1, ntasks)];
+    int sdispls[max(1, ntasks)];
+    int rdispls[max(1, ntasks)];
+    MPI_Datatype sendtypes[max(1, ntasks)];
+    MPI_Datatype recvtypes[max(1, ntasks)];
+
+    /* Initialize pio_swapm parameter arrays. */
+    for (int i = 0; i < ntasks; i++)
+    {
+        sendcounts[i] = 0;
+        recvcounts[i] = 0;
+        sdispls[i] = 0;
+        rdispls[i] = 0;
+        recvtypes[i] = PIO_DATATYPE_NULL;
+        sendtypes[i] =  PIO_DATATYPE_NULL;
+    }
+
+    /* If it has not already been done, define the MPI data types that
+     * will be used for this io_desc_t. */
+    if ((ret = define_iodesc_datatypes(ios, iodesc)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
+    /* Get the vector types for nvars variables. */
+    if ((ret = get_comp2io_types(ios, iodesc, nvars, ntasks, niotasks, &types)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
+    /* With the hierarchical rearranger, the data of the node is
+     * combined in the node buffer, and sent from there by the node
+     * leader. */
+    if (iodesc->hier)
+        if ((ret = hier_comp2io_begin(ios, iodesc, sbuf, nvars, &sbuf)))
+            return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
+    /* With the shared memory comm type, find the tasks on this node
+     * the first time. */
+    if (iodesc->rearr_opts.comm_type == PIO_REARR_COMM_SHM && !iodesc->shm && !ios->async)
+        if ((ret = shm_create(ios, iodesc, mycomm, niotasks)))
+            return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
+    /* If this io proc, we need to receive data from compute tasks. */
+    if (ios->ioproc && iodesc->nrecvs > 0)
+    {
+        for (int i = 0; i < iodesc->nrecvs; i++)
+        {
+            /* Data from tasks on this node comes through the window. */
+            if (iodesc->shm && iodesc->shm->recv_off[i] >= 0)
+                continue;
+
+            if (iodesc->rtype[i] != PIO_DATATYPE_NULL)
+            {
+                int peer = swap_slot(iodesc, iodesc->rearranger == PIO_REARR_SUBSET ?
+                                     i : iodesc->rfrom[i]);
+
+                PLOG((3, "receiving data i = %d peer = %d", i, peer));
+                recvcounts[peer] = 1;
+                recvtypes[peer] = types->recvtypes[peer];
+            }
+        }
+    }
+
+    /* On compute tasks set the count and type of the exchange with
+     * each IO task. */
+    if (!ios->async || ios->compproc)
+    {
+        for (int i = 0; i < niotasks; i++)
+        {
+            int io_comprank = ios->ioranks[i];
+            if (iodesc->rearranger == PIO_REARR_SUBSET)
+                io_comprank = 0;
+
+            PLOG((3, "i = %d iodesc->scount[i] = %d", i, iodesc->scount[i]));
+            if (iodesc->shm && iodesc->shm->send_off[i] >= 0)
+                continue;
+            if (iodesc->scount[i] > 0 && sbuf)
+            {
+                int slot = swap_slot(iodesc, io_comprank);
+
+                sendcounts[slot] = 1;
+                sendtypes[slot] = types->sendtypes[slot];
+                if (iodesc->shm)
+                    iodesc->offnode_bytes += (PIO_Offset)nvars * iodesc->scount[i] *
+                        iodesc->mpitype_size;
+            }
+        }
+    }
+
+    /* Move the data between tasks of the same node through the
+     * shared window. */
+    if (iodesc->shm && iodesc->shm->active)
+        if ((ret = shm_comp2io(ios, iodesc, types, sbuf, rbuf, nvars, niotasks, mycomm)))
+            return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
+    /* Data in sbuf on the compute nodes is sent to rbuf on the
+     * ionodes, or put in their windows with the one-sided comm
+     * type, or packed and sent with MPI_Alltoallv(), or sent with
+     * persistent requests. */
+    if (iodesc->rearr_opts.comm_type == PIO_REARR_COMM_RMA)
+    {
+        if ((ret = rma_comp2io(ios, iodesc, types, sbuf, rbuf, nvars, niotasks, mycomm)))
+            return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+    }
+    else if (iodesc->rearr_opts.comm_type == PIO_REARR_COMM_ALLTOALLV)
+    {
+        if ((ret = alltoallv_rearrange(ios, iodesc, sbuf, rbuf, nvars, niotasks, mycomm,
+                                       false)))
+            return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+    }
+    else if (iodesc->rearr_opts.comm_type == PIO_REARR_COMM_PERSIST)
+    {
+        if ((ret = persist_rearrange(ios, iodesc, types, sbuf, rbuf, niotasks, mycomm, false)))
+            return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+    }
+    else if ((ret = swap_data(iodesc, sbuf, sendcounts, sdispls, sendtypes,
+                              rbuf, recvcounts, rdispls, recvtypes, mycomm,
+                              &iodesc->rearr_opts.comp2io)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
+    /* The node buffer may not be reused before the leader has sent
+     * it. */
+    if (iodesc->hier)
+        if ((ret = hier_sync(iodesc)))
+            return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
+#ifdef TIMING
+    if ((ret = pio_stop_timer("PIO:rearrange_comp2io")))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+#endif /* TIMING */
+
+    return PIO_NOERR;
+}
+
+/**
+ * Start moving data from compute tasks to IO tasks, without waiting
+ * for the data to arrive. This is called from PIOc_iwrite_darray().
+ *
+ * The exchange uses the same MPI datatypes as rearrange_comp2io(),
+ * but every message is posted with MPI_Irecv() or MPI_Isend(), and
+ * the requests are returned to the caller. Neither sbuf nor rbuf may
+ * be touched until rearrange_comp2io_finish() has been called. All
+ * messages use PIO_IWRITE_TAG; since MPI does not let messages
+ * between two tasks overtake each other, several exchanges may be
+ * outstanding at once, as long as all tasks start them in the same
+ * order. Flow control options are not used.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param sbuf send buffer. May be NULL.
+ * @param rbuf receive buffer. May be NULL.
+ * @param nvars number of variables.
+ * @param nreqsp pointer that gets the number of MPI requests.
+ * @param reqsp pointer that gets the array of MPI requests, which
+ * must be freed by the caller. NULL if there are none.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+rearrange_comp2io_start(iosystem_desc_t *ios, io_desc_t *iodesc, void *sbuf,
+                        void *rbuf, int nvars, int *nreqsp, MPI_Request **reqsp)
+{
+    int ntasks;       /* Number of tasks in communicator. */
+    int niotasks;     /* Number of IO tasks. */
+    MPI_Comm mycomm;  /* Communicator that data is transferred over. */
+    rearr_type_cache_t *types; /* Cached MPI types for this nvars. */
+    MPI_Request *reqs;
+    int nreqs = 0;
+    int mpierr;       /* Return code from MPI calls. */
+    int ret;
+
+    /* Caller must provide these. */
+    pioassert(ios && iodesc && nvars > 0 && nreqsp && reqsp, "invalid input",
+              __FILE__, __LINE__);
+
+    PLOG((1, "rearrange_comp2io_start nvars = %d iodesc->rearranger = %d", nvars,
+          iodesc->rearranger));
+
+    /* The node buffer of the hierarchical rearranger, and the window
+     * of the shared memory comm type, are shared by the tasks of the
+     * node, and the one-sided comm type completes in a fence, so the
+     * exchange is completed here. */
+    if (iodesc->hier || (iodesc->rearr_opts.comm_type == PIO_REARR_COMM_SHM && !ios->async) ||
+        iodesc->rearr_opts.comm_type == PIO_REARR_COMM_RMA)
+    {
+        *nreqsp = 0;
+        *reqsp = NULL;
+        return rearrange_comp2io(ios, iodesc, sbuf, rbuf, nvars);
+    }
+
+    /* Different rearraangers use different communicators. */
+    if (iodesc->rearranger != PIO_REARR_SUBSET)
+    {
+        mycomm = ios->union_comm;
+        niotasks = ios->num_iotasks;
+    }
+    else
+    {
+        mycomm = iodesc->subset_comm;
+        niotasks = 1;
+    }
+
+    /* Get the number of tasks. */
+    if ((mpierr = MPI_Comm_size(mycomm, &ntasks)))
+        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+
+    /* With the sparse exchange, the type arrays only hold the peers. */
+    if (use_sparse_swap(iodesc))
+        ntasks = iodesc->npeers;
+
+    /* If it has not already been done, define the MPI data types that
+     * will be used for this io_desc_t. */
+    if ((ret = define_iodesc_datatypes(ios, iodesc)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
+    /* Get the vector types for nvars variables. */
+    if ((ret = get_comp2io_types(ios, iodesc, nvars, ntasks, niotasks, &types)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
+    /* There is at most one receive and one send per task. */
+    if (!(reqs = malloc(2 * max(1, ntasks) * sizeof(MPI_Request))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+
+    /* Post the receives on the IO tasks first. */
+    if (ios->ioproc && iodesc->nrecvs > 0)
+    {
+        for (int i = 0; i < iodesc->nrecvs; i++)
+        {
+            if (iodesc->rtype[i] != PIO_DATATYPE_NULL)
+            {
+                int rank = iodesc->rearranger == PIO_REARR_SUBSET ? i : iodesc->rfrom[i];
+                int peer = swap_slot(iodesc, rank);
+
+                PLOG((3, "posting receive i = %d rank = %d", i, rank));
+                if ((mpierr = MPI_Irecv(rbuf, 1, types->recvtypes[peer], rank, PIO_IWRITE_TAG,
+                                        mycomm, &reqs[nreqs++])))
+                {
+                    free(reqs);
+                    return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+                }
+            }
+        }
+    }
+
+    /* Then the sends on the compute tasks. */
+    if (sbuf && (!ios->async || ios->compproc))
+    {
+        for (int i = 0; i < niotasks; i++)
+        {
+            int io_comprank = ios->ioranks[i];
+            if (iodesc->rearranger == PIO_REARR_SUBSET)
+                io_comprank = 0;
+
+            if (iodesc->scount[i] > 0)
+            {
+                int slot = swap_slot(iodesc, io_comprank);
+
+                PLOG((3, "posting send i = %d io_comprank = %d", i, io_comprank));
+                if ((mpierr = MPI_Isend(sbuf, 1, types->sendtypes[slot], io_comprank,
+                                        PIO_IWRITE_TAG, mycomm, &reqs[nreqs++])))
+                {
+                    free(reqs);
+                    return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+                }
+            }
+        }
+    }
+
+    if (!nreqs)
+    {
+        free(reqs);
+        reqs = NULL;
+    }
+    *nreqsp = nreqs;
+    *reqsp = reqs;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Wait for an exchange started with rearrange_comp2io_start() to
+ * complete, and free its requests.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param nreqs number of MPI requests.
+ * @param reqs array of MPI requests. Freed by this function. May be
+ * NULL if nreqs is 0.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+rearrange_comp2io_finish(iosystem_desc_t *ios, int nreqs, MPI_Request *reqs)
+{
+    int mpierr = MPI_SUCCESS;
+
+    pioassert(ios && nreqs >= 0, "invalid input", __FILE__, __LINE__);
+
+    if (nreqs > 0)
+        mpierr = MPI_Waitall(nreqs, reqs, MPI_STATUSES_IGNORE);
+    free(reqs);
+    if (mpierr)
+        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Moves data from IO tasks to compute tasks. This function is used in
+ * PIOc_read_darray() and PIOc_read_darray_multi().
+ *
+ * To move more than one variable, the vector types of the datatype
+ * cache, which rearrange_comp2io() uses the other way, are used, so
+ * all variables are moved in one exchange.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param sbuf send buffer.
+ * @param rbuf receive buffer.
+ * @param nvars number of variables.
  * @returns 0 on success, error code otherwise.
  * @author Jim Edwards
  */
 int
 rearrange_io2comp(iosystem_desc_t *ios, io_desc_t *iodesc, void *sbuf,
-                  void *rbuf)
+                  void *rbuf, int nvars)
 {
     MPI_Comm mycomm;
     int ntasks;
     int niotasks;
+    rearr_type_cache_t *types = NULL; /* Cached MPI types if nvars > 1. */
+    void *nodebuf = NULL; /* Node buffer of the hierarchical rearranger. */
     int mpierr; /* Return code from MPI calls. */
     int ret;
 
     /* Check inputs. */
-    pioassert(ios && iodesc, "invalid input", __FILE__, __LINE__);
-    PLOG((2, "rearrange_io2comp iodesc->rearranger %d", iodesc->rearranger));
+    pioassert(ios && iodesc && nvars > 0, "invalid input", __FILE__, __LINE__);
+    PLOG((2, "rearrange_io2comp nvars %d iodesc->rearranger %d", nvars,
+          iodesc->rearranger));
 
 #ifdef TIMING
     /* Start timer if desired. */
@@ -1016,7 +2470,7 @@ rearrange_io2comp(iosystem_desc_t *ios, io_desc_t *iodesc, void *sbuf,
 
     /* Different rearrangers use different communicators and number of
      * IO tasks. */
-    if (iodesc->rearranger == PIO_REARR_BOX)
+    if (iodesc->rearranger != PIO_REARR_SUBSET)
     {
         mycomm = ios->union_comm;
         niotasks = ios->num_iotasks;
@@ -1038,13 +2492,17 @@ rearrange_io2comp(iosystem_desc_t *ios, io_desc_t *iodesc, void *sbuf,
     if ((ret = define_iodesc_datatypes(ios, iodesc)))
         return pio_err(ios, NULL, ret, __FILE__, __LINE__);
 
+    /* With the sparse exchange, the arrays only hold the peers. */
+    if (use_sparse_swap(iodesc))
+        ntasks = iodesc->npeers;
+
     /* Allocate arrays needed by the pio_swapm() function. */
-    int sendcounts[ntasks];
-    int recvcounts[ntasks];
-    int sdispls[ntasks];
-    int rdispls[ntasks];
-    MPI_Datatype sendtypes[ntasks];
-    MPI_Datatype recvtypes[ntasks];
+    int sendcounts[max(1, ntasks)];
+    int recvcounts[max(1, ntasks)];
+    int sdispls[max(1, ntasks)];
+    int rdispls[max(1, ntasks)];
+    MPI_Datatype sendtypes[max(1, ntasks)];
+    MPI_Datatype recvtypes[max(1, ntasks)];
 
     /* Initialize arrays. */
     for (int i = 0; i < ntasks; i++)
@@ -1057,6 +2515,15 @@ rearrange_io2comp(iosystem_desc_t *ios, io_desc_t *iodesc, void *sbuf,
         recvtypes[i] = PIO_DATATYPE_NULL;
     }
 
+    /* Get the vector types for nvars variables. The IO tasks send
+     * with the types rearrange_comp2io() receives with, and the other
+     * way around. The one-sided and persistent comm types always use
+     * them. */
+    if (nvars > 1 || iodesc->rearr_opts.comm_type == PIO_REARR_COMM_RMA ||
+        iodesc->rearr_opts.comm_type == PIO_REARR_COMM_PERSIST)
+        if ((ret = get_comp2io_types(ios, iodesc, nvars, ntasks, niotasks, &types)))
+            return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
     /* In IO tasks set up sendcounts/sendtypes for pio_swapm() call
      * below. */
     if (ios->ioproc)
@@ -1065,18 +2532,13 @@ rearrange_io2comp(iosystem_desc_t *ios, io_desc_t *iodesc, void *sbuf,
         {
             if (iodesc->rtype[i] != PIO_DATATYPE_NULL)
             {
-                if (iodesc->rearranger == PIO_REARR_SUBSET)
-                {
-                    if (sbuf)
-                    {
-                        sendcounts[i] = 1;
-                        sendtypes[i] = iodesc->rtype[i];
-                    }
-                }
-                else
+                int peer = swap_slot(iodesc, iodesc->rearranger == PIO_REARR_SUBSET ?
+                                     i : iodesc->rfrom[i]);
+
+                if (iodesc->rearranger != PIO_REARR_SUBSET || sbuf)
                 {
-                    sendcounts[iodesc->rfrom[i]] = 1;
-                    sendtypes[iodesc->rfrom[i]] = iodesc->rtype[i];
+                    sendcounts[peer] = 1;
+                    sendtypes[peer] = types ? types->recvtypes[peer] : iodesc->rtype[i];
                 }
             }
         }
@@ -1093,82 +2555,422 @@ rearrange_io2comp(iosystem_desc_t *ios, io_desc_t *iodesc, void *sbuf,
         if (iodesc->rearranger == PIO_REARR_SUBSET)
             io_comprank = 0;
 
-        if (iodesc->scount[i] > 0 && iodesc->stype[i] != PIO_DATATYPE_NULL)
+        if (iodesc->scount[i] > 0 && iodesc->stype[i] != PIO_DATATYPE_NULL)
+        {
+            int slot = swap_slot(iodesc, io_comprank);
+
+            recvtypes[slot] = types ? types->sendtypes[slot] : iodesc->stype[i];
+            if (recvtypes[slot] != PIO_DATATYPE_NULL)
+                recvcounts[slot] = 1;
+        }
+    }
+
+    /* With the hierarchical rearranger, the node leader receives the
+     * data of the node in the node buffer. */
+    if (iodesc->hier)
+        if ((ret = hier_io2comp_begin(ios, iodesc, nvars, &nodebuf)))
+            return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
+    /* Data in sbuf on the ionodes is sent to rbuf on the compute
+     * nodes, or got from their windows with the one-sided comm
+     * type, or packed and sent with MPI_Alltoallv(), or sent with
+     * persistent requests. */
+    if (iodesc->rearr_opts.comm_type == PIO_REARR_COMM_RMA)
+    {
+        if ((ret = rma_io2comp(ios, iodesc, types, sbuf, iodesc->hier ? nodebuf : rbuf, nvars,
+                               niotasks, mycomm)))
+            return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+    }
+    else if (iodesc->rearr_opts.comm_type == PIO_REARR_COMM_ALLTOALLV)
+    {
+        if ((ret = alltoallv_rearrange(ios, iodesc, iodesc->hier ? nodebuf : rbuf, sbuf, nvars,
+                                       niotasks, mycomm, true)))
+            return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+    }
+    else if (iodesc->rearr_opts.comm_type == PIO_REARR_COMM_PERSIST)
+    {
+        if ((ret = persist_rearrange(ios, iodesc, types, iodesc->hier ? nodebuf : rbuf, sbuf,
+                                     niotasks, mycomm, true)))
+            return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+    }
+    else if ((ret = swap_data(iodesc, sbuf, sendcounts, sdispls, sendtypes,
+                              iodesc->hier ? nodebuf : rbuf, recvcounts,
+                              rdispls, recvtypes, mycomm, &iodesc->rearr_opts.io2comp)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
+    /* Each task of the node gets its data from the node buffer. */
+    if (iodesc->hier)
+        if ((ret = hier_io2comp_end(ios, iodesc, rbuf, nvars)))
+            return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+#ifdef TIMING
+    if ((ret = pio_stop_timer("PIO:rearrange_io2comp")))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+#endif
+
+    return PIO_NOERR;
+}
+
+/**
+ * Determine whether fill values are needed. This function compares
+ * how much data we have to how much data is in a record (or
+ * non-record var). If we have enough data to completely fill the
+ * variable, then fill is not needed.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param gdimlen pointer to an array length iodesc->ndims with the
+ * global array sizes for one record (for record vars) or for the
+ * entire var (for non-record vars).
+ * @param compmap only used for the box communicator.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+determine_fill(iosystem_desc_t *ios, io_desc_t *iodesc, const int *gdimlen,
+               const PIO_Offset *compmap)
+{
+    PIO_Offset totalllen = 0;
+    PIO_Offset totalgridsize = 1;
+    int mpierr; /* Return code from MPI calls. */
+
+    /* Check inputs. */
+    pioassert(ios && iodesc && gdimlen && compmap, "invalid input",
+              __FILE__, __LINE__);
+
+    /* Determine size of data space. */
+    for (int i = 0; i < iodesc->ndims; i++)
+        totalgridsize *= gdimlen[i];
+
+    /* Determine how many values we have locally. */
+    if (iodesc->rearranger == PIO_REARR_SUBSET)
+        totalllen = iodesc->llen;
+    else
+        for (int i = 0; i < iodesc->ndof; i++)
+            if (compmap[i] > 0)
+                totalllen++;
+
+    /* Add results accross communicator. */
+    PLOG((2, "determine_fill before allreduce totalllen = %d totalgridsize = %d",
+          totalllen, totalgridsize));
+    if ((mpierr = MPI_Allreduce(MPI_IN_PLACE, &totalllen, 1, PIO_OFFSET, MPI_SUM,
+                                ios->union_comm)))
+        check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+    PLOG((2, "after allreduce totalllen = %d", totalllen));
+
+    /* If the total size of the data provided to be written is < the
+     * total data size then we need fill values. */
+    iodesc->needsfill = totalllen < totalgridsize;
+
+    /*  TURN OFF FILL for timing test
+        iodesc->needsfill=false; */
+
+    return PIO_NOERR;
+}
+
+/**
+ * Compare two PIO_Offset values. This function is passed to qsort
+ * when sorting the box breakpoints in find_box_dest().
+ *
+ * @param a pointer to an offset.
+ * @param b pointer to another offset.
+ * @returns -1, 0 or 1 as a is less than, equal to or greater than b.
+ * @author Jim Edwards
+ */
+static int
+compare_pio_offset(const void *a, const void *b)
+{
+    PIO_Offset x = *(const PIO_Offset *)a;
+    PIO_Offset y = *(const PIO_Offset *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Find the index of the interval [brk[j], brk[j + 1]) that contains
+ * val, using a binary search of the sorted breakpoint array.
+ *
+ * @param nbrk number of breakpoints in brk.
+ * @param brk sorted array (length nbrk) of unique breakpoints.
+ * @param val the value to look up.
+ * @returns the interval index, or -1 if val is outside the
+ * breakpoints.
+ * @author Jim Edwards
+ */
+static int
+find_interval(int nbrk, const PIO_Offset *brk, PIO_Offset val)
+{
+    int lo = 0;
+    int hi = nbrk - 1;
+
+    if (nbrk < 2 || val < brk[0] || val >= brk[nbrk - 1])
+        return -1;
+
+    /* Invariant: brk[lo] <= val < brk[hi]. */
+    while (hi - lo > 1)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (brk[mid] <= val)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Find the destination IO task, and the index into the data buffer of
+ * that IO task, for each element of the compmap. This is used by the
+ * box rearranger.
+ *
+ * The start and end of each IO task box along each dimension are
+ * collected into a sorted list of breakpoints. Together these cut
+ * the global array into a grid of cells, each of which lies entirely
+ * inside at most one box. A table of the owning IO task of each cell
+ * is built once, and each compmap element is then located with one
+ * binary search per dimension, so the cost is O(maplen * ndims *
+ * log(num_iotasks)) rather than O(maplen * num_iotasks * ndims). For
+ * the boxes computed by CalcStartandCount() there is exactly one cell
+ * per box. If user supplied boxes would give a cell table much larger
+ * than the number of IO tasks, each box is searched in turn instead.
+ *
+ * The global coordinates of all compmap elements are kept in one
+ * flat buffer of length maplen * ndims.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param ndims the number of dimensions.
+ * @param gdimlen an array length ndims with the sizes of the global
+ * dimensions.
+ * @param maplen the length of the map.
+ * @param compmap a 1 based array of offsets into the global space. A
+ * 0 in this array indicates a value which should not be transfered.
+ * @param iomaplen array (length ios->num_iotasks) with the llen of
+ * each IO task. IO tasks with an llen of 0 have no box.
+ * @param sc array holding the start array, followed by the count
+ * array, of each IO task box.
+ * @param sc_stride distance (in elements) between the start arrays of
+ * consecutive IO tasks in sc.
+ * @param dest_ioproc array (length maplen) that gets the IO task of
+ * each element, or -1 if no IO task holds it.
+ * @param dest_ioindex array (length maplen) that gets the index into
+ * the IO task data buffer of each element, or -1.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+find_box_dest(iosystem_desc_t *ios, int ndims, const int *gdimlen, int maplen,
+              const PIO_Offset *compmap, const PIO_Offset *iomaplen,
+              const PIO_Offset *sc, int sc_stride, int *dest_ioproc,
+              PIO_Offset *dest_ioindex)
+{
+    PIO_Offset *gcoord = NULL; /* Global coordinates, ndims per element. */
+    PIO_Offset *brk = NULL;    /* Sorted breakpoints, 2 * num_iotasks per dim. */
+    int *cell_owner = NULL;    /* IO task for each cell of the box grid. */
+    int nbrk[ndims];           /* Number of breakpoints in each dim. */
+    PIO_Offset ncells = 1;
+    int nactive = 0;
+    int ret = PIO_NOERR;
+
+    pioassert(ios && ndims > 0 && gdimlen && maplen >= 0 && iomaplen && sc &&
+              (maplen == 0 || (compmap && dest_ioproc && dest_ioindex)),
+              "invalid input", __FILE__, __LINE__);
+
+    for (int k = 0; k < maplen; k++)
+    {
+        dest_ioproc[k] = -1;
+        dest_ioindex[k] = -1;
+    }
+    if (maplen == 0)
+        return PIO_NOERR;
+
+    /* Convert a 1-D index into a global coordinate value for each
+     * data element. The compmap array is 1 based but calculations
+     * are 0 based. Elements not to be transferred are skipped. */
+    if (!(gcoord = malloc((size_t)maplen * ndims * sizeof(PIO_Offset))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    for (int k = 0; k < maplen; k++)
+        if (compmap[k] > 0)
+            idx_to_dim_list(ndims, gdimlen, compmap[k] - 1, &gcoord[(size_t)k * ndims]);
+
+    /* Collect the start and end of every box along each dimension. */
+    if (!(brk = malloc((size_t)ndims * 2 * ios->num_iotasks * sizeof(PIO_Offset))))
+        EXIT1(PIO_ENOMEM);
+    for (int d = 0; d < ndims; d++)
+    {
+        PIO_Offset *dbrk = &brk[(size_t)d * 2 * ios->num_iotasks];
+
+        nbrk[d] = 0;
+        for (int i = 0; i < ios->num_iotasks; i++)
+        {
+            if (iomaplen[i] <= 0)
+                continue;
+            dbrk[nbrk[d]++] = sc[(size_t)i * sc_stride + d];
+            dbrk[nbrk[d]++] = sc[(size_t)i * sc_stride + d] + sc[(size_t)i * sc_stride + ndims + d];
+        }
+
+        /* Sort and remove duplicates. */
+        qsort(dbrk, nbrk[d], sizeof(PIO_Offset), compare_pio_offset);
+        if (nbrk[d] > 0)
+        {
+            int n = 1;
+            for (int j = 1; j < nbrk[d]; j++)
+                if (dbrk[j] != dbrk[n - 1])
+                    dbrk[n++] = dbrk[j];
+            nbrk[d] = n;
+        }
+
+        /* Number of cells in the grid, capped to avoid overflow. */
+        if (nbrk[d] > 1 && ncells <= (PIO_Offset)BOX_CELLS_PER_IOTASK * ios->num_iotasks)
+            ncells *= nbrk[d] - 1;
+    }
+    for (int i = 0; i < ios->num_iotasks; i++)
+        if (iomaplen[i] > 0)
+            nactive++;
+    PLOG((2, "find_box_dest nactive = %d ncells = %lld", nactive, ncells));
+
+    if (nactive == 0)
+        goto exit;
+
+    if (ncells <= (PIO_Offset)BOX_CELLS_PER_IOTASK * ios->num_iotasks)
+    {
+        /* Build the table of the IO task which owns each cell. The
+         * lowest numbered IO task wins if boxes overlap, as in the
+         * search below. */
+        if (!(cell_owner = malloc(ncells * sizeof(int))))
+            EXIT1(PIO_ENOMEM);
+        for (PIO_Offset c = 0; c < ncells; c++)
+            cell_owner[c] = -1;
+
+        for (int i = 0; i < ios->num_iotasks; i++)
+        {
+            const PIO_Offset *start = &sc[(size_t)i * sc_stride];
+            const PIO_Offset *count = start + ndims;
+            int lo[ndims], hi[ndims], cur[ndims];
+            bool empty = false;
+
+            if (iomaplen[i] <= 0)
+                continue;
+
+            /* The cells covered by this box in each dimension. */
+            for (int d = 0; d < ndims; d++)
+            {
+                const PIO_Offset *dbrk = &brk[(size_t)d * 2 * ios->num_iotasks];
+                lo[d] = find_interval(nbrk[d], dbrk, start[d]);
+                hi[d] = lo[d] < 0 ? -1 : find_interval(nbrk[d], dbrk, start[d] + count[d] - 1) + 1;
+                if (lo[d] < 0 || hi[d] <= lo[d])
+                    empty = true;
+                cur[d] = lo[d];
+            }
+            if (empty)
+                continue;
+
+            /* Visit every cell of the box. */
+            while (true)
+            {
+                PIO_Offset c = 0;
+                int d;
+
+                for (d = 0; d < ndims; d++)
+                    c = c * (nbrk[d] - 1) + cur[d];
+                if (cell_owner[c] < 0)
+                    cell_owner[c] = i;
+
+                for (d = ndims - 1; d >= 0; d--)
+                {
+                    if (++cur[d] < hi[d])
+                        break;
+                    cur[d] = lo[d];
+                }
+                if (d < 0)
+                    break;
+            }
+        }
+
+        /* Locate each element of the compmap in the grid. */
+        for (int k = 0; k < maplen; k++)
         {
-            recvcounts[io_comprank] = 1;
-            recvtypes[io_comprank] = iodesc->stype[i];
-        }
-    }
+            const PIO_Offset *g = &gcoord[(size_t)k * ndims];
+            PIO_Offset c = 0;
+            int d;
 
-    /* Data in sbuf on the ionodes is sent to rbuf on the compute
-     * nodes. */
+            if (compmap[k] <= 0)
+                continue;
 
-    if ((ret = pio_swapm(sbuf, sendcounts, sdispls, sendtypes, rbuf, recvcounts,
-                         rdispls, recvtypes, mycomm, &iodesc->rearr_opts.io2comp)))
-        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
-#ifdef TIMING
-    if ((ret = pio_stop_timer("PIO:rearrange_io2comp")))
-        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
-#endif
+            for (d = 0; d < ndims; d++)
+            {
+                int j = find_interval(nbrk[d], &brk[(size_t)d * 2 * ios->num_iotasks], g[d]);
+                if (j < 0)
+                    break;
+                c = c * (nbrk[d] - 1) + j;
+            }
+            if (d < ndims || cell_owner[c] < 0)
+                continue;
 
-    return PIO_NOERR;
-}
+            /* Determine the index for that element in the IO task
+             * data. */
+            {
+                int i = cell_owner[c];
+                const PIO_Offset *start = &sc[(size_t)i * sc_stride];
+                const PIO_Offset *count = start + ndims;
+                PIO_Offset lcoord[ndims];
 
-/**
- * Determine whether fill values are needed. This function compares
- * how much data we have to how much data is in a record (or
- * non-record var). If we have enough data to completely fill the
- * variable, then fill is not needed.
- *
- * @param ios pointer to the iosystem_desc_t struct.
- * @param iodesc a pointer to the io_desc_t struct.
- * @param gdimlen pointer to an array length iodesc->ndims with the
- * global array sizes for one record (for record vars) or for the
- * entire var (for non-record vars).
- * @param compmap only used for the box communicator.
- * @returns 0 on success, error code otherwise.
- * @author Jim Edwards
- */
-int
-determine_fill(iosystem_desc_t *ios, io_desc_t *iodesc, const int *gdimlen,
-               const PIO_Offset *compmap)
-{
-    PIO_Offset totalllen = 0;
-    PIO_Offset totalgridsize = 1;
-    int mpierr; /* Return code from MPI calls. */
+                for (d = 0; d < ndims; d++)
+                    lcoord[d] = g[d] - start[d];
+                dest_ioindex[k] = coord_to_lindex(ndims, lcoord, count);
+                dest_ioproc[k] = i;
+            }
+        }
+    }
+    else
+    {
+        PIO_Offset lcoord[ndims];
 
-    /* Check inputs. */
-    pioassert(ios && iodesc && gdimlen && compmap, "invalid input",
-              __FILE__, __LINE__);
+        /* The boxes do not form a compact grid, check each box in
+         * turn. */
+        for (int i = 0; i < ios->num_iotasks; i++)
+        {
+            const PIO_Offset *start = &sc[(size_t)i * sc_stride];
+            const PIO_Offset *count = start + ndims;
 
-    /* Determine size of data space. */
-    for (int i = 0; i < iodesc->ndims; i++)
-        totalgridsize *= gdimlen[i];
+            if (iomaplen[i] <= 0)
+                continue;
 
-    /* Determine how many values we have locally. */
-    if (iodesc->rearranger == PIO_REARR_SUBSET)
-        totalllen = iodesc->llen;
-    else
-        for (int i = 0; i < iodesc->ndof; i++)
-            if (compmap[i] > 0)
-                totalllen++;
+            for (int k = 0; k < maplen; k++)
+            {
+                const PIO_Offset *g = &gcoord[(size_t)k * ndims];
+                bool found = true;
 
-    /* Add results accross communicator. */
-    PLOG((2, "determine_fill before allreduce totalllen = %d totalgridsize = %d",
-          totalllen, totalgridsize));
-    if ((mpierr = MPI_Allreduce(MPI_IN_PLACE, &totalllen, 1, PIO_OFFSET, MPI_SUM,
-                                ios->union_comm)))
-        check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
-    PLOG((2, "after allreduce totalllen = %d", totalllen));
+                /* An IO task has already been found for this element */
+                if (compmap[k] <= 0 || dest_ioproc[k] >= 0)
+                    continue;
 
-    /* If the total size of the data provided to be written is < the
-     * total data size then we need fill values. */
-    iodesc->needsfill = totalllen < totalgridsize;
+                for (int j = 0; j < ndims; j++)
+                {
+                    if (g[j] >= start[j] && g[j] < start[j] + count[j])
+                    {
+                        lcoord[j] = g[j] - start[j];
+                    }
+                    else
+                    {
+                        found = false;
+                        break;
+                    }
+                }
 
-    /*  TURN OFF FILL for timing test
-        iodesc->needsfill=false; */
+                if (found)
+                {
+                    dest_ioindex[k] = coord_to_lindex(ndims, lcoord, count);
+                    dest_ioproc[k] = i;
+                }
+            }
+        }
+    }
 
-    return PIO_NOERR;
+exit:
+    free(gcoord);
+    free(brk);
+    free(cell_owner);
+
+    return ret;
 }
 
 /**
@@ -1226,7 +3028,6 @@ box_rearrange_create(iosystem_desc_t *ios, int maplen, const PIO_Offset *compmap
     /* Allocate arrays needed for this function. */
     int *dest_ioproc = NULL; /* Destination IO task for each data element on compute task. */
     PIO_Offset *dest_ioindex = NULL;    /* Offset into IO task array for each data element. */
-    PIO_Offset **gcoord_map = NULL; /* Global coordinate value for each data element. */
     int sendcounts[ios->num_uniontasks]; /* Send counts for swapm call. */
     int sdispls[ios->num_uniontasks];    /* Send displacements for swapm. */
     int recvcounts[ios->num_uniontasks]; /* Receive counts for swapm. */
@@ -1260,15 +3061,6 @@ box_rearrange_create(iosystem_desc_t *ios, int maplen, const PIO_Offset *compmap
 
         if (!(dest_ioindex = malloc(maplen * sizeof(PIO_Offset))))
             return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
-
-        if (!(gcoord_map = malloc(maplen * sizeof(PIO_Offset*))))
-            return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
-
-        for (int i = 0; i < maplen; i++)
-        {
-            if (!(gcoord_map[i] = calloc(ndims, sizeof(PIO_Offset))))
-                return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
-        }
     }
 
     /* Initialize the sc_info send and recv messages */
@@ -1391,82 +3183,18 @@ box_rearrange_create(iosystem_desc_t *ios, int maplen, const PIO_Offset *compmap
         PLOG((3, "iomaplen[%d] = %d", i, sc_info_msg_recv[i * sc_info_msg_sz]));
 #endif /* PIO_ENABLE_LOGGING */
 
-    /* Convert a 1-D index into a global coordinate value for each data element */
-    for (int k = 0; k < maplen; k++)
-    {
-        /* The compmap array is 1 based but calculations are 0 based */
-        PLOG((3, "about to call idx_to_dim_list ndims = %d ", ndims));
-        idx_to_dim_list(ndims, gdimlen, compmap[k] - 1, gcoord_map[k]);
-#if PIO_ENABLE_LOGGING
-        for (int d = 0; d < ndims; d++)
-            PLOG((3, "gcoord_map[%d][%d] = %lld", k, d, gcoord_map[k][d]));
-#endif /* PIO_ENABLE_LOGGING */
-    }
-
+    /* The first entry in the sc_info msg for each IO task is the
+     * iomaplen, the rest are the start and count arrays. */
     for (int i = 0; i < ios->num_iotasks; i++)
-    {
-        /* First entry in the sc_info msg is the iomaplen */
         iomaplen[i] = sc_info_msg_recv[i * sc_info_msg_sz];
-        if(iomaplen[i] > 0)
-        {
-            /* The rest of the entries in the sc_info msg are the start and
-             * count arrays
-             */
-            PIO_Offset *start = &(sc_info_msg_recv[i * sc_info_msg_sz + 1]);
-            PIO_Offset *count = &(sc_info_msg_recv[i * sc_info_msg_sz + 1 + ndims]);
-
-#if PIO_ENABLE_LOGGING
-            for (int d = 0; d < ndims; d++)
-                PLOG((3, "start[%d] = %lld count[%d] = %lld", d, start[d], d, count[d]));
-#endif /* PIO_ENABLE_LOGGING */
-
-            /* Moved this outside of loop over maplen, for performance. */
-            PIO_Offset lcoord[ndims];
-
-            /* For each element of the data array on the compute task,
-             * find the IO task to send the data element to, and its
-             * offset into the global data array. */
-            for (int k = 0; k < maplen; k++)
-            {
-                /* An IO task has already been found for this element */
-                if (dest_ioproc[k] >= 0)
-                    continue;
-
-                bool found = true;
-
-                /* Find a destination for each entry in the compmap. */
-                for (int j = 0; j < ndims; j++)
-                {
-                    if (gcoord_map[k][j] >= start[j] && gcoord_map[k][j] < start[j] + count[j])
-                    {
-                        lcoord[j] = gcoord_map[k][j] - start[j];
-                    }
-                    else
-                    {
-                        found = false;
-                        break;
-                    }
-                }
-
-                /* Did we find a destination IO task for this element
-                 * of the computation task data array? If so, remember
-                 * the destination IO task, and determine the index
-                 * for that element in the IO task data. */
-                if (found)
-                {
-                    dest_ioindex[k] = coord_to_lindex(ndims, lcoord, count);
-                    dest_ioproc[k] = i;
-                    PLOG((3, "found dest_ioindex[%d] = %d dest_ioproc[%d] = %d", k, dest_ioindex[k],
-                          k, dest_ioproc[k]));
-                }
-            }
-        }
-    }
 
-    for (int i = 0; i < maplen; i++)
-        free(gcoord_map[i]);
-    free(gcoord_map);
-    gcoord_map = NULL;
+    /* For each element of the data array on the compute task, find
+     * the IO task to send the data element to, and its offset into
+     * the global data array. */
+    if ((ret = find_box_dest(ios, ndims, gdimlen, maplen, compmap, iomaplen,
+                             sc_info_msg_recv + sc_info_msg_maplen_sz, sc_info_msg_sz,
+                             dest_ioproc, dest_ioindex)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
 
     /* Check that a destination is found for each compmap entry. */
     for (int k = 0; k < maplen; k++)
@@ -1547,7 +3275,6 @@ box_rearrange_create_with_holes(iosystem_desc_t *ios, int maplen,
     /* Allocate arrays needed for this function. */
     int *dest_ioproc = NULL; /* Destination IO task for each data element on compute task. */
     PIO_Offset *dest_ioindex = NULL;    /* Offset into IO task array for each data element. */
-    PIO_Offset **gcoord_map = NULL; /* Global coordinate value for each data element. */
     int sendcounts[ios->num_uniontasks]; /* Send counts for swapm call. */
     int sdispls[ios->num_uniontasks];    /* Send displacements for swapm. */
     int recvcounts[ios->num_uniontasks]; /* Receive counts for swapm. */
@@ -1568,15 +3295,6 @@ box_rearrange_create_with_holes(iosystem_desc_t *ios, int maplen,
 
         if (!(dest_ioindex = malloc(maplen * sizeof(PIO_Offset))))
             return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
-
-        if (!(gcoord_map = malloc(maplen * sizeof(PIO_Offset*))))
-            return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
-
-        for (int i = 0; i < maplen; i++)
-        {
-            if (!(gcoord_map[i] = calloc(ndims, sizeof(PIO_Offset))))
-                return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
-        }
     }
 
     /* Initialize array values. */
@@ -1654,19 +3372,12 @@ box_rearrange_create_with_holes(iosystem_desc_t *ios, int maplen,
         PLOG((3, "iomaplen[%d] = %d", i, iomaplen[i]));
 #endif /* PIO_ENABLE_LOGGING */
 
-    /* Convert a 1-D index into a global coordinate value for each data element */
-    for (int k = 0; k < maplen; k++)
-    {
-        /* The compmap array is 1 based but calculations are 0 based */
-        PLOG((3, "about to call idx_to_dim_list ndims = %d ", ndims));
-        idx_to_dim_list(ndims, gdimlen, compmap[k] - 1, gcoord_map[k]);
-#if PIO_ENABLE_LOGGING
-        for (int d = 0; d < ndims; d++)
-            PLOG((3, "gcoord_map[%d][%d] = %lld", k, d, gcoord_map[k][d]));
-#endif /* PIO_ENABLE_LOGGING */
-    }
+    /* For each IO task send starts/counts to all compute tasks. The
+     * start/count of IO task i is stored at sc[i * 2 * ndims]. */
+    PIO_Offset sc[ios->num_iotasks * 2 * ndims];
+    for (int i = 0; i < ios->num_iotasks * 2 * ndims; i++)
+        sc[i] = 0;
 
-    /* For each IO task send starts/counts to all compute tasks. */
     for (int i = 0; i < ios->num_iotasks; i++)
     {
         /* The ipmaplen contains the llen (number of data elements)
@@ -1678,7 +3389,6 @@ box_rearrange_create_with_holes(iosystem_desc_t *ios, int maplen,
         if (iomaplen[i] > 0)
         {
             PIO_Offset start_count_send[ndims * 2];
-            PIO_Offset start_count_recv[ndims * 2];
 
             /* start/count array to be sent: 1st half for start, 2nd half for count */
             for (int j = 0; j < ndims; j++)
@@ -1703,65 +3413,25 @@ box_rearrange_create_with_holes(iosystem_desc_t *ios, int maplen,
             /* The start/count array from iotask i is sent to all compute tasks. */
             PLOG((3, "about to call pio_swapm with start/count from iotask %d ndims = %d",
                   i, ndims));
-            if ((ret = pio_swapm(start_count_send, sendcounts, sdispls, dtypes, start_count_recv,
+            if ((ret = pio_swapm(start_count_send, sendcounts, sdispls, dtypes, &sc[i * 2 * ndims],
                                  recvcounts, rdispls, dtypes, ios->union_comm,
                                  &iodesc->rearr_opts.io2comp)))
                 return pio_err(ios, NULL, ret, __FILE__, __LINE__);
 
-            /* start/count array received: 1st half for start, 2nd half for count */
-            PIO_Offset *start = start_count_recv;
-            PIO_Offset *count = start_count_recv + ndims;
-
 #if PIO_ENABLE_LOGGING
             for (int d = 0; d < ndims; d++)
-                PLOG((3, "start[%d] = %lld count[%d] = %lld", d, start[d], d, count[d]));
+                PLOG((3, "start[%d] = %lld count[%d] = %lld", d, sc[i * 2 * ndims + d],
+                      d, sc[i * 2 * ndims + ndims + d]));
 #endif /* PIO_ENABLE_LOGGING */
-
-            /* For each element of the data array on the compute task,
-             * find the IO task to send the data element to, and its
-             * offset into the global data array. */
-            for (int k = 0; k < maplen; k++)
-            {
-                /* An IO task has already been found for this element */
-                if (dest_ioproc[k] >= 0)
-                    continue;
-
-                PIO_Offset lcoord[ndims];
-                bool found = true;
-
-                /* Find a destination for each entry in the compmap. */
-                for (int j = 0; j < ndims; j++)
-                {
-                    if (gcoord_map[k][j] >= start[j] && gcoord_map[k][j] < start[j] + count[j])
-                    {
-                        lcoord[j] = gcoord_map[k][j] - start[j];
-                    }
-                    else
-                    {
-                        found = false;
-                        break;
-                    }
-                }
-
-                /* Did we find a destination IO task for this element
-                 * of the computation task data array? If so, remember
-                 * the destination IO task, and determine the index
-                 * for that element in the IO task data. */
-                if (found)
-                {
-                    dest_ioindex[k] = coord_to_lindex(ndims, lcoord, count);
-                    dest_ioproc[k] = i;
-                    PLOG((3, "found dest_ioindex[%d] = %d dest_ioproc[%d] = %d", k, dest_ioindex[k],
-                          k, dest_ioproc[k]));
-                }
-            }
         }
     }
 
-    for (int i = 0; i < maplen; i++)
-        free(gcoord_map[i]);
-    free(gcoord_map);
-    gcoord_map = NULL;
+    /* For each element of the data array on the compute task, find
+     * the IO task to send the data element to, and its offset into
+     * the global data array. */
+    if ((ret = find_box_dest(ios, ndims, gdimlen, maplen, compmap, iomaplen, sc,
+                             2 * ndims, dest_ioproc, dest_ioindex)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
 
     /* Check that a destination is found for each compmap entry. */
     for (int k = 0; k < maplen; k++)
@@ -1822,6 +3492,94 @@ compare_offsets(const void *a, const void *b)
     return 0;
 }
 
+/**
+ * Merge adjacent regions into larger hyperslabs. Region b is merged
+ * into region a when the union of the two is a hyperslab, and the
+ * data of b follow the data of a in the buffer, so that the union
+ * can be written with one call. This is the case when, for some
+ * dimension d, b starts where a ends along d, a and b have the same
+ * start/count along all faster dimensions, and both have a count of
+ * 1 at the same start along all slower dimensions. Empty regions are
+ * dropped.
+ *
+ * @param ndims the number of dimensions.
+ * @param nregions the number of regions.
+ * @param start array of length ndims * nregions with the start of
+ * each region. Gets the start of the merged regions.
+ * @param count array of length ndims * nregions with the count of
+ * each region. Gets the count of the merged regions.
+ * @param loffset array of length nregions with the offset of the
+ * data of each region in the buffer, or NULL if the data of each
+ * region follow those of the one before. Gets the offsets of the
+ * merged regions.
+ * @returns the number of merged regions.
+ * @author Jim Edwards
+ */
+int
+coalesce_regions(int ndims, int nregions, PIO_Offset *start, PIO_Offset *count,
+                 PIO_Offset *loffset)
+{
+    PIO_Offset asize = 0; /* Number of elements in the current merged region. */
+    int n = 0;            /* Number of merged regions. */
+
+    pioassert(ndims > 0 && nregions >= 0 && start && count, "invalid input",
+              __FILE__, __LINE__);
+
+    for (int r = 0; r < nregions; r++)
+    {
+        PIO_Offset *bstart = start + r * ndims;
+        PIO_Offset *bcount = count + r * ndims;
+        PIO_Offset bsize = 1;
+        int merged = 0;
+
+        for (int i = 0; i < ndims; i++)
+            bsize *= bcount[i];
+        if (!bsize)
+            continue;
+
+        if (n && (!loffset || loffset[r] == loffset[n - 1] + asize))
+        {
+            PIO_Offset *astart = start + (n - 1) * ndims;
+            PIO_Offset *acount = count + (n - 1) * ndims;
+
+            /* Find the slowest dimension where a and b differ. */
+            int d = 0;
+            while (d < ndims && astart[d] == bstart[d] && acount[d] == bcount[d])
+                d++;
+
+            if (d < ndims && bstart[d] == astart[d] + acount[d])
+            {
+                merged = 1;
+                for (int i = 0; i < d; i++)
+                    if (acount[i] != 1)
+                        merged = 0;
+                for (int i = d + 1; i < ndims; i++)
+                    if (astart[i] != bstart[i] || acount[i] != bcount[i])
+                        merged = 0;
+                if (merged)
+                    acount[d] += bcount[d];
+            }
+        }
+
+        if (merged)
+            asize += bsize;
+        else
+        {
+            for (int i = 0; i < ndims; i++)
+            {
+                start[n * ndims + i] = bstart[i];
+                count[n * ndims + i] = bcount[i];
+            }
+            if (loffset)
+                loffset[n] = loffset[r];
+            asize = bsize;
+            n++;
+        }
+    }
+
+    return n;
+}
+
 /**
  * Calculate start and count regions for the subset rearranger. This
  * function is not used in the box rearranger.
@@ -1831,31 +3589,41 @@ compare_offsets(const void *a, const void *b)
  * as a single data point, but we hope we've aggragated better than
  * that.
  *
+ * The regions found by find_region() are merged with
+ * coalesce_regions(), and then stored in one contiguous array, which
+ * replaces the list in *firstregionp.
+ *
  * @param ndims the number of dimensions
  * @param gdimlen an array length ndims with the sizes of the global
  * dimensions.
  * @param maplen the length of the map
  * @param map may be NULL (when maplen==0).
- * @param maxregions
- * @param firstregion pointer to the first region.
+ * @param maxregions pointer that gets the number of regions.
+ * @param firstregionp pointer to the pointer to the first region. Any
+ * list it points to is freed.
  * @returns 0 on success, error code otherwise.
  * @author Jim Edwards
  */
 int
 get_regions(int ndims, const int *gdimlen, int maplen, const PIO_Offset *map,
-            int *maxregions, io_region *firstregion)
+            int *maxregions, io_region **firstregionp)
 {
     int nmaplen = 0;
     PIO_Offset regionlen;
+    PIO_Offset *start = NULL;    /* Start of each region found. */
+    PIO_Offset *count = NULL;    /* Count of each region found. */
+    PIO_Offset *loffset = NULL;  /* Offset in the map of each region found. */
+    int nregions = 0;            /* Number of regions found. */
+    int nalloc = 0;              /* Number of regions allocated. */
+    int nmerged = 0;             /* Number of regions after merging. */
     io_region *region;
-    int ret;
+    int ret = PIO_NOERR;
 
     /* Check inputs. */
-    pioassert(ndims >= 0 && gdimlen && maplen >= 0 && maxregions && firstregion,
+    pioassert(ndims >= 0 && gdimlen && maplen >= 0 && maxregions && firstregionp,
               "invalid input", __FILE__, __LINE__);
     PLOG((1, "get_regions ndims = %d maplen = %d", ndims, maplen));
 
-    region = firstregion;
     if (map)
     {
         while (map[nmaplen++] <= 0)
@@ -1865,52 +3633,94 @@ get_regions(int ndims, const int *gdimlen, int maplen, const PIO_Offset *map,
         }
         nmaplen--;
     }
-    region->loffset = nmaplen;
-    PLOG((2, "region->loffset = %d", region->loffset));
-
-    *maxregions = 1;
 
     while (nmaplen < maplen)
     {
+        /* Make room for another region. */
+        if (nregions == nalloc)
+        {
+            PIO_Offset *tmp;
+
+            nalloc = nalloc ? 2 * nalloc : 16;
+            if (!(tmp = realloc(start, nalloc * ndims * sizeof(PIO_Offset))))
+            {
+                ret = PIO_ENOMEM;
+                break;
+            }
+            start = tmp;
+            if (!(tmp = realloc(count, nalloc * ndims * sizeof(PIO_Offset))))
+            {
+                ret = PIO_ENOMEM;
+                break;
+            }
+            count = tmp;
+            if (!(tmp = realloc(loffset, nalloc * sizeof(PIO_Offset))))
+            {
+                ret = PIO_ENOMEM;
+                break;
+            }
+            loffset = tmp;
+        }
+
         /* Here we find the largest region from the current offset
            into the iomap. regionlen is the size of that region and we
            step to that point in the map array until we reach the
            end. */
         for (int i = 0; i < ndims; i++)
-            region->count[i] = 1;
+            count[nregions * ndims + i] = 1;
 
         /* Set start/count to describe first region in map. */
-        if ((ret = find_region(ndims, gdimlen, maplen-nmaplen,
-                               &map[nmaplen], region->start, region->count, &regionlen)))
-            return ret;
-        pioassert(region->start[0] >= 0, "failed to find region", __FILE__, __LINE__);
-
+        if ((ret = find_region(ndims, gdimlen, maplen-nmaplen, &map[nmaplen],
+                               &start[nregions * ndims], &count[nregions * ndims],
+                               &regionlen)))
+            break;
+        pioassert(start[nregions * ndims] >= 0, "failed to find region", __FILE__, __LINE__);
+
+        /* The offset into the local array buffer is the sum of the
+         * sizes of all of the previous regions (loffset) */
+        loffset[nregions++] = nmaplen;
         nmaplen = nmaplen + regionlen;
         PLOG((2, "regionlen = %d nmaplen = %d", regionlen, nmaplen));
-        for (int i = 0; i < ndims; i++)
-            PLOG((3,"region start[%d]=%ld count[%d]=%ld",i,region->start[i], i, region->count[i]));
-        /* If we need to, allocate the next region. */
-        if (region->next == NULL && nmaplen < maplen)
-        {
-            PLOG((2, "allocating next region"));
-            if ((ret = alloc_region2(NULL, ndims, &region->next)))
-                return ret;
-
-            /* The offset into the local array buffer is the sum of
-             * the sizes of all of the previous regions (loffset) */
-            region = region->next;
-            region->loffset = nmaplen;
+    }
 
-            /* The calls to the io library are collective and so we
-               must have the same number of regions on each io task
-               maxregions will be the total number of regions on this
-               task. */
-            (*maxregions)++;
-            PLOG((2, "*maxregions = %d", *maxregions));
+    /* Merge the regions, and copy them to an array. There is always
+     * at least one region, which may be empty. */
+    if (!ret)
+    {
+        if (nregions)
+            nmerged = coalesce_regions(ndims, nregions, start, count, loffset);
+        PLOG((1, "get_regions found %d regions, %d after coalescing", nregions, nmerged));
+        ret = alloc_region_array(NULL, ndims, max(nmerged, 1), &region);
+    }
+    if (!ret)
+    {
+        region->loffset = nmaplen;
+        for (int r = 0; r < nmerged; r++)
+        {
+            region[r].loffset = loffset[r];
+            for (int i = 0; i < ndims; i++)
+            {
+                region[r].start[i] = start[r * ndims + i];
+                region[r].count[i] = count[r * ndims + i];
+                PLOG((3,"region %d start[%d]=%ld count[%d]=%ld", r, i, region[r].start[i],
+                      i, region[r].count[i]));
+            }
         }
+
+        /* The calls to the io library are collective and so we must
+           have the same number of regions on each io task maxregions
+           will be the total number of regions on this task. */
+        *maxregions = max(nmerged, 1);
+        if (*firstregionp)
+            free_region_list(*firstregionp);
+        *firstregionp = region;
     }
 
-    return PIO_NOERR;
+    free(start);
+    free(count);
+    free(loffset);
+
+    return ret;
 }
 
 /**
@@ -1999,6 +3809,7 @@ default_subset_partition(iosystem_desc_t *ios, io_desc_t *iodesc)
  * <li>On IO tasks, call get_regions() and distribute the max
  * maxregions to all tasks in IO communicator.
  * <li>On IO tasks, call compute_maxIObuffersize().
+ * <li>Call compute_maxaggregate_bytes().
  * </ul>
  *
  * @param ios pointer to the iosystem_desc_t struct.
@@ -2405,11 +4216,9 @@ subset_rearrange_create(iosystem_desc_t *ios, int maplen, PIO_Offset *compmap,
         iodesc->maxfillregions = 0;
         if (myfillgrid)
         {
-            /* Allocate a data region to hold fill values. */
-            if ((ret = alloc_region2(ios, iodesc->ndims, &iodesc->fillregion)))
-                return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+            /* Find the data regions to hold fill values. */
             if ((ret = get_regions(iodesc->ndims, gdimlen, iodesc->holegridsize, myfillgrid,
-                                   &iodesc->maxfillregions, iodesc->fillregion)))
+                                   &iodesc->maxfillregions, &iodesc->fillregion)))
                 return pio_err(ios, NULL, ret, __FILE__, __LINE__);
             free(myfillgrid);
             maxregions = iodesc->maxfillregions;
@@ -2440,7 +4249,7 @@ subset_rearrange_create(iosystem_desc_t *ios, int maplen, PIO_Offset *compmap,
     {
         iodesc->maxregions = 0;
         if ((ret = get_regions(iodesc->ndims, gdimlen, iodesc->rllen, iomap,
-                               &iodesc->maxregions, iodesc->firstregion)))
+                               &iodesc->maxregions, &iodesc->firstregion)))
             return pio_err(ios, NULL, ret, __FILE__, __LINE__);
         maxregions = iodesc->maxregions;
 
@@ -2466,8 +4275,19 @@ subset_rearrange_create(iosystem_desc_t *ios, int maplen, PIO_Offset *compmap,
 
         iodesc->nrecvs = ntasks;
     }
+
+    /* Using maxiobuflen compute the maximum number of bytes that the
+     * io task buffer can handle. This also gives maxiobuflen to the
+     * computation tasks. */
+    if ((ret = compute_maxaggregate_bytes(ios, iodesc)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+    PLOG((3, "iodesc->maxbytes = %d", iodesc->maxbytes));
 //    PLOG((2, "At line %d sindex[20] = %d",__LINE__,iodesc->sindex[20]));
 
+    /* Remember which tasks this task exchanges data with. */
+    if ((ret = define_swap_peers(ios, iodesc)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
     return PIO_NOERR;
 }
 
@@ -2506,7 +4326,7 @@ performance_tune_rearranger(iosystem_desc_t *ios, io_desc_t *iodesc)
         if (!(ibuf = bget(iodesc->llen * tsize)))
             return pio_err(ios, file, PIO_ENOMEM, __FILE__, __LINE__);
 
-    if (iodesc->rearranger == PIO_REARR_BOX)
+    if (iodesc->rearranger != PIO_REARR_SUBSET)
         mycomm = ios->union_comm;
     else
         mycomm = iodesc->subset_comm;
@@ -2525,7 +4345,7 @@ performance_tune_rearranger(iosystem_desc_t *ios, io_desc_t *iodesc)
         return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
     GPTLstamp(&wall[0], &usr[0], &sys[0]);
     rearrange_comp2io(ios, iodesc, cbuf, ibuf, 1);
-    rearrange_io2comp(ios, iodesc, ibuf, cbuf);
+    rearrange_io2comp(ios, iodesc, ibuf, cbuf, 1);
     GPTLstamp(&wall[1], &usr[1], &sys[1]);
     mintime = wall[1]-wall[0];
     if ((mpierr = MPI_Allreduce(MPI_IN_PLACE, &mintime, 1, MPI_DOUBLE, MPI_MAX, mycomm)))
@@ -2558,7 +4378,7 @@ performance_tune_rearranger(iosystem_desc_t *ios, io_desc_t *iodesc)
                     return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
                 GPTLstamp(wall, usr, sys);
                 rearrange_comp2io(ios, iodesc, cbuf, ibuf, 1);
-                rearrange_io2comp(ios, iodesc, ibuf, cbuf);
+                rearrange_io2comp(ios, iodesc, ibuf, cbuf, 1);
                 GPTLstamp(wall+1, usr, sys);
                 wall[1] -= wall[0];
                 if ((mpierr = MPI_Allreduce(MPI_IN_PLACE, wall + 1, 1, MPI_DOUBLE, MPI_MAX,
@@ -0,0 +1,206 @@
+/**
+ * @file
+ * The one-sided comm type of the rearranger, PIO_REARR_COMM_RMA.
+ *
+ * pio_swapm() pairs sends and receives, and its handshake and
+ * pending request options have to be tuned for each machine. With
+ * PIO_REARR_COMM_RMA each IO task instead has an MPI window, created
+ * once for the decomposition and grown when more variables are moved
+ * at once. When writing, the compute tasks MPI_Put() their data, with
+ * the send types of the decomposition, into their block of the window
+ * of each IO task, and the IO task unpacks the blocks into the IO
+ * buffer with its receive types. When reading, the IO task packs the
+ * blocks and the compute tasks MPI_Get() them. Each exchange is one
+ * MPI_Win_fence() epoch.
+ *
+ * @author Jim Edwards
+ */
+#include <config.h>
+#include <pio.h>
+#include <pio_internal.h>
+
+/**
+ * Lay out the windows of PIO_REARR_COMM_RMA for a decomposition. This
+ * is collective over the rearranger communicator, and is called on
+ * the first exchange with the decomposition.
+ *
+ * The window of each IO task holds the block of each compute task
+ * that exchanges data with it, in the order of the ranks of the
+ * compute tasks, so the offset of the block of a compute task on an
+ * IO task is the sum of the counts of the lower ranks. The compute
+ * tasks find it with MPI_Exscan(), without messages to the IO tasks.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param comm the rearranger communicator.
+ * @param niotasks number of IO tasks in comm.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+rma_create(iosystem_desc_t *ios, io_desc_t *iodesc, MPI_Comm comm, int niotasks)
+{
+    pio_rma_desc *rma;
+    PIO_Offset *count;  /* Counts of this task for each IO task. */
+    int nrecvs = ios->ioproc ? iodesc->nrecvs : 0;
+    int ntasks;
+    int rank;
+    int mpierr;
+
+    pioassert(ios && iodesc && !iodesc->rma && niotasks > 0, "invalid input",
+              __FILE__, __LINE__);
+    PLOG((1, "rma_create niotasks = %d nrecvs = %d", niotasks, nrecvs));
+
+    if (!(rma = calloc(1, sizeof(pio_rma_desc))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    rma->win = MPI_WIN_NULL;
+    iodesc->rma = rma;
+
+    if ((mpierr = MPI_Comm_size(comm, &ntasks)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Comm_rank(comm, &rank)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+
+    if (!(rma->send_off = calloc(niotasks, sizeof(PIO_Offset))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    if (!(rma->recv_off = calloc(max(1, nrecvs), sizeof(PIO_Offset))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+
+    /* The offset of the block of this task on each IO task is the sum
+     * of the counts of the lower ranks. */
+    if (!(count = calloc(niotasks, sizeof(PIO_Offset))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    if (iodesc->scount && (!ios->async || ios->compproc))
+        for (int i = 0; i < niotasks; i++)
+            count[i] = iodesc->scount[i];
+    if ((mpierr = MPI_Exscan(count, rma->send_off, niotasks, MPI_OFFSET, MPI_SUM, comm)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if (!rank)
+        for (int i = 0; i < niotasks; i++)
+            rma->send_off[i] = 0;
+    free(count);
+
+    /* On IO tasks find the same offsets from the receive counts. */
+    if (nrecvs)
+    {
+        PIO_Offset *rank_off;
+
+        if (!(rank_off = calloc(ntasks + 1, sizeof(PIO_Offset))))
+            return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+        for (int j = 0; j < nrecvs; j++)
+            rank_off[(iodesc->rearranger == PIO_REARR_SUBSET ? j : iodesc->rfrom[j]) + 1] =
+                iodesc->rcount[j];
+        for (int r = 0; r < ntasks; r++)
+            rank_off[r + 1] += rank_off[r];
+        for (int j = 0; j < nrecvs; j++)
+            rma->recv_off[j] = rank_off[iodesc->rearranger == PIO_REARR_SUBSET ? j : iodesc->rfrom[j]];
+        rma->winlen = rank_off[ntasks];
+        free(rank_off);
+    }
+    PLOG((2, "rma_create winlen = %lld", (long long)rma->winlen));
+
+    return PIO_NOERR;
+}
+
+/**
+ * Free the window of PIO_REARR_COMM_RMA. This is collective over the
+ * rearranger communicator.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param rma pointer to the windows of the decomposition.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+rma_free_window(iosystem_desc_t *ios, pio_rma_desc *rma)
+{
+    int mpierr;
+
+    if (rma->win == MPI_WIN_NULL)
+        return PIO_NOERR;
+
+    if ((mpierr = MPI_Win_free(&rma->win)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    pio_mem_add(ios, -rma->win_bytes);
+    rma->win_bytes = 0;
+    rma->win_nvars = 0;
+    rma->winbuf = NULL;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Make sure the window holds nvars variables, allocating a larger
+ * one if needed. This is collective over the rearranger
+ * communicator. The window is only synchronized with
+ * MPI_Win_fence(), so it is created with the no_locks hint.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param comm the rearranger communicator.
+ * @param nvars number of variables.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+rma_window(iosystem_desc_t *ios, io_desc_t *iodesc, MPI_Comm comm, int nvars)
+{
+    pio_rma_desc *rma = iodesc->rma;
+    MPI_Info info;
+    MPI_Aint bytes;
+    int mpierr;
+    int ret;
+
+    pioassert(rma && nvars > 0, "invalid input", __FILE__, __LINE__);
+
+    if (nvars <= rma->win_nvars)
+        return PIO_NOERR;
+
+    if ((ret = rma_free_window(ios, rma)))
+        return ret;
+
+    bytes = (MPI_Aint)nvars * rma->winlen * iodesc->mpitype_size;
+    if ((mpierr = MPI_Info_create(&info)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Info_set(info, "no_locks", "true")))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Win_allocate(bytes, iodesc->mpitype_size, info, comm, &rma->winbuf,
+                                   &rma->win)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Info_free(&info)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    rma->win_nvars = nvars;
+    rma->win_bytes = bytes;
+    pio_mem_add(ios, bytes);
+    PLOG((2, "rma_window nvars = %d bytes = %lld", nvars, (long long)bytes));
+
+    return PIO_NOERR;
+}
+
+/**
+ * Free the windows of PIO_REARR_COMM_RMA. This is collective over the
+ * rearranger communicator.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+rma_free(iosystem_desc_t *ios, io_desc_t *iodesc)
+{
+    pio_rma_desc *rma = iodesc->rma;
+    int ret;
+
+    if (!rma)
+        return PIO_NOERR;
+
+    if ((ret = rma_free_window(ios, rma)))
+        return ret;
+    free(rma->send_off);
+    free(rma->recv_off);
+    free(rma);
+    iodesc->rma = NULL;
+
+    return PIO_NOERR;
+}
@@ -0,0 +1,284 @@
+/**
+ * @file
+ * The shared memory path of the rearranger, PIO_REARR_COMM_SHM.
+ *
+ * An IO task usually shares its node with many of the compute tasks
+ * it gets data from. Sending that data with point to point messages
+ * copies it through the MPI library for nothing. With
+ * PIO_REARR_COMM_SHM each task has a segment of an MPI-3 shared
+ * memory window on its node. In rearrange_comp2io() a compute task
+ * packs the data for each IO task of its node into its segment, and
+ * those IO tasks unpack it from there straight into the IO buffer,
+ * with the receive types built from rindex. Only the data for IO
+ * tasks on other nodes is sent with messages, with the sparse
+ * exchange. The tasks of each node are found with
+ * MPI_Comm_split_type().
+ *
+ * @author Jim Edwards
+ */
+#include <config.h>
+#include <pio.h>
+#include <pio_internal.h>
+
+/**
+ * Find the tasks on the node of this task, and lay out the segment
+ * of this task in the shared window. This is collective over the
+ * rearranger communicator, and is called on the first exchange with
+ * the decomposition.
+ *
+ * The segment holds one block for each IO task of the node that this
+ * task sends data to. Each IO task gets the offset of its block in
+ * the segment of each compute task of the node it receives from.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param comm the rearranger communicator.
+ * @param niotasks number of IO tasks in comm.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+shm_create(iosystem_desc_t *ios, io_desc_t *iodesc, MPI_Comm comm, int niotasks)
+{
+    pio_shm_desc *shm;
+    MPI_Group group, node_group;
+    int nrecvs = ios->ioproc ? iodesc->nrecvs : 0;
+    int *ranks;             /* Ranks in comm of the IO tasks and senders. */
+    PIO_Offset *node_off;   /* send_off of all tasks of the node. */
+    int myio;               /* Index of this IO task. */
+    int rank;
+    int active;
+    int mpierr;
+
+    pioassert(ios && iodesc && !iodesc->shm && niotasks > 0, "invalid input",
+              __FILE__, __LINE__);
+    PLOG((1, "shm_create niotasks = %d nrecvs = %d", niotasks, nrecvs));
+
+    if (!(shm = calloc(1, sizeof(pio_shm_desc))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    shm->node_comm = MPI_COMM_NULL;
+    shm->win = MPI_WIN_NULL;
+    iodesc->shm = shm;
+
+    /* Find the tasks on this node. */
+    if ((mpierr = MPI_Comm_rank(comm, &rank)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL,
+                                      &shm->node_comm)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Comm_size(shm->node_comm, &shm->node_size)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+
+    if (!(shm->io_node_rank = malloc(niotasks * sizeof(int))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    if (!(shm->recv_node_rank = malloc(max(1, nrecvs) * sizeof(int))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    if (!(shm->send_off = malloc(niotasks * sizeof(PIO_Offset))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    if (!(shm->recv_off = malloc(max(1, nrecvs) * sizeof(PIO_Offset))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+
+    /* Translate the ranks of the IO tasks, and of the tasks this IO
+     * task receives from, to ranks on the node. Tasks on other nodes
+     * get MPI_UNDEFINED. */
+    if (!(ranks = malloc((niotasks + nrecvs) * sizeof(int))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    for (int i = 0; i < niotasks; i++)
+        ranks[i] = iodesc->rearranger == PIO_REARR_SUBSET ? 0 : ios->ioranks[i];
+    for (int j = 0; j < nrecvs; j++)
+        ranks[niotasks + j] = iodesc->rearranger == PIO_REARR_SUBSET ? j : iodesc->rfrom[j];
+
+    if ((mpierr = MPI_Comm_group(comm, &group)))
+    {
+        free(ranks);
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    }
+    if ((mpierr = MPI_Comm_group(shm->node_comm, &node_group)))
+    {
+        free(ranks);
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    }
+    mpierr = MPI_Group_translate_ranks(group, niotasks, ranks, node_group,
+                                       shm->io_node_rank);
+    if (!mpierr && nrecvs)
+        mpierr = MPI_Group_translate_ranks(group, nrecvs, &ranks[niotasks], node_group,
+                                           shm->recv_node_rank);
+    free(ranks);
+    if (mpierr)
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Group_free(&group)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Group_free(&node_group)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+
+    /* Lay out the segment: one block for each IO task of the node
+     * this task sends to. */
+    shm->seglen = 0;
+    for (int i = 0; i < niotasks; i++)
+    {
+        shm->send_off[i] = -1;
+        if (iodesc->scount && iodesc->scount[i] > 0 && shm->io_node_rank[i] != MPI_UNDEFINED)
+        {
+            shm->send_off[i] = shm->seglen;
+            shm->seglen += iodesc->scount[i];
+        }
+    }
+
+    /* Each IO task finds its block in the segments of the tasks of
+     * the node. */
+    if (!(node_off = malloc((size_t)shm->node_size * niotasks * sizeof(PIO_Offset))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    if ((mpierr = MPI_Allgather(shm->send_off, niotasks, MPI_OFFSET, node_off, niotasks,
+                                MPI_OFFSET, shm->node_comm)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    myio = iodesc->rearranger == PIO_REARR_SUBSET ? 0 : ios->io_rank;
+    active = shm->seglen > 0;
+    for (int j = 0; j < nrecvs; j++)
+    {
+        shm->recv_off[j] = -1;
+        if (shm->recv_node_rank[j] != MPI_UNDEFINED)
+            shm->recv_off[j] = node_off[(size_t)shm->recv_node_rank[j] * niotasks + myio];
+    }
+    free(node_off);
+
+    /* If no task of the node sends to an IO task of the node, the
+     * window is never used. */
+    if ((mpierr = MPI_Allreduce(&active, &shm->active, 1, MPI_INT, MPI_LOR, shm->node_comm)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    PLOG((2, "shm_create node_size = %d seglen = %lld active = %d", shm->node_size,
+          (long long)shm->seglen, shm->active));
+
+    return PIO_NOERR;
+}
+
+/**
+ * Free the shared window of PIO_REARR_COMM_SHM. This is collective
+ * over the tasks of the node.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param shm pointer to the node level of the decomposition.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+shm_free_window(iosystem_desc_t *ios, pio_shm_desc *shm)
+{
+    int mpierr;
+
+    if (shm->win == MPI_WIN_NULL)
+        return PIO_NOERR;
+
+    if ((mpierr = MPI_Win_unlock_all(shm->win)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Win_free(&shm->win)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    pio_mem_add(ios, -shm->win_bytes);
+    shm->win_bytes = 0;
+    shm->win_nvars = 0;
+    shm->winbuf = NULL;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Make sure the segment of each task holds nvars variables,
+ * allocating a larger shared window if needed. This is collective
+ * over the tasks of the node. The window stays in a passive target
+ * epoch for all tasks while it exists, and is synchronized with
+ * shm_sync().
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @param nvars number of variables.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+shm_window(iosystem_desc_t *ios, io_desc_t *iodesc, int nvars)
+{
+    pio_shm_desc *shm = iodesc->shm;
+    MPI_Aint bytes;
+    int mpierr;
+    int ret;
+
+    pioassert(shm && nvars > 0, "invalid input", __FILE__, __LINE__);
+
+    if (nvars <= shm->win_nvars)
+        return PIO_NOERR;
+
+    if ((ret = shm_free_window(ios, shm)))
+        return ret;
+
+    bytes = (MPI_Aint)nvars * shm->seglen * iodesc->mpitype_size;
+    if ((mpierr = MPI_Win_allocate_shared(bytes, 1, MPI_INFO_NULL, shm->node_comm,
+                                          &shm->winbuf, &shm->win)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Win_lock_all(MPI_MODE_NOCHECK, shm->win)))
+        return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    shm->win_nvars = nvars;
+    shm->win_bytes = bytes;
+    pio_mem_add(ios, bytes);
+    PLOG((2, "shm_window nvars = %d bytes = %lld", nvars, (long long)bytes));
+
+    return PIO_NOERR;
+}
+
+/**
+ * Synchronize the tasks of the node, so that the stores of each task
+ * into its segment are seen by all of them.
+ *
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+shm_sync(io_desc_t *iodesc)
+{
+    pio_shm_desc *shm = iodesc->shm;
+    int mpierr;
+
+    pioassert(shm && shm->win != MPI_WIN_NULL, "invalid input", __FILE__, __LINE__);
+
+    if ((mpierr = MPI_Win_sync(shm->win)))
+        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Barrier(shm->node_comm)))
+        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Win_sync(shm->win)))
+        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Free the node level of PIO_REARR_COMM_SHM. This is collective over
+ * the tasks of the node.
+ *
+ * @param ios pointer to the iosystem_desc_t struct.
+ * @param iodesc a pointer to the io_desc_t struct.
+ * @returns 0 on success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+shm_free(iosystem_desc_t *ios, io_desc_t *iodesc)
+{
+    pio_shm_desc *shm = iodesc->shm;
+    int mpierr;
+    int ret;
+
+    if (!shm)
+        return PIO_NOERR;
+
+    if ((ret = shm_free_window(ios, shm)))
+        return ret;
+    if (shm->node_comm != MPI_COMM_NULL)
+        if ((mpierr = MPI_Comm_free(&shm->node_comm)))
+            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+    free(shm->io_node_rank);
+    free(shm->recv_node_rank);
+    free(shm->send_off);
+    free(shm->recv_off);
+    free(shm);
+    iodesc->shm = NULL;
+
+    return PIO_NOERR;
+}
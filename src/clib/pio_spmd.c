@@ -376,6 +376,213 @@ int pio_swapm(void *sendbuf, int *sendcounts, int *sdispls, MPI_Datatype *sendty
     return PIO_NOERR;
 }
 
+/**
+ * Provides the functionality of pio_swapm() for a task which only
+ * exchanges data with a few other tasks. The count, displacement and
+ * type arrays are indexed by position in the peer list rather than
+ * by rank, so no work or memory proportional to the size of comm is
+ * needed.
+ *
+ * If graph_comm is not NULL, the exchange is done with
+ * MPI_Neighbor_alltoallw() over a distributed graph communicator of
+ * the peers. If *graph_comm is MPI_COMM_NULL the graph is created
+ * (collectively over comm) and returned in *graph_comm for reuse. The
+ * peer lists must be symmetric: if task a lists task b, task b must
+ * list task a. Without MPI-3, point to point messages are used
+ * instead.
+ *
+ * Otherwise receives are posted for all peers, followed by the sends,
+ * with the handshake and isend flow control options of pio_swapm(). If
+ * fc->max_pend_req is greater than 0, no more than that many isends
+ * are outstanding at once.
+ *
+ * @param npeers number of peers.
+ * @param peers array (length npeers) of the ranks in comm of the
+ * peers, in the order used by the other arrays.
+ * @param sendbuf starting address of send buffer.
+ * @param sendcounts array (length npeers) of the number of elements
+ * to send to each peer.
+ * @param sdispls array (length npeers) of displacements in bytes
+ * (relative to sendbuf) of the data for each peer.
+ * @param sendtypes array (length npeers) of datatypes to send to
+ * each peer.
+ * @param recvbuf address of receive buffer.
+ * @param recvcounts array (length npeers) of the number of elements
+ * to receive from each peer.
+ * @param rdispls array (length npeers) of displacements in bytes
+ * (relative to recvbuf) of the data from each peer.
+ * @param recvtypes array (length npeers) of datatypes received from
+ * each peer.
+ * @param comm MPI communicator the peer ranks refer to.
+ * @param graph_comm pointer to the graph communicator, or NULL to
+ * use point to point messages.
+ * @param fc pointer to the struct that provided flow control options.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+pio_swapm_sparse(int npeers, const int *peers, void *sendbuf, int *sendcounts,
+                 int *sdispls, MPI_Datatype *sendtypes, void *recvbuf,
+                 int *recvcounts, int *rdispls, MPI_Datatype *recvtypes,
+                 MPI_Comm comm, MPI_Comm *graph_comm, rearr_comm_fc_opt_t *fc)
+{
+    int ntasks;  /* Number of tasks in communicator comm. */
+    int my_rank; /* Rank of this task in comm. */
+    int nreq = npeers > 0 ? npeers : 1;
+    int mpierr;  /* Return code from MPI functions. */
+
+    pioassert(npeers >= 0 && (!npeers || (peers && sendcounts && sdispls && sendtypes &&
+                                          recvcounts && rdispls && recvtypes)) && fc,
+              "invalid input", __FILE__, __LINE__);
+    PLOG((2, "pio_swapm_sparse npeers = %d graph = %d fc->hs = %d fc->isend = %d "
+          "fc->max_pend_req = %d", npeers, graph_comm ? 1 : 0, fc->hs, fc->isend,
+          fc->max_pend_req));
+
+#if MPI_VERSION >= 3
+    if (graph_comm)
+    {
+        MPI_Aint sdispls_a[nreq];
+        MPI_Aint rdispls_a[nreq];
+        MPI_Datatype stypes[nreq];
+        MPI_Datatype rtypes[nreq];
+
+        /* Create the graph of this task and its peers. */
+        if (*graph_comm == MPI_COMM_NULL)
+        {
+            PLOG((3, "creating neighbor graph communicator"));
+            if ((mpierr = MPI_Dist_graph_create_adjacent(comm, npeers, peers, MPI_UNWEIGHTED,
+                                                         npeers, peers, MPI_UNWEIGHTED,
+                                                         MPI_INFO_NULL, 0, graph_comm)))
+                return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+        }
+
+        /* The neighborhood collective takes MPI_Aint displacements,
+         * and needs valid types even for zero counts. */
+        for (int k = 0; k < npeers; k++)
+        {
+            sdispls_a[k] = sdispls[k];
+            rdispls_a[k] = rdispls[k];
+            stypes[k] = sendcounts[k] > 0 ? sendtypes[k] : MPI_BYTE;
+            rtypes[k] = recvcounts[k] > 0 ? recvtypes[k] : MPI_BYTE;
+        }
+
+        if ((mpierr = MPI_Neighbor_alltoallw(sendbuf, sendcounts, sdispls_a, stypes,
+                                             recvbuf, recvcounts, rdispls_a, rtypes,
+                                             *graph_comm)))
+            return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+
+        return PIO_NOERR;
+    }
+#endif /* MPI_VERSION >= 3 */
+
+    /* Get my rank and size of communicator. */
+    if ((mpierr = MPI_Comm_size(comm, &ntasks)))
+        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Comm_rank(comm, &my_rank)))
+        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+
+    {
+        MPI_Request rcvids[nreq];
+        MPI_Request sndids[nreq];
+        MPI_Request hs_rcvids[nreq];
+        int pending[nreq];     /* Queue of outstanding isends. */
+        int first_pending = 0;
+        int npending = 0;
+        int hs = 1;            /* Used for handshaking. */
+        int offset_t = ntasks; /* An index for communications tags. */
+
+        for (int k = 0; k < npeers; k++)
+        {
+            rcvids[k] = MPI_REQUEST_NULL;
+            sndids[k] = MPI_REQUEST_NULL;
+            hs_rcvids[k] = MPI_REQUEST_NULL;
+        }
+
+        /* If handshaking is in use, listen for it from each task we
+         * send to. */
+        if (fc->hs)
+            for (int k = 0; k < npeers; k++)
+                if (sendcounts[k] > 0)
+                    if ((mpierr = MPI_Irecv(&hs, 1, MPI_INT, peers[k], my_rank + offset_t, comm,
+                                            &hs_rcvids[k])))
+                        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+
+        /* Post all the receives, and tell the sender they are posted. */
+        for (int k = 0; k < npeers; k++)
+        {
+            if (recvcounts[k] > 0)
+            {
+                int tag = peers[k] + offset_t;
+
+                if ((mpierr = MPI_Irecv((char *)recvbuf + rdispls[k], recvcounts[k], recvtypes[k],
+                                        peers[k], tag, comm, &rcvids[k])))
+                    return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+
+                if (fc->hs)
+                    if ((mpierr = MPI_Send(&hs, 1, MPI_INT, peers[k], tag, comm)))
+                        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+            }
+        }
+
+        /* Send the data. */
+        for (int k = 0; k < npeers; k++)
+        {
+            void *ptr;
+            int tag = my_rank + offset_t;
+
+            if (sendcounts[k] <= 0)
+                continue;
+
+            /* If handshake is enabled don't post sends until the
+             * receiving task has posted recvs. */
+            if (fc->hs)
+                if ((mpierr = MPI_Wait(&hs_rcvids[k], MPI_STATUS_IGNORE)))
+                    return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+
+            /* Throttle the number of outstanding isends. */
+            if (fc->isend && fc->max_pend_req > 0 && npending >= fc->max_pend_req)
+            {
+                if ((mpierr = MPI_Wait(&sndids[pending[first_pending]], MPI_STATUS_IGNORE)))
+                    return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+                first_pending++;
+                npending--;
+            }
+
+            ptr = (char *)sendbuf + sdispls[k];
+            if (fc->hs && fc->isend)
+            {
+                if ((mpierr = MPI_Irsend(ptr, sendcounts[k], sendtypes[k], peers[k], tag, comm,
+                                         &sndids[k])))
+                    return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+            }
+            else if (fc->isend)
+            {
+                if ((mpierr = MPI_Isend(ptr, sendcounts[k], sendtypes[k], peers[k], tag, comm,
+                                        &sndids[k])))
+                    return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+            }
+            else
+            {
+                if ((mpierr = MPI_Send(ptr, sendcounts[k], sendtypes[k], peers[k], tag, comm)))
+                    return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+            }
+            if (fc->isend)
+                pending[first_pending + npending++] = k;
+        }
+
+        /* Wait for outstanding messages. */
+        if (npeers > 0)
+        {
+            if ((mpierr = MPI_Waitall(npeers, rcvids, MPI_STATUSES_IGNORE)))
+                return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+            if ((mpierr = MPI_Waitall(npeers, sndids, MPI_STATUSES_IGNORE)))
+                return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+        }
+    }
+
+    return PIO_NOERR;
+}
+
 /**
  * Clean up internal data structures, and free MPI resources,
  * associated with an IOSystem. This is the old name for
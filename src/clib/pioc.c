@@ -64,6 +64,12 @@ extern int diosysid;
  *
  * @defgroup PIO_set_blocksize_c Set Blocksize
  * Set the Blocksize in C.
+ *
+ * @defgroup PIO_set_file_mode_c Set File Writing Mode
+ * Set how the IO tasks write the data of files in C.
+ *
+ * @defgroup PIO_rearr_opts_c Rearranger Options
+ * Set the options of the rearranger, and get its statistics, in C.
  */
 
 /** The default error handler used when iosystem cannot be located. */
@@ -200,6 +206,10 @@ PIOc_advanceframe(int ncid, int varid)
     if ((ret = get_var_desc(varid, &file->varlist, &vdesc)))
         return pio_err(ios, file, ret, __FILE__, __LINE__);
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ret = pio_batch_flush(file)))
+        return ret;
+
     /* If using async, and not an IO task, then send parameters. */
     if (ios->async)
     {
@@ -262,6 +272,10 @@ PIOc_setframe(int ncid, int varid, int frame)
     if ((ret = get_var_desc(varid, &file->varlist, &vdesc)))
         return pio_err(ios, file, ret, __FILE__, __LINE__);
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ret = pio_batch_flush(file)))
+        return ret;
+
     /* If using async, and not an IO task, then send parameters. */
     if (ios->async)
     {
@@ -337,6 +351,70 @@ PIOc_get_local_array_size(int ioid)
     return iodesc->ndof;
 }
 
+/**
+ * Get the number of hits and misses of the datatype cache of a
+ * decomposition. The cache holds the MPI datatypes used to move data
+ * from compute to IO tasks in PIOc_write_darray_multi(), so that
+ * repeated writes of the same number of variables do not need to
+ * rebuild them.
+ *
+ * @param ioid IO description ID.
+ * @param hits pointer that gets the number of cache hits. Ignored if
+ * NULL.
+ * @param misses pointer that gets the number of cache misses. Ignored
+ * if NULL.
+ * @returns 0 for success, error code otherwise.
+ * @ingroup PIO_rearr_opts_c
+ * @author Jim Edwards
+ */
+int
+PIOc_get_type_cache_stats(int ioid, PIO_Offset *hits, PIO_Offset *misses)
+{
+    io_desc_t *iodesc;
+
+    if (!(iodesc = pio_get_iodesc_from_id(ioid)))
+        return pio_err(NULL, NULL, PIO_EBADID, __FILE__, __LINE__);
+
+    if (hits)
+        *hits = iodesc->type_cache_hits;
+    if (misses)
+        *misses = iodesc->type_cache_misses;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Get the number of bytes this task moved to IO tasks on its own
+ * node, and sent to IO tasks on other nodes, when writing with a
+ * decomposition. The bytes are only counted with the
+ * PIO_REARR_COMM_SHM comm type, which finds the tasks of each node;
+ * otherwise both are zero.
+ *
+ * @param ioid IO description ID.
+ * @param onnode pointer that gets the bytes moved through the shared
+ * window on the node. Ignored if NULL.
+ * @param offnode pointer that gets the bytes sent to other nodes.
+ * Ignored if NULL.
+ * @returns 0 for success, error code otherwise.
+ * @ingroup PIO_rearr_opts_c
+ * @author Jim Edwards
+ */
+int
+PIOc_get_rearr_node_stats(int ioid, PIO_Offset *onnode, PIO_Offset *offnode)
+{
+    io_desc_t *iodesc;
+
+    if (!(iodesc = pio_get_iodesc_from_id(ioid)))
+        return pio_err(NULL, NULL, PIO_EBADID, __FILE__, __LINE__);
+
+    if (onnode)
+        *onnode = iodesc->onnode_bytes;
+    if (offnode)
+        *offnode = iodesc->offnode_bytes;
+
+    return PIO_NOERR;
+}
+
 /**
  * Set the error handling method used for subsequent calls. This
  * function is deprecated. New code should use
@@ -535,37 +613,28 @@ PIOc_InitDecomp(int iosysid, int pio_type, int ndims, const int *gdimlen, int ma
             char rearranger_present = rearranger ? true : false;
             char iostart_present = iostart ? true : false;
             char iocount_present = iocount ? true : false;
-            if (ios->compmain == MPI_ROOT){
-                PLOG((1, "about to sent msg %d union_comm %d",msg,ios->union_comm));
-                mpierr = MPI_Send(&msg, 1, MPI_INT, ios->ioroot, 1, ios->union_comm);
-            }
-            if (!mpierr)
-                mpierr = MPI_Bcast(&iosysid, 1, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&pio_type, 1, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&ndims, 1, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast((int *)gdimlen, ndims, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&maplen, 1, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast((PIO_Offset *)compmap, maplen, MPI_OFFSET, ios->compmain, ios->intercomm);
+            pio_msgbuf mb; /* The packed parameters. */
 
-            if (!mpierr)
-                mpierr = MPI_Bcast(&rearranger_present, 1, MPI_CHAR, ios->compmain, ios->intercomm);
-            if (rearranger_present && !mpierr)
-                mpierr = MPI_Bcast((int *)rearranger, 1, MPI_INT, ios->compmain, ios->intercomm);
-
-            if (!mpierr)
-                mpierr = MPI_Bcast(&iostart_present, 1, MPI_CHAR, ios->compmain, ios->intercomm);
-            if (iostart_present && !mpierr)
-                mpierr = MPI_Bcast((PIO_Offset *)iostart, ndims, MPI_OFFSET, ios->compmain, ios->intercomm);
-
-            if (!mpierr)
-                mpierr = MPI_Bcast(&iocount_present, 1, MPI_CHAR, ios->compmain, ios->intercomm);
-            if (iocount_present && !mpierr)
-                mpierr = MPI_Bcast((PIO_Offset *)iocount, ndims, MPI_OFFSET, ios->compmain, ios->intercomm);
+            PLOG((1, "about to sent msg %d union_comm %d",msg,ios->union_comm));
+            if (!(mpierr = pio_msgbuf_start(ios, &mb, msg)))
+            {
+                pio_msgbuf_put(&mb, &iosysid, sizeof(int));
+                pio_msgbuf_put(&mb, &pio_type, sizeof(int));
+                pio_msgbuf_put(&mb, &ndims, sizeof(int));
+                pio_msgbuf_put(&mb, gdimlen, ndims * sizeof(int));
+                pio_msgbuf_put(&mb, &maplen, sizeof(int));
+                pio_msgbuf_put(&mb, &rearranger_present, 1);
+                if (rearranger_present)
+                    pio_msgbuf_put(&mb, rearranger, sizeof(int));
+                pio_msgbuf_put(&mb, &iostart_present, 1);
+                if (iostart_present)
+                    pio_msgbuf_put(&mb, iostart, ndims * sizeof(PIO_Offset));
+                pio_msgbuf_put(&mb, &iocount_present, 1);
+                if (iocount_present)
+                    pio_msgbuf_put(&mb, iocount, ndims * sizeof(PIO_Offset));
+                pio_msgbuf_put_bulk(&mb, compmap, maplen * sizeof(PIO_Offset));
+                mpierr = pio_msgbuf_send(ios, &mb);
+            }
             PLOG((2, "PIOc_InitDecomp iosysid = %d pio_type = %d ndims = %d maplen = %d rearranger_present = %d iostart_present = %d "
                   "iocount_present = %d ", iosysid, pio_type, ndims, maplen, rearranger_present, iostart_present, iocount_present));
         }
@@ -720,8 +789,15 @@ PIOc_InitDecomp(int iosysid, int pio_type, int ndims, const int *gdimlen, int ma
 
         /* Compute the communications pattern for this decomposition. */
         if (iodesc->rearranger == PIO_REARR_BOX)
+        {
             if ((ierr = box_rearrange_create(ios, maplen, iodesc->map, gdimlen, ndims, iodesc)))
                 return pio_err(ios, NULL, ierr, __FILE__, __LINE__);
+        }
+        else if (iodesc->rearranger == PIO_REARR_HIER)
+        {
+            if ((ierr = hier_rearrange_create(ios, maplen, iodesc->map, gdimlen, ndims, iodesc)))
+                return pio_err(ios, NULL, ierr, __FILE__, __LINE__);
+        }
     }
 
     /* Broadcast next ioid to all tasks from io root.*/
@@ -850,37 +926,28 @@ PIOc_InitDecomp_ReadOnly(int iosysid, int pio_type, int ndims, const int *gdimle
             char rearranger_present = rearranger ? true : false;
             char iostart_present = iostart ? true : false;
             char iocount_present = iocount ? true : false;
-            if (ios->compmain == MPI_ROOT){
-                PLOG((1, "about to sent msg %d union_comm %d",msg,ios->union_comm));
-                mpierr = MPI_Send(&msg, 1, MPI_INT, ios->ioroot, 1, ios->union_comm);
-            }
-            if (!mpierr)
-                mpierr = MPI_Bcast(&iosysid, 1, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&pio_type, 1, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&ndims, 1, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast((int *)gdimlen, ndims, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast(&maplen, 1, MPI_INT, ios->compmain, ios->intercomm);
-            if (!mpierr)
-                mpierr = MPI_Bcast((PIO_Offset *)compmap, maplen, MPI_OFFSET, ios->compmain, ios->intercomm);
-
-            if (!mpierr)
-                mpierr = MPI_Bcast(&rearranger_present, 1, MPI_CHAR, ios->compmain, ios->intercomm);
-            if (rearranger_present && !mpierr)
-                mpierr = MPI_Bcast((int *)rearranger, 1, MPI_INT, ios->compmain, ios->intercomm);
-
-            if (!mpierr)
-                mpierr = MPI_Bcast(&iostart_present, 1, MPI_CHAR, ios->compmain, ios->intercomm);
-            if (iostart_present && !mpierr)
-                mpierr = MPI_Bcast((PIO_Offset *)iostart, ndims, MPI_OFFSET, ios->compmain, ios->intercomm);
+            pio_msgbuf mb; /* The packed parameters. */
 
-            if (!mpierr)
-                mpierr = MPI_Bcast(&iocount_present, 1, MPI_CHAR, ios->compmain, ios->intercomm);
-            if (iocount_present && !mpierr)
-                mpierr = MPI_Bcast((PIO_Offset *)iocount, ndims, MPI_OFFSET, ios->compmain, ios->intercomm);
+            PLOG((1, "about to sent msg %d union_comm %d",msg,ios->union_comm));
+            if (!(mpierr = pio_msgbuf_start(ios, &mb, msg)))
+            {
+                pio_msgbuf_put(&mb, &iosysid, sizeof(int));
+                pio_msgbuf_put(&mb, &pio_type, sizeof(int));
+                pio_msgbuf_put(&mb, &ndims, sizeof(int));
+                pio_msgbuf_put(&mb, gdimlen, ndims * sizeof(int));
+                pio_msgbuf_put(&mb, &maplen, sizeof(int));
+                pio_msgbuf_put(&mb, &rearranger_present, 1);
+                if (rearranger_present)
+                    pio_msgbuf_put(&mb, rearranger, sizeof(int));
+                pio_msgbuf_put(&mb, &iostart_present, 1);
+                if (iostart_present)
+                    pio_msgbuf_put(&mb, iostart, ndims * sizeof(PIO_Offset));
+                pio_msgbuf_put(&mb, &iocount_present, 1);
+                if (iocount_present)
+                    pio_msgbuf_put(&mb, iocount, ndims * sizeof(PIO_Offset));
+                pio_msgbuf_put_bulk(&mb, compmap, maplen * sizeof(PIO_Offset));
+                mpierr = pio_msgbuf_send(ios, &mb);
+            }
             PLOG((2, "PIOc_InitDecomp iosysid = %d pio_type = %d ndims = %d maplen = %d rearranger_present = %d iostart_present = %d "
                   "iocount_present = %d ", iosysid, pio_type, ndims, maplen, rearranger_present, iostart_present, iocount_present));
         }
@@ -1224,56 +1291,24 @@ PIOc_InitDecomp_bc(int iosysid, int pio_type, int ndims, const int *gdimlen,
 }
 
 /**
- * Library initialization used when IO tasks are a subset of compute
- * tasks.
- *
- * This function creates an MPI intracommunicator between a set of IO
- * tasks and one or more sets of computational tasks.
- *
- * The caller must create all comp_comm and the io_comm MPI
- * communicators before calling this function.
- *
- * Internally, this function does the following:
- *
- * <ul>
- * <li>Initialize logging system (if PIO_ENABLE_LOGGING is set).
- * <li>Allocates and initializes the iosystem_desc_t struct (ios).
- * <li>MPI duplicated user comp_comm to ios->comp_comm and
- * ios->union_comm.
- * <li>Set ios->my_comm to be ios->comp_comm. (Not an MPI
- * duplication.)
- * <li>Find MPI rank in comp_comm, determine ranks of IO tasks,
- * determine whether this task is one of the IO tasks.
- * <li>Identify the root IO tasks.
- * <li>Create MPI groups for IO tasks, and for computation tasks.
- * <li>On IO tasks, create an IO communicator (ios->io_comm).
- * <li>Assign an iosystemid, and put this iosystem_desc_t into the
- * list of open iosystems.
- * </ul>
- *
- * When complete, there are three MPI communicators (ios->comp_comm,
- * ios->union_comm, and ios->io_comm) that must be freed by MPI.
+ * Initialize the IO system for the non-async case, with the IO tasks
+ * given by their ranks in comp_comm. This does the work of
+ * PIOc_Init_Intracomm() and PIOc_Init_Intracomm_pernode().
  *
  * @param comp_comm the MPI_Comm of the compute tasks.
  * @param num_iotasks the number of io tasks to use.
- * @param stride the offset between io tasks in the comp_comm. The mod
- * operator is used when computing the IO tasks with the formula:
- * <pre>ios->ioranks[i] = (base + i * ustride) % ios->num_comptasks</pre>.
- * @param base the comp_comm index of the first io task.
- * @param rearr the rearranger to use by default, this may be
- * overriden in the PIO_init_decomp(). The rearranger is not used
- * until the decomposition is initialized.
+ * @param ioranks array of length num_iotasks with the comp_comm
+ * ranks of the IO tasks.
+ * @param rearr the default rearranger.
  * @param iosysidp index of the defined system descriptor.
  * @return 0 on success, otherwise a PIO error code.
- * @ingroup PIO_init_c
  * @author Jim Edwards, Ed Hartnett
  */
-int
-PIOc_Init_Intracomm(MPI_Comm comp_comm, int num_iotasks, int stride, int base,
-                    int rearr, int *iosysidp)
+static int
+init_intracomm(MPI_Comm comp_comm, int num_iotasks, const int *ioranks, int rearr,
+               int *iosysidp)
 {
     iosystem_desc_t *ios;
-    int ustride;
     MPI_Group compgroup;  /* Contains tasks involved in computation. */
     MPI_Group iogroup;    /* Contains the processors involved in I/O. */
     int num_comptasks; /* The size of the comp_comm. */
@@ -1299,13 +1334,8 @@ PIOc_Init_Intracomm(MPI_Comm comp_comm, int num_iotasks, int stride, int base,
     if ((mpierr = MPI_Comm_size(comp_comm, &num_comptasks)))
         return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
 
-    PLOG((1, "PIOc_Init_Intracomm comp_comm = %d num_iotasks = %d stride = %d base = %d "
-          "rearr = %d", comp_comm, num_iotasks, stride, base, rearr));
-
-    /* Check the inputs. */
-    if (!iosysidp || num_iotasks < 1 || num_iotasks * stride > num_comptasks)
-        return pio_err(NULL, NULL, PIO_EINVAL, __FILE__, __LINE__);
-
+    PLOG((1, "init_intracomm comp_comm = %d num_iotasks = %d rearr = %d", comp_comm,
+          num_iotasks, rearr));
 
     /* Allocate memory for the iosystem info. */
     if (!(ios = calloc(1, sizeof(iosystem_desc_t))))
@@ -1335,7 +1365,6 @@ PIOc_Init_Intracomm(MPI_Comm comp_comm, int num_iotasks, int stride, int base,
     PLOG((2, "union_comm = %d comp_comm = %d", ios->union_comm, ios->comp_comm));
 
     ios->my_comm = ios->comp_comm;
-    ustride = stride;
 
     /* Find MPI rank in comp_comm communicator. */
     if ((mpierr = MPI_Comm_rank(ios->comp_comm, &ios->comp_rank)))
@@ -1362,7 +1391,7 @@ PIOc_Init_Intracomm(MPI_Comm comp_comm, int num_iotasks, int stride, int base,
         return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
     for (int i = 0; i < ios->num_iotasks; i++)
     {
-        ios->ioranks[i] = (base + i * ustride) % ios->num_comptasks;
+        ios->ioranks[i] = ioranks[i];
         if (ios->ioranks[i] == ios->comp_rank)
             ios->ioproc = true;
         PLOG((3, "ios->ioranks[%d] = %d", i, ios->ioranks[i]));
@@ -1422,6 +1451,157 @@ PIOc_Init_Intracomm(MPI_Comm comp_comm, int num_iotasks, int stride, int base,
     return PIO_NOERR;
 }
 
+/**
+ * Library initialization used when IO tasks are a subset of compute
+ * tasks.
+ *
+ * This function creates an MPI intracommunicator between a set of IO
+ * tasks and one or more sets of computational tasks.
+ *
+ * The caller must create all comp_comm and the io_comm MPI
+ * communicators before calling this function.
+ *
+ * Internally, this function does the following:
+ *
+ * <ul>
+ * <li>Initialize logging system (if PIO_ENABLE_LOGGING is set).
+ * <li>Allocates and initializes the iosystem_desc_t struct (ios).
+ * <li>MPI duplicated user comp_comm to ios->comp_comm and
+ * ios->union_comm.
+ * <li>Set ios->my_comm to be ios->comp_comm. (Not an MPI
+ * duplication.)
+ * <li>Find MPI rank in comp_comm, determine ranks of IO tasks,
+ * determine whether this task is one of the IO tasks.
+ * <li>Identify the root IO tasks.
+ * <li>Create MPI groups for IO tasks, and for computation tasks.
+ * <li>On IO tasks, create an IO communicator (ios->io_comm).
+ * <li>Assign an iosystemid, and put this iosystem_desc_t into the
+ * list of open iosystems.
+ * </ul>
+ *
+ * When complete, there are three MPI communicators (ios->comp_comm,
+ * ios->union_comm, and ios->io_comm) that must be freed by MPI.
+ *
+ * @param comp_comm the MPI_Comm of the compute tasks.
+ * @param num_iotasks the number of io tasks to use.
+ * @param stride the offset between io tasks in the comp_comm. The mod
+ * operator is used when computing the IO tasks with the formula:
+ * <pre>ios->ioranks[i] = (base + i * ustride) % ios->num_comptasks</pre>.
+ * @param base the comp_comm index of the first io task.
+ * @param rearr the rearranger to use by default, this may be
+ * overriden in the PIO_init_decomp(). The rearranger is not used
+ * until the decomposition is initialized.
+ * @param iosysidp index of the defined system descriptor.
+ * @return 0 on success, otherwise a PIO error code.
+ * @ingroup PIO_init_c
+ * @author Jim Edwards, Ed Hartnett
+ */
+int
+PIOc_Init_Intracomm(MPI_Comm comp_comm, int num_iotasks, int stride, int base,
+                    int rearr, int *iosysidp)
+{
+    int *ioranks;      /* The comp_comm ranks of the IO tasks. */
+    int num_comptasks; /* The size of the comp_comm. */
+    int mpierr;        /* Return value for MPI calls. */
+    int ret;           /* Return code for function calls. */
+
+    /* Find the number of computation tasks. */
+    if ((mpierr = MPI_Comm_size(comp_comm, &num_comptasks)))
+        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+
+    PLOG((1, "PIOc_Init_Intracomm comp_comm = %d num_iotasks = %d stride = %d base = %d "
+          "rearr = %d", comp_comm, num_iotasks, stride, base, rearr));
+
+    /* Check the inputs. */
+    if (!iosysidp || num_iotasks < 1 || num_iotasks * stride > num_comptasks)
+        return pio_err(NULL, NULL, PIO_EINVAL, __FILE__, __LINE__);
+
+    /* The IO tasks are placed by base and stride. */
+    if (!(ioranks = malloc(num_iotasks * sizeof(int))))
+        return pio_err(NULL, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    for (int i = 0; i < num_iotasks; i++)
+        ioranks[i] = (base + i * stride) % num_comptasks;
+
+    ret = init_intracomm(comp_comm, num_iotasks, ioranks, rearr, iosysidp);
+    free(ioranks);
+
+    return ret;
+}
+
+/**
+ * Library initialization used when IO tasks are a subset of compute
+ * tasks, with the IO tasks placed by node.
+ *
+ * The nodes are found with MPI_Comm_split_type(), with
+ * MPI_COMM_TYPE_SHARED. The IO tasks are spread evenly across the
+ * nodes, with at most iotasks_per_node IO tasks on any node, so that
+ * the IO load (and network traffic) is shared by as many nodes as
+ * possible. No node gets a second IO task until all nodes have
+ * one. Within a node, the IO tasks are spread evenly over the tasks
+ * of the node. Otherwise this is the same as PIOc_Init_Intracomm().
+ *
+ * @param comp_comm the MPI_Comm of the compute tasks.
+ * @param num_iotasks the number of io tasks to use. If 0,
+ * iotasks_per_node IO tasks are used on each node (or all the tasks
+ * of a node, if it has fewer).
+ * @param iotasks_per_node the maximum number of IO tasks on a node.
+ * @param rearr the rearranger to use by default, this may be
+ * overriden in the PIO_init_decomp(). The rearranger is not used
+ * until the decomposition is initialized.
+ * @param iosysidp index of the defined system descriptor.
+ * @return 0 on success, PIO_EINVAL if there are not enough tasks on
+ * the nodes for num_iotasks IO tasks, otherwise a PIO error code.
+ * @ingroup PIO_init_c
+ * @author Jim Edwards
+ */
+int
+PIOc_Init_Intracomm_pernode(MPI_Comm comp_comm, int num_iotasks, int iotasks_per_node,
+                            int rearr, int *iosysidp)
+{
+    int *node_of_task; /* Node number of each task in comp_comm. */
+    int *ioranks;      /* The comp_comm ranks of the IO tasks. */
+    int num_comptasks; /* The size of the comp_comm. */
+    int mpierr;        /* Return value for MPI calls. */
+    int ret;           /* Return code for function calls. */
+
+    /* Find the number of computation tasks. */
+    if ((mpierr = MPI_Comm_size(comp_comm, &num_comptasks)))
+        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+
+    PLOG((1, "PIOc_Init_Intracomm_pernode comp_comm = %d num_iotasks = %d "
+          "iotasks_per_node = %d rearr = %d", comp_comm, num_iotasks, iotasks_per_node,
+          rearr));
+
+    /* Check the inputs. */
+    if (!iosysidp || num_iotasks < 0 || num_iotasks > num_comptasks || iotasks_per_node < 1)
+        return pio_err(NULL, NULL, PIO_EINVAL, __FILE__, __LINE__);
+
+    if (!(node_of_task = malloc(num_comptasks * sizeof(int))))
+        return pio_err(NULL, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    if (!(ioranks = malloc(num_comptasks * sizeof(int))))
+    {
+        free(node_of_task);
+        return pio_err(NULL, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    }
+
+    /* Learn the node layout, and choose the IO tasks. All tasks get
+     * the same answer. */
+    if (!(ret = pio_get_node_of_task(comp_comm, node_of_task, NULL)))
+        ret = pio_select_node_ioranks(num_comptasks, node_of_task, iotasks_per_node,
+                                      &num_iotasks, ioranks);
+    free(node_of_task);
+    if (ret)
+    {
+        free(ioranks);
+        return pio_err(NULL, NULL, ret, __FILE__, __LINE__);
+    }
+
+    ret = init_intracomm(comp_comm, num_iotasks, ioranks, rearr, iosysidp);
+    free(ioranks);
+
+    return ret;
+}
+
 /**
  * Interface to call from pio_init from fortran.
  *
@@ -1506,6 +1686,40 @@ PIOc_set_hint(int iosysid, const char *hint, const char *hintval)
     return PIO_NOERR;
 }
 
+/**
+ * Turn on or off the multi-writer mode for PIO_IOTYPE_NETCDF files
+ * created or opened after this call.
+ *
+ * Normally all IO tasks send their data to IO task 0, which writes
+ * it with netCDF. In the multi-writer mode, IO task 0 still writes
+ * the header, but each IO task writes its own data with MPI-IO, at
+ * the offsets of the variables in the file. Other iotypes are not
+ * affected, and PIO_IOTYPE_NETCDF4C files are still written by IO
+ * task 0. The mode is not available with async.
+ *
+ * This function must be called on all tasks of the IO system.
+ *
+ * @param iosysid the IO system ID.
+ * @param enable non-zero to turn on the multi-writer mode.
+ * @returns 0 for success, or PIO_BADID if iosysid can't be found.
+ * @ingroup PIO_set_file_mode_c
+ * @author Jim Edwards
+ */
+int
+PIOc_set_multiwriter(int iosysid, int enable)
+{
+    iosystem_desc_t *ios;
+
+    /* Get the iosysid. */
+    if (!(ios = pio_get_iosystem_from_id(iosysid)))
+        return pio_err(NULL, NULL, PIO_EBADID, __FILE__, __LINE__);
+
+    PLOG((1, "PIOc_set_multiwriter enable = %d", enable));
+    ios->multiwriter = enable ? 1 : 0;
+
+    return PIO_NOERR;
+}
+
 /**
  * Clean up internal data structures, and free MPI resources,
  * associated with an IOSystem.
@@ -1572,6 +1786,9 @@ PIOc_free_iosystem(int iosysid)
         free(ios->compranks);
     PLOG((3, "Freed compranks."));
 
+    /* Free the IO buffers kept for reuse. */
+    pio_iobuf_pool_free(ios);
+
     /* Learn the number of open IO systems. */
     if ((ierr = pio_num_iosystem(&niosysid)))
         return pio_err(ios, NULL, ierr, __FILE__, __LINE__);
@@ -1605,6 +1822,9 @@ PIOc_free_iosystem(int iosysid)
 
     if (niosysid == 1)
     {
+        /* Stop the progress thread, if it was started. */
+        pio_progress_stop();
+
         PLOG((1, "about to finalize logging"));
         pio_finalize_logging();
     }
@@ -840,3 +840,509 @@ PIOc_init_async_comms_from_F90(int f90_world_comm,
 */
     return ret;
 }
+
+/**
+ * Turn on or off the deferral of define-mode calls in async mode.
+ *
+ * Normally each call to PIOc_def_dim(), PIOc_def_var() and
+ * PIOc_put_att_*() made by the computation tasks is a round trip to
+ * the IO tasks. With this mode on, these calls are queued on the
+ * computation tasks and sent to the IO tasks in one message, which
+ * is replayed there. The dimension and variable IDs are assigned
+ * by the computation tasks, and PIOc_inq_dimid(), PIOc_inq_varid(),
+ * PIOc_inq_dim() and PIOc_inq_unlimdims() are answered locally for
+ * the queued definitions. Any other call on the file (for example
+ * PIOc_enddef()) first sends the queued calls. An error in a queued
+ * call is returned by the call which sends the queue.
+ *
+ * Only calls with atomic types are queued. This has no effect if
+ * async is not in use. This function is called on the computation
+ * tasks.
+ *
+ * @param iosysid the IO system ID.
+ * @param enable non-zero to queue define-mode calls.
+ * @returns 0 for success, or PIO_BADID if iosysid can't be found.
+ * @ingroup PIO_init_async
+ * @author Jim Edwards
+ */
+int
+PIOc_set_batch_define(int iosysid, int enable)
+{
+    iosystem_desc_t *ios;
+
+    /* Get the iosysid. */
+    if (!(ios = pio_get_iosystem_from_id(iosysid)))
+        return pio_err(NULL, NULL, PIO_EBADID, __FILE__, __LINE__);
+
+    PLOG((1, "PIOc_set_batch_define enable = %d", enable));
+    ios->batch_define = enable ? 1 : 0;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Grow an array which holds n elements, if it is full. The capacity
+ * of the array is the smallest power of two not less than n, so it
+ * is doubled when n is a power of two.
+ *
+ * @param array pointer to the array, may be NULL if n is 0.
+ * @param n number of elements in the array.
+ * @param elemsize size of an element in bytes.
+ * @returns pointer to the array, or NULL if out of memory.
+ * @author Jim Edwards
+ */
+static void *
+batch_grow(void *array, int n, size_t elemsize)
+{
+    if (n & (n - 1))
+        return array;
+
+    return realloc(array, (n ? 2 * n : 1) * elemsize);
+}
+
+/**
+ * Start deferring define-mode calls for a file, if not already
+ * started. The numbers of dims and vars, and the unlimited dims, are
+ * learned from the IO tasks once, so that IDs of later definitions
+ * can be assigned without asking them.
+ *
+ * @param file pointer to the file info.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+static int
+batch_start(file_desc_t *file)
+{
+    pio_def_batch *batch;
+    int ndims, nvars, nunlimdims;
+    int ierr;
+
+    if (file->def_batch)
+        return PIO_NOERR;
+
+    /* Errors are handled in these functions. */
+    if ((ierr = PIOc_inq(file->pio_ncid, &ndims, &nvars, NULL, NULL)))
+        return ierr;
+    if ((ierr = PIOc_inq_unlimdims(file->pio_ncid, &nunlimdims, NULL)))
+        return ierr;
+
+    if (!(batch = calloc(1, sizeof(pio_def_batch))))
+        return pio_err(NULL, file, PIO_ENOMEM, __FILE__, __LINE__);
+    if (nunlimdims)
+    {
+        if (!(batch->unlimdimids = malloc(nunlimdims * sizeof(int))))
+        {
+            free(batch);
+            return pio_err(NULL, file, PIO_ENOMEM, __FILE__, __LINE__);
+        }
+        if ((ierr = PIOc_inq_unlimdims(file->pio_ncid, NULL, batch->unlimdimids)))
+        {
+            pio_batch_free(batch);
+            return ierr;
+        }
+    }
+    batch->ndims = batch->first_dimid = ndims;
+    batch->nvars = batch->first_varid = nvars;
+    batch->nunlimdims = nunlimdims;
+
+    /* The message starts with the ncid, followed by the calls. */
+    pio_msgbuf_init(file->iosystem, &batch->mb);
+    pio_msgbuf_put(&batch->mb, &file->pio_ncid, sizeof(int));
+
+    file->def_batch = batch;
+    PLOG((2, "batch_start ncid = %d ndims = %d nvars = %d nunlimdims = %d",
+          file->pio_ncid, ndims, nvars, nunlimdims));
+
+    return PIO_NOERR;
+}
+
+/**
+ * Queue a call to PIOc_def_dim(). This runs on the computation tasks.
+ *
+ * @param file pointer to the file info.
+ * @param name name of the dimension.
+ * @param len length of the dimension.
+ * @param idp a pointer that will get the id of the dimension. Ignored
+ * if NULL.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+pio_batch_def_dim(file_desc_t *file, const char *name, PIO_Offset len, int *idp)
+{
+    pio_def_batch *batch;
+    int op = PIO_MSG_DEF_DIM;
+    int namelen = strlen(name);
+    int n, dimid;
+    void *p;
+    int ierr;
+
+    if ((ierr = batch_start(file)))
+        return ierr;
+    batch = file->def_batch;
+
+    /* Remember the name and length, for inquiries. */
+    n = batch->ndims - batch->first_dimid;
+    if (!(p = batch_grow(batch->dimnames, n, sizeof(char *))))
+        return pio_err(NULL, file, PIO_ENOMEM, __FILE__, __LINE__);
+    batch->dimnames = p;
+    if (!(p = batch_grow(batch->dimlens, n, sizeof(PIO_Offset))))
+        return pio_err(NULL, file, PIO_ENOMEM, __FILE__, __LINE__);
+    batch->dimlens = p;
+    if (!(batch->dimnames[n] = malloc(namelen + 1)))
+        return pio_err(NULL, file, PIO_ENOMEM, __FILE__, __LINE__);
+    strcpy(batch->dimnames[n], name);
+    batch->dimlens[n] = len;
+    dimid = batch->ndims++;
+
+    if (len == PIO_UNLIMITED)
+    {
+        if (!(p = realloc(batch->unlimdimids, (batch->nunlimdims + 1) * sizeof(int))))
+            return pio_err(NULL, file, PIO_ENOMEM, __FILE__, __LINE__);
+        batch->unlimdimids = p;
+        batch->unlimdimids[batch->nunlimdims++] = dimid;
+    }
+
+    pio_msgbuf_put(&batch->mb, &op, sizeof(int));
+    pio_msgbuf_put(&batch->mb, &namelen, sizeof(int));
+    pio_msgbuf_put(&batch->mb, name, namelen + 1);
+    pio_msgbuf_put(&batch->mb, &len, sizeof(PIO_Offset));
+    pio_msgbuf_put(&batch->mb, &dimid, sizeof(int));
+    batch->nops++;
+
+    PLOG((2, "pio_batch_def_dim name = %s len = %lld dimid = %d", name, len, dimid));
+    if (idp)
+        *idp = dimid;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Queue a call to PIOc_def_var(). This runs on the computation
+ * tasks. The variable is added to the varlist of the file, as
+ * PIOc_def_var() does.
+ *
+ * @param file pointer to the file info.
+ * @param name the variable name.
+ * @param xtype the PIO_TYPE of the variable. Must be an atomic type.
+ * @param ndims the number of dimensions.
+ * @param dimidsp pointer to array of dimension IDs.
+ * @param varidp a pointer that will get the variable ID. Ignored if
+ * NULL.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+pio_batch_def_var(file_desc_t *file, const char *name, nc_type xtype, int ndims,
+                  const int *dimidsp, int *varidp)
+{
+    pio_def_batch *batch;
+    int op = PIO_MSG_DEF_VAR;
+    int namelen = strlen(name);
+    MPI_Datatype mpi_type;
+    int type_size;
+    int mpi_type_size = 0;
+    int rec_var = 0;
+    int n, varid;
+    void *p;
+    int mpierr;
+    int ierr;
+
+    if (ndims < 0 || ndims > PIO_MAX_DIMS || (ndims && !dimidsp))
+        return pio_err(NULL, file, PIO_EINVAL, __FILE__, __LINE__);
+
+    if ((ierr = batch_start(file)))
+        return ierr;
+    batch = file->def_batch;
+
+    /* Get the MPI type and the size of the type. */
+    if ((ierr = find_mpi_type(xtype, &mpi_type, &type_size)))
+        return pio_err(NULL, file, ierr, __FILE__, __LINE__);
+    if (mpi_type != MPI_DATATYPE_NULL)
+        if ((mpierr = MPI_Type_size(mpi_type, &mpi_type_size)))
+            return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+
+    /* Only the first dim may be unlimited, for PIO. */
+    for (int d = 0; d < ndims; d++)
+        for (int ud = 0; ud < batch->nunlimdims; ud++)
+            if (dimidsp[d] == batch->unlimdimids[ud])
+            {
+                if (d)
+                    return pio_err(NULL, file, PIO_EINVAL, __FILE__, __LINE__);
+                rec_var++;
+            }
+
+    /* Remember the name, for inquiries. */
+    n = batch->nvars - batch->first_varid;
+    if (!(p = batch_grow(batch->varnames, n, sizeof(char *))))
+        return pio_err(NULL, file, PIO_ENOMEM, __FILE__, __LINE__);
+    batch->varnames = p;
+    if (!(batch->varnames[n] = malloc(namelen + 1)))
+        return pio_err(NULL, file, PIO_ENOMEM, __FILE__, __LINE__);
+    strcpy(batch->varnames[n], name);
+    varid = batch->nvars++;
+
+    pio_msgbuf_put(&batch->mb, &op, sizeof(int));
+    pio_msgbuf_put(&batch->mb, &namelen, sizeof(int));
+    pio_msgbuf_put(&batch->mb, name, namelen + 1);
+    pio_msgbuf_put(&batch->mb, &xtype, sizeof(nc_type));
+    pio_msgbuf_put(&batch->mb, &ndims, sizeof(int));
+    pio_msgbuf_put(&batch->mb, dimidsp, ndims * sizeof(int));
+    pio_msgbuf_put(&batch->mb, &rec_var, sizeof(int));
+    pio_msgbuf_put(&batch->mb, &varid, sizeof(int));
+    batch->nops++;
+
+    PLOG((2, "pio_batch_def_var name = %s xtype = %d ndims = %d varid = %d", name, xtype,
+          ndims, varid));
+    if (varidp)
+        *varidp = varid;
+
+    /* Add to the list of var_desc_t structs for this file. */
+    if ((ierr = add_to_varlist(varid, rec_var, xtype, type_size, mpi_type, mpi_type_size,
+                               ndims, &file->varlist)))
+        return pio_err(NULL, file, ierr, __FILE__, __LINE__);
+    file->nvars++;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Queue a call to PIOc_put_att_tc(). This runs on the computation
+ * tasks. The attribute data is copied.
+ *
+ * @param file pointer to the file info.
+ * @param varid the variable ID.
+ * @param name the name of the attribute.
+ * @param atttype the nc_type of the attribute. Must be an atomic type.
+ * @param len the length of the attribute array.
+ * @param memtype the nc_type of the attribute data in memory. Must be
+ * an atomic type, or PIO_LONG_INTERNAL.
+ * @param op a pointer with the attribute data.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+pio_batch_put_att(file_desc_t *file, int varid, const char *name, nc_type atttype,
+                  PIO_Offset len, nc_type memtype, const void *op)
+{
+    pio_def_batch *batch;
+    int msgop = PIO_MSG_PUT_ATT;
+    int namelen = strlen(name);
+    int type_size;
+    PIO_Offset memtype_len;
+    int ierr;
+
+    if ((ierr = batch_start(file)))
+        return ierr;
+    batch = file->def_batch;
+
+    /* Get the length (in bytes) of the type in memory. */
+    if (memtype == PIO_LONG_INTERNAL)
+        memtype_len = sizeof(long int);
+    else
+    {
+        if ((ierr = find_mpi_type(memtype, NULL, &type_size)))
+            return pio_err(NULL, file, ierr, __FILE__, __LINE__);
+        memtype_len = type_size;
+    }
+
+    pio_msgbuf_put(&batch->mb, &msgop, sizeof(int));
+    pio_msgbuf_put(&batch->mb, &varid, sizeof(int));
+    pio_msgbuf_put(&batch->mb, &namelen, sizeof(int));
+    pio_msgbuf_put(&batch->mb, name, namelen + 1);
+    pio_msgbuf_put(&batch->mb, &atttype, sizeof(nc_type));
+    pio_msgbuf_put(&batch->mb, &len, sizeof(PIO_Offset));
+    pio_msgbuf_put(&batch->mb, &memtype, sizeof(nc_type));
+    pio_msgbuf_put(&batch->mb, &memtype_len, sizeof(PIO_Offset));
+    pio_msgbuf_put(&batch->mb, op, len * memtype_len);
+    batch->nops++;
+
+    PLOG((2, "pio_batch_put_att varid = %d name = %s len = %lld", varid, name, len));
+
+    return PIO_NOERR;
+}
+
+/**
+ * Find a deferred dimension by name.
+ *
+ * @param file pointer to the file info.
+ * @param name name of the dimension.
+ * @param idp a pointer that will get the id of the dimension. Ignored
+ * if NULL.
+ * @returns 1 if the dimension was found, 0 otherwise.
+ * @author Jim Edwards
+ */
+int
+pio_batch_inq_dimid(file_desc_t *file, const char *name, int *idp)
+{
+    pio_def_batch *batch = file->def_batch;
+
+    if (batch)
+        for (int d = 0; d < batch->ndims - batch->first_dimid; d++)
+            if (!strcmp(batch->dimnames[d], name))
+            {
+                if (idp)
+                    *idp = batch->first_dimid + d;
+                return 1;
+            }
+
+    return 0;
+}
+
+/**
+ * Learn the name and length of a deferred dimension.
+ *
+ * @param file pointer to the file info.
+ * @param dimid the dimension ID.
+ * @param name pointer that gets the name. Ignored if NULL.
+ * @param lenp pointer that gets the length. Ignored if NULL.
+ * @returns 1 if dimid is a deferred dimension, 0 otherwise.
+ * @author Jim Edwards
+ */
+int
+pio_batch_inq_dim(file_desc_t *file, int dimid, char *name, PIO_Offset *lenp)
+{
+    pio_def_batch *batch = file->def_batch;
+
+    if (!batch || dimid < batch->first_dimid || dimid >= batch->ndims)
+        return 0;
+
+    if (name)
+        strcpy(name, batch->dimnames[dimid - batch->first_dimid]);
+    if (lenp)
+        *lenp = batch->dimlens[dimid - batch->first_dimid];
+
+    return 1;
+}
+
+/**
+ * Find a deferred variable by name.
+ *
+ * @param file pointer to the file info.
+ * @param name name of the variable.
+ * @param varidp a pointer that will get the variable ID. Ignored if
+ * NULL.
+ * @returns 1 if the variable was found, 0 otherwise.
+ * @author Jim Edwards
+ */
+int
+pio_batch_inq_varid(file_desc_t *file, const char *name, int *varidp)
+{
+    pio_def_batch *batch = file->def_batch;
+
+    if (batch)
+        for (int v = 0; v < batch->nvars - batch->first_varid; v++)
+            if (!strcmp(batch->varnames[v], name))
+            {
+                if (varidp)
+                    *varidp = batch->first_varid + v;
+                return 1;
+            }
+
+    return 0;
+}
+
+/**
+ * Learn the unlimited dimensions of a file with deferred calls.
+ *
+ * @param file pointer to the file info.
+ * @param nunlimdimsp pointer that gets the number of unlimited
+ * dimensions. Ignored if NULL.
+ * @param unlimdimidsp pointer that gets the unlimited dimension IDs.
+ * Ignored if NULL.
+ * @returns 1 if the file has deferred calls, 0 otherwise.
+ * @author Jim Edwards
+ */
+int
+pio_batch_inq_unlimdims(file_desc_t *file, int *nunlimdimsp, int *unlimdimidsp)
+{
+    pio_def_batch *batch = file->def_batch;
+
+    if (!batch)
+        return 0;
+
+    if (nunlimdimsp)
+        *nunlimdimsp = batch->nunlimdims;
+    if (unlimdimidsp)
+        for (int d = 0; d < batch->nunlimdims; d++)
+            unlimdimidsp[d] = batch->unlimdimids[d];
+
+    return 1;
+}
+
+/**
+ * Send the define-mode calls deferred for a file to the IO tasks,
+ * which replay them in order, and wait for the result. This is
+ * called on the computation tasks before any other call on the
+ * file. It does nothing if there are no deferred calls.
+ *
+ * @param file pointer to the file info.
+ * @returns 0 for success, or the error from the first deferred call
+ * which failed.
+ * @author Jim Edwards
+ */
+int
+pio_batch_flush(file_desc_t *file)
+{
+    pio_def_batch *batch = file->def_batch;
+    iosystem_desc_t *ios = file->iosystem;
+    int result[2] = {PIO_NOERR, 0}; /* Error code, and the call which failed. */
+    int msg = PIO_MSG_DEF_BATCH;
+    int mpierr = MPI_SUCCESS, mpierr2;
+
+    if (!batch)
+        return PIO_NOERR;
+    file->def_batch = NULL;
+
+    PLOG((1, "pio_batch_flush ncid = %d nops = %d", file->pio_ncid, batch->nops));
+    if (batch->nops)
+    {
+        if (ios->compmain == MPI_ROOT)
+            mpierr = MPI_Send(&msg, 1, MPI_INT, ios->ioroot, 1, ios->union_comm);
+        if (!mpierr)
+            mpierr = pio_msgbuf_send(ios, &batch->mb);
+
+        /* Handle MPI errors. */
+        if ((mpierr2 = MPI_Bcast(&mpierr, 1, MPI_INT, ios->comproot, ios->my_comm)))
+            mpierr = mpierr2;
+
+        /* Get the result of the replay from the IO tasks. */
+        if (!mpierr)
+            mpierr = MPI_Bcast(result, 2, MPI_INT, ios->ioroot, ios->my_comm);
+    }
+    pio_batch_free(batch);
+
+    if (mpierr)
+        return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+    if (result[0])
+    {
+        PLOG((1, "pio_batch_flush deferred call %d failed with %d", result[1], result[0]));
+        return check_netcdf(file, result[0], __FILE__, __LINE__);
+    }
+
+    return PIO_NOERR;
+}
+
+/**
+ * Free the deferred calls and shadow metadata of a file.
+ *
+ * @param batch pointer to the deferred calls. Ignored if NULL.
+ * @author Jim Edwards
+ */
+void
+pio_batch_free(pio_def_batch *batch)
+{
+    if (!batch)
+        return;
+
+    for (int d = 0; d < batch->ndims - batch->first_dimid; d++)
+        free(batch->dimnames[d]);
+    for (int v = 0; v < batch->nvars - batch->first_varid; v++)
+        free(batch->varnames[v]);
+    free(batch->dimnames);
+    free(batch->dimlens);
+    free(batch->varnames);
+    free(batch->unlimdimids);
+    pio_msgbuf_free(&batch->mb);
+    free(batch);
+}
@@ -815,6 +815,55 @@ alloc_region2(iosystem_desc_t *ios, int ndims, io_region **regionp)
     return PIO_NOERR;
 }
 
+/**
+ * Allocate a contiguous array of region structs, and initialize
+ * it. The start and count arrays of all regions are allocated in one
+ * block, and each region is linked to the next one, so the array can
+ * also be used as a list. Free it with free_region_list().
+ *
+ * @param ios pointer to the IO system info, used for error
+ * handling. Ignored if NULL.
+ * @param ndims the number of dimensions for the data in the regions.
+ * @param nregions the number of regions, at least 1.
+ * @param regionp a pointer that gets a pointer to the first region.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+alloc_region_array(iosystem_desc_t *ios, int ndims, int nregions, io_region **regionp)
+{
+    io_region *region;
+    PIO_Offset *block;
+
+    /* Check inputs. */
+    pioassert(ndims >= 0 && nregions > 0 && regionp, "invalid input", __FILE__, __LINE__);
+    PLOG((1, "alloc_region_array ndims = %d nregions = %d", ndims, nregions));
+
+    /* Allocate memory for the io_region structs. */
+    if (!(region = calloc(nregions, sizeof(io_region))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+
+    /* Allocate memory for all the start and count arrays. */
+    if (!(block = calloc(max(1, 2 * ndims * nregions), sizeof(PIO_Offset))))
+    {
+        free(region);
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    }
+
+    for (int r = 0; r < nregions; r++)
+    {
+        region[r].start = block + r * ndims;
+        region[r].count = block + (nregions + r) * ndims;
+        region[r].next = r < nregions - 1 ? &region[r + 1] : NULL;
+    }
+    region->nregions = nregions;
+
+    /* Return pointer to the first region to caller. */
+    *regionp = region;
+
+    return PIO_NOERR;
+}
+
 /**
  * Given a PIO type, find the MPI type and the type size.
  *
@@ -961,6 +1010,7 @@ malloc_iodesc(iosystem_desc_t *ios, int piotype, int ndims,
     (*iodesc)->ioid = -1;
     (*iodesc)->ndims = ndims;
     (*iodesc)->readonly = 0;
+    (*iodesc)->neighbor_comm = MPI_COMM_NULL;
 
     /* Allocate space for, and initialize, the first region. */
     if ((ret = alloc_region2(ios, ndims, &((*iodesc)->firstregion))))
@@ -983,6 +1033,14 @@ free_region_list(io_region *top)
 {
     io_region *ptr, *tptr;
 
+    /* An array from alloc_region_array() is freed with two calls. */
+    if (top && top->nregions)
+    {
+        free(top->start);
+        free(top);
+        return;
+    }
+
     ptr = top;
     while (ptr)
     {
@@ -1011,6 +1069,7 @@ PIOc_freedecomp(int iosysid, int ioid)
     iosystem_desc_t *ios;
     io_desc_t *iodesc;
     int mpierr = MPI_SUCCESS, mpierr2;  /* Return code from MPI function calls. */
+    int ret;
 
     PLOG((1, "PIOc_freedecomp iosysid = %d ioid = %d", iosysid, ioid));
 
@@ -1057,6 +1116,14 @@ PIOc_freedecomp(int iosysid, int ioid)
         free(iodesc->remap);
         iodesc->remap = NULL;
     }
+    free(iodesc->sortbuf);
+    iodesc->sortbuf = NULL;
+    /* Free the cached vector types, which are built on rtype and
+     * stype. */
+    PLOG((3, "freeing type cache"));
+    if ((mpierr = free_type_cache(iodesc)))
+        return pio_err(ios, NULL, mpierr, __FILE__, __LINE__);
+
     PLOG((3, "freeing rfrom, rtype"));
     if (iodesc->rfrom){
         free(iodesc->rfrom);
@@ -1103,10 +1170,33 @@ PIOc_freedecomp(int iosysid, int ioid)
     if (iodesc->fillregion)
         free_region_list(iodesc->fillregion);
 
+    if (iodesc->peers)
+        free(iodesc->peers);
+
+    if (iodesc->neighbor_comm != MPI_COMM_NULL)
+        if ((mpierr = MPI_Comm_free(&iodesc->neighbor_comm)))
+            return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
+
     if (iodesc->rearranger == PIO_REARR_SUBSET)
         if ((mpierr = MPI_Comm_free(&iodesc->subset_comm)))
             return check_mpi(ios, NULL, mpierr, __FILE__, __LINE__);
 
+    /* Free the node level of the hierarchical rearranger. */
+    if ((ret = hier_free(ios, iodesc)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
+    /* Free the shared window of the shared memory comm type. */
+    if ((ret = shm_free(ios, iodesc)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
+    /* Free the windows of the one-sided comm type. */
+    if ((ret = rma_free(ios, iodesc)))
+        return pio_err(ios, NULL, ret, __FILE__, __LINE__);
+
+    /* Free the index lists of the packed comm type. */
+    free(iodesc->pack_sidx);
+    free(iodesc->pack_ridx);
+
     return pio_delete_iodesc_from_list(ioid);
 }
 
@@ -2085,6 +2175,8 @@ PIOc_createfile_int(int iosysid, int *ncidp, int *iotype, const char *filename,
     file->iotype = *iotype;
     file->buffer = NULL;
     file->writable = 1;
+    file->multiwriter = ios->multiwriter && !ios->async &&
+        file->iotype == PIO_IOTYPE_NETCDF;
 
     /* Set to true if this task should participate in IO (only true for
      * one task with netcdf serial files. */
@@ -2161,6 +2253,10 @@ PIOc_createfile_int(int iosysid, int *ncidp, int *iotype, const char *filename,
         case PIO_IOTYPE_NETCDF:
             if (!ios->io_rank)
             {
+                /* Other IO tasks write the data of multi-writer
+                 * files, so netCDF must not buffer them. */
+                if (file->multiwriter)
+                    mode |= NC_SHARE;
 //                PIOc_set_log_level(3);
                 PLOG((2, "Calling nc_create mode = %d", mode));
                 ierr = nc_create(filename, mode, &file->fh);
@@ -2173,6 +2269,11 @@ PIOc_createfile_int(int iosysid, int *ncidp, int *iotype, const char *filename,
             ierr = ncmpi_create(ios->io_comm, filename, mode, ios->info, &file->fh);
             if (!ierr)
                 ierr = ncmpi_buffer_attach(file->fh, pio_pnetcdf_buffer_size_limit);
+            if (!ierr)
+            {
+                file->attached_bytes = pio_pnetcdf_buffer_size_limit;
+                pio_mem_add(ios, file->attached_bytes);
+            }
             break;
 #endif
         }
@@ -2194,6 +2295,10 @@ PIOc_createfile_int(int iosysid, int *ncidp, int *iotype, const char *filename,
     if ((mpierr = MPI_Bcast(&file->writable, 1, MPI_INT, ios->ioroot, ios->my_comm)))
         return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
 
+    /* Open the file on all IO tasks for the multi-writer mode. */
+    if ((ierr = multiwriter_open(file, filename)))
+        return pio_err(ios, file, ierr, __FILE__, __LINE__);
+
     /* Broadcast next ncid to all tasks from io root, necessary
      * because files may be opened on mutilple iosystems, causing the
      * underlying library to reuse ncids. Hilarious confusion
@@ -2664,6 +2769,8 @@ PIOc_openfile_retry(int iosysid, int *ncidp, int *iotype, const char *filename,
     file->iotype = *iotype;
     file->iosystem = ios;
     file->writable = (mode & PIO_WRITE) ? 1 : 0;
+    file->multiwriter = ios->multiwriter && !ios->async && file->writable &&
+        file->iotype == PIO_IOTYPE_NETCDF;
 
     /* Set to true if this task should participate in IO (only true
      * for one task with netcdf serial files. */
@@ -2768,7 +2875,8 @@ PIOc_openfile_retry(int iosysid, int *ncidp, int *iotype, const char *filename,
         case PIO_IOTYPE_NETCDF:
             if (ios->io_rank == 0)
             {
-                if ((ierr = nc_open(filename, mode, &file->fh)))
+                if ((ierr = nc_open(filename, file->multiwriter ? mode | NC_SHARE : mode,
+                                    &file->fh)))
                     break;
                 ierr = inq_file_metadata(file, file->fh, PIO_IOTYPE_NETCDF,
                                          &nvars, &rec_var, &pio_type,
@@ -2790,6 +2898,11 @@ PIOc_openfile_retry(int iosysid, int *ncidp, int *iotype, const char *filename,
                     PLOG((2, "%d Setting IO buffer %ld", __LINE__,
                           pio_pnetcdf_buffer_size_limit));
                 ierr = ncmpi_buffer_attach(file->fh, pio_pnetcdf_buffer_size_limit);
+                if (!ierr)
+                {
+                    file->attached_bytes = pio_pnetcdf_buffer_size_limit;
+                    pio_mem_add(ios, file->attached_bytes);
+                }
             }
             PLOG((2, "ncmpi_open(%s) : fd = %d", filename, file->fh));
 
@@ -2862,6 +2975,10 @@ PIOc_openfile_retry(int iosysid, int *ncidp, int *iotype, const char *filename,
     if ((mpierr = MPI_Bcast(&file->writable, 1, MPI_INT, ios->ioroot, ios->my_comm)))
         return check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
 
+    /* Open the file on all IO tasks for the multi-writer mode. */
+    if ((ierr = multiwriter_open(file, filename)))
+        return pio_err(ios, file, ierr, __FILE__, __LINE__);
+
     /* Broadcast some values to all tasks from io root. */
     if (ios->async)
     {
@@ -3046,6 +3163,10 @@ pioc_change_def(int ncid, int is_enddef)
         return pio_err(NULL, NULL, ierr, __FILE__, __LINE__);
     ios = file->iosystem;
 
+    /* Send any define-mode calls deferred for this file first. */
+    if ((ierr = pio_batch_flush(file)))
+        return ierr;
+
     /* If async is in use, and this is not an IO task, bcast the parameters. */
     if (ios->async)
     {
@@ -3085,7 +3206,15 @@ pioc_change_def(int ncid, int is_enddef)
                 ierr = ncmpi_redef(file->fh);
         }
 #endif /* _PNETCDF */
-        if (file->iotype != PIO_IOTYPE_PNETCDF && file->do_io)
+        /* The header of a multi-writer file may change, and netCDF
+         * may move data written by other IO tasks. */
+        if (file->multiwriter)
+        {
+            multiwriter_free_layout(file);
+            if ((mpierr = MPI_File_sync(file->mw_fh)) && !ierr)
+                ierr = check_mpi(NULL, file, mpierr, __FILE__, __LINE__);
+        }
+        if (file->iotype != PIO_IOTYPE_PNETCDF && file->do_io && !ierr)
         {
             if (is_enddef)
             {
@@ -3153,6 +3282,20 @@ iotype_is_valid(int iotype)
  * Possible values are :
  * PIO_REARR_COMM_P2P (Point to point communication)
  * PIO_REARR_COMM_COLL (Collective communication)
+ * PIO_REARR_COMM_SPARSE (Point to point communication with only the
+ * tasks that exchange data)
+ * PIO_REARR_COMM_NEIGHBOR (MPI neighborhood collective over the tasks
+ * that exchange data)
+ * PIO_REARR_COMM_SHM (Point to point communication with only the
+ * tasks that exchange data, except that IO tasks copy the data of
+ * compute tasks on the same node from a shared memory window when
+ * writing)
+ * PIO_REARR_COMM_RMA (One-sided communication into windows on the
+ * IO tasks)
+ * PIO_REARR_COMM_ALLTOALLV (Collective MPI_Alltoallv() on buffers
+ * packed with the index lists of the decomposition)
+ * PIO_REARR_COMM_PERSIST (Point to point with persistent requests,
+ * made once for each number of variables and pair of buffers)
  * @param fcd Flow control direction for the rearranger.
  * See PIO_REARR_COMM_FC_DIR for more detail.
  * Possible values are :
@@ -3177,6 +3320,7 @@ iotype_is_valid(int iotype)
  * @param max_pend_req_i2c Maximum pending requests during
  * data rearragment from io processes to compute processes
  * @return 0 on success, otherwise a PIO error code.
+ * @ingroup PIO_rearr_opts_c
  * @author Jayesh Krishna
  */
 int
@@ -3193,7 +3337,7 @@ PIOc_set_rearr_opts(int iosysid, int comm_type, int fcd, bool enable_hs_c2i,
     };
 
     /* Check inputs. */
-    if ((comm_type != PIO_REARR_COMM_P2P && comm_type != PIO_REARR_COMM_FC_1D_COMP2IO) ||
+    if ((comm_type < PIO_REARR_COMM_P2P || comm_type > PIO_REARR_COMM_PERSIST) ||
         (fcd < 0 || fcd > PIO_REARR_COMM_FC_2D_DISABLE) ||
         (max_pend_req_c2i != PIO_REARR_COMM_UNLIMITED_PEND_REQ && max_pend_req_c2i < 0) ||
         (max_pend_req_i2c != PIO_REARR_COMM_UNLIMITED_PEND_REQ && max_pend_req_i2c < 0))
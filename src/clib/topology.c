@@ -361,3 +361,218 @@ int bgq_pset_info (MPI_Comm comm, int* tot_pset, int* psetID, int* pset_size, in
 }
 
 #endif
+
+/*
+ * Node-aware placement of IO tasks. This uses only MPI-3, so it works
+ * on any system (including oversubscribed runs on one node).
+ */
+#include <config.h>
+#include <pio.h>
+#include <pio_internal.h>
+
+/**
+ * Compare two ints, for qsort().
+ *
+ * @param a pointer to first int.
+ * @param b pointer to second int.
+ * @returns -1, 0 or 1.
+ * @author Jim Edwards
+ */
+static int
+compare_ints(const void *a, const void *b)
+{
+    int ia = *(const int *)a;
+    int ib = *(const int *)b;
+
+    return (ia > ib) - (ia < ib);
+}
+
+/**
+ * Choose the IO tasks, given the node of each task. The IO tasks are
+ * spread evenly across the nodes: each node gets at most
+ * iotasks_per_node of them, and no node gets a second IO task until
+ * every node has one (and so on). Within a node the IO tasks are
+ * spread evenly over the tasks of that node, so that they are likely
+ * to be on different sockets.
+ *
+ * @param ntasks the number of tasks.
+ * @param node_of_task array of length ntasks with the node number of
+ * each task. Node numbers are 0 to (number of nodes - 1), and the
+ * tasks of a node are in increasing rank order.
+ * @param iotasks_per_node the maximum number of IO tasks on a node.
+ * @param num_iotasksp pointer to the number of IO tasks wanted, 0 for
+ * iotasks_per_node on every node. Gets the number of IO tasks chosen.
+ * @param ioranks array that gets the ranks of the IO tasks, in
+ * increasing order. Must have room for *num_iotasksp elements, or
+ * for ntasks elements if *num_iotasksp is 0.
+ * @returns 0 for success, PIO_EINVAL if there are not enough tasks,
+ * PIO_ENOMEM if out of memory.
+ * @author Jim Edwards
+ */
+int
+pio_select_node_ioranks(int ntasks, const int *node_of_task, int iotasks_per_node,
+                        int *num_iotasksp, int *ioranks)
+{
+    int nnodes = 0;
+    int *node_start;  /* Index in node_tasks of first task of each node. */
+    int *node_tasks;  /* The tasks, grouped by node. */
+    int *node_nio;    /* Number of IO tasks allowed on each node. */
+    int *eligible;    /* Nodes which get an IO task in this round. */
+    int max_iotasks = 0;
+    int num_iotasks;
+    int n = 0;
+
+    pioassert(ntasks > 0 && node_of_task && num_iotasksp && ioranks,
+              "invalid input", __FILE__, __LINE__);
+    if (iotasks_per_node < 1 || *num_iotasksp < 0)
+        return PIO_EINVAL;
+
+    for (int t = 0; t < ntasks; t++)
+        if (node_of_task[t] + 1 > nnodes)
+            nnodes = node_of_task[t] + 1;
+
+    if (!(node_start = calloc(nnodes + 1, sizeof(int))))
+        return PIO_ENOMEM;
+    if (!(node_tasks = malloc(ntasks * sizeof(int))))
+    {
+        free(node_start);
+        return PIO_ENOMEM;
+    }
+    if (!(node_nio = malloc(nnodes * sizeof(int))) ||
+        !(eligible = malloc(nnodes * sizeof(int))))
+    {
+        free(node_start);
+        free(node_tasks);
+        free(node_nio);
+        return PIO_ENOMEM;
+    }
+
+    /* Group the tasks by node, keeping rank order within a node. */
+    for (int t = 0; t < ntasks; t++)
+        node_start[node_of_task[t] + 1]++;
+    for (int nd = 0; nd < nnodes; nd++)
+        node_start[nd + 1] += node_start[nd];
+    for (int nd = 0; nd < nnodes; nd++)
+        node_nio[nd] = node_start[nd];
+    for (int t = 0; t < ntasks; t++)
+        node_tasks[node_nio[node_of_task[t]]++] = t;
+
+    /* How many IO tasks can each node have? */
+    for (int nd = 0; nd < nnodes; nd++)
+    {
+        int node_ntasks = node_start[nd + 1] - node_start[nd];
+
+        node_nio[nd] = node_ntasks < iotasks_per_node ? node_ntasks : iotasks_per_node;
+        max_iotasks += node_nio[nd];
+    }
+
+    num_iotasks = *num_iotasksp ? *num_iotasksp : max_iotasks;
+    if (num_iotasks > max_iotasks)
+    {
+        free(node_start);
+        free(node_tasks);
+        free(node_nio);
+        free(eligible);
+        return PIO_EINVAL;
+    }
+
+    /* In round k, the nodes which may have k+1 IO tasks each get
+     * their (k+1)th IO task. In the last round, there may be fewer
+     * IO tasks left than such nodes, so pick nodes spaced evenly
+     * among them. */
+    for (int k = 0; n < num_iotasks; k++)
+    {
+        int neligible = 0;
+        int need;
+
+        for (int nd = 0; nd < nnodes; nd++)
+            if (node_nio[nd] > k)
+                eligible[neligible++] = nd;
+        need = num_iotasks - n < neligible ? num_iotasks - n : neligible;
+
+        for (int j = 0; j < need; j++)
+        {
+            int nd = eligible[(int)((long long)j * neligible / need)];
+            int node_ntasks = node_start[nd + 1] - node_start[nd];
+
+            /* The kth IO task of this node is spaced evenly over the
+             * tasks of the node. */
+            ioranks[n++] = node_tasks[node_start[nd] + (int)((long long)k * node_ntasks / node_nio[nd])];
+        }
+    }
+    qsort(ioranks, num_iotasks, sizeof(int), compare_ints);
+    *num_iotasksp = num_iotasks;
+
+    PLOG((2, "pio_select_node_ioranks ntasks = %d nnodes = %d iotasks_per_node = %d "
+          "num_iotasks = %d", ntasks, nnodes, iotasks_per_node, num_iotasks));
+
+    free(node_start);
+    free(node_tasks);
+    free(node_nio);
+    free(eligible);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Find the node of every task in a communicator. Tasks which share
+ * memory (as found by MPI_Comm_split_type() with
+ * MPI_COMM_TYPE_SHARED) are on the same node. Nodes are numbered in
+ * the order of their lowest rank.
+ *
+ * This is collective on comm.
+ *
+ * @param comm the communicator.
+ * @param node_of_task array of length (size of comm) that gets the
+ * node number of each task.
+ * @param nnodesp pointer that gets the number of nodes. Ignored if
+ * NULL.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+pio_get_node_of_task(MPI_Comm comm, int *node_of_task, int *nnodesp)
+{
+    MPI_Comm node_comm;
+    int rank, ntasks;
+    int leader;      /* Rank in comm of the lowest rank on my node. */
+    int nnodes = 0;
+    int mpierr;
+
+    if ((mpierr = MPI_Comm_rank(comm, &rank)))
+        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+    if ((mpierr = MPI_Comm_size(comm, &ntasks)))
+        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+
+    /* Find the tasks on my node. With rank as the key, rank 0 of
+     * node_comm is the lowest rank on the node. */
+    if ((mpierr = MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL,
+                                      &node_comm)))
+        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+    leader = rank;
+    mpierr = MPI_Bcast(&leader, 1, MPI_INT, 0, node_comm);
+    MPI_Comm_free(&node_comm);
+    if (mpierr)
+        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+
+    /* Everyone learns the leader of every task. */
+    if ((mpierr = MPI_Allgather(&leader, 1, MPI_INT, node_of_task, 1, MPI_INT, comm)))
+        return check_mpi(NULL, NULL, mpierr, __FILE__, __LINE__);
+
+    /* Number the nodes. A leader is always the first task of its
+     * node, so its node number is known before its other tasks are
+     * reached. */
+    for (int t = 0; t < ntasks; t++)
+    {
+        if (node_of_task[t] == t)
+            node_of_task[t] = nnodes++;
+        else
+            node_of_task[t] = node_of_task[node_of_task[t]];
+    }
+    PLOG((2, "pio_get_node_of_task ntasks = %d nnodes = %d", ntasks, nnodes));
+
+    if (nnodesp)
+        *nnodesp = nnodes;
+
+    return PIO_NOERR;
+}
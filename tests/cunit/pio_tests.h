@@ -120,6 +120,49 @@ int run_test_main(int argc, char **argv, int min_ntasks, int max_ntasks,
                   int log_level, char *test_name, int *dim_len, int component_count,
                   int num_io_procs);
 
+/* The layouts of the maps of perf_decomp_map(). */
+#define PERF_MAP_BLOCK 0
+#define PERF_MAP_SPLIT 1
+#define PERF_MAP_INTERLEAVED 2
+
+/* The most variables perf_write_file() and perf_read_file() take. */
+#define PERF_MAX_VARS 16
+
+/* A case of a perf test, as passed by run_perf_cases() to the
+ * function that runs it. */
+typedef struct perf_case_t
+{
+    int iosysid;               /* The IO system of the case. */
+    int ioid;                  /* The decomposition, or -1. */
+    int num_io_procs;          /* Number of IO tasks. */
+    int variant;               /* Index of the variant of the test. */
+    int my_rank;               /* Rank of this task in test_comm. */
+    int ntasks;                /* Number of tasks in test_comm. */
+    MPI_Comm test_comm;        /* The communicator the test is running on. */
+    const int *dim_len;        /* The NDIM2 dimensions of the decomposition. */
+    PIO_Offset maplen;         /* Length of the map of this task. */
+    const PIO_Offset *compdof; /* The map of this task, or NULL. */
+} perf_case_t;
+
+/* The function that runs a case of a perf test. */
+typedef int (*perf_case_fn)(const perf_case_t *pc);
+
+/* Shared setup, timing and checks of the perf tests. */
+int perf_decomp_map(int my_rank, int ntasks, PIO_Offset gsize, int layout,
+                    PIO_Offset *maplenp, PIO_Offset **compdofp);
+int perf_start(MPI_Comm test_comm, double *startp);
+int perf_max_time(MPI_Comm test_comm, double local_sec, double *max_secp);
+double perf_value(int t, int v, PIO_Offset dof);
+int perf_create_file(const perf_case_t *pc, const char *filename, int nvars, int *ncidp,
+                     int *varid);
+int perf_write_file(const perf_case_t *pc, const char *filename, int nvars, int ntimesteps,
+                    double *write_secp);
+int perf_read_file(const perf_case_t *pc, const char *filename, int nvars, int ntimesteps,
+                   double *read_secp);
+int run_perf_cases(MPI_Comm test_comm, int num_io_tests, const int *num_io_procs, int nvariants,
+                   const int *rearranger, const int *comm_type, const int *dim_len,
+                   PIO_Offset maplen, const PIO_Offset *compdof, perf_case_fn run_case);
+
 /* Create a 2D decomposition used in some tests. */
 int create_decomposition_2d(int ntasks, int my_rank, int iosysid, int *dim_len_2d, int *ioid,
                             int pio_type);
@@ -84,29 +84,42 @@ int main(int argc, char **argv)
          * and when the do, they should go straight to finalize. */
         if (comp_task)
         {
-            for (int flv = 0; flv < num_flavors; flv++)
+            /* Check for invalid values. */
+            if (PIOc_set_batch_define(iosysid[0] + TEST_VAL_42, 1) != PIO_EBADID)
+                ERR(ERR_WRONG);
+
+            /* Create the sample files with each call sent as it is
+             * made, and then with define-mode calls deferred. */
+            for (int batch = 0; batch < 2; batch++)
             {
-                int my_comp_idx = my_rank - 1; /* Index in iosysid array. */
+                if ((ret = PIOc_set_batch_define(iosysid[0], batch)))
+                    ERR(ret);
 
-                for (int sample = 0; sample < NUM_SAMPLES; sample++)
+                for (int flv = 0; flv < num_flavors; flv++)
                 {
-                    char filename[PIO_MAX_NAME * 2 + 1]; /* Test filename. */
-                    char iotype_name[PIO_MAX_NAME + 1];
-
-                    /* Create a filename. */
-                    if ((ret = get_iotype_name(flavor[flv], iotype_name)))
-                        return ret;
-                    sprintf(filename, "%s_%s_%d_%d.nc", TEST_NAME, iotype_name, sample, my_comp_idx);
-
-                    /* Create sample file. */
-                    if ((ret = create_nc_sample(sample, iosysid[my_comp_idx], flavor[flv], filename, my_rank, NULL)))
-                        AERR2(ret, iosysid[my_comp_idx]);
-
-                    /* Check the file for correctness. */
-                    if ((ret = check_nc_sample(sample, iosysid[my_comp_idx], flavor[flv], filename, my_rank, NULL)))
-                        AERR2(ret, iosysid[my_comp_idx]);
-                }
-            } /* next netcdf flavor */
+                    int my_comp_idx = my_rank - 1; /* Index in iosysid array. */
+
+                    for (int sample = 0; sample < NUM_SAMPLES; sample++)
+                    {
+                        char filename[PIO_MAX_NAME * 2 + 1]; /* Test filename. */
+                        char iotype_name[PIO_MAX_NAME + 1];
+
+                        /* Create a filename. */
+                        if ((ret = get_iotype_name(flavor[flv], iotype_name)))
+                            return ret;
+                        sprintf(filename, "%s_%s_%d_%d_%d.nc", TEST_NAME, iotype_name, sample,
+                                my_comp_idx, batch);
+
+                        /* Create sample file. */
+                        if ((ret = create_nc_sample(sample, iosysid[my_comp_idx], flavor[flv], filename, my_rank, NULL)))
+                            AERR2(ret, iosysid[my_comp_idx]);
+
+                        /* Check the file for correctness. */
+                        if ((ret = check_nc_sample(sample, iosysid[my_comp_idx], flavor[flv], filename, my_rank, NULL)))
+                            AERR2(ret, iosysid[my_comp_idx]);
+                    }
+                } /* next netcdf flavor */
+            } /* next batch mode */
 
             /* Finalize the IO system. Only call this from the computation tasks. */
             for (int c = 0; c < COMPONENT_COUNT; c++)
@@ -1550,3 +1550,380 @@ int check_nc_sample_4(int iosysid, int iotype, int my_rank, int my_comp_idx,
         ERR(ret);
     return 0;
 }
+
+/* The dimension names of the files written by the perf tests. */
+static const char *perf_dim_name[NDIM3] = {"timestep", "y", "x"};
+
+/**
+ * Make the map of this task for a perf test, over a global array of
+ * gsize elements.
+ *
+ * @param my_rank rank of this task.
+ * @param ntasks number of tasks.
+ * @param gsize number of elements of the global array.
+ * @param layout PERF_MAP_BLOCK for a contiguous block on each task,
+ * PERF_MAP_SPLIT for a block split in two halves, one in each half of
+ * the array, or PERF_MAP_INTERLEAVED for elements spread over the
+ * whole array, so every task has data for every IO task.
+ * @param maplenp pointer that gets the length of the map.
+ * @param compdofp pointer that gets the map, which must be freed by
+ * the caller.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+perf_decomp_map(int my_rank, int ntasks, PIO_Offset gsize, int layout,
+                PIO_Offset *maplenp, PIO_Offset **compdofp)
+{
+    PIO_Offset maplen = gsize / ntasks;
+    PIO_Offset *compdof;
+
+    if (!(compdof = malloc(max(1, maplen) * sizeof(PIO_Offset))))
+        return PIO_ENOMEM;
+    for (PIO_Offset i = 0; i < maplen; i++)
+    {
+        switch (layout)
+        {
+        case PERF_MAP_BLOCK:
+            compdof[i] = my_rank * maplen + i + 1;
+            break;
+        case PERF_MAP_SPLIT:
+            compdof[i] = i < maplen / 2 ? my_rank * maplen / 2 + i + 1 :
+                (ntasks + my_rank) * maplen / 2 + i - maplen / 2 + 1;
+            break;
+        default:
+            compdof[i] = i * ntasks + my_rank + 1;
+        }
+    }
+    *maplenp = maplen;
+    *compdofp = compdof;
+
+    return PIO_NOERR;
+}
+
+/**
+ * Start timing part of a perf test. The tasks are synchronized
+ * first, so they all start together.
+ *
+ * @param test_comm the communicator the test is running on.
+ * @param startp pointer that gets the start time.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+perf_start(MPI_Comm test_comm, double *startp)
+{
+    int mpierr;
+
+    if ((mpierr = MPI_Barrier(test_comm)))
+        MPIERR(mpierr);
+    *startp = MPI_Wtime();
+
+    return PIO_NOERR;
+}
+
+/**
+ * Get the time of the slowest task, which is the time of a
+ * collective operation.
+ *
+ * @param test_comm the communicator the test is running on.
+ * @param local_sec the time on this task.
+ * @param max_secp pointer that gets the time of the slowest task, on
+ * task 0.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+perf_max_time(MPI_Comm test_comm, double local_sec, double *max_secp)
+{
+    int mpierr;
+
+    if ((mpierr = MPI_Reduce(&local_sec, max_secp, 1, MPI_DOUBLE, MPI_MAX, 0, test_comm)))
+        MPIERR(mpierr);
+
+    return PIO_NOERR;
+}
+
+/**
+ * The value of an element of the data of the perf tests.
+ *
+ * @param t the timestep.
+ * @param v the variable.
+ * @param dof the 1 based global index of the element.
+ * @returns the value.
+ * @author Jim Edwards
+ */
+double
+perf_value(int t, int v, PIO_Offset dof)
+{
+    return t * 1000000.0 + v * 100000.0 + dof;
+}
+
+/**
+ * Create a PIO_IOTYPE_NETCDF file for a perf test, with nvars double
+ * record variables over the dimensions of the decomposition.
+ *
+ * @param pc the case of the perf test.
+ * @param filename the name of the file.
+ * @param nvars number of variables.
+ * @param ncidp pointer that gets the ncid of the file.
+ * @param varid array of length nvars that gets the variable IDs.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+perf_create_file(const perf_case_t *pc, const char *filename, int nvars, int *ncidp,
+                 int *varid)
+{
+    char var_name[PIO_MAX_NAME + 1];
+    int iotype = PIO_IOTYPE_NETCDF;
+    int dimids[NDIM3];
+    int my_rank = pc->my_rank;
+    int ret;
+
+    if ((ret = PIOc_createfile(pc->iosysid, ncidp, &iotype, filename, PIO_CLOBBER)))
+        ERR(ret);
+    for (int d = 0; d < NDIM3; d++)
+        if ((ret = PIOc_def_dim(*ncidp, perf_dim_name[d], d ? pc->dim_len[d - 1] : NC_UNLIMITED,
+                                &dimids[d])))
+            ERR(ret);
+    for (int v = 0; v < nvars; v++)
+    {
+        sprintf(var_name, "var_%d", v);
+        if ((ret = PIOc_def_var(*ncidp, var_name, PIO_DOUBLE, NDIM3, dimids, &varid[v])))
+            ERR(ret);
+    }
+    if ((ret = PIOc_enddef(*ncidp)))
+        ERR(ret);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Write ntimesteps records of nvars variables with the decomposition
+ * of a perf test, and get the time taken, with the close of the
+ * file. One variable is written with PIOc_write_darray(), more with
+ * PIOc_write_darray_multi().
+ *
+ * @param pc the case of the perf test.
+ * @param filename the name of the file.
+ * @param nvars number of variables, at most PERF_MAX_VARS.
+ * @param ntimesteps number of records.
+ * @param write_secp pointer that gets the time of the slowest task,
+ * on task 0.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+perf_write_file(const perf_case_t *pc, const char *filename, int nvars, int ntimesteps,
+                double *write_secp)
+{
+    int ncid;
+    int varid[PERF_MAX_VARS];
+    int frame[PERF_MAX_VARS];
+    double *data;
+    double start;
+    int my_rank = pc->my_rank;
+    int ret;
+
+    if (nvars > PERF_MAX_VARS)
+        return PIO_EINVAL;
+    if (!(data = malloc(max(1, nvars * pc->maplen) * sizeof(double))))
+        return PIO_ENOMEM;
+
+    if ((ret = perf_create_file(pc, filename, nvars, &ncid, varid)))
+        return ret;
+
+    if ((ret = perf_start(pc->test_comm, &start)))
+        return ret;
+    for (int t = 0; t < ntimesteps; t++)
+    {
+        for (int v = 0; v < nvars; v++)
+        {
+            frame[v] = t;
+            for (PIO_Offset i = 0; i < pc->maplen; i++)
+                data[v * pc->maplen + i] = perf_value(t, v, pc->compdof[i]);
+        }
+        if (nvars == 1)
+        {
+            if ((ret = PIOc_setframe(ncid, varid[0], t)))
+                ERR(ret);
+            if ((ret = PIOc_write_darray(ncid, varid[0], pc->ioid, pc->maplen, data, NULL)))
+                ERR(ret);
+        }
+        else if ((ret = PIOc_write_darray_multi(ncid, varid, pc->ioid, nvars, pc->maplen, data,
+                                                frame, NULL, false)))
+            ERR(ret);
+    }
+    if ((ret = PIOc_closefile(ncid)))
+        ERR(ret);
+    if ((ret = perf_max_time(pc->test_comm, MPI_Wtime() - start, write_secp)))
+        return ret;
+
+    free(data);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Read back and check the file of a perf test, written by
+ * perf_write_file() or with the same values, and get the time
+ * taken. One variable is read with PIOc_read_darray(), more with
+ * PIOc_read_darray_multi().
+ *
+ * @param pc the case of the perf test.
+ * @param filename the name of the file.
+ * @param nvars number of variables, at most PERF_MAX_VARS.
+ * @param ntimesteps number of records.
+ * @param read_secp pointer that gets the time of the slowest task,
+ * on task 0. Ignored if NULL.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+perf_read_file(const perf_case_t *pc, const char *filename, int nvars, int ntimesteps,
+               double *read_secp)
+{
+    int iotype = PIO_IOTYPE_NETCDF;
+    int ncid;
+    int varid[PERF_MAX_VARS];
+    int frame[PERF_MAX_VARS];
+    double *data_in;
+    double start, max_sec;
+    int my_rank = pc->my_rank;
+    int ret;
+
+    if (nvars > PERF_MAX_VARS)
+        return PIO_EINVAL;
+    if (!(data_in = malloc(max(1, nvars * pc->maplen) * sizeof(double))))
+        return PIO_ENOMEM;
+
+    if ((ret = PIOc_openfile(pc->iosysid, &ncid, &iotype, filename, PIO_NOWRITE)))
+        ERR(ret);
+    for (int v = 0; v < nvars; v++)
+    {
+        char var_name[PIO_MAX_NAME + 1];
+
+        sprintf(var_name, "var_%d", v);
+        if ((ret = PIOc_inq_varid(ncid, var_name, &varid[v])))
+            ERR(ret);
+    }
+
+    if ((ret = perf_start(pc->test_comm, &start)))
+        return ret;
+    for (int t = 0; t < ntimesteps; t++)
+    {
+        for (int v = 0; v < nvars; v++)
+            frame[v] = t;
+        if (nvars == 1)
+        {
+            if ((ret = PIOc_setframe(ncid, varid[0], t)))
+                ERR(ret);
+            if ((ret = PIOc_read_darray(ncid, varid[0], pc->ioid, pc->maplen, data_in)))
+                ERR(ret);
+        }
+        else if ((ret = PIOc_read_darray_multi(ncid, nvars, varid, pc->ioid, frame, data_in)))
+            ERR(ret);
+        for (int v = 0; v < nvars; v++)
+            for (PIO_Offset i = 0; i < pc->maplen; i++)
+                if (data_in[v * pc->maplen + i] != perf_value(t, v, pc->compdof[i]))
+                    ERR(ERR_WRONG);
+    }
+    if ((ret = perf_max_time(pc->test_comm, MPI_Wtime() - start, &max_sec)))
+        return ret;
+    if (read_secp)
+        *read_secp = max_sec;
+    if ((ret = PIOc_closefile(ncid)))
+        ERR(ret);
+
+    free(data_in);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Run the cases of a perf test. For each number of IO tasks which is
+ * not more than the number of tasks, and each variant of the test, an
+ * IO system is created with the rearranger and comm type of the
+ * variant, and a decomposition of doubles if a map is given. The case
+ * is then run, and the decomposition and IO system are freed.
+ *
+ * @param test_comm the communicator the test is running on.
+ * @param num_io_tests number of entries in num_io_procs.
+ * @param num_io_procs the numbers of IO tasks, in increasing order.
+ * @param nvariants number of variants of each case.
+ * @param rearranger the rearranger of each variant, or NULL for
+ * PIO_REARR_BOX.
+ * @param comm_type the rearranger comm type of each variant, or NULL
+ * for the default.
+ * @param dim_len array of length NDIM2 with the dimensions of the
+ * decomposition, which are also the non-record dimensions of the
+ * files.
+ * @param maplen length of the map of this task.
+ * @param compdof the map of this task, or NULL for no decomposition.
+ * @param run_case the function that runs a case.
+ * @returns 0 for success, error code otherwise.
+ * @author Jim Edwards
+ */
+int
+run_perf_cases(MPI_Comm test_comm, int num_io_tests, const int *num_io_procs, int nvariants,
+               const int *rearranger, const int *comm_type, const int *dim_len,
+               PIO_Offset maplen, const PIO_Offset *compdof, perf_case_fn run_case)
+{
+    perf_case_t pc;
+    int ioproc_stride = 1;    /* Stride in the mpi rank between io tasks. */
+    int ioproc_start = 0;     /* Zero based rank of first processor to be used for I/O. */
+    int mpierr;
+    int ret;
+
+    if ((mpierr = MPI_Comm_rank(test_comm, &pc.my_rank)))
+        MPIERR(mpierr);
+    if ((mpierr = MPI_Comm_size(test_comm, &pc.ntasks)))
+        MPIERR(mpierr);
+    pc.test_comm = test_comm;
+    pc.dim_len = dim_len;
+    pc.maplen = maplen;
+    pc.compdof = compdof;
+
+    for (int i = 0; i < num_io_tests && num_io_procs[i] <= pc.ntasks; i++)
+    {
+        for (int v = 0; v < nvariants; v++)
+        {
+            int rearr = rearranger ? rearranger[v] : PIO_REARR_BOX;
+
+            pc.num_io_procs = num_io_procs[i];
+            pc.variant = v;
+            pc.ioid = -1;
+
+            if ((ret = PIOc_Init_Intracomm(test_comm, num_io_procs[i], ioproc_stride,
+                                           ioproc_start, rearr, &pc.iosysid)))
+                return ret;
+
+            /* The decomposition takes the comm type of the IO system. */
+            if (comm_type)
+                if ((ret = PIOc_set_rearr_opts(pc.iosysid, comm_type[v],
+                                               PIO_REARR_COMM_FC_2D_DISABLE, false, false,
+                                               PIO_REARR_COMM_UNLIMITED_PEND_REQ, false, false,
+                                               PIO_REARR_COMM_UNLIMITED_PEND_REQ)))
+                    return ret;
+
+            if (compdof)
+                if ((ret = PIOc_init_decomp(pc.iosysid, PIO_DOUBLE, NDIM2, dim_len, maplen,
+                                            compdof, &pc.ioid, rearr, NULL, NULL)))
+                    return ret;
+
+            if ((ret = run_case(&pc)))
+                return ret;
+
+            if (compdof)
+                if ((ret = PIOc_freedecomp(pc.iosysid, pc.ioid)))
+                    return ret;
+
+            /* Finalize PIO system. */
+            if ((ret = PIOc_free_iosystem(pc.iosysid)))
+                return ret;
+        }
+    } /* next num io procs */
+
+    return PIO_NOERR;
+}
@@ -42,8 +42,10 @@
 #define VAR_NAME "Billy-Bob"
 #define VAR_NAME2 "Sally-Sue"
 
-/* Test cases relating to PIOc_write_darray_multi(). */
-#define NUM_TEST_CASES_WRT_MULTI 3
+/* Test cases relating to PIOc_write_darray_multi(). The last one
+ * uses PIOc_iwrite_darray(). */
+#define NUM_TEST_CASES_WRT_MULTI 4
+#define TEST_IWRITE (NUM_TEST_CASES_WRT_MULTI - 1)
 
 /* Test with and without specifying a fill value to
  * PIOc_write_darray(). */
@@ -210,6 +212,55 @@ int test_darray(int iosysid, int ioid, int num_flavors, int *flavor, int my_rank
                         ERR(ret);
 
                 }
+                else if (test_multi == TEST_IWRITE)
+                {
+                    PIO_Request req[2] = {PIO_REQ_NULL, PIO_REQ_NULL};
+                    int flag;
+
+                    /* These should not work. */
+                    if (PIOc_iwrite_darray(ncid + TEST_VAL_42, varid, ioid, arraylen, test_data, fillvalue,
+                                           &req[0]) != PIO_EBADID)
+                        ERR(ERR_WRONG);
+                    if (PIOc_iwrite_darray(ncid, varid, ioid + TEST_VAL_42, arraylen, test_data, fillvalue,
+                                           &req[0]) != PIO_EBADID)
+                        ERR(ERR_WRONG);
+                    if (PIOc_iwrite_darray(ncid, varid, ioid, arraylen - 1, test_data, fillvalue,
+                                           &req[0]) != PIO_EINVAL)
+                        ERR(ERR_WRONG);
+                    if (PIOc_iwrite_darray(ncid, varid, ioid, arraylen, test_data, fillvalue, NULL) != PIO_EINVAL)
+                        ERR(ERR_WRONG);
+                    if (PIOc_wait(NULL) != PIO_EINVAL)
+                        ERR(ERR_WRONG);
+                    if (PIOc_test(req[0], NULL) != PIO_EINVAL)
+                        ERR(ERR_WRONG);
+                    if (PIOc_waitall(-1, req) != PIO_EINVAL)
+                        ERR(ERR_WRONG);
+
+		    /* This should work - library type conversion */
+		    if (other_type && (ret = PIOc_iwrite_darray(ncid, varid2, ioid, arraylen, test_data,
+                                                                ofillvalue, &req[1])))
+                        ERR(ret);
+
+                    /* Start writing the data. */
+                    if ((ret = PIOc_iwrite_darray(ncid, varid, ioid, arraylen, test_data, fillvalue, &req[0])))
+                        ERR(ret);
+                    if ((ret = PIOc_test(req[0], &flag)))
+                        ERR(ret);
+
+                    /* Complete both writes. */
+                    if ((ret = PIOc_waitall(2, req)))
+                        ERR(ret);
+                    if (req[0] != PIO_REQ_NULL || req[1] != PIO_REQ_NULL)
+                        ERR(ERR_WRONG);
+
+                    /* Completed requests can be waited for again. */
+                    if ((ret = PIOc_wait(&req[0])))
+                        ERR(ret);
+                    if ((ret = PIOc_test(req[0], &flag)))
+                        ERR(ret);
+                    if (!flag)
+                        ERR(ERR_WRONG);
+                }
                 else
                 {
                     int varid_big = PIO_MAX_VARS + TEST_VAL_42;
@@ -310,6 +361,13 @@ int test_darray(int iosysid, int ioid, int num_flavors, int *flavor, int my_rank
                     if (PIOc_write_darray(ncid2, varid, ioid, arraylen, test_data, fillvalue) != PIO_EPERM)
                         ERR(ERR_WRONG);
                 }
+                else if (test_multi == TEST_IWRITE)
+                {
+                    PIO_Request req;
+
+                    if (PIOc_iwrite_darray(ncid2, varid, ioid, arraylen, test_data, fillvalue, &req) != PIO_EPERM)
+                        ERR(ERR_WRONG);
+                }
                 else
                 {
                     if (PIOc_write_darray_multi(ncid2, &varid, ioid, 1, arraylen, test_data, &frame,
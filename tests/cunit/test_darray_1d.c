@@ -45,6 +45,23 @@
 #define DIM_NAME "episode"
 #define DIM_NAME_2 "phaser_draws"
 
+/* The name of the global attribute added in redef by
+ * test_darray_multiwriter(). */
+#define ATT_NAME "episode_count"
+
+/* The length of the dimension of the permuted decompositions. */
+#define PERM_DIM_LEN 64
+
+/* The permutations of the maps: the two halves of the block of each
+ * task swapped, and the block reversed. */
+#define NUM_PERMS 2
+#define PERM_SWAP 0
+#define PERM_REVERSE 1
+
+/* The number of variables written and read together by
+ * test_darray_multivar(). */
+#define NUM_MULTI_VARS 3
+
 /* Create a 1D decomposition.
  *
  * @param ntasks the number of available tasks
@@ -787,6 +804,296 @@ int test_decomp_read_write(int iosysid, int ioid, int num_flavors, int *flavor,
     return PIO_NOERR;
 }
 
+/**
+ * Test writing and reading back data with a map which is not
+ * sorted. Each task has a contiguous block of the dimension, in a
+ * permuted order. When the halves of the block are swapped, the send
+ * types take the data in the order of the map (stype_unsorted). When
+ * the block is reversed, the types would be too fragmented, and the
+ * data is copied to the sorted order instead. With the hierarchical
+ * rearranger, the remap is composed with the positions of the
+ * elements in the node buffer, so the data is never sorted.
+ *
+ * @param iosysid the IO system ID.
+ * @param rearranger the rearranger of the IO system.
+ * @param num_flavors the number of IOTYPES available in this build.
+ * @param flavor array of available iotypes.
+ * @param my_rank rank of this task.
+ * @param ntasks the number of tasks in the decomposition.
+ * @returns 0 for success, error code otherwise.
+ */
+int test_darray_permuted(int iosysid, int rearranger, int num_flavors, int *flavor,
+                         int my_rank, int ntasks)
+{
+    int dim_len = PERM_DIM_LEN;
+    PIO_Offset elements_per_pe = PERM_DIM_LEN / ntasks;
+    PIO_Offset compdof[elements_per_pe];
+    int data[elements_per_pe];
+    int data_in[elements_per_pe];
+    int ret;
+
+    for (int p = 0; p < NUM_PERMS; p++)
+    {
+        io_desc_t *iodesc;
+        int ioid;
+
+        /* Permute the block of this task. Don't forget to add 1! */
+        for (PIO_Offset i = 0; i < elements_per_pe; i++)
+        {
+            PIO_Offset j = p == PERM_SWAP ? (i + elements_per_pe / 2) % elements_per_pe :
+                elements_per_pe - 1 - i;
+
+            compdof[i] = my_rank * elements_per_pe + j + 1;
+            data[i] = compdof[i] * 10 + my_rank;
+        }
+        if ((ret = PIOc_InitDecomp(iosysid, PIO_INT, NDIM, &dim_len, elements_per_pe,
+                                   compdof, &ioid, NULL, NULL, NULL)))
+            ERR(ret);
+        if (!(iodesc = pio_get_iodesc_from_id(ioid)))
+            ERR(ERR_WRONG);
+        if (rearranger == PIO_REARR_HIER)
+        {
+            if (iodesc->needssort || iodesc->remap || !iodesc->hier)
+                ERR(ERR_WRONG);
+        }
+        else if (!iodesc->needssort)
+            ERR(ERR_WRONG);
+
+        for (int fmt = 0; fmt < num_flavors; fmt++)
+        {
+            char filename[PIO_MAX_NAME + 1];
+            int ncid, dimid, varid;
+
+            /* Write the data. */
+            sprintf(filename, "%s_permuted_%d_%d.nc", TEST_NAME, p, flavor[fmt]);
+            if ((ret = PIOc_createfile(iosysid, &ncid, &flavor[fmt], filename, PIO_CLOBBER)))
+                ERR(ret);
+            if ((ret = PIOc_def_dim(ncid, DIM_NAME, PERM_DIM_LEN, &dimid)))
+                ERR(ret);
+            if ((ret = PIOc_def_var(ncid, VAR_NAME, PIO_INT, NDIM, &dimid, &varid)))
+                ERR(ret);
+            if ((ret = PIOc_enddef(ncid)))
+                ERR(ret);
+            if ((ret = PIOc_write_darray(ncid, varid, ioid, elements_per_pe, data, NULL)))
+                ERR(ret);
+            if ((ret = PIOc_closefile(ncid)))
+                ERR(ret);
+
+            /* The send types are made by the first write. */
+            if (rearranger != PIO_REARR_HIER && iodesc->stype_unsorted != (p == PERM_SWAP))
+                ERR(ERR_WRONG);
+
+            /* Read the data back, through the same types. */
+            if ((ret = PIOc_openfile(iosysid, &ncid, &flavor[fmt], filename, PIO_NOWRITE)))
+                ERR(ret);
+            memset(data_in, 0, sizeof(data_in));
+            if ((ret = PIOc_read_darray(ncid, varid, ioid, elements_per_pe, data_in)))
+                ERR(ret);
+            for (PIO_Offset i = 0; i < elements_per_pe; i++)
+                if (data_in[i] != data[i])
+                    ERR(ERR_WRONG);
+            if ((ret = PIOc_closefile(ncid)))
+                ERR(ret);
+        }
+
+        if ((ret = PIOc_freedecomp(iosysid, ioid)))
+            ERR(ret);
+    }
+
+    return PIO_NOERR;
+}
+
+/**
+ * Test the multi-writer mode of PIOc_set_multiwriter(). With it,
+ * each IO task writes its own data of PIO_IOTYPE_NETCDF files;
+ * other iotypes are not affected. A record of a record variable is
+ * written, the file is put in define mode and back, and another
+ * record is written. The file is then read back and checked.
+ *
+ * @param iosysid the IO system ID.
+ * @param num_flavors the number of IOTYPES available in this build.
+ * @param flavor array of available iotypes.
+ * @param my_rank rank of this task.
+ * @param ntasks the number of tasks in the decomposition.
+ * @returns 0 for success, error code otherwise.
+ */
+int test_darray_multiwriter(int iosysid, int num_flavors, int *flavor, int my_rank,
+                            int ntasks)
+{
+    int dim_len = PERM_DIM_LEN;
+    PIO_Offset elements_per_pe = PERM_DIM_LEN / ntasks;
+    PIO_Offset compdof[elements_per_pe];
+    int data[NUM_TIMESTEPS][elements_per_pe];
+    int data_in[elements_per_pe];
+    int att_val = NUM_TIMESTEPS;
+    int ioid;
+    int ret;
+
+    /* Each task has a contiguous block. Don't forget to add 1! */
+    for (PIO_Offset i = 0; i < elements_per_pe; i++)
+    {
+        compdof[i] = my_rank * elements_per_pe + i + 1;
+        for (int t = 0; t < NUM_TIMESTEPS; t++)
+            data[t][i] = t * 1000 + compdof[i];
+    }
+    if ((ret = PIOc_InitDecomp(iosysid, PIO_INT, NDIM, &dim_len, elements_per_pe,
+                               compdof, &ioid, NULL, NULL, NULL)))
+        ERR(ret);
+
+    if ((ret = PIOc_set_multiwriter(iosysid, 1)))
+        ERR(ret);
+
+    for (int fmt = 0; fmt < num_flavors; fmt++)
+    {
+        char filename[PIO_MAX_NAME + 1];
+        int ncid, dimid[NDIM + 1], varid;
+
+        /* Write the first record. */
+        sprintf(filename, "%s_multiwriter_%d.nc", TEST_NAME, flavor[fmt]);
+        if ((ret = PIOc_createfile(iosysid, &ncid, &flavor[fmt], filename, PIO_CLOBBER)))
+            ERR(ret);
+        if ((ret = PIOc_def_dim(ncid, DIM_NAME_2, PIO_UNLIMITED, &dimid[0])))
+            ERR(ret);
+        if ((ret = PIOc_def_dim(ncid, DIM_NAME, PERM_DIM_LEN, &dimid[1])))
+            ERR(ret);
+        if ((ret = PIOc_def_var(ncid, VAR_NAME, PIO_INT, NDIM + 1, dimid, &varid)))
+            ERR(ret);
+        if ((ret = PIOc_enddef(ncid)))
+            ERR(ret);
+        if ((ret = PIOc_setframe(ncid, varid, 0)))
+            ERR(ret);
+        if ((ret = PIOc_write_darray(ncid, varid, ioid, elements_per_pe, data[0], NULL)))
+            ERR(ret);
+
+        /* The data written so far is synced before the header
+         * changes. */
+        if ((ret = PIOc_redef(ncid)))
+            ERR(ret);
+        if ((ret = PIOc_put_att_int(ncid, PIO_GLOBAL, ATT_NAME, PIO_INT, 1, &att_val)))
+            ERR(ret);
+        if ((ret = PIOc_enddef(ncid)))
+            ERR(ret);
+
+        /* Write the other records. */
+        for (int t = 1; t < NUM_TIMESTEPS; t++)
+        {
+            if ((ret = PIOc_setframe(ncid, varid, t)))
+                ERR(ret);
+            if ((ret = PIOc_write_darray(ncid, varid, ioid, elements_per_pe, data[t], NULL)))
+                ERR(ret);
+        }
+        if ((ret = PIOc_closefile(ncid)))
+            ERR(ret);
+
+        /* Read the data back. */
+        if ((ret = PIOc_openfile(iosysid, &ncid, &flavor[fmt], filename, PIO_NOWRITE)))
+            ERR(ret);
+        for (int t = 0; t < NUM_TIMESTEPS; t++)
+        {
+            if ((ret = PIOc_setframe(ncid, varid, t)))
+                ERR(ret);
+            if ((ret = PIOc_read_darray(ncid, varid, ioid, elements_per_pe, data_in)))
+                ERR(ret);
+            for (PIO_Offset i = 0; i < elements_per_pe; i++)
+                if (data_in[i] != data[t][i])
+                    ERR(ERR_WRONG);
+        }
+        if ((ret = PIOc_closefile(ncid)))
+            ERR(ret);
+    }
+
+    /* Later files are written by IO task 0 again. */
+    if ((ret = PIOc_set_multiwriter(iosysid, 0)))
+        ERR(ret);
+    if ((ret = PIOc_freedecomp(iosysid, ioid)))
+        ERR(ret);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Test writing and reading back several variables of a decomposition
+ * at once. The variables are written with PIOc_write_darray(), so
+ * they are buffered and moved to the IO tasks together when the file
+ * is closed, and read back with PIOc_read_darray_multi(). The block
+ * of each task is reversed, so the data of each variable is stored
+ * at its own place in the node buffer of the hierarchical rearranger.
+ *
+ * @param iosysid the IO system ID.
+ * @param num_flavors the number of IOTYPES available in this build.
+ * @param flavor array of available iotypes.
+ * @param my_rank rank of this task.
+ * @param ntasks the number of tasks in the decomposition.
+ * @returns 0 for success, error code otherwise.
+ */
+int test_darray_multivar(int iosysid, int num_flavors, int *flavor, int my_rank,
+                         int ntasks)
+{
+    int dim_len = PERM_DIM_LEN;
+    PIO_Offset elements_per_pe = PERM_DIM_LEN / ntasks;
+    PIO_Offset compdof[elements_per_pe];
+    int data[NUM_MULTI_VARS][elements_per_pe];
+    int data_in[NUM_MULTI_VARS][elements_per_pe];
+    int ioid;
+    int ret;
+
+    /* Each task has a reversed block. Don't forget to add 1! */
+    for (PIO_Offset i = 0; i < elements_per_pe; i++)
+    {
+        compdof[i] = my_rank * elements_per_pe + elements_per_pe - i;
+        for (int v = 0; v < NUM_MULTI_VARS; v++)
+            data[v][i] = v * 1000 + compdof[i];
+    }
+    if ((ret = PIOc_InitDecomp(iosysid, PIO_INT, NDIM, &dim_len, elements_per_pe,
+                               compdof, &ioid, NULL, NULL, NULL)))
+        ERR(ret);
+
+    for (int fmt = 0; fmt < num_flavors; fmt++)
+    {
+        char filename[PIO_MAX_NAME + 1];
+        char var_name[PIO_MAX_NAME + 1];
+        int ncid, dimid, varid[NUM_MULTI_VARS];
+
+        /* Write the variables. */
+        sprintf(filename, "%s_multivar_%d.nc", TEST_NAME, flavor[fmt]);
+        if ((ret = PIOc_createfile(iosysid, &ncid, &flavor[fmt], filename, PIO_CLOBBER)))
+            ERR(ret);
+        if ((ret = PIOc_def_dim(ncid, DIM_NAME, PERM_DIM_LEN, &dimid)))
+            ERR(ret);
+        for (int v = 0; v < NUM_MULTI_VARS; v++)
+        {
+            sprintf(var_name, "%s_%d", VAR_NAME, v);
+            if ((ret = PIOc_def_var(ncid, var_name, PIO_INT, NDIM, &dimid, &varid[v])))
+                ERR(ret);
+        }
+        if ((ret = PIOc_enddef(ncid)))
+            ERR(ret);
+        for (int v = 0; v < NUM_MULTI_VARS; v++)
+            if ((ret = PIOc_write_darray(ncid, varid[v], ioid, elements_per_pe, data[v], NULL)))
+                ERR(ret);
+        if ((ret = PIOc_closefile(ncid)))
+            ERR(ret);
+
+        /* Read them back together. */
+        if ((ret = PIOc_openfile(iosysid, &ncid, &flavor[fmt], filename, PIO_NOWRITE)))
+            ERR(ret);
+        memset(data_in, 0, sizeof(data_in));
+        if ((ret = PIOc_read_darray_multi(ncid, NUM_MULTI_VARS, varid, ioid, NULL, data_in)))
+            ERR(ret);
+        for (int v = 0; v < NUM_MULTI_VARS; v++)
+            for (PIO_Offset i = 0; i < elements_per_pe; i++)
+                if (data_in[v][i] != data[v][i])
+                    ERR(ERR_WRONG);
+        if ((ret = PIOc_closefile(ncid)))
+            ERR(ret);
+    }
+
+    if ((ret = PIOc_freedecomp(iosysid, ioid)))
+        ERR(ret);
+
+    return PIO_NOERR;
+}
+
 /* Run tests for darray functions. */
 int main(int argc, char **argv)
 {
@@ -864,11 +1171,35 @@ int main(int argc, char **argv)
                     ERR(ret);
             }
 
+            /* Write and read with maps which are not sorted. */
+            if ((ret = test_darray_permuted(iosysid, rearranger[r], num_flavors, flavor,
+                                            my_rank, TARGET_NTASKS)))
+                return ret;
+
+            /* Write with each IO task writing its own data. */
+            if ((ret = test_darray_multiwriter(iosysid, num_flavors, flavor, my_rank,
+                                               TARGET_NTASKS)))
+                return ret;
+
             /* Finalize PIO system. */
             if ((ret = PIOc_free_iosystem(iosysid)))
                 return ret;
         } /* next rearranger */
 
+        /* The hierarchical rearranger, with two IO tasks so the node
+         * leaders exchange data with an IO task on another rank. */
+        if ((ret = PIOc_Init_Intracomm(test_comm, TARGET_NTASKS / 2, 2, ioproc_start,
+                                       PIO_REARR_HIER, &iosysid)))
+            return ret;
+        if ((ret = test_darray_permuted(iosysid, PIO_REARR_HIER, num_flavors, flavor,
+                                        my_rank, TARGET_NTASKS)))
+            return ret;
+        if ((ret = test_darray_multivar(iosysid, num_flavors, flavor, my_rank,
+                                        TARGET_NTASKS)))
+            return ret;
+        if ((ret = PIOc_free_iosystem(iosysid)))
+            return ret;
+
     } /* endif my_rank < TARGET_NTASKS */
 
     /* Finalize the MPI library. */
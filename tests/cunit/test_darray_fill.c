@@ -41,6 +41,58 @@ int dim_len[NDIM1] = {28};
 /* Run test for each of the rearrangers. */
 #define NUM_REARRANGERS_TO_TEST 2
 
+/* The sizes of the values checked with pio_fill_buffer(), with 12
+ * for the generic path. */
+#define NUM_FILL_SIZES 5
+#define MAX_FILL_SIZE 12
+
+/* The most elements filled by test_fill_buffer(). */
+#define MAX_FILL_NELEMS 1000
+
+/**
+ * Test the fill kernel pio_fill_buffer(), which the IO tasks use to
+ * fill the holes of the data. Buffers of each value size are filled
+ * with 0 to 20 elements, and with MAX_FILL_NELEMS, and every element
+ * is checked, as is the byte after the last one.
+ *
+ * @param my_rank rank of this task.
+ * @returns 0 for success, error code otherwise.
+ */
+int test_fill_buffer(int my_rank)
+{
+    int size[NUM_FILL_SIZES] = {1, 2, 4, 8, MAX_FILL_SIZE};
+    unsigned char fillvalue[MAX_FILL_SIZE];
+    unsigned char *buf;
+
+    if (!(buf = malloc((MAX_FILL_NELEMS + 1) * MAX_FILL_SIZE)))
+        ERR(ERR_MEM);
+
+    /* A value with different bytes, so misplaced bytes are caught. */
+    for (int b = 0; b < MAX_FILL_SIZE; b++)
+        fillvalue[b] = 0xa0 + b;
+
+    for (int s = 0; s < NUM_FILL_SIZES; s++)
+    {
+        for (PIO_Offset n = 0; n <= 21; n++)
+        {
+            PIO_Offset nelems = n == 21 ? MAX_FILL_NELEMS : n;
+
+            memset(buf, 0, (size_t)(nelems + 1) * size[s]);
+            pio_fill_buffer(buf, fillvalue, nelems, size[s]);
+            for (PIO_Offset i = 0; i < nelems; i++)
+                if (memcmp(&buf[i * size[s]], fillvalue, size[s]))
+                    ERR(ERR_WRONG);
+            for (int b = 0; b < size[s]; b++)
+                if (buf[nelems * size[s] + b])
+                    ERR(ERR_WRONG);
+        }
+    }
+
+    free(buf);
+
+    return PIO_NOERR;
+}
+
 /* Run tests for darray functions. */
 int main(int argc, char **argv)
 {
@@ -59,6 +111,10 @@ int main(int argc, char **argv)
     if ((ret = PIOc_set_iosystem_error_handling(PIO_DEFAULT, PIO_RETURN_ERROR, NULL)))
         return ret;
 
+    /* Test the fill kernel. */
+    if ((ret = test_fill_buffer(my_rank)))
+        return ret;
+
     /* Only do something on max_ntasks tasks. */
     if (my_rank < TARGET_NTASKS)
     {
@@ -88,6 +88,7 @@ int test_darray(int iosysid, int ioid, int num_flavors, int *flavor, int my_rank
     void *fillvalue;       /* Pointer to fill value. */
     void *test_data;       /* Pointer to test data we will write. */
     void *test_data_in;    /* Pointer to buffer we will read into. */
+    PIO_Offset type_size;  /* Size of pio_type in bytes. */
     int ret;               /* Return code. */
 
     /* Default fill value array for each type. */
@@ -120,6 +121,9 @@ int test_darray(int iosysid, int ioid, int num_flavors, int *flavor, int my_rank
     unsigned long long test_data_uint64[arraylen * NVAR];
 #endif /* _NETCDF4 */
 
+    /* Buffer for reading all vars at once. */
+    unsigned long long test_data_multi_in[arraylen * NVAR];
+
     /* We will read test data into these buffers. */
     signed char test_data_byte_in[arraylen];
     char test_data_char_in[arraylen];
@@ -360,6 +364,26 @@ int test_darray(int iosysid, int ioid, int num_flavors, int *flavor, int my_rank
                     }
                 }
 
+                /* Now read all vars at once with the _multi function,
+                 * and make sure we get the same data. */
+                if ((ret = PIOc_inq_type(ncid2, pio_type, NULL, &type_size)))
+                    ERR(ret);
+                memset(test_data_multi_in, 0, sizeof(test_data_multi_in));
+                if ((ret = PIOc_read_darray_multi(ncid2, NVAR, varid, ioid, frame,
+                                                  test_data_multi_in)))
+                    ERR(ret);
+                if (memcmp(test_data_multi_in, test_data, arraylen * NVAR * type_size))
+                    ERR(ERR_WRONG);
+
+                /* Bad inputs are rejected. */
+                if (PIOc_read_darray_multi(ncid2, 0, varid, ioid, frame, test_data_multi_in) != PIO_EINVAL)
+                    ERR(ERR_WRONG);
+                if (PIOc_read_darray_multi(ncid2, NVAR, NULL, ioid, frame, test_data_multi_in) != PIO_EINVAL)
+                    ERR(ERR_WRONG);
+                if (PIOc_read_darray_multi(ncid2 + TEST_VAL_42, NVAR, varid, ioid, frame,
+                                           test_data_multi_in) != PIO_EBADID)
+                    ERR(ERR_WRONG);
+
                 /* Close the netCDF file. */
                 if ((ret = PIOc_closefile(ncid2)))
                     ERR(ret);
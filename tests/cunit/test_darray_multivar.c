@@ -46,6 +46,15 @@
 /* Number of variables in the test file. */
 #define NUM_VAR 4
 
+/* The length of the data of the IO buffer pool test. The IO buffer
+ * of each IO task is larger than the smallest one the pool keeps. */
+#define POOL_X_DIM_LEN 256
+#define POOL_Y_DIM_LEN 256
+
+/* The number of records written and read in the IO buffer pool
+ * test. */
+#define POOL_NUM_REC 4
+
 /* The dimension names. */
 char dim_name[NDIM][PIO_MAX_NAME + 1] = {"timestep", "x", "y"};
 
@@ -539,6 +548,214 @@ int test_all_darray(int iosysid, int num_flavors, int *flavor, int my_rank,
     return PIO_NOERR;
 }
 
+/**
+ * Test the IO buffer pool. Write POOL_NUM_REC records of a variable
+ * large enough for the pool, then read them back one at a time. Each
+ * read gets an IO buffer and gives it back, so after the first one
+ * the buffers come from the pool. The buffers the pool holds count
+ * in the memory usage, and are given back under a memory budget.
+ *
+ * @param iosysid the IO system ID, with the pool enabled.
+ * @param iotype the iotype to use.
+ * @param my_rank rank of this task.
+ * @returns 0 for success, error code otherwise.
+ */
+int test_iobuf_pool(int iosysid, int iotype, int my_rank)
+{
+    char filename[PIO_MAX_NAME + 1];
+    int dim_len_2d[NDIM2] = {POOL_X_DIM_LEN, POOL_Y_DIM_LEN};
+    int pool_dim_len[NDIM] = {NC_UNLIMITED, POOL_X_DIM_LEN, POOL_Y_DIM_LEN};
+    PIO_Offset elements_per_pe = POOL_X_DIM_LEN * POOL_Y_DIM_LEN / TARGET_NTASKS;
+    PIO_Offset hits0, saved0, hits, saved, cached, usage;
+    double *data, *data_in;
+    int dimids[NDIM];
+    int ncid, varid, ioid;
+    int ret;
+
+    if (!(data = malloc(elements_per_pe * sizeof(double))))
+        return PIO_ENOMEM;
+    if (!(data_in = malloc(elements_per_pe * sizeof(double))))
+        return PIO_ENOMEM;
+
+    if ((ret = create_decomposition_2d(TARGET_NTASKS, my_rank, iosysid, dim_len_2d,
+                                       &ioid, PIO_DOUBLE)))
+        return ret;
+
+    sprintf(filename, "%s_pool_%d.nc", TEST_NAME, iotype);
+    if ((ret = PIOc_createfile(iosysid, &ncid, &iotype, filename, PIO_CLOBBER)))
+        ERR(ret);
+    for (int d = 0; d < NDIM; d++)
+        if ((ret = PIOc_def_dim(ncid, dim_name[d], (PIO_Offset)pool_dim_len[d], &dimids[d])))
+            ERR(ret);
+    if ((ret = PIOc_def_var(ncid, VAR_NAME_1, PIO_DOUBLE, NDIM, dimids, &varid)))
+        ERR(ret);
+    if ((ret = PIOc_enddef(ncid)))
+        ERR(ret);
+    for (int t = 0; t < POOL_NUM_REC; t++)
+    {
+        for (PIO_Offset i = 0; i < elements_per_pe; i++)
+            data[i] = t * 100000.0 + my_rank * elements_per_pe + i;
+        if ((ret = PIOc_setframe(ncid, varid, t)))
+            ERR(ret);
+        if ((ret = PIOc_write_darray(ncid, varid, ioid, elements_per_pe, data, NULL)))
+            ERR(ret);
+    }
+    if ((ret = PIOc_closefile(ncid)))
+        ERR(ret);
+
+    if ((ret = PIOc_get_iobuf_pool_stats(iosysid, &hits0, NULL, &saved0, NULL)))
+        ERR(ret);
+
+    /* Read the records back. */
+    if ((ret = PIOc_openfile(iosysid, &ncid, &iotype, filename, PIO_NOWRITE)))
+        ERR(ret);
+    for (int t = 0; t < POOL_NUM_REC; t++)
+    {
+        if ((ret = PIOc_setframe(ncid, varid, t)))
+            ERR(ret);
+        if ((ret = PIOc_read_darray(ncid, varid, ioid, elements_per_pe, data_in)))
+            ERR(ret);
+        for (PIO_Offset i = 0; i < elements_per_pe; i++)
+            if (data_in[i] != t * 100000.0 + my_rank * elements_per_pe + i)
+                ERR(ERR_WRONG);
+    }
+    if ((ret = PIOc_closefile(ncid)))
+        ERR(ret);
+
+    /* All tasks are IO tasks, so each one reused its buffer for all
+     * but the first read, and the pool holds it now. */
+    if ((ret = PIOc_get_iobuf_pool_stats(iosysid, &hits, NULL, &saved, &cached)))
+        ERR(ret);
+    if (hits < hits0 + POOL_NUM_REC - 1 || saved <= saved0 || cached <= 0)
+        ERR(ERR_WRONG);
+
+    /* The files are closed, so the buffers the pool holds are all
+     * the memory in use. */
+    if ((ret = PIOc_get_mem_usage(iosysid, &usage, NULL)))
+        ERR(ret);
+    if (usage != cached)
+        ERR(ERR_WRONG);
+
+    /* With a tiny memory budget, the pool gives back its buffers
+     * before the next write, and does not keep the IO buffer. */
+    if ((ret = PIOc_set_mem_budget(iosysid, 1, PIO_MEM_FLUSH_LARGEST)))
+        ERR(ret);
+    if ((ret = PIOc_openfile(iosysid, &ncid, &iotype, filename, PIO_WRITE)))
+        ERR(ret);
+    if ((ret = PIOc_setframe(ncid, varid, 0)))
+        ERR(ret);
+    if ((ret = PIOc_write_darray(ncid, varid, ioid, elements_per_pe, data, NULL)))
+        ERR(ret);
+    if ((ret = PIOc_closefile(ncid)))
+        ERR(ret);
+    if ((ret = PIOc_get_iobuf_pool_stats(iosysid, NULL, NULL, NULL, &cached)))
+        ERR(ret);
+    if ((ret = PIOc_get_mem_usage(iosysid, &usage, NULL)))
+        ERR(ret);
+    if (cached || usage)
+        ERR(ERR_WRONG);
+    if ((ret = PIOc_set_mem_budget(iosysid, 0, PIO_MEM_FLUSH_LARGEST)))
+        ERR(ret);
+
+    if ((ret = PIOc_freedecomp(iosysid, ioid)))
+        ERR(ret);
+    free(data);
+    free(data_in);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Test that PIOc_write_darray() aggregates the variables of a
+ * decomposition with PIO_BUFFER_POLICY_BUDGET. All NUM_VAR variables
+ * must be in the multi-buffer before the file is closed, so no write
+ * flushed the ones before it. The data is then read back. This sets
+ * the buffer policy and turns off the memory budget of the IO
+ * system.
+ *
+ * @param iosysid the IO system ID.
+ * @param iotype the iotype to use.
+ * @param my_rank rank of this task.
+ * @returns 0 for success, error code otherwise.
+ */
+int test_budget_aggregation(int iosysid, int iotype, int my_rank)
+{
+    char filename[PIO_MAX_NAME + 1];
+    int dim_len_2d[NDIM2] = {X_DIM_LEN, Y_DIM_LEN};
+    PIO_Offset elements_per_pe = X_DIM_LEN * Y_DIM_LEN / TARGET_NTASKS;
+    int data[NUM_VAR][elements_per_pe];
+    int data_in[elements_per_pe];
+    int dimids[NDIM];
+    int varid[NUM_VAR];
+    int ncid, ioid;
+    file_desc_t *file;
+    wmulti_buffer *wmb, *tmp;
+    int num_arrays = 0;
+    int ret;
+
+    if ((ret = PIOc_set_buffer_policy(iosysid, PIO_BUFFER_POLICY_BUDGET)))
+        ERR(ret);
+    if ((ret = PIOc_set_mem_budget(iosysid, 0, PIO_MEM_FLUSH_LARGEST)))
+        ERR(ret);
+
+    if ((ret = create_decomposition_2d(TARGET_NTASKS, my_rank, iosysid, dim_len_2d,
+                                       &ioid, PIO_INT)))
+        return ret;
+
+    /* Write all the variables. */
+    sprintf(filename, "%s_budget_%d.nc", TEST_NAME, iotype);
+    if ((ret = PIOc_createfile(iosysid, &ncid, &iotype, filename, PIO_CLOBBER)))
+        ERR(ret);
+    for (int d = 0; d < NDIM; d++)
+        if ((ret = PIOc_def_dim(ncid, dim_name[d], (PIO_Offset)dim_len[d], &dimids[d])))
+            ERR(ret);
+    for (int v = 0; v < NUM_VAR; v++)
+        if ((ret = PIOc_def_var(ncid, var_name[v], PIO_INT, NDIM, dimids, &varid[v])))
+            ERR(ret);
+    if ((ret = PIOc_enddef(ncid)))
+        ERR(ret);
+    for (int v = 0; v < NUM_VAR; v++)
+    {
+        for (PIO_Offset i = 0; i < elements_per_pe; i++)
+            data[v][i] = v * 1000 + my_rank * elements_per_pe + i;
+        if ((ret = PIOc_setframe(ncid, varid[v], 0)))
+            ERR(ret);
+        if ((ret = PIOc_write_darray(ncid, varid[v], ioid, elements_per_pe, data[v], NULL)))
+            ERR(ret);
+    }
+
+    /* Nothing was flushed yet. */
+    if ((ret = pio_get_file(ncid, &file)))
+        ERR(ret);
+    HASH_ITER(hh, file->buffer, wmb, tmp)
+        num_arrays += wmb->num_arrays;
+    if (num_arrays != NUM_VAR)
+        ERR(ERR_WRONG);
+    if ((ret = PIOc_closefile(ncid)))
+        ERR(ret);
+
+    /* Read the variables back. */
+    if ((ret = PIOc_openfile(iosysid, &ncid, &iotype, filename, PIO_NOWRITE)))
+        ERR(ret);
+    for (int v = 0; v < NUM_VAR; v++)
+    {
+        if ((ret = PIOc_setframe(ncid, varid[v], 0)))
+            ERR(ret);
+        if ((ret = PIOc_read_darray(ncid, varid[v], ioid, elements_per_pe, data_in)))
+            ERR(ret);
+        for (PIO_Offset i = 0; i < elements_per_pe; i++)
+            if (data_in[i] != data[v][i])
+                ERR(ERR_WRONG);
+    }
+    if ((ret = PIOc_closefile(ncid)))
+        ERR(ret);
+
+    if ((ret = PIOc_freedecomp(iosysid, ioid)))
+        ERR(ret);
+
+    return PIO_NOERR;
+}
+
 /* Run tests for darray functions. */
 int main(int argc, char **argv)
 {
@@ -580,11 +797,73 @@ int main(int argc, char **argv)
             if ((ret = PIOc_Init_Intracomm(test_comm, TARGET_NTASKS, ioproc_stride,
                                            ioproc_start, rearranger[r], &iosysid)))
                 return ret;
+
+            /* Check for invalid values. */
+            if (PIOc_set_buffer_policy(iosysid + TEST_VAL_42, PIO_BUFFER_POLICY_BUDGET) != PIO_EBADID)
+                return ERR_WRONG;
+            if (PIOc_set_buffer_policy(iosysid, TEST_VAL_42) != PIO_EINVAL)
+                return ERR_WRONG;
+
+            /* Use each buffer policy with one of the rearrangers. */
+            if ((ret = PIOc_set_buffer_policy(iosysid, r ? PIO_BUFFER_POLICY_COLLECTIVE :
+                                              PIO_BUFFER_POLICY_BUDGET)))
+                return ret;
+
+            /* Check for invalid memory budget values. */
+            if (PIOc_set_mem_budget(iosysid + TEST_VAL_42, 0, PIO_MEM_FLUSH_LARGEST) != PIO_EBADID)
+                return ERR_WRONG;
+            if (PIOc_set_mem_budget(iosysid, -1, PIO_MEM_FLUSH_LARGEST) != PIO_EINVAL)
+                return ERR_WRONG;
+            if (PIOc_set_mem_budget(iosysid, 0, TEST_VAL_42) != PIO_EINVAL)
+                return ERR_WRONG;
+            if (PIOc_get_mem_usage(iosysid + TEST_VAL_42, NULL, NULL) != PIO_EBADID)
+                return ERR_WRONG;
+
+            /* Check for invalid IO buffer pool values. */
+            if (PIOc_set_iobuf_pool(iosysid + TEST_VAL_42, PIO_IOBUF_POOL_ENABLE, 0) != PIO_EBADID)
+                return ERR_WRONG;
+            if (PIOc_set_iobuf_pool(iosysid, PIO_IOBUF_POOL_HUGEPAGE, 0) != PIO_EINVAL)
+                return ERR_WRONG;
+            if (PIOc_set_iobuf_pool(iosysid, PIO_IOBUF_POOL_ENABLE, -1) != PIO_EINVAL)
+                return ERR_WRONG;
+            if (PIOc_get_iobuf_pool_stats(iosysid + TEST_VAL_42, NULL, NULL, NULL, NULL) != PIO_EBADID)
+                return ERR_WRONG;
+
+            /* Reuse the IO buffers with one of the rearrangers. */
+            if (!r && (ret = PIOc_set_iobuf_pool(iosysid, PIO_IOBUF_POOL_ENABLE |
+                                                 PIO_IOBUF_POOL_HUGEPAGE, 0)))
+                return ret;
+
+            /* Use a small memory budget with one of the rearrangers,
+             * so multi-buffers get flushed by the governor. */
+            if (r && (ret = PIOc_set_mem_budget(iosysid, 1024, PIO_MEM_FLUSH_OLDEST)))
+                return ret;
+
             /* printf("test Rearranger %d\n",rearranger[r]); */
             /* Run tests. */
             if ((ret = test_all_darray(iosysid, num_flavors, flavor, my_rank, test_comm,
                                        rearranger[r])))
                 return ret;
+
+            /* All the files are closed, so no buffer memory is in
+             * use. */
+            {
+                PIO_Offset usage, highwater;
+
+                if ((ret = PIOc_get_mem_usage(iosysid, &usage, &highwater)))
+                    return ret;
+                if (usage || highwater <= 0)
+                    return ERR_WRONG;
+            }
+
+            /* Check that the writes are aggregated without a
+             * collective. */
+            if ((ret = test_budget_aggregation(iosysid, flavor[0], my_rank)))
+                return ret;
+
+            /* Check that the pool reuses the IO buffers. */
+            if (!r && (ret = test_iobuf_pool(iosysid, flavor[0], my_rank)))
+                return ret;
             /* printf("test Rearranger %d complete\n",rearranger[r]); */
 
             /* Finalize PIO system. */
@@ -0,0 +1,131 @@
+/*
+ * This program measures the time taken to create a decomposition
+ * with PIOc_init_decomp(). The number of elements per task, the
+ * number of IO tasks and the rearranger are varied. The map is
+ * interleaved across tasks, so that the data on each compute task
+ * is spread over all of the IO tasks. This exercises the destination
+ * lookup in the box rearranger.
+ *
+ * @author Jim Edwards
+ */
+#include <config.h>
+#include <pio.h>
+#include <pio_internal.h>
+#include <pio_tests.h>
+
+/* The name of this test. */
+#define TEST_NAME "test_perf_decomp"
+
+/* The length of the fastest varying dimension. */
+#define X_DIM_LEN 1024
+
+/* How many different map lengths to check? */
+#define NUM_MAPLEN_TESTS 3
+
+/* How many different number of IO tasks to check? */
+#define MAX_IO_TESTS 5
+
+/* Number of times each decomposition is created. */
+#define NUM_REPEATS 3
+
+/* Run test for each of the rearrangers. */
+#define NUM_REARRANGERS_TO_TEST 2
+
+/* The rearrangers. */
+int rearranger[NUM_REARRANGERS_TO_TEST] = {PIO_REARR_BOX, PIO_REARR_SUBSET};
+
+/* The map lengths. */
+int maplen[NUM_MAPLEN_TESTS] = {X_DIM_LEN, 16 * X_DIM_LEN, 64 * X_DIM_LEN};
+
+/**
+ * Create and free a decomposition NUM_REPEATS times for each map
+ * length, and report the average of the time taken by the slowest
+ * task.
+ *
+ * @param pc the case of the test. The variant is the index of the
+ * rearranger.
+ * @returns 0 for success, error code otherwise.
+ */
+int
+time_decomp(const perf_case_t *pc)
+{
+    int my_rank = pc->my_rank;
+    int ret;
+
+    for (int m = 0; m < NUM_MAPLEN_TESTS; m++)
+    {
+        int dim_len_2d[NDIM2];
+        PIO_Offset len;
+        PIO_Offset *compdof;
+        double local_sec = 0, max_sec;
+        int ioid;
+
+        /* The global array has maplen * ntasks elements. The
+         * elements are interleaved across tasks. */
+        dim_len_2d[0] = (PIO_Offset)maplen[m] * pc->ntasks / X_DIM_LEN;
+        dim_len_2d[1] = X_DIM_LEN;
+        if ((ret = perf_decomp_map(my_rank, pc->ntasks, (PIO_Offset)maplen[m] * pc->ntasks,
+                                   PERF_MAP_INTERLEAVED, &len, &compdof)))
+            return ret;
+
+        for (int r = 0; r < NUM_REPEATS; r++)
+        {
+            double start;
+
+            if ((ret = perf_start(pc->test_comm, &start)))
+                return ret;
+
+            if ((ret = PIOc_init_decomp(pc->iosysid, PIO_INT, NDIM2, dim_len_2d, len,
+                                        compdof, &ioid, rearranger[pc->variant], NULL, NULL)))
+                ERR(ret);
+
+            local_sec += MPI_Wtime() - start;
+
+            if ((ret = PIOc_freedecomp(pc->iosysid, ioid)))
+                ERR(ret);
+        }
+
+        /* The time of the slowest task is the time of the call. */
+        if ((ret = perf_max_time(pc->test_comm, local_sec / NUM_REPEATS, &max_sec)))
+            return ret;
+
+        if (!my_rank)
+            printf("%d,\t%d,\t%s,\t%d,\t%10.6f\n", pc->ntasks, pc->num_io_procs,
+                   (rearranger[pc->variant] == PIO_REARR_BOX ? "box" : "subset"), maplen[m],
+                   max_sec);
+
+        free(compdof);
+    }
+
+    return PIO_NOERR;
+}
+
+/* Run decomposition timing tests. */
+int
+main(int argc, char **argv)
+{
+    int my_rank;
+    int ntasks;
+    MPI_Comm test_comm; /* A communicator for this test. */
+    int num_io_procs[MAX_IO_TESTS] = {1, 4, 16, 64, 256}; /* Number of processors that will do IO. */
+    int ret;      /* Return code. */
+
+    /* Initialize test. */
+    if ((ret = pio_test_init2(argc, argv, &my_rank, &ntasks, 1,
+                              0, -1, &test_comm)))
+        ERR(ERR_INIT);
+
+    if (!my_rank)
+        printf("ntasks,\tnio,\trearr,\tmaplen,\tinit_decomp time(s)\n");
+
+    /* The decompositions are made by time_decomp(). */
+    if ((ret = run_perf_cases(test_comm, MAX_IO_TESTS, num_io_procs, NUM_REARRANGERS_TO_TEST,
+                              rearranger, NULL, NULL, 0, NULL, time_decomp)))
+        ERR(ret);
+
+    /* Finalize the MPI library. */
+    if ((ret = pio_test_finalize2(&test_comm, TEST_NAME)))
+        return ret;
+
+    return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * This program measures the time taken to fill a buffer with fill
+ * values, as the IO tasks do before writing data with holes. The
+ * fill kernel pio_fill_buffer() is compared with copying the value
+ * one element at a time with memcpy(), for values of 1, 2, 4 and 8
+ * bytes, and for a 12 byte value which takes the generic path. The
+ * buffers are checked after each fill. Short buffers are checked by
+ * test_darray_fill.
+ *
+ * Only task 0 runs the benchmark.
+ *
+ * @author Jim Edwards
+ */
+#include <config.h>
+#include <pio.h>
+#include <pio_internal.h>
+#include <pio_tests.h>
+
+/* The name of this test. */
+#define TEST_NAME "test_perf_fill"
+
+/* Number of elements in the buffer. */
+#define NELEMS (4 * 1024 * 1024)
+
+/* Number of times each fill is done. */
+#define NUM_REPEATS 10
+
+/* Number of value sizes to check. */
+#define NUM_SIZES 5
+
+/* The largest value size. */
+#define MAX_SIZE 12
+
+/**
+ * Fill the buffer one element at a time, as the IO tasks used to.
+ *
+ * @param buf the buffer.
+ * @param fillvalue the value.
+ * @param nelems number of elements.
+ * @param size size of the value in bytes.
+ */
+static void
+fill_memcpy(void *buf, const void *fillvalue, PIO_Offset nelems, int size)
+{
+    for (PIO_Offset i = 0; i < nelems; i++)
+        memcpy(&((char *)buf)[size * i], fillvalue, size);
+}
+
+/**
+ * Check that every element of the buffer holds the value.
+ *
+ * @param buf the buffer.
+ * @param fillvalue the value.
+ * @param nelems number of elements.
+ * @param size size of the value in bytes.
+ * @returns 0 if the buffer is correct, ERR_WRONG otherwise.
+ */
+static int
+check_fill(const void *buf, const void *fillvalue, PIO_Offset nelems, int size)
+{
+    for (PIO_Offset i = 0; i < nelems; i++)
+        if (memcmp(&((const char *)buf)[size * i], fillvalue, size))
+            return ERR_WRONG;
+    return PIO_NOERR;
+}
+
+/**
+ * Time one of the fill functions, and check the result.
+ *
+ * @param fill the fill function.
+ * @param buf the buffer.
+ * @param fillvalue the value.
+ * @param size size of the value in bytes.
+ * @param secp pointer that gets the average time in seconds.
+ * @returns 0 for success, error code otherwise.
+ */
+static int
+time_fill(void (*fill)(void *, const void *, PIO_Offset, int), void *buf,
+          const void *fillvalue, int size, double *secp)
+{
+    double start;
+
+    /* Touch the buffer before timing. */
+    memset(buf, 0, (size_t)NELEMS * size);
+
+    start = MPI_Wtime();
+    for (int r = 0; r < NUM_REPEATS; r++)
+        fill(buf, fillvalue, NELEMS, size);
+    *secp = (MPI_Wtime() - start) / NUM_REPEATS;
+
+    return check_fill(buf, fillvalue, NELEMS, size);
+}
+
+/* Run fill kernel timing tests. */
+int
+main(int argc, char **argv)
+{
+    int my_rank;
+    int ntasks;
+    MPI_Comm test_comm; /* A communicator for this test. */
+    int size[NUM_SIZES] = {1, 2, 4, 8, MAX_SIZE};
+    unsigned char fillvalue[MAX_SIZE];
+    void *buf;
+    int ret;      /* Return code. */
+
+    /* Initialize test. */
+    if ((ret = pio_test_init2(argc, argv, &my_rank, &ntasks, 1,
+                              0, -1, &test_comm)))
+        ERR(ERR_INIT);
+
+    if (!my_rank)
+    {
+        if (!(buf = malloc((size_t)NELEMS * MAX_SIZE)))
+            return PIO_ENOMEM;
+
+        /* A value with different bytes, so misplaced bytes are
+         * caught. */
+        for (int b = 0; b < MAX_SIZE; b++)
+            fillvalue[b] = 0xa0 + b;
+
+        printf("size,\tnelems,\tmemcpy time(s),\tkernel time(s),\tspeedup\n");
+        for (int s = 0; s < NUM_SIZES; s++)
+        {
+            double memcpy_sec, kernel_sec;
+
+            if ((ret = time_fill(fill_memcpy, buf, fillvalue, size[s], &memcpy_sec)))
+                ERR(ret);
+            if ((ret = time_fill(pio_fill_buffer, buf, fillvalue, size[s], &kernel_sec)))
+                ERR(ret);
+            printf("%d,\t%d,\t%10.6f,\t%10.6f,\t%6.2f\n", size[s], NELEMS, memcpy_sec,
+                   kernel_sec, memcpy_sec / kernel_sec);
+        }
+
+        free(buf);
+    }
+
+    /* Finalize the MPI library. */
+    if ((ret = pio_test_finalize2(&test_comm, TEST_NAME)))
+        return ret;
+
+    return 0;
+}
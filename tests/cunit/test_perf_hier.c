@@ -0,0 +1,151 @@
+/*
+ * This program compares the box, subset and hierarchical
+ * rearrangers. For each rearranger a decomposition is created, and
+ * the number of messages sent by the compute tasks and received by
+ * the IO tasks for each variable is reported, with the time taken to
+ * write and read back NUM_TIMESTEPS records of a variable. The data
+ * read back is checked.
+ *
+ * The hierarchical rearranger gathers the data of each node in
+ * shared memory before sending it, so it should send about one
+ * message per node to each IO task, where the others send one per
+ * task.
+ *
+ * @author Jim Edwards
+ */
+#include <config.h>
+#include <pio.h>
+#include <pio_internal.h>
+#include <pio_tests.h>
+
+/* The name of this test. */
+#define TEST_NAME "test_perf_hier"
+
+/* The length of the non-record dimensions. */
+#define X_DIM_LEN 1024
+#define Y_DIM_LEN 1024
+
+/* The number of timesteps of data to write. */
+#define NUM_TIMESTEPS 10
+
+/* How many different number of IO tasks to check? */
+#define MAX_IO_TESTS 4
+
+/* The number of rearrangers to compare. */
+#define NUM_REARR_TESTS 3
+
+/* Length of the non-record dimensions. */
+int dim_len[NDIM2] = {Y_DIM_LEN, X_DIM_LEN};
+
+/* The rearrangers, and their names for the output. */
+int rearranger[NUM_REARR_TESTS] = {PIO_REARR_BOX, PIO_REARR_SUBSET, PIO_REARR_HIER};
+const char *rearranger_name[NUM_REARR_TESTS] = {"box", "subset", "hier"};
+
+/**
+ * Count the messages of one variable in the decomposition, summed
+ * over all tasks.
+ *
+ * @param pc the case of the test.
+ * @param nsendp pointer that gets the number of messages sent by the
+ * compute tasks, on task 0.
+ * @param nrecvp pointer that gets the number of messages received by
+ * the IO tasks, on task 0.
+ * @returns 0 for success, error code otherwise.
+ */
+int
+count_messages(const perf_case_t *pc, int *nsendp, int *nrecvp)
+{
+    io_desc_t *iodesc;
+    int count[2] = {0, 0};
+    int mpierr;
+
+    if (!(iodesc = pio_get_iodesc_from_id(pc->ioid)))
+        return PIO_EBADID;
+
+    /* The subset rearranger sends to the one IO task of its subset. */
+    if (iodesc->scount)
+        for (int i = 0; i < (iodesc->rearranger == PIO_REARR_SUBSET ? 1 : pc->num_io_procs); i++)
+            if (iodesc->scount[i] > 0)
+                count[0]++;
+    count[1] = iodesc->nrecvs;
+
+    if ((mpierr = MPI_Reduce(&count[0], nsendp, 1, MPI_INT, MPI_SUM, 0, pc->test_comm)))
+        MPIERR(mpierr);
+    if ((mpierr = MPI_Reduce(&count[1], nrecvp, 1, MPI_INT, MPI_SUM, 0, pc->test_comm)))
+        MPIERR(mpierr);
+
+    return PIO_NOERR;
+}
+
+/**
+ * Count the messages of a rearranger, write NUM_TIMESTEPS records of
+ * a double variable, then read them back and check the data, and
+ * report the times taken.
+ *
+ * @param pc the case of the test. The variant is the index of the
+ * rearranger.
+ * @returns 0 for success, error code otherwise.
+ */
+int
+time_rearranger(const perf_case_t *pc)
+{
+    char filename[PIO_MAX_NAME + 1];
+    int nsend, nrecv;
+    double write_sec, read_sec;
+    int ret;
+
+    if ((ret = count_messages(pc, &nsend, &nrecv)))
+        return ret;
+
+    sprintf(filename, "%s_%d_%s.nc", TEST_NAME, pc->num_io_procs, rearranger_name[pc->variant]);
+    if ((ret = perf_write_file(pc, filename, 1, NUM_TIMESTEPS, &write_sec)))
+        return ret;
+    if ((ret = perf_read_file(pc, filename, 1, NUM_TIMESTEPS, &read_sec)))
+        return ret;
+
+    if (!pc->my_rank)
+        printf("%d,\t%d,\t%s,\t%d,\t%d,\t%10.6f,\t%10.6f\n", pc->ntasks, pc->num_io_procs,
+               rearranger_name[pc->variant], nsend, nrecv, write_sec, read_sec);
+
+    return PIO_NOERR;
+}
+
+/* Run rearranger comparison tests. */
+int
+main(int argc, char **argv)
+{
+    int my_rank;
+    int ntasks;
+    MPI_Comm test_comm; /* A communicator for this test. */
+    int num_io_procs[MAX_IO_TESTS] = {1, 2, 4, 8}; /* Number of processors that will do IO. */
+    PIO_Offset elements_per_pe;
+    PIO_Offset *compdof;
+    int ret;      /* Return code. */
+
+    /* Initialize test. */
+    if ((ret = pio_test_init2(argc, argv, &my_rank, &ntasks, 1,
+                              0, -1, &test_comm)))
+        ERR(ERR_INIT);
+
+    /* The elements of each task are spread over the whole array, so
+     * every task has data for every IO task. */
+    if ((ret = perf_decomp_map(my_rank, ntasks, (PIO_Offset)X_DIM_LEN * Y_DIM_LEN,
+                               PERF_MAP_INTERLEAVED, &elements_per_pe, &compdof)))
+        ERR(ret);
+
+    if (!my_rank)
+        printf("ntasks,\tnio,\trearranger,\tsends,\trecvs,\twrite time(s),\tread time(s)\n");
+
+    if ((ret = run_perf_cases(test_comm, MAX_IO_TESTS, num_io_procs, NUM_REARR_TESTS,
+                              rearranger, NULL, dim_len, elements_per_pe, compdof,
+                              time_rearranger)))
+        ERR(ret);
+
+    free(compdof);
+
+    /* Finalize the MPI library. */
+    if ((ret = pio_test_finalize2(&test_comm, TEST_NAME)))
+        return ret;
+
+    return 0;
+}
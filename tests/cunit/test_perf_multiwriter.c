@@ -0,0 +1,107 @@
+/*
+ * This program compares the write performance of the two ways that
+ * PIO_IOTYPE_NETCDF files can be written. By default all IO tasks
+ * send their data to IO task 0, which writes it with netCDF. With
+ * PIOc_set_multiwriter(), each IO task writes its own data with
+ * MPI-IO. The data are read back and checked after each write.
+ *
+ * @author Jim Edwards
+ */
+#include <config.h>
+#include <pio.h>
+#include <pio_internal.h>
+#include <pio_tests.h>
+
+/* The name of this test. */
+#define TEST_NAME "test_perf_multiwriter"
+
+/* The length of the non-record dimensions. */
+#define X_DIM_LEN 1024
+#define Y_DIM_LEN 512
+
+/* The number of timesteps of data to write. */
+#define NUM_TIMESTEPS 10
+
+/* How many different number of IO tasks to check? */
+#define MAX_IO_TESTS 5
+
+/* Number of write modes to compare. */
+#define NUM_MODES 2
+
+/* Length of the non-record dimensions. */
+int dim_len[NDIM2] = {Y_DIM_LEN, X_DIM_LEN};
+
+/**
+ * Write NUM_TIMESTEPS records of a double variable, report the
+ * bandwidth, then read the file back and check the data.
+ *
+ * @param pc the case of the test. The variant is non-zero to use
+ * the multi-writer mode.
+ * @returns 0 for success, error code otherwise.
+ */
+int
+time_write(const perf_case_t *pc)
+{
+    char filename[PIO_MAX_NAME + 1];
+    int multiwriter = pc->variant;
+    double max_sec;
+    int my_rank = pc->my_rank;
+    int ret;
+
+    if ((ret = PIOc_set_multiwriter(pc->iosysid, multiwriter)))
+        ERR(ret);
+
+    sprintf(filename, "%s_%d_%d.nc", TEST_NAME, pc->num_io_procs, multiwriter);
+    if ((ret = perf_write_file(pc, filename, 1, NUM_TIMESTEPS, &max_sec)))
+        return ret;
+    if (!my_rank)
+        printf("%d,\t%d,\t%s,\t%10.6f,\t%10.2f\n", pc->ntasks, pc->num_io_procs,
+               multiwriter ? "multi" : "funnel", max_sec,
+               (double)X_DIM_LEN * Y_DIM_LEN * NUM_TIMESTEPS * sizeof(double) /
+               (1024 * 1024) / max_sec);
+
+    /* Check the data. */
+    if ((ret = perf_read_file(pc, filename, 1, NUM_TIMESTEPS, NULL)))
+        return ret;
+
+    return PIO_NOERR;
+}
+
+/* Run multi-writer performance tests. */
+int
+main(int argc, char **argv)
+{
+    int my_rank;
+    int ntasks;
+    MPI_Comm test_comm; /* A communicator for this test. */
+    int num_io_procs[MAX_IO_TESTS] = {1, 2, 4, 8, 16}; /* Number of processors that will do IO. */
+    PIO_Offset elements_per_pe;
+    PIO_Offset *compdof;
+    int ret;      /* Return code. */
+
+    /* Initialize test. */
+    if ((ret = pio_test_init2(argc, argv, &my_rank, &ntasks, 1,
+                              0, -1, &test_comm)))
+        ERR(ERR_INIT);
+
+    /* Each task gets a block of rows, split in two halves so that
+     * each IO task has more than one region. */
+    if ((ret = perf_decomp_map(my_rank, ntasks, (PIO_Offset)X_DIM_LEN * Y_DIM_LEN,
+                               PERF_MAP_SPLIT, &elements_per_pe, &compdof)))
+        ERR(ret);
+
+    if (!my_rank)
+        printf("ntasks,\tnio,\tmode,\twrite time(s),\tMB/s\n");
+
+    if ((ret = run_perf_cases(test_comm, MAX_IO_TESTS, num_io_procs, NUM_MODES, NULL, NULL,
+                              dim_len, elements_per_pe, compdof, time_write)))
+        ERR(ret);
+
+    free(compdof);
+
+    /* Finalize the MPI library. */
+    if ((ret = pio_test_finalize2(&test_comm, TEST_NAME)))
+        return ret;
+
+    return 0;
+}
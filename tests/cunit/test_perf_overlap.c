@@ -0,0 +1,195 @@
+/*
+ * This program measures how much of the cost of writing distributed
+ * arrays can be hidden behind computation. Each timestep some data
+ * is written, and then a fixed amount of computation is done. The
+ * data is written with PIOc_write_darray_multi(), which returns when
+ * the data is in the file, or started with PIOc_iwrite_darray() and
+ * completed with PIOc_wait() after the computation, with and without
+ * the progress thread. The data are read back and checked after each
+ * run.
+ *
+ * MPI is initialized with MPI_THREAD_MULTIPLE. If the MPI library
+ * does not provide it, the runs with the progress thread are
+ * skipped.
+ *
+ * @author Jim Edwards
+ */
+#include <config.h>
+#include <pio.h>
+#include <pio_internal.h>
+#include <pio_tests.h>
+
+/* The name of this test. */
+#define TEST_NAME "test_perf_overlap"
+
+/* The length of the non-record dimensions. */
+#define X_DIM_LEN 1024
+#define Y_DIM_LEN 1024
+
+/* The number of timesteps of data to write. */
+#define NUM_TIMESTEPS 10
+
+/* Seconds of computation for each timestep. */
+#define COMPUTE_SEC 0.05
+
+/* Length of the work array of the computation. */
+#define WORK_LEN 4096
+
+/* How many different number of IO tasks to check? */
+#define MAX_IO_TESTS 4
+
+/* The ways the data is written. */
+#define MODE_BLOCKING 0
+#define MODE_NONBLOCKING 1
+#define MODE_PROGRESS 2
+#define NUM_MODES 3
+
+/* Length of the non-record dimensions. */
+int dim_len[NDIM2] = {Y_DIM_LEN, X_DIM_LEN};
+
+/* Names of the modes for the output. */
+const char *mode_name[NUM_MODES] = {"blocking", "iwrite", "iwrite+thread"};
+
+/**
+ * Do COMPUTE_SEC seconds of computation which makes no MPI calls.
+ *
+ * @param work a work array of length WORK_LEN.
+ */
+static void
+compute(double *work)
+{
+    double start = MPI_Wtime();
+
+    while (MPI_Wtime() - start < COMPUTE_SEC)
+        for (int i = 0; i < WORK_LEN; i++)
+            work[i] = work[i] * 0.999 + 1.0;
+}
+
+/**
+ * Write NUM_TIMESTEPS records of a double variable, computing after
+ * each write, report the time taken, then read the file back and
+ * check the data.
+ *
+ * @param pc the case of the test. The variant is how the data is
+ * written, one of the MODE values.
+ * @returns 0 for success, error code otherwise.
+ */
+int
+time_overlap(const perf_case_t *pc)
+{
+    char filename[PIO_MAX_NAME + 1];
+    int mode = pc->variant;
+    int ncid, varid;
+    double *data;
+    double work[WORK_LEN] = {0};
+    double start, max_sec;
+    int my_rank = pc->my_rank;
+    int ret;
+
+    if (!(data = malloc(pc->maplen * sizeof(double))))
+        return PIO_ENOMEM;
+
+    if ((ret = PIOc_set_progress_thread(mode == MODE_PROGRESS)))
+        ERR(ret);
+
+    sprintf(filename, "%s_%d_%d.nc", TEST_NAME, pc->num_io_procs, mode);
+    if ((ret = perf_create_file(pc, filename, 1, &ncid, &varid)))
+        return ret;
+
+    if ((ret = perf_start(pc->test_comm, &start)))
+        return ret;
+    for (int t = 0; t < NUM_TIMESTEPS; t++)
+    {
+        PIO_Request req;
+
+        for (PIO_Offset i = 0; i < pc->maplen; i++)
+            data[i] = perf_value(t, 0, pc->compdof[i]);
+
+        if (mode == MODE_BLOCKING)
+        {
+            if ((ret = PIOc_write_darray_multi(ncid, &varid, pc->ioid, 1, pc->maplen, data,
+                                               &t, NULL, false)))
+                ERR(ret);
+            compute(work);
+        }
+        else
+        {
+            if ((ret = PIOc_setframe(ncid, varid, t)))
+                ERR(ret);
+            if ((ret = PIOc_iwrite_darray(ncid, varid, pc->ioid, pc->maplen, data, NULL, &req)))
+                ERR(ret);
+            compute(work);
+            if ((ret = PIOc_wait(&req)))
+                ERR(ret);
+        }
+    }
+    if ((ret = PIOc_closefile(ncid)))
+        ERR(ret);
+    if ((ret = perf_max_time(pc->test_comm, MPI_Wtime() - start, &max_sec)))
+        return ret;
+    if (!my_rank)
+        printf("%d,\t%d,\t%s,\t%10.6f,\t%10.6f\n", pc->ntasks, pc->num_io_procs,
+               mode_name[mode], max_sec, NUM_TIMESTEPS * COMPUTE_SEC);
+
+    if ((ret = PIOc_set_progress_thread(0)))
+        ERR(ret);
+
+    /* Check the data. */
+    if ((ret = perf_read_file(pc, filename, 1, NUM_TIMESTEPS, NULL)))
+        return ret;
+
+    free(data);
+
+    return PIO_NOERR;
+}
+
+/* Run write overlap performance tests. */
+int
+main(int argc, char **argv)
+{
+    int my_rank;
+    int ntasks;
+    int provided;     /* Thread support of the MPI library. */
+    int num_io_procs[MAX_IO_TESTS] = {1, 2, 4, 8}; /* Number of processors that will do IO. */
+    PIO_Offset elements_per_pe;
+    PIO_Offset *compdof;
+    int num_modes;
+    int ret;      /* Return code. */
+
+    /* The progress thread needs MPI_THREAD_MULTIPLE, so MPI is
+     * initialized here and not with pio_test_init2(). */
+    if ((ret = MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided)))
+        MPIERR(ret);
+    if ((ret = MPI_Comm_rank(MPI_COMM_WORLD, &my_rank)))
+        MPIERR(ret);
+    if ((ret = MPI_Comm_size(MPI_COMM_WORLD, &ntasks)))
+        MPIERR(ret);
+    num_modes = provided < MPI_THREAD_MULTIPLE ? MODE_PROGRESS : NUM_MODES;
+
+    if ((ret = PIOc_set_iosystem_error_handling(PIO_DEFAULT, PIO_RETURN_ERROR, NULL)))
+        return ret;
+
+    /* Each task gets a block of rows. */
+    if ((ret = perf_decomp_map(my_rank, ntasks, (PIO_Offset)X_DIM_LEN * Y_DIM_LEN,
+                               PERF_MAP_BLOCK, &elements_per_pe, &compdof)))
+        ERR(ret);
+
+    if (!my_rank)
+    {
+        if (num_modes < NUM_MODES)
+            printf("MPI_THREAD_MULTIPLE not available, skipping progress thread runs\n");
+        printf("ntasks,\tnio,\tmode,\ttotal time(s),\tcompute time(s)\n");
+    }
+
+    if ((ret = run_perf_cases(MPI_COMM_WORLD, MAX_IO_TESTS, num_io_procs, num_modes, NULL,
+                              NULL, dim_len, elements_per_pe, compdof, time_overlap)))
+        ERR(ret);
+
+    free(compdof);
+
+    /* Finalize the MPI library. */
+    if ((ret = MPI_Finalize()))
+        MPIERR(ret);
+
+    return 0;
+}
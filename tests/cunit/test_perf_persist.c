@@ -0,0 +1,149 @@
+/*
+ * This program measures the latency of the rearranger with small
+ * messages, where the cost of setting up the messages matters more
+ * than moving the data. For point to point (pio_swapm()), collective
+ * (MPI_Alltoallw()) and persistent requests (MPI_Startall() on
+ * requests made on the first call), the same variable is moved
+ * NUM_CALLS times from the compute tasks to the IO tasks with
+ * rearrange_comp2io(), and back with rearrange_io2comp(), from and
+ * into the same buffers, as when a model writes a field every
+ * timestep. The data moved back is checked. The time per call of the
+ * slowest task is reported.
+ *
+ * @author Jim Edwards
+ */
+#include <config.h>
+#include <pio.h>
+#include <pio_internal.h>
+#include <pio_tests.h>
+
+/* The name of this test. */
+#define TEST_NAME "test_perf_persist"
+
+/* The length of the dimensions. This is small, so the messages are
+ * small. */
+#define X_DIM_LEN 64
+#define Y_DIM_LEN 64
+
+/* The number of times the data is moved each way. */
+#define NUM_CALLS 1000
+
+/* How many different number of IO tasks to check? */
+#define MAX_IO_TESTS 4
+
+/* The number of comm types to compare. */
+#define NUM_COMM_TESTS 3
+
+/* Length of the dimensions. */
+int dim_len[NDIM2] = {Y_DIM_LEN, X_DIM_LEN};
+
+/* The comm types, and their names for the output. */
+int comm_type[NUM_COMM_TESTS] = {PIO_REARR_COMM_P2P, PIO_REARR_COMM_COLL, PIO_REARR_COMM_PERSIST};
+const char *comm_name[NUM_COMM_TESTS] = {"p2p", "alltoallw", "persist"};
+
+/**
+ * Move the data of a decomposition NUM_CALLS times each way, check
+ * it, and report the times per call.
+ *
+ * @param pc the case of the test. The variant is the index of the
+ * comm type.
+ * @returns 0 for success, error code otherwise.
+ */
+int
+time_comm_type(const perf_case_t *pc)
+{
+    iosystem_desc_t *ios;
+    io_desc_t *iodesc;
+    double *data, *data_in, *iobuf;
+    double start, c2i_usec, i2c_usec;
+    int my_rank = pc->my_rank;
+    int ret;
+
+    if (!(ios = pio_get_iosystem_from_id(pc->iosysid)))
+        return PIO_EBADID;
+    if (!(iodesc = pio_get_iodesc_from_id(pc->ioid)))
+        return PIO_EBADID;
+
+    if (!(data = malloc(pc->maplen * sizeof(double))))
+        return PIO_ENOMEM;
+    if (!(data_in = calloc(pc->maplen, sizeof(double))))
+        return PIO_ENOMEM;
+    if (!(iobuf = malloc(max(1, iodesc->llen) * sizeof(double))))
+        return PIO_ENOMEM;
+    for (PIO_Offset i = 0; i < pc->maplen; i++)
+        data[i] = pc->compdof[i];
+
+    /* Compute tasks to IO tasks. */
+    if ((ret = perf_start(pc->test_comm, &start)))
+        return ret;
+    for (int n = 0; n < NUM_CALLS; n++)
+        if ((ret = rearrange_comp2io(ios, iodesc, data, ios->ioproc ? iobuf : NULL, 1)))
+            ERR(ret);
+    if ((ret = perf_max_time(pc->test_comm, (MPI_Wtime() - start) * 1.0e6 / NUM_CALLS,
+                             &c2i_usec)))
+        return ret;
+
+    /* IO tasks to compute tasks. */
+    if ((ret = perf_start(pc->test_comm, &start)))
+        return ret;
+    for (int n = 0; n < NUM_CALLS; n++)
+        if ((ret = rearrange_io2comp(ios, iodesc, ios->ioproc ? iobuf : NULL, data_in, 1)))
+            ERR(ret);
+    if ((ret = perf_max_time(pc->test_comm, (MPI_Wtime() - start) * 1.0e6 / NUM_CALLS,
+                             &i2c_usec)))
+        return ret;
+
+    /* The data made the round trip. */
+    for (PIO_Offset i = 0; i < pc->maplen; i++)
+        if (data_in[i] != data[i])
+            ERR(ERR_WRONG);
+
+    if (!my_rank)
+        printf("%d,\t%d,\t%s,\t%10.3f,\t%10.3f\n", pc->ntasks, pc->num_io_procs,
+               comm_name[pc->variant], c2i_usec, i2c_usec);
+
+    free(data);
+    free(data_in);
+    free(iobuf);
+
+    return PIO_NOERR;
+}
+
+/* Run rearranger latency tests. */
+int
+main(int argc, char **argv)
+{
+    int my_rank;
+    int ntasks;
+    MPI_Comm test_comm; /* A communicator for this test. */
+    int num_io_procs[MAX_IO_TESTS] = {1, 2, 4, 8}; /* Number of processors that will do IO. */
+    PIO_Offset elements_per_pe;
+    PIO_Offset *compdof;
+    int ret;      /* Return code. */
+
+    /* Initialize test. */
+    if ((ret = pio_test_init2(argc, argv, &my_rank, &ntasks, 1,
+                              0, -1, &test_comm)))
+        ERR(ERR_INIT);
+
+    /* The elements of each task are spread over the whole array, so
+     * every task has data for every IO task. */
+    if ((ret = perf_decomp_map(my_rank, ntasks, (PIO_Offset)X_DIM_LEN * Y_DIM_LEN,
+                               PERF_MAP_INTERLEAVED, &elements_per_pe, &compdof)))
+        ERR(ret);
+
+    if (!my_rank)
+        printf("ntasks,\tnio,\tcomm type,\tcomp2io (usec),\tio2comp (usec)\n");
+
+    if ((ret = run_perf_cases(test_comm, MAX_IO_TESTS, num_io_procs, NUM_COMM_TESTS, NULL,
+                              comm_type, dim_len, elements_per_pe, compdof, time_comm_type)))
+        ERR(ret);
+
+    free(compdof);
+
+    /* Finalize the MPI library. */
+    if ((ret = pio_test_finalize2(&test_comm, TEST_NAME)))
+        return ret;
+
+    return 0;
+}
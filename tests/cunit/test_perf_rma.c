@@ -0,0 +1,112 @@
+/*
+ * This program compares the rearranger comm types that move data
+ * between compute and IO tasks: point to point (pio_swapm() with
+ * MPI_Isend/MPI_Irecv), collective (MPI_Alltoallw()), one-sided
+ * (MPI_Put/MPI_Get into windows on the IO tasks) and packed
+ * (MPI_Alltoallv() on buffers packed with the index lists of the
+ * decomposition). For each comm type
+ * NUM_TIMESTEPS records of NUM_VARS variables are written at once
+ * with PIOc_write_darray_multi() and read back with
+ * PIOc_read_darray_multi(), and the data are checked. The time of
+ * the slowest task is reported.
+ *
+ * @author Jim Edwards
+ */
+#include <config.h>
+#include <pio.h>
+#include <pio_internal.h>
+#include <pio_tests.h>
+
+/* The name of this test. */
+#define TEST_NAME "test_perf_rma"
+
+/* The length of the non-record dimensions. */
+#define X_DIM_LEN 512
+#define Y_DIM_LEN 512
+
+/* The number of timesteps of data to write. */
+#define NUM_TIMESTEPS 10
+
+/* The number of variables written at once. */
+#define NUM_VARS 4
+
+/* How many different number of IO tasks to check? */
+#define MAX_IO_TESTS 4
+
+/* The number of comm types to compare. */
+#define NUM_COMM_TESTS 4
+
+/* Length of the non-record dimensions. */
+int dim_len[NDIM2] = {Y_DIM_LEN, X_DIM_LEN};
+
+/* The comm types, and their names for the output. */
+int comm_type[NUM_COMM_TESTS] = {PIO_REARR_COMM_P2P, PIO_REARR_COMM_COLL, PIO_REARR_COMM_RMA,
+                                 PIO_REARR_COMM_ALLTOALLV};
+const char *comm_name[NUM_COMM_TESTS] = {"p2p", "alltoallw", "rma", "alltoallv"};
+
+/**
+ * Write NUM_TIMESTEPS records of NUM_VARS double variables, then read
+ * them back and check the data, and report the times taken.
+ *
+ * @param pc the case of the test. The variant is the index of the
+ * comm type.
+ * @returns 0 for success, error code otherwise.
+ */
+int
+time_comm_type(const perf_case_t *pc)
+{
+    char filename[PIO_MAX_NAME + 1];
+    double write_sec, read_sec;
+    int ret;
+
+    sprintf(filename, "%s_%d_%s.nc", TEST_NAME, pc->num_io_procs, comm_name[pc->variant]);
+    if ((ret = perf_write_file(pc, filename, NUM_VARS, NUM_TIMESTEPS, &write_sec)))
+        return ret;
+    if ((ret = perf_read_file(pc, filename, NUM_VARS, NUM_TIMESTEPS, &read_sec)))
+        return ret;
+
+    if (!pc->my_rank)
+        printf("%d,\t%d,\t%s,\t%10.6f,\t%10.6f\n", pc->ntasks, pc->num_io_procs,
+               comm_name[pc->variant], write_sec, read_sec);
+
+    return PIO_NOERR;
+}
+
+/* Run rearranger comm type comparison tests. */
+int
+main(int argc, char **argv)
+{
+    int my_rank;
+    int ntasks;
+    MPI_Comm test_comm; /* A communicator for this test. */
+    int num_io_procs[MAX_IO_TESTS] = {1, 2, 4, 8}; /* Number of processors that will do IO. */
+    PIO_Offset elements_per_pe;
+    PIO_Offset *compdof;
+    int ret;      /* Return code. */
+
+    /* Initialize test. */
+    if ((ret = pio_test_init2(argc, argv, &my_rank, &ntasks, 1,
+                              0, -1, &test_comm)))
+        ERR(ERR_INIT);
+
+    /* The elements of each task are spread over the whole array, so
+     * every task has data for every IO task. */
+    if ((ret = perf_decomp_map(my_rank, ntasks, (PIO_Offset)X_DIM_LEN * Y_DIM_LEN,
+                               PERF_MAP_INTERLEAVED, &elements_per_pe, &compdof)))
+        ERR(ret);
+
+    if (!my_rank)
+        printf("ntasks,\tnio,\tcomm type,\twrite time(s),\tread time(s)\n");
+
+    if ((ret = run_perf_cases(test_comm, MAX_IO_TESTS, num_io_procs, NUM_COMM_TESTS, NULL,
+                              comm_type, dim_len, elements_per_pe, compdof, time_comm_type)))
+        ERR(ret);
+
+    free(compdof);
+
+    /* Finalize the MPI library. */
+    if ((ret = pio_test_finalize2(&test_comm, TEST_NAME)))
+        return ret;
+
+    return 0;
+}
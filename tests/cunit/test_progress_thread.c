@@ -0,0 +1,188 @@
+/*
+ * Test the progress thread of PIOc_set_progress_thread(). The thread
+ * is started, some records are written with PIOc_iwrite_darray() and
+ * completed with PIOc_waitall(), and the thread is stopped. The file
+ * is then read back and checked. The thread needs
+ * MPI_THREAD_MULTIPLE; if MPI does not provide it, the test only
+ * checks that the thread can not be started.
+ *
+ * @author Jim Edwards
+ */
+#include <config.h>
+#include <pio.h>
+#include <pio_tests.h>
+
+/* The name of this test. */
+#define TEST_NAME "test_progress_thread"
+
+/* Number of processors that will do IO. */
+#define NUM_IO_PROCS 1
+
+/* The names of the dimensions and the variable. */
+#define DIM_NAME_UNLIM "time"
+#define DIM_NAME "x"
+#define VAR_NAME "progress_var"
+
+/* The length of the dimension of the decomposition. */
+#define DIM_LEN 16
+
+/* The number of records written before waiting. */
+#define NUM_REC 3
+
+#define NDIM1 1
+#define NDIM2 2
+
+int main(int argc, char **argv)
+{
+    int my_rank;
+    int ntasks;
+    int provided;            /* Thread support provided by MPI. */
+    int iosysid, ioid;
+    int gdimlen = DIM_LEN;
+    int elements_per_pe;
+    PIO_Offset *compmap;
+    int num_flavors;         /* Number of PIO netCDF flavors in this build. */
+    int flavor[NUM_FLAVORS]; /* iotypes for the supported netCDF IO flavors. */
+    int data[NUM_REC][DIM_LEN], data_in[DIM_LEN];
+    int ret;
+
+    /* Initialize MPI. The progress thread calls MPI at the same time
+     * as this thread. */
+    if ((ret = MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided)))
+        MPIERR(ret);
+
+    /* Learn my rank and the total number of processors. */
+    if ((ret = MPI_Comm_rank(MPI_COMM_WORLD, &my_rank)))
+        MPIERR(ret);
+    if ((ret = MPI_Comm_size(MPI_COMM_WORLD, &ntasks)))
+        MPIERR(ret);
+    if (DIM_LEN % ntasks)
+    {
+        if (!my_rank)
+            printf("Test must be run on 1, 2, 4, 8 or 16 tasks.\n");
+        return ERR_AWFUL;
+    }
+
+    /* Turn off logging, to prevent error messages from being logged
+     * when we intentionally call functions we know will fail. */
+    PIOc_set_log_level(-1);
+
+    /* Change error handling so we can test inval parameters. */
+    if ((ret = PIOc_set_iosystem_error_handling(PIO_DEFAULT, PIO_RETURN_ERROR, NULL)))
+        ERR(ret);
+
+    /* Without MPI_THREAD_MULTIPLE the thread can't be started. */
+    if (provided < MPI_THREAD_MULTIPLE)
+    {
+        if (PIOc_set_progress_thread(1) != PIO_EINVAL)
+            ERR(ERR_WRONG);
+        if (!my_rank)
+            printf("%d %s MPI_THREAD_MULTIPLE not provided, skipping\n", my_rank, TEST_NAME);
+        MPI_Finalize();
+        return 0;
+    }
+
+    /* Initialize the IOsystem. */
+    if ((ret = PIOc_Init_Intracomm(MPI_COMM_WORLD, NUM_IO_PROCS, 1, 0, PIO_REARR_BOX,
+                                   &iosysid)))
+        ERR(ret);
+
+    /* Find out which IOtypes are available in this build. */
+    if ((ret = get_iotypes(&num_flavors, flavor)))
+        ERR(ret);
+
+    /* Each task has a contiguous block of the dimension. */
+    elements_per_pe = DIM_LEN / ntasks;
+    if (!(compmap = malloc(elements_per_pe * sizeof(PIO_Offset))))
+        ERR(ERR_MEM);
+    for (int i = 0; i < elements_per_pe; i++)
+        compmap[i] = my_rank * elements_per_pe + i + 1;
+    if ((ret = PIOc_init_decomp(iosysid, PIO_INT, NDIM1, &gdimlen, elements_per_pe, compmap,
+                                &ioid, PIO_REARR_BOX, NULL, NULL)))
+        ERR(ret);
+    free(compmap);
+
+    for (int r = 0; r < NUM_REC; r++)
+        for (int i = 0; i < elements_per_pe; i++)
+            data[r][i] = r * 100 + my_rank * elements_per_pe + i;
+
+    /* Start the thread. Starting it again does nothing. */
+    if ((ret = PIOc_set_progress_thread(1)))
+        ERR(ret);
+    if ((ret = PIOc_set_progress_thread(1)))
+        ERR(ret);
+
+    for (int f = 0; f < num_flavors; f++)
+    {
+        char filename[PIO_MAX_NAME + 1];
+        PIO_Request req[NUM_REC];
+        int ncid, dimid[NDIM2], varid;
+
+        /* Create a file with a record var. */
+        sprintf(filename, "%s_%d.nc", TEST_NAME, flavor[f]);
+        if ((ret = PIOc_createfile(iosysid, &ncid, &flavor[f], filename, PIO_CLOBBER)))
+            ERR(ret);
+        if ((ret = PIOc_def_dim(ncid, DIM_NAME_UNLIM, PIO_UNLIMITED, &dimid[0])))
+            ERR(ret);
+        if ((ret = PIOc_def_dim(ncid, DIM_NAME, DIM_LEN, &dimid[1])))
+            ERR(ret);
+        if ((ret = PIOc_def_var(ncid, VAR_NAME, PIO_INT, NDIM2, dimid, &varid)))
+            ERR(ret);
+        if ((ret = PIOc_enddef(ncid)))
+            ERR(ret);
+
+        /* Start the writes. The thread moves their data to the IO
+         * task while they are pending. */
+        for (int r = 0; r < NUM_REC; r++)
+        {
+            if ((ret = PIOc_setframe(ncid, varid, r)))
+                ERR(ret);
+            if ((ret = PIOc_iwrite_darray(ncid, varid, ioid, elements_per_pe, data[r], NULL,
+                                          &req[r])))
+                ERR(ret);
+        }
+
+        /* Complete them. */
+        if ((ret = PIOc_waitall(NUM_REC, req)))
+            ERR(ret);
+        for (int r = 0; r < NUM_REC; r++)
+            if (req[r] != PIO_REQ_NULL)
+                ERR(ERR_WRONG);
+
+        if ((ret = PIOc_closefile(ncid)))
+            ERR(ret);
+
+        /* Check the file. */
+        if ((ret = PIOc_openfile(iosysid, &ncid, &flavor[f], filename, PIO_NOWRITE)))
+            ERR(ret);
+        for (int r = 0; r < NUM_REC; r++)
+        {
+            if ((ret = PIOc_setframe(ncid, varid, r)))
+                ERR(ret);
+            if ((ret = PIOc_read_darray(ncid, varid, ioid, elements_per_pe, data_in)))
+                ERR(ret);
+            for (int i = 0; i < elements_per_pe; i++)
+                if (data_in[i] != data[r][i])
+                    ERR(ERR_WRONG);
+        }
+        if ((ret = PIOc_closefile(ncid)))
+            ERR(ret);
+    } /* next iotype */
+
+    /* Stop the thread. */
+    if ((ret = PIOc_set_progress_thread(0)))
+        ERR(ret);
+
+    /* Free resources. */
+    if ((ret = PIOc_freedecomp(iosysid, ioid)))
+        ERR(ret);
+    if ((ret = PIOc_finalize(iosysid)))
+        ERR(ret);
+
+    printf("%d %s SUCCESS!!\n", my_rank, TEST_NAME);
+
+    /* Finalize MPI. */
+    MPI_Finalize();
+
+    return 0;
+}
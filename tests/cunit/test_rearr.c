@@ -422,18 +422,27 @@ int test_get_regions(int my_rank)
     ior1->count[0] = 1;
 
     /* Call the function we are testing. */
-    if ((ret = get_regions(ndims, gdimlen, MAPLEN, map, &maxregions, ior1)))
+    if ((ret = get_regions(ndims, gdimlen, MAPLEN, map, &maxregions, &ior1)))
         return ret;
     if (maxregions != 2)
         return ERR_WRONG;
+    if (ior1->next != &ior1[1] || ior1[1].next || ior1[1].loffset != 1)
+        return ERR_WRONG;
 
     /* Free resources for the region. */
-    free(ior1->next->start);
-    free(ior1->next->count);
-    free(ior1->next);
-    free(ior1->start);
-    free(ior1->count);
-    free(ior1);
+    free_region_list(ior1);
+
+    /* Contiguous elements are one region. */
+    {
+        PIO_Offset map2[MAPLEN] = {3, 4};
+
+        ior1 = NULL;
+        if ((ret = get_regions(ndims, gdimlen, MAPLEN, map2, &maxregions, &ior1)))
+            return ret;
+        if (maxregions != 1 || ior1->start[0] != 2 || ior1->count[0] != 2)
+            return ERR_WRONG;
+        free_region_list(ior1);
+    }
 
     return 0;
 }
@@ -460,6 +469,42 @@ int test_find_region()
     return 0;
 }
 
+/* Run tests for coalesce_regions() function. */
+int test_coalesce_regions()
+{
+#define NREGIONS 5
+    /* Rows 0 and 1 of columns 2-5, an empty region, row 2 of columns
+     * 2-5, and row 2 of columns 6-7. */
+    PIO_Offset start[NREGIONS * NDIM2] = {0, 2, 1, 2, 0, 0, 2, 2, 2, 6};
+    PIO_Offset count[NREGIONS * NDIM2] = {1, 4, 1, 4, 0, 0, 1, 4, 1, 2};
+    PIO_Offset loffset[NREGIONS] = {0, 4, 8, 8, 12};
+    int nregions;
+
+    /* The first three rows become one region. The last region does
+     * not make a hyperslab with them. */
+    nregions = coalesce_regions(NDIM2, NREGIONS, start, count, loffset);
+    if (nregions != 2)
+        return ERR_WRONG;
+    if (start[0] != 0 || start[1] != 2 || count[0] != 3 || count[1] != 4 || loffset[0] != 0)
+        return ERR_WRONG;
+    if (start[2] != 2 || start[3] != 6 || count[2] != 1 || count[3] != 2 || loffset[1] != 12)
+        return ERR_WRONG;
+
+    /* Regions whose data are not next to each other are not merged. */
+    {
+        PIO_Offset start2[NDIM2 * 2] = {0, 0, 0, 4};
+        PIO_Offset count2[NDIM2 * 2] = {1, 4, 1, 4};
+        PIO_Offset loffset2[2] = {4, 0};
+
+        if (coalesce_regions(NDIM2, 2, start2, count2, loffset2) != 2)
+            return ERR_WRONG;
+        if (coalesce_regions(NDIM2, 2, start2, count2, NULL) != 1 || count2[1] != 8)
+            return ERR_WRONG;
+    }
+
+    return 0;
+}
+
 /* Run tests for expand_region() function. */
 int test_expand_region()
 {
@@ -662,6 +707,7 @@ int test_compute_counts(MPI_Comm test_comm, int my_rank)
     free(iodesc->rcount);
     free(iodesc->rfrom);
     free(iodesc->rindex);
+    free(iodesc->peers);
 
     /* Free test resources. */
     free(ios->ioranks);
@@ -795,6 +841,7 @@ int test_box_rearrange_create(MPI_Comm test_comm, int my_rank)
     free(iodesc->rcount);
     free(iodesc->rfrom);
     free(iodesc->rindex);
+    free(iodesc->peers);
 
     /* Free resources from test. */
     free(ior1->start);
@@ -910,6 +957,118 @@ int test_box_rearrange_create_2(MPI_Comm test_comm, int my_rank)
     free(iodesc->rcount);
     free(iodesc->rfrom);
     free(iodesc->rindex);
+    free(iodesc->peers);
+
+    /* Free resources from test. */
+    free(ior1->start);
+    free(ior1->count);
+    free(ior1);
+    free(ios->ioranks);
+    free(ios->compranks);
+    free(iodesc);
+    free(ios);
+
+    return 0;
+}
+
+/* Test for the box_rearrange_create() function with a 2D
+ * decomposition where each IO task holds one quadrant of the global
+ * array, and each compute task holds one row. */
+int test_box_rearrange_create_3(MPI_Comm test_comm, int my_rank)
+{
+#define MAPLEN4 4
+    iosystem_desc_t *ios;
+    io_desc_t *iodesc;
+    io_region *ior1;
+    int maplen = MAPLEN4;
+    PIO_Offset compmap[MAPLEN4];
+    const int gdimlen[NDIM2] = {4, 4};
+    int ndims = NDIM2;
+    int ret;
+
+    /* Each task has one row of the global array. */
+    for (int i = 0; i < MAPLEN4; i++)
+        compmap[i] = my_rank * MAPLEN4 + i + 1;
+
+    /* Allocate IO system info struct for this test. */
+    if (!(ios = calloc(1, sizeof(iosystem_desc_t))))
+        return PIO_ENOMEM;
+
+    /* Allocate IO desc struct for this test. */
+    if (!(iodesc = calloc(1, sizeof(io_desc_t))))
+        return PIO_ENOMEM;
+
+    /* Default rearranger options. */
+    iodesc->rearr_opts.comm_type = PIO_REARR_COMM_COLL;
+    iodesc->rearr_opts.fcd = PIO_REARR_COMM_FC_2D_DISABLE;
+
+    /* Set up for determine_fill(). */
+    ios->union_comm = test_comm;
+    ios->io_comm = test_comm;
+    iodesc->ndims = NDIM2;
+    iodesc->rearranger = PIO_REARR_BOX;
+
+    /* This is the size of the map in computation tasks. */
+    iodesc->ndof = MAPLEN4;
+
+    /* Set up the IO task info for the test. */
+    ios->ioproc = 1;
+    ios->compproc = 1;
+    ios->union_rank = my_rank;
+    ios->num_iotasks = 4;
+    ios->num_comptasks = 4;
+    ios->num_uniontasks = 4;
+    if (!(ios->ioranks = calloc(ios->num_iotasks, sizeof(int))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    for (int i = 0; i < TARGET_NTASKS; i++)
+        ios->ioranks[i] = i;
+    if (!(ios->compranks = calloc(ios->num_comptasks, sizeof(int))))
+        return pio_err(ios, NULL, PIO_ENOMEM, __FILE__, __LINE__);
+    for (int i = 0; i < TARGET_NTASKS; i++)
+        ios->compranks[i] = i;
+
+    /* Each IO task holds a 2x2 quadrant of the global array. */
+    if ((ret = alloc_region2(NULL, NDIM2, &ior1)))
+        return ret;
+    ior1->next = NULL;
+    ior1->start[0] = (my_rank / 2) * 2;
+    ior1->start[1] = (my_rank % 2) * 2;
+    ior1->count[0] = 2;
+    ior1->count[1] = 2;
+
+    iodesc->firstregion = ior1;
+
+    /* We are finally ready to run the code under test. */
+    if ((ret = box_rearrange_create(ios, maplen, compmap, gdimlen, ndims, iodesc)))
+        return ret;
+
+    /* Check some results. */
+    if (iodesc->rearranger != PIO_REARR_BOX || iodesc->ndof != maplen ||
+        iodesc->llen != 4 || iodesc->needsfill)
+        return ERR_WRONG;
+
+    /* Each row is split between the two IO tasks holding its
+     * quadrants. */
+    for (int i = 0; i < ios->num_iotasks; i++)
+    {
+        int expected = (i / 2 == my_rank / 2) ? 2 : 0;
+        if (iodesc->scount[i] != expected)
+            return ERR_WRONG;
+    }
+
+    /* The first two elements of the row go to the first of those IO
+     * tasks, the last two to the second. */
+    if (iodesc->sindex[0] != 0 || iodesc->sindex[1] != 1 ||
+        iodesc->sindex[2] != 2 || iodesc->sindex[3] != 3)
+        return ERR_WRONG;
+
+    /* Free resources allocated in compute_counts(). */
+    free(iodesc->scount);
+    free(iodesc->sindex);
+    free(iodesc->rcount);
+    free(iodesc->rfrom);
+    free(iodesc->rindex);
+    free(iodesc->peers);
 
     /* Free resources from test. */
     free(ior1->start);
@@ -958,8 +1117,8 @@ int test_default_subset_partition(MPI_Comm test_comm, int my_rank)
     return 0;
 }
 
-/* Test function rearrange_comp2io. */
-int test_rearrange_comp2io(MPI_Comm test_comm, int my_rank)
+/* Test function rearrange_comp2io with the given rearranger comm type. */
+int test_rearrange_comp2io(MPI_Comm test_comm, int my_rank, int comm_type)
 {
     iosystem_desc_t *ios;
     io_desc_t *iodesc = NULL;
@@ -1006,8 +1165,9 @@ int test_rearrange_comp2io(MPI_Comm test_comm, int my_rank)
     /* The two rearrangers create a different number of send types. */
     int num_send_types = iodesc->rearranger == PIO_REARR_BOX ? ios->num_iotasks : 1;
 
-    /* Default rearranger options. */
-    iodesc->rearr_opts.comm_type = PIO_REARR_COMM_COLL;
+    /* Rearranger options. */
+    iodesc->rearr_opts.comm_type = comm_type;
+    iodesc->neighbor_comm = MPI_COMM_NULL;
     iodesc->rearr_opts.fcd = PIO_REARR_COMM_FC_2D_DISABLE;
 
     /* Set up for determine_fill(). */
@@ -1047,6 +1207,36 @@ int test_rearrange_comp2io(MPI_Comm test_comm, int my_rank)
     if ((ret = rearrange_comp2io(ios, iodesc, sbuf, rbuf, nvars)))
         PBAIL(ret);
 
+    /* A second call reuses the cached vector types. */
+    if ((ret = rearrange_comp2io(ios, iodesc, sbuf, rbuf, nvars)))
+        PBAIL(ret);
+    if (iodesc->type_cache_hits != 1 || iodesc->type_cache_misses != 1)
+        PBAIL(ERR_WRONG);
+
+    /* With the shared memory comm type, every byte sent is counted,
+     * on or off the node. */
+    if (comm_type == PIO_REARR_COMM_SHM)
+    {
+        PIO_Offset sent = 0;
+
+        for (int i = 0; i < ios->num_iotasks; i++)
+            sent += iodesc->scount[i] * sizeof(int);
+        if (!iodesc->shm || iodesc->onnode_bytes + iodesc->offnode_bytes != 2 * sent)
+            PBAIL(ERR_WRONG);
+    }
+    else if (iodesc->shm || iodesc->onnode_bytes || iodesc->offnode_bytes)
+        PBAIL(ERR_WRONG);
+
+    /* Free the shared window, and the one-sided windows. */
+    if ((ret = shm_free(ios, iodesc)))
+        PBAIL(ret);
+    if ((ret = rma_free(ios, iodesc)))
+        PBAIL(ret);
+
+    /* Free the cached vector types. */
+    if ((ret = free_type_cache(iodesc)))
+        PBAIL(ret);
+
     /* We created send types, so free them. */
     for (int st = 0; st < num_send_types; st++)
         if (iodesc->stype[st] != PIO_DATATYPE_NULL)
@@ -1076,6 +1266,15 @@ exit:
         free(iodesc->rfrom);
     if (iodesc->rindex)
         free(iodesc->rindex);
+    if (iodesc->peers)
+        free(iodesc->peers);
+    if (iodesc->pack_sidx)
+        free(iodesc->pack_sidx);
+    if (iodesc->pack_ridx)
+        free(iodesc->pack_ridx);
+
+    if (iodesc && iodesc->neighbor_comm != MPI_COMM_NULL)
+        MPI_Comm_free(&iodesc->neighbor_comm);
 
     /* Free resources from test. */
     if (ior1)
@@ -1100,8 +1299,8 @@ exit:
     return ret;
 }
 
-/* Test function rearrange_io2comp. */
-int test_rearrange_io2comp(MPI_Comm test_comm, int my_rank)
+/* Test function rearrange_io2comp with the given rearranger comm type. */
+int test_rearrange_io2comp(MPI_Comm test_comm, int my_rank, int comm_type)
 {
     iosystem_desc_t *ios = NULL;
     io_desc_t *iodesc = NULL;
@@ -1147,8 +1346,9 @@ int test_rearrange_io2comp(MPI_Comm test_comm, int my_rank)
     /* The two rearrangers create a different number of send types. */
     int num_send_types = iodesc->rearranger == PIO_REARR_BOX ? ios->num_iotasks : 1;
 
-    /* Default rearranger options. */
-    iodesc->rearr_opts.comm_type = PIO_REARR_COMM_COLL;
+    /* Rearranger options. */
+    iodesc->rearr_opts.comm_type = comm_type;
+    iodesc->neighbor_comm = MPI_COMM_NULL;
     iodesc->rearr_opts.fcd = PIO_REARR_COMM_FC_2D_DISABLE;
 
     /* Set up for determine_fill(). */
@@ -1189,7 +1389,14 @@ int test_rearrange_io2comp(MPI_Comm test_comm, int my_rank)
         return ret;
 
     /* Run the function to test. */
-    if ((ret = rearrange_io2comp(ios, iodesc, sbuf, rbuf)))
+    if ((ret = rearrange_io2comp(ios, iodesc, sbuf, rbuf, 1)))
+        PBAIL(ret);
+
+    /* The one-sided and persistent comm types use the datatype
+     * cache, and the one-sided comm type a window. */
+    if ((ret = free_type_cache(iodesc)))
+        PBAIL(ret);
+    if ((ret = rma_free(ios, iodesc)))
         PBAIL(ret);
 
     /* We created send types, so free them. */
@@ -1216,8 +1423,14 @@ exit:
         free(iodesc->rcount);
         free(iodesc->rfrom);
         free(iodesc->rindex);
+        free(iodesc->peers);
+        free(iodesc->pack_sidx);
+        free(iodesc->pack_ridx);
     }
 
+    if (iodesc && iodesc->neighbor_comm != MPI_COMM_NULL)
+        MPI_Comm_free(&iodesc->neighbor_comm);
+
     /* Free resources from test. */
     if (ior1->start)
         free(ior1->start);
@@ -1244,6 +1457,11 @@ exit:
 /* These tests do not need an iosysid. */
 int run_no_iosys_tests(int my_rank, MPI_Comm test_comm)
 {
+#define NUM_COMM_TYPES 7
+    int comm_type[NUM_COMM_TYPES] = {PIO_REARR_COMM_COLL, PIO_REARR_COMM_SPARSE,
+                                     PIO_REARR_COMM_NEIGHBOR, PIO_REARR_COMM_SHM,
+                                     PIO_REARR_COMM_RMA, PIO_REARR_COMM_ALLTOALLV,
+                                     PIO_REARR_COMM_PERSIST};
     int ret;
 
     if ((ret = test_idx_to_dim_list()))
@@ -1264,6 +1482,9 @@ int run_no_iosys_tests(int my_rank, MPI_Comm test_comm)
     if ((ret = test_find_region()))
         return ret;
 
+    if ((ret = test_coalesce_regions()))
+        return ret;
+
     if ((ret = test_get_regions(my_rank)))
         return ret;
 
@@ -1288,14 +1509,19 @@ int run_no_iosys_tests(int my_rank, MPI_Comm test_comm)
     if ((ret = test_box_rearrange_create_2(test_comm, my_rank)))
         return ret;
 
-    if ((ret = test_default_subset_partition(test_comm, my_rank)))
+    if ((ret = test_box_rearrange_create_3(test_comm, my_rank)))
         return ret;
 
-    if ((ret = test_rearrange_comp2io(test_comm, my_rank)))
+    if ((ret = test_default_subset_partition(test_comm, my_rank)))
         return ret;
 
-    if ((ret = test_rearrange_io2comp(test_comm, my_rank)))
-        return ret;
+    for (int c = 0; c < NUM_COMM_TYPES; c++)
+        if ((ret = test_rearrange_comp2io(test_comm, my_rank, comm_type[c])))
+            return ret;
+
+    for (int c = 0; c < NUM_COMM_TYPES; c++)
+        if ((ret = test_rearrange_io2comp(test_comm, my_rank, comm_type[c])))
+            return ret;
 
     return 0;
 }
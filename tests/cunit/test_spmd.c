@@ -614,6 +614,163 @@ int test_misc()
     return 0;
 }
 
+/* Test the growth of write multi-buffers. */
+int test_wmb_reserve()
+{
+#define WMB_ARRAY_SIZE 100
+#define WMB_NARRAYS 9
+    wmulti_buffer *wmb;
+    void *data;
+    int ret;
+
+    if (!(wmb = calloc(1, sizeof(wmulti_buffer))))
+        return PIO_ENOMEM;
+
+    /* Fill the buffer, as PIOc_write_darray() does. The buffers
+     * double as needed. */
+    for (int a = 0; a < WMB_NARRAYS; a++)
+    {
+        if ((ret = pio_wmb_reserve(wmb, WMB_ARRAY_SIZE, sizeof(int))))
+            return ret;
+        if (wmb->capacity < a + 1 || wmb->data_capacity < (a + 1) * WMB_ARRAY_SIZE ||
+            wmb->fill_capacity < (a + 1) * sizeof(int))
+            return ERR_WRONG;
+        wmb->vid[a] = a;
+        wmb->frame[a] = a;
+        wmb->num_arrays++;
+    }
+    if (wmb->capacity != 16 || wmb->data_capacity != 16 * WMB_ARRAY_SIZE)
+        return ERR_WRONG;
+
+    /* After a flush, filling the buffer again does not allocate. */
+    data = wmb->data;
+    wmb->num_arrays = 0;
+    for (int a = 0; a < WMB_NARRAYS; a++)
+    {
+        if ((ret = pio_wmb_reserve(wmb, WMB_ARRAY_SIZE, sizeof(int))))
+            return ret;
+        wmb->num_arrays++;
+    }
+    if (wmb->data != data || wmb->capacity != 16)
+        return ERR_WRONG;
+
+    pio_wmb_free(wmb);
+
+    return PIO_NOERR;
+}
+
+/* Test the choice of IO tasks by node. */
+int test_select_node_ioranks()
+{
+#define NODE_NTASKS 16
+#define NUM_NODE_TESTS 4
+    int node_of_task[NODE_NTASKS];
+    int ioranks[NODE_NTASKS];
+    int num_iotasks[NUM_NODE_TESTS] = {4, 2, 6, 0};
+    int iotasks_per_node[NUM_NODE_TESTS] = {1, 1, 2, 2};
+    int expected_num[NUM_NODE_TESTS] = {4, 2, 6, 8};
+    int expected[NUM_NODE_TESTS][NODE_NTASKS] = {{0, 4, 8, 12},
+                                                 {0, 8},
+                                                 {0, 2, 4, 8, 10, 12},
+                                                 {0, 2, 4, 6, 8, 10, 12, 14}};
+    int uneven_node_of_task[6] = {0, 1, 1, 1, 2, 2};
+    int uneven_expected[5] = {0, 1, 2, 4, 5};
+    int num;
+    int ret;
+
+    /* Four nodes with four tasks each. */
+    for (int t = 0; t < NODE_NTASKS; t++)
+        node_of_task[t] = t / 4;
+
+    for (int tc = 0; tc < NUM_NODE_TESTS; tc++)
+    {
+        num = num_iotasks[tc];
+        if ((ret = pio_select_node_ioranks(NODE_NTASKS, node_of_task, iotasks_per_node[tc],
+                                           &num, ioranks)))
+            return ret;
+        if (num != expected_num[tc])
+            return ERR_WRONG;
+        for (int i = 0; i < num; i++)
+            if (ioranks[i] != expected[tc][i])
+                return ERR_WRONG;
+    }
+
+    /* Not enough tasks. */
+    num = NODE_NTASKS + 1;
+    if (pio_select_node_ioranks(NODE_NTASKS, node_of_task, 4, &num, ioranks) != PIO_EINVAL)
+        return ERR_WRONG;
+    num = 0;
+    if (pio_select_node_ioranks(NODE_NTASKS, node_of_task, 0, &num, ioranks) != PIO_EINVAL)
+        return ERR_WRONG;
+
+    /* Nodes with different numbers of tasks. */
+    num = 0;
+    if ((ret = pio_select_node_ioranks(6, uneven_node_of_task, 2, &num, ioranks)))
+        return ret;
+    if (num != 5)
+        return ERR_WRONG;
+    for (int i = 0; i < num; i++)
+        if (ioranks[i] != uneven_expected[i])
+            return ERR_WRONG;
+
+    return PIO_NOERR;
+}
+
+/* Test PIOc_Init_Intracomm_pernode() on the nodes of test_comm. */
+int test_init_pernode(MPI_Comm test_comm)
+{
+    int ntasks;
+    int *node_of_task;
+    int nnodes;
+    int iosysid;
+    int numiotasks;
+    int expected;
+    int mpierr;
+    int ret;
+
+    if ((mpierr = MPI_Comm_size(test_comm, &ntasks)))
+        MPIERR(mpierr);
+
+    /* Every task learns the same layout. */
+    if (!(node_of_task = malloc(ntasks * sizeof(int))))
+        return PIO_ENOMEM;
+    ret = pio_get_node_of_task(test_comm, node_of_task, &nnodes);
+    if (!ret && (nnodes < 1 || nnodes > ntasks || node_of_task[0] != 0))
+        ret = ERR_WRONG;
+    free(node_of_task);
+    if (ret)
+        return ret;
+
+    /* Check for invalid values. */
+    if (PIOc_Init_Intracomm_pernode(test_comm, 0, 0, PIO_REARR_BOX, &iosysid) != PIO_EINVAL)
+        return ERR_WRONG;
+    if (PIOc_Init_Intracomm_pernode(test_comm, 0, 1, PIO_REARR_BOX, NULL) != PIO_EINVAL)
+        return ERR_WRONG;
+
+    /* Use up to two IO tasks on each node. */
+    if ((ret = PIOc_Init_Intracomm_pernode(test_comm, 0, 2, PIO_REARR_BOX, &iosysid)))
+        return ret;
+    if ((ret = PIOc_get_numiotasks(iosysid, &numiotasks)))
+        return ret;
+    expected = 2 * nnodes < ntasks ? 2 * nnodes : ntasks;
+    if (numiotasks > expected || numiotasks < nnodes)
+        return ERR_WRONG;
+    if ((ret = PIOc_free_iosystem(iosysid)))
+        return ret;
+
+    /* Use one IO task. */
+    if ((ret = PIOc_Init_Intracomm_pernode(test_comm, 1, 1, PIO_REARR_SUBSET, &iosysid)))
+        return ret;
+    if ((ret = PIOc_get_numiotasks(iosysid, &numiotasks)))
+        return ret;
+    if (numiotasks != 1)
+        return ERR_WRONG;
+    if ((ret = PIOc_free_iosystem(iosysid)))
+        return ret;
+
+    return PIO_NOERR;
+}
+
 /* This test code was recovered from main() in pioc_sc.c. */
 int test_CalcStartandCount()
 {
@@ -780,6 +937,15 @@ int main(int argc, char **argv)
         if ((ret = test_misc()))
             return ret;
 
+        if ((ret = test_wmb_reserve()))
+            return ret;
+
+        if ((ret = test_select_node_ioranks()))
+            return ret;
+
+        if ((ret = test_init_pernode(test_comm)))
+            return ret;
+
         /* Finalize PIO system. */
         if ((ret = PIOc_free_iosystem(iosysid)))
             return ret;